@@ -19,6 +19,8 @@
 #include "xb-database-manager.h"
 #include "xb-error.h"
 
+#include <math.h>
+#include <string.h>
 #include <xapian-glib.h>
 
 #define QUERY_PARAM_COLLAPSE_KEY "collapse"
@@ -33,10 +35,13 @@
 #define QUERY_PARAM_OFFSET "offset"
 #define QUERY_PARAM_ORDER "order"
 #define QUERY_PARAM_QUERYSTR "q"
+#define QUERY_PARAM_RAW_RESULTS "rawResults"
 #define QUERY_PARAM_SORT_BY "sortBy"
+#define QUERY_PARAM_TIME_LIMIT "timeLimit"
 
 #define QUERY_RESULTS_MEMBER_NUM_RESULTS "numResults"
 #define QUERY_RESULTS_MEMBER_OFFSET "offset"
+#define QUERY_RESULTS_MEMBER_PARTIAL "partial"
 #define QUERY_RESULTS_MEMBER_QUERYSTR "query"
 #define QUERY_RESULTS_MEMBER_RESULTS "results"
 #define QUERY_RESULTS_MEMBER_UPPER_BOUND "upperBound"
@@ -51,58 +56,735 @@
   XAPIAN_QUERY_PARSER_FEATURE_PURE_NOT |\
   XAPIAN_QUERY_PARSER_FEATURE_SPELLING_CORRECTION
 
+/* Rough per-table footprint of an open Xapian database: the B-tree cursor
+ * keeps one block per level in memory, plus some bookkeeping.
+ */
+#define DATABASE_TABLE_MEMORY_ESTIMATE (64 * 1024)
+
+#define DEFAULT_MAX_DATABASES 32
+#define DEFAULT_MAX_OPEN_FILES 512
+#define DEFAULT_MAX_MEMORY (64 * 1024 * 1024)
+#define DEFAULT_IDLE_TIMEOUT 300
+#define DEFAULT_MAX_CACHE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_MONITOR_QUIET_PERIOD 500
+#define DEFAULT_COMPRESSION_MIN_SIZE 1024
+#define DEFAULT_COMPRESSION_LEVEL 6
+#define DEFAULT_STREAM_WRITE_TIMEOUT 10000
+
+#define N_ENCODINGS (XB_ENCODING_DEFLATE + 1)
+
+/* A database that keeps changing is still refreshed after this many quiet
+ * periods.
+ */
+#define MAX_QUIET_PERIODS 10
+
+/* Parsed queries kept by each database handle */
+#define MAX_CACHED_QUERIES 256
+
+/* Xapian cannot stop matching half way, so a query with a time limit is
+ * kept cheap to match instead: it ranks at most this many documents, and
+ * only expands wildcards and partial words of at least this many characters
+ */
+#define TIME_LIMITED_MAX_RESULTS 1000
+#define TIME_LIMITED_MIN_EXPANSION 3
+
+/* Streamed results are handed over to the main thread in chunks of about
+ * this size, and a worker waits while this much is not sent yet, for up to
+ * the stream-write-timeout property.
+ */
+#define STREAM_CHUNK_SIZE (16 * 1024)
+#define STREAM_MAX_PENDING (256 * 1024)
+
+/* The query parser configuration registered in the metadata of a database.
+ * It is read once when the database is opened, and again only if the
+ * metadata changes; every parser created for the database starts from it.
+ */
+typedef struct {
+  volatile gint ref_count;
+  /* The raw metadata values, to tell whether they changed */
+  gchar *prefixes_json;
+  gchar *stopwords_json;
+  /* string field, string prefix pairs */
+  GPtrArray *prefixes;
+  GPtrArray *boolean_prefixes;
+  /* NULL if the database has no stop words */
+  GPtrArray *stopwords;
+} QueryParserTemplate;
+
+/* A set of Xapian objects for one database. Xapian objects are not
+ * thread-safe, so every thread querying a database uses its own handle.
+ */
+typedef struct {
+  XapianDatabase *db;
+  /* The generation of the database the handle was last brought up to date
+   * with, see xb_database_manager_reopen_db()
+   */
+  guint64 generation;
+  QueryParserTemplate *template;
+  XapianStopper *stopper;
+  /* string "lang defaultOp" => object XapianQueryParser; parsers are never
+   * reconfigured once created, so that the options of one request do not
+   * leak into the next one.
+   */
+  GHashTable *parsers;
+  /* string lang_name => object XapianStem */
+  GHashTable *stemmers;
+  /* string key => struct CachedQuery, most recently used at the head of
+   * the queue; see database_handle_parse_query()
+   */
+  GHashTable *queries;
+  GQueue queries_lru;
+  /* The registry the shards of the database come from, if shared, and the
+   * keys of those shards
+   */
+  GHashTable *shards;
+  GPtrArray *shard_keys;
+  /* Files opened for this handle alone, the shared shards left out; only
+   * set for the handles of the worker threads
+   */
+  guint n_files;
+} DatabaseHandle;
+
+/* A shard used by one or more databases of the same thread; Xapian objects
+ * are not thread-safe, so every thread has its own registry of shards.
+ */
 typedef struct {
   XapianDatabase *db;
-  XapianQueryParser *qp;
+  guint n_users;
+  gchar *path;
+  /* Files the shard keeps open, see count_database_files() */
+  guint n_files;
+} SharedShard;
+
+typedef struct {
+  gchar *key;
+  XapianQuery *query;
+  GList *link;
+} CachedQuery;
+
+typedef struct {
+  volatile gint ref_count;
+  /* Handle owned by the main thread, which opened the database; the worker
+   * threads keep their own, see database_payload_get_worker_handle()
+   */
+  DatabaseHandle *handle;
+  /* Files the worker threads opened for the database, see
+   * database_payload_get_open_files()
+   */
+  volatile gint n_worker_files;
+  /* Set once the manager dropped the database, for the workers to close
+   * their handles
+   */
+  volatile gint released;
+  /* Protects the template and generation, which the main thread changes
+   * while the workers read them
+   */
+  GMutex lock;
+  QueryParserTemplate *parser_template;
   XbDatabaseManager *manager;
-  GFileMonitor *monitor;
+  /* GFileMonitor of the database, or of each member of a federation */
+  GPtrArray *monitors;
   gchar *path;
-  guint expiration_timeout;
+  /* The paths the database was requested with, to open worker handles */
+  gchar *db_path;
+  gchar *manifest_path;
+  gchar **federated;
+  /* Link in one of the manager's recency queues */
+  GList *link;
+  gboolean protected;
+  /* Pinned databases are never evicted nor expired */
+  gboolean pinned;
+  gint64 last_used;
+  /* Changes whenever the database is reopened; part of the key of cached
+   * results.
+   */
+  guint64 generation;
+  /* Pending refresh after changes on disk, see
+   * xb_database_manager_schedule_refresh()
+   */
+  guint refresh_id;
+  gboolean refresh_invalidates;
+  gint64 refresh_requested;
 } DatabasePayload;
 
+/* The serialized JSON response of a query, kept for identical requests */
+typedef struct {
+  gchar *key;
+  gchar *path;
+  /* Indexed by XbEncoding; only the identity one is always there */
+  GBytes *bytes[N_ENCODINGS];
+  gsize size;
+  GList *link;
+} CachedResult;
+
+typedef struct {
+  /* string path => struct DatabasePayload */
+  GHashTable *databases;
+  /* set of string paths of pinned databases */
+  GHashTable *pinned;
+
+  /* Segmented LRU over the open databases, most recently used at the head.
+   * Databases used once sit in the probation queue and are evicted first;
+   * a second use promotes them to the protected queue, so that a scan over
+   * many content packs does not flush the frequently used ones.
+   */
+  GQueue probation;
+  GQueue protected;
+
+  guint max_databases;
+  guint max_open_files;
+  guint64 max_memory;
+  guint idle_timeout;
+  guint expire_id;
+  guint monitor_quiet_period;
+  guint64 coalesced_refreshes;
+  guint64 databases_opened;
+  guint64 databases_evicted;
+
+  GThreadPool *workers;
+  guint n_workers;
+  guint64 next_generation;
+
+  /* struct WorkerState of each thread of the pool, see
+   * xb_database_manager_sweep_workers()
+   */
+  GPtrArray *worker_states;
+  /* Evicted databases whose files some worker has yet to close */
+  GPtrArray *released;
+
+  /* Where the databases are managed, for the workers to call back into */
+  GMainContext *context;
+  /* Set while xb_database_manager_schedule_enforce_limits() is pending */
+  volatile gint enforce_pending;
+
+  /* string path => struct PendingOpen, for the databases being opened */
+  GHashTable *opening;
+
+  /* Shards of the databases opened by the main thread, see
+   * shard_registry_new()
+   */
+  GHashTable *shards;
+
+  /* Recent query results, most recently used at the head of the queue.
+   * Results are stored by the worker threads, hence the lock.
+   */
+  GMutex results_lock;
+  /* string key => struct CachedResult */
+  GHashTable *results;
+  GQueue results_lru;
+  guint64 results_size;
+  guint64 max_cache_size;
+  guint64 cache_hits;
+  guint64 cache_misses;
+
+  guint compression_min_size;
+  guint compression_level;
+
+  /* Milliseconds a query may take, or 0 */
+  guint default_time_limit;
+  /* Milliseconds a streaming query waits for its client, or 0 */
+  guint stream_write_timeout;
+} XbDatabaseManagerPrivate;
+
+enum {
+  PROP_0,
+  PROP_MAX_DATABASES,
+  PROP_MAX_OPEN_FILES,
+  PROP_MAX_MEMORY,
+  PROP_IDLE_TIMEOUT,
+  PROP_OPEN_DATABASES,
+  PROP_N_WORKERS,
+  PROP_MAX_CACHE_SIZE,
+  PROP_CACHE_HITS,
+  PROP_CACHE_MISSES,
+  PROP_MONITOR_QUIET_PERIOD,
+  PROP_COALESCED_REFRESHES,
+  PROP_COMPRESSION_MIN_SIZE,
+  PROP_COMPRESSION_LEVEL,
+  PROP_DATABASES_OPENED,
+  PROP_DATABASES_EVICTED,
+  PROP_DEFAULT_TIME_LIMIT,
+  PROP_OPEN_FILES,
+  PROP_STREAM_WRITE_TIMEOUT,
+  NUM_PROPS
+};
+
+static GParamSpec *props[NUM_PROPS] = { NULL, };
+
+G_DEFINE_TYPE_WITH_PRIVATE (XbDatabaseManager, xb_database_manager, G_TYPE_OBJECT)
+
+static QueryParserTemplate *
+query_parser_template_new (void)
+{
+  QueryParserTemplate *template;
+
+  template = g_slice_new0 (QueryParserTemplate);
+  template->ref_count = 1;
+  template->prefixes = g_ptr_array_new_with_free_func (g_free);
+  template->boolean_prefixes = g_ptr_array_new_with_free_func (g_free);
+
+  return template;
+}
+
+static QueryParserTemplate *
+query_parser_template_ref (QueryParserTemplate *template)
+{
+  g_atomic_int_inc (&template->ref_count);
+  return template;
+}
+
+/* Templates are shared by the handles of all threads */
 static void
-database_payload_free (DatabasePayload *payload)
+query_parser_template_unref (QueryParserTemplate *template)
 {
-  g_clear_object (&payload->db);
-  g_clear_object (&payload->qp);
+  if (!g_atomic_int_dec_and_test (&template->ref_count))
+    return;
 
-  g_file_monitor_cancel (payload->monitor);
-  g_clear_object (&payload->monitor);
-  g_free (payload->path);
+  g_free (template->prefixes_json);
+  g_free (template->stopwords_json);
+  g_ptr_array_unref (template->prefixes);
+  g_ptr_array_unref (template->boolean_prefixes);
+  g_clear_pointer (&template->stopwords, g_ptr_array_unref);
+
+  g_slice_free (QueryParserTemplate, template);
+}
+
+static char *
+read_link (const char *path)
+{
+  char *resolved_path = g_file_read_link (path, NULL);
+  if (resolved_path)
+    return resolved_path;
+  else
+    return g_strdup (path);
+}
+
+static void
+shared_shard_free (SharedShard *shard)
+{
+  g_object_unref (shard->db);
+  g_free (shard->path);
+
+  g_slice_free (SharedShard, shard);
+}
+
+/* Returns a registry of shards, mapping string keys to struct SharedShard */
+static GHashTable *
+shard_registry_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal,
+                                g_free, (GDestroyNotify) shared_shard_free);
+}
+
+/* The same files opened at the same document offset make the same shard,
+ * whatever the path they are reached by; the path only stands in for files
+ * that cannot be queried, which fail to open anyway.
+ */
+static gchar *
+shard_registry_make_key (const gchar *path,
+                         guint64 offset)
+{
+  GFile *file;
+  GFileInfo *info;
+  gchar *key;
+
+  file = g_file_new_for_path (path);
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_UNIX_DEVICE "," G_FILE_ATTRIBUTE_UNIX_INODE,
+                            G_FILE_QUERY_INFO_NONE, NULL, NULL);
+
+  if (info != NULL && g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_UNIX_INODE))
+    key = g_strdup_printf ("%u:%" G_GUINT64_FORMAT "\n%" G_GUINT64_FORMAT,
+                           g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE),
+                           g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE),
+                           offset);
+  else
+    key = g_strdup_printf ("%s\n%" G_GUINT64_FORMAT, path, offset);
+
+  g_clear_object (&info);
+  g_object_unref (file);
+
+  return key;
+}
+
+/* Returns the shard registered for @key, if any, counting a new user */
+static XapianDatabase *
+shard_registry_acquire (GHashTable *registry,
+                        const gchar *key)
+{
+  SharedShard *shard;
+
+  shard = g_hash_table_lookup (registry, key);
+  if (shard == NULL)
+    return NULL;
+
+  shard->n_users++;
+  return shard->db;
+}
+
+static void
+shard_registry_add (GHashTable *registry,
+                    const gchar *key,
+                    XapianDatabase *db,
+                    const gchar *path,
+                    guint n_files)
+{
+  SharedShard *shard;
+
+  shard = g_slice_new0 (SharedShard);
+  shard->db = g_object_ref (db);
+  shard->n_users = 1;
+  shard->path = g_strdup (path);
+  shard->n_files = n_files;
+
+  g_hash_table_insert (registry, g_strdup (key), shard);
+}
+
+static void
+shard_registry_release (GHashTable *registry,
+                        const gchar *key)
+{
+  SharedShard *shard;
+
+  shard = g_hash_table_lookup (registry, key);
+  g_assert (shard != NULL);
+
+  if (--shard->n_users == 0)
+    g_hash_table_remove (registry, key);
+}
+
+/* Moves the shards of @from to @registry, adding up the users of those
+ * already there; the duplicates are closed along with @from, so the
+ * databases they were opened for must have been rebound to the shards of
+ * @registry first, see opened_database_rebind().
+ */
+static void
+shard_registry_merge (GHashTable *registry,
+                      GHashTable *from)
+{
+  GHashTableIter iter;
+  gchar *key;
+  SharedShard *shard, *existing;
+
+  g_hash_table_iter_init (&iter, from);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &key, (gpointer *) &shard))
+    {
+      existing = g_hash_table_lookup (registry, key);
+      if (existing != NULL)
+        {
+          existing->n_users += shard->n_users;
+          continue;
+        }
+
+      g_hash_table_iter_steal (&iter);
+      g_hash_table_insert (registry, key, shard);
+    }
+}
+
+/* Each shard is counted once, however many databases share it */
+static guint
+shard_registry_count_files (GHashTable *registry)
+{
+  GHashTableIter iter;
+  SharedShard *shard;
+  guint n_files = 0;
 
-  if (payload->expiration_timeout)
-    g_source_remove (payload->expiration_timeout);
+  g_hash_table_iter_init (&iter, registry);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &shard))
+    n_files += shard->n_files;
+
+  return n_files;
+}
+
+static void
+cached_query_free (CachedQuery *cached)
+{
+  g_free (cached->key);
+  g_object_unref (cached->query);
+
+  g_slice_free (CachedQuery, cached);
+}
+
+/* The stopper is shared by all the parsers of the handle */
+static void
+database_handle_create_stopper (DatabaseHandle *handle)
+{
+  XapianSimpleStopper *stopper;
+  guint idx;
+
+  if (handle->template->stopwords == NULL)
+    return;
+
+  stopper = xapian_simple_stopper_new ();
+  for (idx = 0; idx < handle->template->stopwords->len; idx++)
+    xapian_simple_stopper_add (stopper, g_ptr_array_index (handle->template->stopwords, idx));
+  handle->stopper = XAPIAN_STOPPER (stopper);
+}
+
+/* Takes ownership of @shard_keys, the keys of the shards of @db acquired from
+ * @shards; both are NULL if the database shares no shards.
+ */
+static DatabaseHandle *
+database_handle_new (XapianDatabase *db,
+                     guint64 generation,
+                     QueryParserTemplate *template,
+                     GHashTable *shards,
+                     GPtrArray *shard_keys)
+{
+  DatabaseHandle *handle;
+
+  handle = g_slice_new0 (DatabaseHandle);
+  handle->db = g_object_ref (db);
+  handle->shards = shards != NULL ? g_hash_table_ref (shards) : NULL;
+  handle->shard_keys = shard_keys;
+  handle->generation = generation;
+  handle->template = query_parser_template_ref (template);
+  handle->parsers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, g_object_unref);
+  handle->stemmers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, g_object_unref);
+  g_hash_table_insert (handle->stemmers, g_strdup ("none"), xapian_stem_new ());
+  handle->queries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, (GDestroyNotify) cached_query_free);
+  g_queue_init (&handle->queries_lru);
+
+  database_handle_create_stopper (handle);
+
+  return handle;
+}
+
+/* Drops whatever the handle derived from an older generation of the
+ * database, once its database was reopened.
+ */
+static void
+database_handle_update (DatabaseHandle *handle,
+                        guint64 generation,
+                        QueryParserTemplate *template)
+{
+  /* Wildcard expansion and spelling corrections depend on the contents */
+  g_queue_clear (&handle->queries_lru);
+  g_hash_table_remove_all (handle->queries);
+
+  if (handle->template != template)
+    {
+      g_hash_table_remove_all (handle->parsers);
+      g_clear_object (&handle->stopper);
+      query_parser_template_unref (handle->template);
+      handle->template = query_parser_template_ref (template);
+      database_handle_create_stopper (handle);
+    }
+
+  handle->generation = generation;
+}
+
+static void
+database_handle_free (DatabaseHandle *handle)
+{
+  guint idx;
+
+  g_queue_clear (&handle->queries_lru);
+  g_clear_pointer (&handle->queries, g_hash_table_unref);
+  g_clear_pointer (&handle->parsers, g_hash_table_unref);
+  g_clear_object (&handle->stopper);
+  g_clear_pointer (&handle->template, query_parser_template_unref);
+  g_clear_object (&handle->db);
+  g_clear_pointer (&handle->stemmers, g_hash_table_unref);
+
+  if (handle->shard_keys != NULL)
+    {
+      for (idx = 0; idx < handle->shard_keys->len; idx++)
+        shard_registry_release (handle->shards, g_ptr_array_index (handle->shard_keys, idx));
+      g_ptr_array_unref (handle->shard_keys);
+    }
+  g_clear_pointer (&handle->shards, g_hash_table_unref);
+
+  g_slice_free (DatabaseHandle, handle);
+}
+
+static DatabasePayload *
+database_payload_ref (DatabasePayload *payload)
+{
+  g_atomic_int_inc (&payload->ref_count);
+  return payload;
+}
+
+/* The last reference may be dropped by a worker thread, once the database
+ * was already evicted from the cache by the main thread; the handles were
+ * closed by then.
+ */
+static void
+database_payload_unref (DatabasePayload *payload)
+{
+  if (!g_atomic_int_dec_and_test (&payload->ref_count))
+    return;
+
+  g_clear_pointer (&payload->parser_template, query_parser_template_unref);
+  g_mutex_clear (&payload->lock);
+
+  g_free (payload->path);
+  g_free (payload->db_path);
+  g_free (payload->manifest_path);
+  g_strfreev (payload->federated);
 
   g_slice_free (DatabasePayload, payload);
 }
 
+static void
+cached_result_free (CachedResult *result)
+{
+  gint idx;
+
+  g_free (result->key);
+  g_free (result->path);
+  for (idx = 0; idx < N_ENCODINGS; idx++)
+    g_clear_pointer (&result->bytes[idx], g_bytes_unref);
+
+  g_slice_free (CachedResult, result);
+}
+
+/* Must be called with the results lock held */
+static void
+xb_database_manager_remove_result (XbDatabaseManager *self,
+                                   CachedResult *result)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  g_queue_delete_link (&priv->results_lru, result->link);
+  priv->results_size -= result->size;
+  g_hash_table_remove (priv->results, result->key);
+}
+
+/* Must be called with the results lock held */
+static void
+xb_database_manager_trim_results (XbDatabaseManager *self)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  while (priv->results_size > priv->max_cache_size &&
+         priv->results_lru.tail != NULL)
+    xb_database_manager_remove_result (self, priv->results_lru.tail->data);
+}
+
+/* Drops the cached results of the database at @path */
+static void
+xb_database_manager_drop_results (XbDatabaseManager *self,
+                                  const gchar *path)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  GList *l, *next;
+
+  g_mutex_lock (&priv->results_lock);
+
+  for (l = priv->results_lru.head; l != NULL; l = next)
+    {
+      CachedResult *result = l->data;
+
+      next = l->next;
+      if (g_str_equal (result->path, path))
+        xb_database_manager_remove_result (self, result);
+    }
+
+  g_mutex_unlock (&priv->results_lock);
+}
+
+static void xb_database_manager_sweep_workers (XbDatabaseManager *self);
+static void xb_database_manager_detach_workers (XbDatabaseManager *self);
+
+/* Removes the database from the manager; called on the main thread when it
+ * is dropped from the cache.
+ */
+static void
+database_payload_release (DatabasePayload *payload)
+{
+  XbDatabaseManager *self = payload->manager;
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  GFileMonitor *monitor;
+  guint idx;
+
+  g_queue_delete_link (payload->protected ? &priv->protected : &priv->probation,
+                       payload->link);
+  payload->link = NULL;
+
+  if (payload->refresh_id != 0)
+    {
+      g_source_remove (payload->refresh_id);
+      payload->refresh_id = 0;
+    }
+
+  if (payload->monitors != NULL)
+    {
+      for (idx = 0; idx < payload->monitors->len; idx++)
+        {
+          monitor = g_ptr_array_index (payload->monitors, idx);
+          g_signal_handlers_disconnect_by_data (monitor, payload);
+          g_file_monitor_cancel (monitor);
+        }
+
+      g_clear_pointer (&payload->monitors, g_ptr_array_unref);
+    }
+
+  xb_database_manager_drop_results (payload->manager, payload->path);
+
+  /* The handle may share shards with other databases of the main thread, so
+   * it is closed here rather than by whichever thread drops the last
+   * reference.
+   */
+  g_clear_pointer (&payload->handle, database_handle_free);
+  g_atomic_int_set (&payload->released, 1);
+  payload->manager = NULL;
+
+  /* The files of busy workers still count until they close them */
+  xb_database_manager_sweep_workers (self);
+  if (g_atomic_int_get (&payload->n_worker_files) > 0)
+    g_ptr_array_add (priv->released, database_payload_ref (payload));
+
+  database_payload_unref (payload);
+}
+
+/* Takes ownership of @parser_template, @shard_keys and @monitors */
 static DatabasePayload *
 database_payload_new (XapianDatabase *db,
-                      XapianQueryParser *qp,
+                      QueryParserTemplate *parser_template,
+                      GHashTable *shards,
+                      GPtrArray *shard_keys,
                       XbDatabaseManager *manager,
-                      GFileMonitor *monitor,
-                      const gchar *path)
+                      GPtrArray *monitors,
+                      const gchar *path,
+                      XbDatabase xbdb)
 {
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (manager);
   DatabasePayload *payload;
 
   payload = g_slice_new0 (DatabasePayload);
-  payload->db = g_object_ref (db);
-  payload->qp = g_object_ref (qp);
+  payload->ref_count = 1;
+  payload->generation = priv->next_generation++;
+  payload->parser_template = parser_template;
+  payload->handle = database_handle_new (db, payload->generation, parser_template,
+                                         shards, shard_keys);
+  g_mutex_init (&payload->lock);
   payload->manager = manager;
-  payload->monitor = g_object_ref (monitor);
+  payload->monitors = monitors;
   payload->path = g_strdup (path);
+  payload->db_path = g_strdup (xbdb.path);
+  payload->manifest_path = g_strdup (xbdb.manifest_path);
+  payload->federated = g_strdupv ((gchar **) xbdb.federated);
+  payload->last_used = g_get_monotonic_time ();
+
+  g_queue_push_head (&priv->probation, payload);
+  payload->link = priv->probation.head;
 
   return payload;
 }
 
-typedef struct {
-  /* string path => struct DatabasePayload */
-  GHashTable *databases;
-  /* string lang_name => object XapianStem */
-  GHashTable *stemmers;
-} XbDatabaseManagerPrivate;
-
-G_DEFINE_TYPE_WITH_PRIVATE (XbDatabaseManager, xb_database_manager, G_TYPE_OBJECT)
+/* Every worker thread that queried the database holds its own files open.
+ * A shard the databases of a thread share is counted against the first
+ * one to open it there, and no longer counted once that one is closed.
+ */
+static guint
+database_payload_get_open_files (DatabasePayload *payload)
+{
+  return g_atomic_int_get (&payload->n_worker_files);
+}
 
 static void
 xb_database_manager_invalidate_db (XbDatabaseManager *self,
@@ -115,474 +797,2758 @@ xb_database_manager_invalidate_db (XbDatabaseManager *self,
     }
 }
 
+/* Marks the database as just used, promoting it from probation to the
+ * protected queue on its second use.
+ */
 static void
-database_monitor_changed (GFileMonitor *monitor,
-                          GFile *file,
-                          GFile *other_file,
-                          GFileMonitorEvent event_type,
-                          gpointer user_data)
+xb_database_manager_touch_db (XbDatabaseManager *self,
+                              DatabasePayload *payload)
 {
-  DatabasePayload *payload = user_data;
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  DatabasePayload *demoted;
+  GList *link;
 
-  switch (event_type)
+  payload->last_used = g_get_monotonic_time ();
+
+  if (payload->protected)
     {
-    case G_FILE_MONITOR_EVENT_CHANGED:
-    case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
-    case G_FILE_MONITOR_EVENT_DELETED:
-    case G_FILE_MONITOR_EVENT_MOVED:
-    case G_FILE_MONITOR_EVENT_UNMOUNTED:
-      xb_database_manager_invalidate_db (payload->manager, payload->path);
+      g_queue_unlink (&priv->protected, payload->link);
+      g_queue_push_head_link (&priv->protected, payload->link);
+      return;
+    }
+
+  g_queue_unlink (&priv->probation, payload->link);
+  g_queue_push_head_link (&priv->protected, payload->link);
+  payload->protected = TRUE;
+
+  /* Keep a quarter of the slots for probation, so that new databases get a
+   * chance to prove themselves before being evicted.
+   */
+  while (priv->max_databases > 0 &&
+         priv->protected.length > MAX (priv->max_databases * 3 / 4, 1))
+    {
+      link = g_queue_pop_tail_link (&priv->protected);
+      demoted = link->data;
+      demoted->protected = FALSE;
+      g_queue_push_head_link (&priv->probation, link);
+    }
+}
+
+static guint64
+xb_database_manager_count_open_files (XbDatabaseManager *self)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  DatabasePayload *payload;
+  GHashTableIter iter;
+  guint64 n_open_files;
+  guint idx;
+
+  /* The handles of the main thread all share its shards */
+  n_open_files = shard_registry_count_files (priv->shards);
+
+  g_hash_table_iter_init (&iter, priv->databases);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &payload))
+    n_open_files += database_payload_get_open_files (payload);
+
+  for (idx = priv->released->len; idx > 0; idx--)
+    {
+      payload = g_ptr_array_index (priv->released, idx - 1);
+      if (database_payload_get_open_files (payload) == 0)
+        g_ptr_array_remove_index_fast (priv->released, idx - 1);
+      else
+        n_open_files += database_payload_get_open_files (payload);
+    }
+
+  return n_open_files;
+}
+
+static gboolean
+xb_database_manager_over_budget (XbDatabaseManager *self)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  guint64 n_open_files;
+
+  if (priv->max_databases > 0 &&
+      g_hash_table_size (priv->databases) > priv->max_databases)
+    return TRUE;
+
+  n_open_files = xb_database_manager_count_open_files (self);
+
+  if (priv->max_open_files > 0 && n_open_files > priv->max_open_files)
+    return TRUE;
+
+  if (priv->max_memory > 0 &&
+      n_open_files * DATABASE_TABLE_MEMORY_ESTIMATE > priv->max_memory)
+    return TRUE;
+
+  return FALSE;
+}
+
+/* Evicts the least valuable databases until the cache fits in its budget
+ * again. The database passed as @keep is never evicted, even if it alone
+ * exceeds the budget, since the caller is about to use it.
+ */
+static void
+xb_database_manager_enforce_limits (XbDatabaseManager *self,
+                                    DatabasePayload *keep)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  DatabasePayload *victim;
+  GList *l;
+
+  while (xb_database_manager_over_budget (self))
+    {
+      victim = NULL;
+
+      for (l = priv->probation.tail; l != NULL && victim == NULL; l = l->prev)
+        if (l->data != keep && !((DatabasePayload *) l->data)->pinned)
+          victim = l->data;
+
+      for (l = priv->protected.tail; l != NULL && victim == NULL; l = l->prev)
+        if (l->data != keep && !((DatabasePayload *) l->data)->pinned)
+          victim = l->data;
+
+      if (victim == NULL)
+        break;
+
+      g_info ("Evicting database %s", victim->path);
+      priv->databases_evicted++;
+      xb_database_manager_invalidate_db (self, victim->path);
+    }
+}
+
+static gboolean
+on_enforce_limits (gpointer user_data)
+{
+  XbDatabaseManager *self = user_data;
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  g_atomic_int_set (&priv->enforce_pending, 0);
+  xb_database_manager_enforce_limits (self, NULL);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* The worker threads open their own files after the database was added, so
+ * they have the main thread check the limits again; may be called from any
+ * thread.
+ */
+static void
+xb_database_manager_schedule_enforce_limits (XbDatabaseManager *self)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  if (!g_atomic_int_compare_and_exchange (&priv->enforce_pending, 0, 1))
+    return;
+
+  g_main_context_invoke_full (priv->context, G_PRIORITY_DEFAULT,
+                              on_enforce_limits, g_object_ref (self),
+                              g_object_unref);
+}
+
+static gboolean
+on_databases_expire (gpointer user_data)
+{
+  XbDatabaseManager *self = user_data;
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  DatabasePayload *payload;
+  GHashTableIter iter;
+  gint64 deadline;
+
+  deadline = g_get_monotonic_time () - priv->idle_timeout * G_USEC_PER_SEC;
+
+  g_hash_table_iter_init (&iter, priv->databases);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &payload))
+    {
+      if (!payload->pinned && payload->last_used < deadline)
+        {
+          priv->databases_evicted++;
+          g_hash_table_iter_remove (&iter);
+        }
+    }
+
+  if (g_hash_table_size (priv->databases) > 0)
+    return G_SOURCE_CONTINUE;
+
+  priv->expire_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
+/* Idle expiry is only a fallback to release databases nobody has asked for
+ * in a long while; a single sweep timer covers all of them.
+ */
+static void
+xb_database_manager_schedule_expiry (XbDatabaseManager *self)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  if (priv->expire_id != 0 || priv->idle_timeout == 0 ||
+      g_hash_table_size (priv->databases) == 0)
+    return;
+
+  priv->expire_id = g_timeout_add_seconds (MAX (priv->idle_timeout / 2, 1),
+                                           on_databases_expire, self);
+}
+
+/* Adds the prefixes and booleanPrefixes contained in the JSON object
+ * to the query parser template.
+ */
+static void
+xb_database_manager_add_queryparser_prefixes (XbDatabaseManager *self,
+                                              QueryParserTemplate *template,
+                                              JsonObject *object)
+{
+  JsonNode *element_node;
+  JsonObject *element_object;
+  JsonArray *array;
+  GList *elements, *l;
+
+  array = json_object_get_array_member (object, "prefixes");
+  elements = json_array_get_elements (array);
+
+  for (l = elements; l != NULL; l = l->next)
+    {
+      element_node = l->data;
+      element_object = json_node_get_object (element_node);
+      g_ptr_array_add (template->prefixes,
+                       g_strdup (json_object_get_string_member (element_object, "field")));
+      g_ptr_array_add (template->prefixes,
+                       g_strdup (json_object_get_string_member (element_object, "prefix")));
+    }
+
+  g_list_free (elements);
+
+  array = json_object_get_array_member (object, "booleanPrefixes");
+  elements = json_array_get_elements (array);
+
+  for (l = elements; l != NULL; l = l->next)
+    {
+      element_node = l->data;
+      element_object = json_node_get_object (element_node);
+      g_ptr_array_add (template->boolean_prefixes,
+                       g_strdup (json_object_get_string_member (element_object, "field")));
+      g_ptr_array_add (template->boolean_prefixes,
+                       g_strdup (json_object_get_string_member (element_object, "prefix")));
+    }
+
+  g_list_free (elements);
+}
+
+static void
+xb_database_manager_add_queryparser_standard_prefixes (XbDatabaseManager *self,
+                                                       QueryParserTemplate *template)
+{
+  /* TODO: these should be configurable */
+  static const struct {
+    const gchar *field;
+    const gchar *prefix;
+  } standard_prefixes[] = {
+    { "title", "S" },
+    { "exact_title", "XEXACTS" },
+  }, standard_boolean_prefixes[] = {
+    { "tag", "K" },
+    { "id", "Q" },
+  };
+  gint idx;
+
+  for (idx = 0; idx < G_N_ELEMENTS (standard_prefixes); idx++)
+    {
+      g_ptr_array_add (template->prefixes, g_strdup (standard_prefixes[idx].field));
+      g_ptr_array_add (template->prefixes, g_strdup (standard_prefixes[idx].prefix));
+    }
+
+  for (idx = 0; idx < G_N_ELEMENTS (standard_boolean_prefixes); idx++)
+    {
+      g_ptr_array_add (template->boolean_prefixes,
+                       g_strdup (standard_boolean_prefixes[idx].field));
+      g_ptr_array_add (template->boolean_prefixes,
+                       g_strdup (standard_boolean_prefixes[idx].prefix));
+    }
+}
+
+static guint
+xb_database_manager_get_n_threads (XbDatabaseManager *self)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  if (priv->n_workers > 0)
+    return priv->n_workers;
+
+  return g_get_num_processors ();
+}
+
+static void
+xb_database_manager_get_property (GObject *object,
+                                  guint prop_id,
+                                  GValue *value,
+                                  GParamSpec *pspec)
+{
+  XbDatabaseManager *self = XB_DATABASE_MANAGER (object);
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_MAX_DATABASES:
+      g_value_set_uint (value, priv->max_databases);
+      break;
+    case PROP_MAX_OPEN_FILES:
+      g_value_set_uint (value, priv->max_open_files);
+      break;
+    case PROP_MAX_MEMORY:
+      g_value_set_uint64 (value, priv->max_memory);
+      break;
+    case PROP_IDLE_TIMEOUT:
+      g_value_set_uint (value, priv->idle_timeout);
+      break;
+    case PROP_OPEN_DATABASES:
+      g_value_set_uint (value, g_hash_table_size (priv->databases));
+      break;
+    case PROP_OPEN_FILES:
+      g_value_set_uint64 (value, xb_database_manager_count_open_files (self));
+      break;
+    case PROP_N_WORKERS:
+      g_value_set_uint (value, priv->n_workers);
+      break;
+    case PROP_MONITOR_QUIET_PERIOD:
+      g_value_set_uint (value, priv->monitor_quiet_period);
+      break;
+    case PROP_COALESCED_REFRESHES:
+      g_value_set_uint64 (value, priv->coalesced_refreshes);
+      break;
+    case PROP_MAX_CACHE_SIZE:
+      g_value_set_uint64 (value, priv->max_cache_size);
+      break;
+    case PROP_CACHE_HITS:
+      g_mutex_lock (&priv->results_lock);
+      g_value_set_uint64 (value, priv->cache_hits);
+      g_mutex_unlock (&priv->results_lock);
+      break;
+    case PROP_CACHE_MISSES:
+      g_mutex_lock (&priv->results_lock);
+      g_value_set_uint64 (value, priv->cache_misses);
+      g_mutex_unlock (&priv->results_lock);
+      break;
+    case PROP_COMPRESSION_MIN_SIZE:
+      g_value_set_uint (value, priv->compression_min_size);
+      break;
+    case PROP_COMPRESSION_LEVEL:
+      g_value_set_uint (value, priv->compression_level);
+      break;
+    case PROP_DATABASES_OPENED:
+      g_value_set_uint64 (value, priv->databases_opened);
+      break;
+    case PROP_DEFAULT_TIME_LIMIT:
+      g_value_set_uint (value, priv->default_time_limit);
+      break;
+    case PROP_STREAM_WRITE_TIMEOUT:
+      g_value_set_uint (value, priv->stream_write_timeout);
+      break;
+    case PROP_DATABASES_EVICTED:
+      g_value_set_uint64 (value, priv->databases_evicted);
       break;
     default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
     }
 }
 
-static GFileMonitor *
-xb_database_manager_monitor_db (XbDatabaseManager *self,
-                                const gchar *path)
+static void
+xb_database_manager_set_property (GObject *object,
+                                  guint prop_id,
+                                  const GValue *value,
+                                  GParamSpec *pspec)
 {
-  GFile *file;
-  GFileMonitor *monitor;
+  XbDatabaseManager *self = XB_DATABASE_MANAGER (object);
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_MAX_DATABASES:
+      priv->max_databases = g_value_get_uint (value);
+      break;
+    case PROP_MAX_OPEN_FILES:
+      priv->max_open_files = g_value_get_uint (value);
+      break;
+    case PROP_MAX_MEMORY:
+      priv->max_memory = g_value_get_uint64 (value);
+      break;
+    case PROP_IDLE_TIMEOUT:
+      priv->idle_timeout = g_value_get_uint (value);
+      if (priv->expire_id != 0)
+        {
+          g_source_remove (priv->expire_id);
+          priv->expire_id = 0;
+        }
+      xb_database_manager_schedule_expiry (self);
+      return;
+    case PROP_N_WORKERS:
+      priv->n_workers = g_value_get_uint (value);
+      if (priv->workers != NULL)
+        g_thread_pool_set_max_threads (priv->workers,
+                                       xb_database_manager_get_n_threads (self),
+                                       NULL);
+      return;
+    case PROP_MAX_CACHE_SIZE:
+      g_mutex_lock (&priv->results_lock);
+      priv->max_cache_size = g_value_get_uint64 (value);
+      xb_database_manager_trim_results (self);
+      g_mutex_unlock (&priv->results_lock);
+      return;
+    case PROP_MONITOR_QUIET_PERIOD:
+      priv->monitor_quiet_period = g_value_get_uint (value);
+      return;
+    case PROP_COMPRESSION_MIN_SIZE:
+      priv->compression_min_size = g_value_get_uint (value);
+      return;
+    case PROP_DEFAULT_TIME_LIMIT:
+      priv->default_time_limit = g_value_get_uint (value);
+      return;
+    case PROP_STREAM_WRITE_TIMEOUT:
+      priv->stream_write_timeout = g_value_get_uint (value);
+      return;
+    case PROP_COMPRESSION_LEVEL:
+      priv->compression_level = g_value_get_uint (value);
+      return;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      return;
+    }
+
+  /* A smaller budget takes effect immediately */
+  xb_database_manager_enforce_limits (self, NULL);
+}
+
+static void
+xb_database_manager_finalize (GObject *object)
+{
+  XbDatabaseManager *self = XB_DATABASE_MANAGER (object);
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  if (priv->expire_id != 0)
+    g_source_remove (priv->expire_id);
+
+  /* Let the workers finish whatever they are doing with our databases */
+  if (priv->workers != NULL)
+    g_thread_pool_free (priv->workers, FALSE, TRUE);
+
+  xb_database_manager_detach_workers (self);
+
+  g_clear_pointer (&priv->databases, g_hash_table_unref);
+  g_clear_pointer (&priv->pinned, g_hash_table_unref);
+  g_clear_pointer (&priv->opening, g_hash_table_unref);
+  g_clear_pointer (&priv->released, g_ptr_array_unref);
+  g_clear_pointer (&priv->shards, g_hash_table_unref);
+  g_clear_pointer (&priv->context, g_main_context_unref);
+
+  g_queue_clear (&priv->results_lru);
+  g_clear_pointer (&priv->results, g_hash_table_unref);
+  g_mutex_clear (&priv->results_lock);
+
+  G_OBJECT_CLASS (xb_database_manager_parent_class)->finalize (object);
+}
+
+static void
+xb_database_manager_class_init (XbDatabaseManagerClass *klass)
+{
+    GObjectClass *gobject_class = (GObjectClass *)klass;
+    gobject_class->get_property = xb_database_manager_get_property;
+    gobject_class->set_property = xb_database_manager_set_property;
+    gobject_class->finalize = xb_database_manager_finalize;
+
+    /* Maximum number of databases kept open at once; 0 means unbounded. */
+    props[PROP_MAX_DATABASES] =
+      g_param_spec_uint ("max-databases", "Max databases",
+                         "Maximum number of open databases",
+                         0, G_MAXUINT, DEFAULT_MAX_DATABASES,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+    /* Maximum number of database files kept open at once; 0 means unbounded. */
+    props[PROP_MAX_OPEN_FILES] =
+      g_param_spec_uint ("max-open-files", "Max open files",
+                         "Maximum number of open database files",
+                         0, G_MAXUINT, DEFAULT_MAX_OPEN_FILES,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+    /* Estimated memory budget for open databases, in bytes; 0 means unbounded. */
+    props[PROP_MAX_MEMORY] =
+      g_param_spec_uint64 ("max-memory", "Max memory",
+                           "Memory budget for open databases, in bytes",
+                           0, G_MAXUINT64, DEFAULT_MAX_MEMORY,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+    /* Seconds after which an unused database is closed; 0 disables expiry. */
+    props[PROP_IDLE_TIMEOUT] =
+      g_param_spec_uint ("idle-timeout", "Idle timeout",
+                         "Seconds after which an unused database is closed",
+                         0, G_MAXUINT, DEFAULT_IDLE_TIMEOUT,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+    /* Number of threads running queries; 0 means one per processor. */
+    props[PROP_N_WORKERS] =
+      g_param_spec_uint ("n-workers", "Number of workers",
+                         "Number of query worker threads",
+                         0, G_MAXUINT, 0,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+    /* Memory budget for cached query results, in bytes; 0 disables the cache. */
+    props[PROP_MAX_CACHE_SIZE] =
+      g_param_spec_uint64 ("max-cache-size", "Max cache size",
+                           "Memory budget for cached query results, in bytes",
+                           0, G_MAXUINT64, DEFAULT_MAX_CACHE_SIZE,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+    /* Milliseconds without changes on disk before a changed database is
+     * refreshed; 0 refreshes it on every change.
+     */
+    props[PROP_MONITOR_QUIET_PERIOD] =
+      g_param_spec_uint ("monitor-quiet-period", "Monitor quiet period",
+                         "Milliseconds without changes before refreshing a database",
+                         0, G_MAXUINT, DEFAULT_MONITOR_QUIET_PERIOD,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+    /* Encoded results smaller than this are sent as is */
+    props[PROP_COMPRESSION_MIN_SIZE] =
+      g_param_spec_uint ("compression-min-size", "Compression min size",
+                         "Smallest result compressed when asked to, in bytes",
+                         0, G_MAXUINT, DEFAULT_COMPRESSION_MIN_SIZE,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+    /* zlib compression level; 0 disables compression. */
+    props[PROP_COMPRESSION_LEVEL] =
+      g_param_spec_uint ("compression-level", "Compression level",
+                         "Level of compression of the results, from 1 to 9",
+                         0, 9, DEFAULT_COMPRESSION_LEVEL,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+    /* Milliseconds a query may spend matching and fetching documents,
+     * counted from when a worker starts it; 0 means unbounded. The
+     * timeLimit parameter can only lower it. Xapian cannot stop matching,
+     * so such queries are kept cheap to match instead.
+     */
+    props[PROP_DEFAULT_TIME_LIMIT] =
+      g_param_spec_uint ("default-time-limit", "Default time limit",
+                         "Milliseconds a query may take, after which partial results are sent",
+                         0, G_MAXUINT, 0,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+    /* Milliseconds a streaming query waits for the client to read what it
+     * was sent before giving up on it; 0 waits for as long as it takes.
+     */
+    props[PROP_STREAM_WRITE_TIMEOUT] =
+      g_param_spec_uint ("stream-write-timeout", "Stream write timeout",
+                         "Milliseconds a streaming query waits for the client to read",
+                         0, G_MAXUINT, DEFAULT_STREAM_WRITE_TIMEOUT,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+    props[PROP_COALESCED_REFRESHES] =
+      g_param_spec_uint64 ("coalesced-refreshes", "Coalesced refreshes",
+                           "Number of database changes folded into a later refresh",
+                           0, G_MAXUINT64, 0,
+                           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+    props[PROP_CACHE_HITS] =
+      g_param_spec_uint64 ("cache-hits", "Cache hits",
+                           "Number of queries answered from the result cache",
+                           0, G_MAXUINT64, 0,
+                           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+    props[PROP_CACHE_MISSES] =
+      g_param_spec_uint64 ("cache-misses", "Cache misses",
+                           "Number of queries not found in the result cache",
+                           0, G_MAXUINT64, 0,
+                           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+    props[PROP_OPEN_DATABASES] =
+      g_param_spec_uint ("open-databases", "Open databases",
+                         "Number of currently open databases",
+                         0, G_MAXUINT, 0,
+                         G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+    props[PROP_OPEN_FILES] =
+      g_param_spec_uint64 ("open-files", "Open files",
+                           "Estimated number of database files currently open, "
+                           "as limited by max-open-files",
+                           0, G_MAXUINT64, 0,
+                           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+    props[PROP_DATABASES_OPENED] =
+      g_param_spec_uint64 ("databases-opened", "Databases opened",
+                           "Number of databases opened, including reopened ones",
+                           0, G_MAXUINT64, 0,
+                           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+    props[PROP_DATABASES_EVICTED] =
+      g_param_spec_uint64 ("databases-evicted", "Databases evicted",
+                           "Number of databases closed to stay within the limits, or when idle",
+                           0, G_MAXUINT64, 0,
+                           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+    g_object_class_install_properties (gobject_class, NUM_PROPS, props);
+}
+
+static void
+xb_database_manager_init (XbDatabaseManager *self)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  priv->databases = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, (GDestroyNotify) database_payload_release);
+  priv->pinned = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  priv->opening = g_hash_table_new (g_str_hash, g_str_equal);
+  priv->shards = shard_registry_new ();
+  priv->context = g_main_context_ref_thread_default ();
+  priv->worker_states = g_ptr_array_new ();
+  priv->released = g_ptr_array_new_with_free_func ((GDestroyNotify) database_payload_unref);
+
+  g_queue_init (&priv->probation);
+  g_queue_init (&priv->protected);
+
+  g_mutex_init (&priv->results_lock);
+  priv->results = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         NULL, (GDestroyNotify) cached_result_free);
+  g_queue_init (&priv->results_lru);
+}
+
+static gboolean
+xb_database_manager_register_prefixes (XbDatabaseManager *self,
+                                       XapianDatabase *db,
+                                       QueryParserTemplate *template,
+                                       GError **error_out)
+{
+  gchar *metadata_json;
   GError *error = NULL;
+  JsonParser *parser = NULL;
+  JsonNode *root;
+  gboolean ret = FALSE;
 
-  file = g_file_new_for_path (path);
-  monitor = g_file_monitor (file, G_FILE_MONITOR_NONE, NULL, &error);
-  g_object_unref (file);
+  /* Attempt to read the database's custom prefix association metadata */
+  metadata_json = xapian_database_get_metadata (db, PREFIX_METADATA_KEY, &error);
+  if (error != NULL)
+    {
+      g_propagate_error (error_out, error);
+      goto out;
+    }
+
+  template->prefixes_json = g_strdup (metadata_json);
 
+  parser = json_parser_new ();
+  json_parser_load_from_data (parser, metadata_json, -1, &error);
   if (error != NULL)
     {
-      /* Non-fatal */
-      g_warning ("Could not monitor database at path %s: %s",
-                 path, error->message);
-      g_error_free (error);
-      return NULL;
+      g_propagate_error (error_out, error);
+      goto out;
     }
 
-  return monitor;
+  root = json_parser_get_root (parser);
+  if (root != NULL)
+    xb_database_manager_add_queryparser_prefixes (self, template,
+                                                  json_node_get_object (root));
+
+  ret = TRUE;
+
+ out:
+  /* If there was an error, just use the "standard" prefix map */
+  if (error != NULL)
+    xb_database_manager_add_queryparser_standard_prefixes (self, template);
+
+  g_clear_error (&error);
+  g_clear_object (&parser);
+  g_free (metadata_json);
+  return ret;
+}
+
+static gboolean
+xb_database_manager_register_stopwords (XbDatabaseManager *self,
+                                        XapianDatabase *db,
+                                        QueryParserTemplate *template,
+                                        GError **error_out)
+{
+  gchar *stopwords_json;
+  GError *error = NULL;
+  JsonParser *parser;
+  JsonNode *node;
+  JsonArray *array;
+  GList *elements, *l;
+  const gchar *stopword;
+  gchar *stopword_chomped;
+
+  stopwords_json = xapian_database_get_metadata (db, STOPWORDS_METADATA_KEY, &error);
+  if (error != NULL)
+    {
+      g_propagate_error (error_out, error);
+      return FALSE;
+    }
+
+  template->stopwords_json = stopwords_json;
+
+  parser = json_parser_new ();
+  json_parser_load_from_data (parser, stopwords_json, -1, &error);
+  if (error != NULL)
+    {
+      g_propagate_error (error_out, error);
+      g_object_unref (parser);
+      return FALSE;
+    }
+
+  /* empty JSON is not an error */
+  node = json_parser_get_root (parser);
+  if (node != NULL)
+    {
+      array = json_node_get_array (node);
+      elements = json_array_get_elements (array);
+
+      template->stopwords = g_ptr_array_new_with_free_func (g_free);
+      for (l = elements; l != NULL; l = l->next)
+        {
+          stopword = json_node_get_string (l->data);
+          /* In older databases, each stopword had a newline appended.
+           * This has now been fixed, but to avoid having to rebuild
+           * everything, we check for and remove such newlines.
+           */
+          if (g_str_has_suffix (stopword, "\n"))
+            {
+              stopword_chomped = g_strdup (stopword);
+              g_strchomp (stopword_chomped);
+              g_ptr_array_add (template->stopwords, stopword_chomped);
+            }
+          else
+            {
+              g_ptr_array_add (template->stopwords, g_strdup (stopword));
+            }
+        }
+
+      g_list_free (elements);
+    }
+
+  g_object_unref (parser);
+
+  return TRUE;
+}
+
+/* Xapian keeps one descriptor open per table of a multi-file database, and a
+ * single one for a single-file (compacted) glass database.
+ */
+static guint
+count_database_files (const gchar *path)
+{
+  GDir *dir;
+  const gchar *name;
+  guint n_files = 0;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    return 1;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      if (g_str_has_suffix (name, ".DB") || g_str_has_suffix (name, ".glass"))
+        n_files++;
+    }
+
+  g_dir_close (dir);
+
+  return MAX (n_files, 1);
+}
+
+/* A shard listed in a manifest, opened by one of the threads of
+ * create_database_from_manifest()
+ */
+typedef struct {
+  gchar *path;
+  guint64 offset;
+  gchar *key;
+  gboolean acquired;
+  XapianDatabase *db;
+  GError *error;
+} ManifestShard;
+
+static void
+open_manifest_shard (gpointer data,
+                     gpointer user_data)
+{
+  ManifestShard *shard = data;
+  gint64 start = g_get_monotonic_time ();
+
+  shard->db = g_initable_new (XAPIAN_TYPE_DATABASE,
+                              NULL, &shard->error,
+                              "path", shard->path,
+                              "offset", shard->offset,
+                              NULL);
+
+  g_info ("Opened shard %s in %.3f ms", shard->path,
+          (g_get_monotonic_time () - start) / 1000.0);
+}
+
+/* Appends the keys of the shards the manifest lists to @shard_keys, in
+ * order, to tell whether they changed since the manifest was opened.
+ */
+static gboolean
+read_manifest_shard_keys (const char *manifest_path,
+                          GPtrArray  *shard_keys)
+{
+  g_autofree char *manifest_dir_path = NULL;
+  JsonParser *parser;
+  JsonNode *node;
+  JsonArray *json_dbs = NULL;
+  guint idx;
+
+  parser = json_parser_new ();
+  if (json_parser_load_from_file (parser, manifest_path, NULL))
+    {
+      node = json_parser_get_root (parser);
+      if (JSON_NODE_HOLDS_OBJECT (node) &&
+          json_object_has_member (json_node_get_object (node), "xapian_databases"))
+        json_dbs = json_object_get_array_member (json_node_get_object (node),
+                                                 "xapian_databases");
+    }
+
+  if (json_dbs == NULL)
+    {
+      g_object_unref (parser);
+      return FALSE;
+    }
+
+  manifest_dir_path = g_path_get_dirname (manifest_path);
+
+  for (idx = 0; idx < json_array_get_length (json_dbs); idx++)
+    {
+      JsonObject *json_db = json_array_get_object_element (json_dbs, idx);
+      g_autofree char *path = NULL;
+
+      path = g_build_filename (manifest_dir_path,
+                               json_object_get_string_member (json_db, "path"),
+                               NULL);
+      g_ptr_array_add (shard_keys,
+                       shard_registry_make_key (path,
+                                                json_object_get_int_member (json_db, "offset")));
+    }
+
+  g_object_unref (parser);
+  return TRUE;
+}
+
+/* Shards already open in @registry are reused rather than opened again, and
+ * the keys of all the shards are appended to @shard_keys; @registry may be
+ * NULL to open every shard anew.
+ */
+static XapianDatabase *
+create_database_from_manifest (const char  *manifest_path,
+                               GHashTable  *registry,
+                               GPtrArray   *shard_keys,
+                               guint       *n_files_out,
+                               GError     **error_out)
+{
+  GError *error = NULL;
+  g_autofree char *manifest_dir_path = NULL;
+  XapianDatabase *db = NULL;
+  ManifestShard *shards = NULL;
+  GThreadPool *pool = NULL;
+  guint n_shards = 0, n_missing = 0, idx;
+
+  JsonParser *parser = json_parser_new ();
+  if (!json_parser_load_from_file (parser, manifest_path, &error))
+    goto out;
+
+  db = xapian_database_new (&error);
+  if (error != NULL)
+    goto out;
+
+  JsonNode *node = json_parser_get_root (parser);
+  JsonObject *json_manifest = json_node_get_object (node);
+  JsonArray *json_dbs = json_object_get_array_member (json_manifest, "xapian_databases");
+
+  manifest_dir_path = g_path_get_dirname (manifest_path);
+
+  n_shards = json_array_get_length (json_dbs);
+  shards = g_new0 (ManifestShard, n_shards);
+
+  for (idx = 0; idx < n_shards; idx++)
+    {
+      JsonObject *json_db = json_array_get_object_element (json_dbs, idx);
+
+      const char *relpath = json_object_get_string_member (json_db, "path");
+      shards[idx].path = g_build_filename (manifest_dir_path, relpath, NULL);
+      shards[idx].offset = json_object_get_int_member (json_db, "offset");
+
+      if (registry != NULL)
+        {
+          XapianDatabase *shared;
+
+          shards[idx].key = shard_registry_make_key (shards[idx].path, shards[idx].offset);
+          shared = shard_registry_acquire (registry, shards[idx].key);
+          if (shared != NULL)
+            {
+              shards[idx].db = g_object_ref (shared);
+              shards[idx].acquired = TRUE;
+              continue;
+            }
+        }
+
+      n_missing++;
+    }
+
+  /* Opening a shard mostly waits on the disk, so they are all opened at
+   * once, then added in manifest order.
+   */
+  if (n_missing > 1)
+    pool = g_thread_pool_new (open_manifest_shard, NULL,
+                              MIN (n_missing, g_get_num_processors () * 2),
+                              FALSE, NULL);
+
+  for (idx = 0; idx < n_shards; idx++)
+    {
+      if (shards[idx].acquired)
+        continue;
+
+      if (pool != NULL)
+        g_thread_pool_push (pool, &shards[idx], NULL);
+      else
+        open_manifest_shard (&shards[idx], NULL);
+    }
+
+  if (pool != NULL)
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+  for (idx = 0; idx < n_shards; idx++)
+    {
+      if (shards[idx].error != NULL)
+        {
+          error = shards[idx].error;
+          shards[idx].error = NULL;
+          goto out;
+        }
+    }
+
+  for (idx = 0; idx < n_shards; idx++)
+    {
+      guint n_files = 0;
+
+      xapian_database_add_database (db, shards[idx].db);
+
+      /* Shards shared from @registry were counted when they were opened */
+      if (!shards[idx].acquired)
+        {
+          n_files = count_database_files (shards[idx].path);
+          *n_files_out += n_files;
+        }
+
+      if (registry != NULL)
+        {
+          /* A manifest may list the same shard twice */
+          if (!shards[idx].acquired &&
+              shard_registry_acquire (registry, shards[idx].key) == NULL)
+            shard_registry_add (registry, shards[idx].key, shards[idx].db,
+                                shards[idx].path, n_files);
+          g_ptr_array_add (shard_keys, g_steal_pointer (&shards[idx].key));
+        }
+    }
+
+ out:
+  g_clear_object (&parser);
+
+  for (idx = 0; idx < n_shards; idx++)
+    {
+      if (shards[idx].acquired && shards[idx].key != NULL)
+        shard_registry_release (registry, shards[idx].key);
+
+      g_free (shards[idx].path);
+      g_free (shards[idx].key);
+      g_clear_object (&shards[idx].db);
+      g_clear_error (&shards[idx].error);
+    }
+  g_free (shards);
+
+  if (error)
+    {
+      g_propagate_error (error_out, error);
+      g_clear_object (&db);
+    }
+
+  return db;
+}
+
+static gboolean
+xb_database_is_federated (XbDatabase xbdb)
+{
+  return xbdb.federated != NULL && xbdb.federated[0] != NULL;
+}
+
+/* Returns the resolved path of each database searched, NULL-terminated */
+static gchar **
+xb_database_member_paths (XbDatabase xbdb)
+{
+  GPtrArray *paths;
+  guint idx;
+
+  paths = g_ptr_array_new ();
+
+  if (xbdb.manifest_path)
+    g_ptr_array_add (paths, read_link (xbdb.manifest_path));
+  else if (xbdb.path)
+    g_ptr_array_add (paths, read_link (xbdb.path));
+
+  for (idx = 0; xbdb.federated != NULL && xbdb.federated[idx] != NULL; idx++)
+    g_ptr_array_add (paths, read_link (xbdb.federated[idx]));
+
+  g_ptr_array_add (paths, NULL);
+
+  return (gchar **) g_ptr_array_free (paths, FALSE);
+}
+
+/* The key of the database in the manager; a federation of databases is
+ * keyed by all its members, in order.
+ */
+static char *
+xb_database_path (XbDatabase xbdb)
+{
+  gchar **paths;
+  gchar *path;
+
+  if (!xb_database_is_federated (xbdb))
+    {
+      if (xbdb.manifest_path)
+        return read_link (xbdb.manifest_path);
+      if (xbdb.path)
+        return read_link (xbdb.path);
+      return NULL;
+    }
+
+  paths = xb_database_member_paths (xbdb);
+  path = g_strjoinv ("\n", paths);
+  g_strfreev (paths);
+
+  return path;
+}
+
+static XapianDatabase *
+xb_database_manager_open_db (XbDatabaseManager *self,
+                             GHashTable *shards,
+                             XbDatabase xbdb,
+                             const gchar *path,
+                             GPtrArray **shard_keys_out,
+                             guint *n_files_out,
+                             GError **error_out);
+
+/* Opens each member of a federation and combines them into one database, so
+ * that ranking uses the statistics of all of them.
+ */
+static XapianDatabase *
+xb_database_manager_open_federated_db (XbDatabaseManager *self,
+                                       GHashTable *shards,
+                                       XbDatabase xbdb,
+                                       GPtrArray **shard_keys_out,
+                                       guint *n_files_out,
+                                       GError **error_out)
+{
+  XapianDatabase *db, *member;
+  XbDatabase member_xbdb = { NULL, };
+  GPtrArray *shard_keys = NULL, *member_keys = NULL;
+  const gchar *member_path;
+  guint n_files = 0, member_files, idx, key_idx;
+
+  db = xapian_database_new (error_out);
+  if (db == NULL)
+    return NULL;
+
+  if (shards != NULL)
+    shard_keys = g_ptr_array_new_with_free_func (g_free);
+
+  for (idx = 0; idx == 0 || xbdb.federated[idx - 1] != NULL; idx++)
+    {
+      if (idx == 0)
+        member_path = xbdb.manifest_path != NULL ? xbdb.manifest_path : xbdb.path;
+      else
+        member_path = xbdb.federated[idx - 1];
+
+      if (xbdb.manifest_path != NULL)
+        member_xbdb.manifest_path = member_path;
+      else
+        member_xbdb.path = member_path;
+
+      member = xb_database_manager_open_db (self, shards, member_xbdb, member_path,
+                                            shards != NULL ? &member_keys : NULL,
+                                            &member_files, error_out);
+      if (member == NULL)
+        {
+          for (key_idx = 0; shard_keys != NULL && key_idx < shard_keys->len; key_idx++)
+            shard_registry_release (shards, g_ptr_array_index (shard_keys, key_idx));
+
+          g_clear_pointer (&shard_keys, g_ptr_array_unref);
+          g_object_unref (db);
+          return NULL;
+        }
+
+      xapian_database_add_database (db, member);
+      g_object_unref (member);
+      n_files += member_files;
+
+      if (member_keys != NULL)
+        {
+          for (key_idx = 0; key_idx < member_keys->len; key_idx++)
+            g_ptr_array_add (shard_keys, g_strdup (g_ptr_array_index (member_keys, key_idx)));
+          g_clear_pointer (&member_keys, g_ptr_array_unref);
+        }
+    }
+
+  if (shard_keys_out != NULL)
+    *shard_keys_out = shard_keys;
+  if (n_files_out != NULL)
+    *n_files_out = n_files;
+
+  return db;
+}
+
+/* Opens the XapianDatabase for the given path or manifest, and returns the
+ * number of files it opened in @n_files_out. Shards already open in @shards
+ * are shared, and left out of @n_files_out; @shard_keys_out is set to the
+ * keys to release once the database is closed. @shards may be NULL to share
+ * nothing.
+ */
+static XapianDatabase *
+xb_database_manager_open_db (XbDatabaseManager *self,
+                             GHashTable *shards,
+                             XbDatabase xbdb,
+                             const gchar *path,
+                             GPtrArray **shard_keys_out,
+                             guint *n_files_out,
+                             GError **error_out)
+{
+  XapianDatabase *db = NULL;
+  GPtrArray *shard_keys = NULL;
+  GError *error = NULL;
+  guint n_files = 0;
+
+  if (xb_database_is_federated (xbdb))
+    return xb_database_manager_open_federated_db (self, shards, xbdb, shard_keys_out,
+                                                  n_files_out, error_out);
+
+  if (shards != NULL)
+    shard_keys = g_ptr_array_new_with_free_func (g_free);
+
+  if (xbdb.manifest_path)
+    {
+      db = create_database_from_manifest (xbdb.manifest_path, shards, shard_keys,
+                                          &n_files, &error);
+    }
+  else
+    {
+      g_autofree gchar *key = NULL;
+
+      if (shards != NULL)
+        {
+          key = shard_registry_make_key (xbdb.path, 0);
+          db = shard_registry_acquire (shards, key);
+        }
+
+      if (db != NULL)
+        {
+          g_object_ref (db);
+        }
+      else
+        {
+          db = xapian_database_new_with_path (xbdb.path, &error);
+          if (db != NULL)
+            n_files = count_database_files (xbdb.path);
+          if (db != NULL && shards != NULL)
+            shard_registry_add (shards, key, db, xbdb.path, n_files);
+        }
+
+      if (db != NULL && shards != NULL)
+        g_ptr_array_add (shard_keys, g_steal_pointer (&key));
+    }
+
+  if (error != NULL)
+    {
+      g_set_error (error_out, XB_ERROR,
+                   XB_ERROR_INVALID_PATH,
+                   "Cannot create XapianDatabase for path %s: %s",
+                   path, error->message);
+      g_error_free (error);
+      g_clear_pointer (&shard_keys, g_ptr_array_unref);
+      return NULL;
+    }
+
+  if (shard_keys_out != NULL)
+    *shard_keys_out = shard_keys;
+  if (n_files_out != NULL)
+    *n_files_out = n_files;
+
+  return db;
+}
+
+/* Reads the prefixes and stop words registered in the metadata of this
+ * particular database.
+ */
+static QueryParserTemplate *
+xb_database_manager_create_parser_template (XbDatabaseManager *self,
+                                           XapianDatabase *db,
+                                           const gchar *path)
+{
+  QueryParserTemplate *template;
+  GError *error = NULL;
+
+  template = query_parser_template_new ();
+
+  if (!xb_database_manager_register_prefixes (self, db, template, &error))
+    {
+      /* Non-fatal */
+      g_warning ("Could not register prefixes for database %s: %s",
+                 path, error->message);
+      g_clear_error (&error);
+    }
+
+  if (!xb_database_manager_register_stopwords (self, db, template, &error))
+    {
+      /* Non-fatal */
+      g_warning ("Could not add stop words for database %s: %s.",
+                 path, error->message);
+      g_clear_error (&error);
+    }
+
+  return template;
+}
+
+/* Picks up changes to the database on disk while keeping it open, so that
+ * the parser configuration and monitor survive content updates. The handles
+ * of the worker threads are reopened the next time they are used.
+ */
+static void
+xb_database_manager_reopen_db (XbDatabaseManager *self,
+                               DatabasePayload *payload)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  QueryParserTemplate *template = payload->parser_template;
+  XapianDatabase *db = payload->handle->db;
+  GPtrArray *shard_keys = payload->handle->shard_keys;
+  SharedShard *shard;
+  gchar *prefixes_json, *stopwords_json;
+  guint idx;
+
+  xapian_database_reopen (db);
+
+  /* Metadata is parsed again only if it changed */
+  prefixes_json = xapian_database_get_metadata (db, PREFIX_METADATA_KEY, NULL);
+  stopwords_json = xapian_database_get_metadata (db, STOPWORDS_METADATA_KEY, NULL);
+
+  if (g_strcmp0 (prefixes_json, template->prefixes_json) != 0 ||
+      g_strcmp0 (stopwords_json, template->stopwords_json) != 0)
+    template = xb_database_manager_create_parser_template (self, db, payload->path);
+  else
+    template = query_parser_template_ref (template);
+
+  g_free (prefixes_json);
+  g_free (stopwords_json);
+
+  g_mutex_lock (&payload->lock);
+  payload->generation = priv->next_generation++;
+  query_parser_template_unref (payload->parser_template);
+  payload->parser_template = template;
+  g_mutex_unlock (&payload->lock);
+
+  database_handle_update (payload->handle, payload->generation, template);
+
+  /* A compaction changes the number of files of a shard */
+  for (idx = 0; shard_keys != NULL && idx < shard_keys->len; idx++)
+    {
+      shard = g_hash_table_lookup (priv->shards, g_ptr_array_index (shard_keys, idx));
+      shard->n_files = count_database_files (shard->path);
+    }
+
+  xb_database_manager_drop_results (self, payload->path);
+}
+
+/* Whether the manifests of the database still list the shards it opened */
+static gboolean
+xb_database_manager_same_shards (DatabasePayload *payload)
+{
+  GPtrArray *shard_keys = payload->handle->shard_keys;
+  GPtrArray *listed;
+  gboolean same;
+  guint idx;
+
+  if (shard_keys == NULL)
+    return FALSE;
+
+  listed = g_ptr_array_new_with_free_func (g_free);
+  same = read_manifest_shard_keys (payload->manifest_path, listed);
+  for (idx = 0; same && payload->federated != NULL && payload->federated[idx] != NULL; idx++)
+    same = read_manifest_shard_keys (payload->federated[idx], listed);
+
+  same = same && listed->len == shard_keys->len;
+  for (idx = 0; same && idx < listed->len; idx++)
+    same = g_str_equal (g_ptr_array_index (listed, idx), g_ptr_array_index (shard_keys, idx));
+
+  g_ptr_array_unref (listed);
+  return same;
+}
+
+/* A manifest that lists other shards than before is opened anew */
+static void
+xb_database_manager_refresh_db (XbDatabaseManager *self,
+                                DatabasePayload *payload,
+                                gboolean invalidate)
+{
+  if (!invalidate && payload->manifest_path != NULL)
+    invalidate = !xb_database_manager_same_shards (payload);
+
+  if (invalidate)
+    xb_database_manager_invalidate_db (self, payload->path);
+  else
+    xb_database_manager_reopen_db (self, payload);
+}
+
+static gboolean
+on_database_settled (gpointer user_data)
+{
+  DatabasePayload *payload = user_data;
+
+  payload->refresh_id = 0;
+  xb_database_manager_refresh_db (payload->manager, payload,
+                                  payload->refresh_invalidates);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* An update to a database comes as a burst of events; the database is only
+ * refreshed once no event arrived for the quiet period, and keeps serving
+ * the previous contents until then.
+ */
+static void
+xb_database_manager_schedule_refresh (XbDatabaseManager *self,
+                                      DatabasePayload *payload,
+                                      gboolean invalidate)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  gint64 now = g_get_monotonic_time ();
+
+  if (priv->monitor_quiet_period == 0)
+    {
+      xb_database_manager_refresh_db (self, payload, invalidate);
+      return;
+    }
+
+  if (payload->refresh_id != 0)
+    {
+      priv->coalesced_refreshes++;
+      payload->refresh_invalidates |= invalidate;
+
+      /* Do not put off the refresh forever */
+      if (now - payload->refresh_requested >
+          (gint64) priv->monitor_quiet_period * MAX_QUIET_PERIODS * 1000)
+        return;
+
+      g_source_remove (payload->refresh_id);
+    }
+  else
+    {
+      payload->refresh_invalidates = invalidate;
+      payload->refresh_requested = now;
+    }
+
+  payload->refresh_id = g_timeout_add (priv->monitor_quiet_period,
+                                       on_database_settled, payload);
+}
+
+/* The path a GFileMonitor of the manager watches */
+static GQuark
+monitored_path_quark (void)
+{
+  return g_quark_from_static_string ("xb-monitored-path");
+}
+
+static void
+database_monitor_changed (GFileMonitor *monitor,
+                          GFile *file,
+                          GFile *other_file,
+                          GFileMonitorEvent event_type,
+                          gpointer user_data)
+{
+  DatabasePayload *payload = user_data;
+  const gchar *monitored_path;
+  gchar *file_path;
+  gboolean database_gone, invalidate;
+
+  switch (event_type)
+    {
+    case G_FILE_MONITOR_EVENT_CHANGED:
+    case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+    case G_FILE_MONITOR_EVENT_DELETED:
+    case G_FILE_MONITOR_EVENT_MOVED:
+    case G_FILE_MONITOR_EVENT_UNMOUNTED:
+      break;
+    default:
+      return;
+    }
+
+  /* A database, shard or manifest that went away is opened anew; other
+   * changes are picked up by reopening the database, unless its manifests
+   * list different shards.
+   */
+  monitored_path = g_object_get_qdata (G_OBJECT (monitor), monitored_path_quark ());
+  file_path = g_file_get_path (file);
+  database_gone = (g_strcmp0 (file_path, monitored_path) == 0 &&
+                   event_type != G_FILE_MONITOR_EVENT_CHANGED &&
+                   event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT);
+  g_free (file_path);
+
+  invalidate = (database_gone || event_type == G_FILE_MONITOR_EVENT_UNMOUNTED);
+
+  xb_database_manager_schedule_refresh (payload->manager, payload, invalidate);
+}
+
+static GFileMonitor *
+xb_database_manager_monitor_db (XbDatabaseManager *self,
+                                const gchar *path)
+{
+  GFile *file;
+  GFileMonitor *monitor;
+  GError *error = NULL;
+
+  file = g_file_new_for_path (path);
+  monitor = g_file_monitor (file, G_FILE_MONITOR_NONE, NULL, &error);
+  g_object_unref (file);
+
+  if (error != NULL)
+    {
+      /* Non-fatal */
+      g_warning ("Could not monitor database at path %s: %s",
+                 path, error->message);
+      g_error_free (error);
+      return NULL;
+    }
+
+  g_object_set_qdata_full (G_OBJECT (monitor), monitored_path_quark (),
+                           g_strdup (path), g_free);
+
+  return monitor;
+}
+
+/* What a query worker thread keeps open. Xapian objects are not thread-safe,
+ * so each thread opens its own handles, and shares shards between them
+ * through its own registry.
+ */
+typedef struct {
+  /* struct DatabasePayload => struct DatabaseHandle */
+  GHashTable *handles;
+  GHashTable *shards;
+  /* Held by the thread while it runs a job, and by the main thread while it
+   * sweeps the state of an idle thread
+   */
+  GMutex lock;
+  /* The manager whose pool the thread belongs to, if still alive */
+  XbDatabaseManager *manager;
+} WorkerState;
+
+/* Protects the worker_states of every manager, and WorkerState.manager */
+static GMutex worker_states_lock;
+
+static void
+worker_state_forget_handle (DatabasePayload *payload,
+                            DatabaseHandle *handle)
+{
+  g_atomic_int_add (&payload->n_worker_files, -(gint) handle->n_files);
+  database_handle_free (handle);
+  database_payload_unref (payload);
+}
+
+static gboolean
+worker_state_forget_handle_cb (gpointer key,
+                               gpointer value,
+                               gpointer user_data)
+{
+  worker_state_forget_handle (key, value);
+  return TRUE;
+}
+
+static void
+worker_state_free (WorkerState *state)
+{
+  XbDatabaseManagerPrivate *priv;
+
+  g_mutex_lock (&worker_states_lock);
+  if (state->manager != NULL)
+    {
+      priv = xb_database_manager_get_instance_private (state->manager);
+      g_ptr_array_remove_fast (priv->worker_states, state);
+    }
+  g_mutex_unlock (&worker_states_lock);
+
+  g_hash_table_foreach_remove (state->handles, worker_state_forget_handle_cb, NULL);
+  g_hash_table_unref (state->handles);
+  g_hash_table_unref (state->shards);
+  g_mutex_clear (&state->lock);
+
+  g_slice_free (WorkerState, state);
+}
+
+static GPrivate worker_state = G_PRIVATE_INIT ((GDestroyNotify) worker_state_free);
+
+/* The pool of each manager is exclusive, so a thread only ever works for
+ * @self.
+ */
+static WorkerState *
+worker_state_get (XbDatabaseManager *self)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  WorkerState *state = g_private_get (&worker_state);
+
+  if (state == NULL)
+    {
+      state = g_slice_new0 (WorkerState);
+      /* Handles are removed with worker_state_forget_handle() */
+      state->handles = g_hash_table_new (g_direct_hash, g_direct_equal);
+      state->shards = shard_registry_new ();
+      g_mutex_init (&state->lock);
+      g_private_set (&worker_state, state);
+
+      g_mutex_lock (&worker_states_lock);
+      state->manager = self;
+      g_ptr_array_add (priv->worker_states, state);
+      g_mutex_unlock (&worker_states_lock);
+    }
+
+  return state;
+}
+
+static gboolean
+worker_state_forget_released (gpointer key,
+                              gpointer value,
+                              gpointer user_data)
+{
+  DatabasePayload *payload = key;
+
+  if (!g_atomic_int_get (&payload->released))
+    return FALSE;
+
+  worker_state_forget_handle (payload, value);
+  return TRUE;
+}
+
+/* Closes the handles of the state on databases the manager closed; called
+ * with the lock of the state held.
+ */
+static void
+worker_state_sweep (WorkerState *state)
+{
+  g_hash_table_foreach_remove (state->handles, worker_state_forget_released, NULL);
+}
+
+/* Closes the handles of the idle workers on the databases just evicted,
+ * rather than when they next run a job; busy workers do it once their job
+ * is done.
+ */
+static void
+xb_database_manager_sweep_workers (XbDatabaseManager *self)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  WorkerState *state;
+  guint idx;
+
+  g_mutex_lock (&worker_states_lock);
+
+  for (idx = 0; priv->worker_states != NULL && idx < priv->worker_states->len; idx++)
+    {
+      state = g_ptr_array_index (priv->worker_states, idx);
+      if (g_mutex_trylock (&state->lock))
+        {
+          worker_state_sweep (state);
+          g_mutex_unlock (&state->lock);
+        }
+    }
+
+  g_mutex_unlock (&worker_states_lock);
+}
+
+/* Forgets the states of the threads of the pool, which may only exit, and
+ * close their handles, after the manager is gone.
+ */
+static void
+xb_database_manager_detach_workers (XbDatabaseManager *self)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  WorkerState *state;
+  guint idx;
+
+  g_mutex_lock (&worker_states_lock);
+
+  for (idx = 0; idx < priv->worker_states->len; idx++)
+    {
+      state = g_ptr_array_index (priv->worker_states, idx);
+      state->manager = NULL;
+    }
+  g_clear_pointer (&priv->worker_states, g_ptr_array_unref);
+
+  g_mutex_unlock (&worker_states_lock);
+}
+
+/* Returns the handle on the database for the calling worker thread, opening
+ * a new one the first time the thread uses the database, and reopening it
+ * if the database changed since the thread last used it.
+ */
+static DatabaseHandle *
+database_payload_get_worker_handle (DatabasePayload *payload,
+                                    XbDatabaseManager *self,
+                                    GError **error_out)
+{
+  WorkerState *state = worker_state_get (self);
+  DatabaseHandle *handle;
+  QueryParserTemplate *template;
+  guint64 generation;
+  XapianDatabase *db;
+  XbDatabase xbdb;
+  GPtrArray *shard_keys = NULL;
+  guint n_files = 0;
+
+  g_mutex_lock (&payload->lock);
+  generation = payload->generation;
+  template = query_parser_template_ref (payload->parser_template);
+  g_mutex_unlock (&payload->lock);
+
+  handle = g_hash_table_lookup (state->handles, payload);
+  if (handle != NULL)
+    {
+      if (handle->generation != generation)
+        {
+          xapian_database_reopen (handle->db);
+          database_handle_update (handle, generation, template);
+        }
+
+      query_parser_template_unref (template);
+      return handle;
+    }
+
+  xbdb.path = payload->db_path;
+  xbdb.manifest_path = payload->manifest_path;
+  xbdb.federated = (const char * const *) payload->federated;
+
+  db = xb_database_manager_open_db (self, state->shards, xbdb, payload->path,
+                                    &shard_keys, &n_files, error_out);
+  if (db == NULL)
+    {
+      query_parser_template_unref (template);
+      return NULL;
+    }
+
+  handle = database_handle_new (db, generation, template, state->shards, shard_keys);
+  handle->n_files = n_files;
+  query_parser_template_unref (template);
+  g_object_unref (db);
+
+  g_hash_table_insert (state->handles, database_payload_ref (payload), handle);
+  g_atomic_int_add (&payload->n_worker_files, n_files);
+
+  if (n_files > 0)
+    xb_database_manager_schedule_enforce_limits (self);
+
+  return handle;
+}
+
+/* Indexes an opened database by path and starts monitoring it, then closes
+ * other databases as needed to stay within the limits. Takes ownership of
+ * @parser_template and @shard_keys, the shards of @db acquired from
+ * @shards, if any.
+ */
+static DatabasePayload *
+xb_database_manager_add_db (XbDatabaseManager *self,
+                            XbDatabase xbdb,
+                            const gchar *path,
+                            XapianDatabase *db,
+                            QueryParserTemplate *parser_template,
+                            GHashTable *shards,
+                            GPtrArray *shard_keys)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  DatabasePayload *payload;
+  GPtrArray *monitors;
+  GFileMonitor *monitor;
+  GHashTable *monitored;
+  SharedShard *shard;
+  gchar **member_paths;
+  guint idx;
+
+  g_assert (!g_hash_table_contains (priv->databases, path));
+
+  monitors = g_ptr_array_new_with_free_func (g_object_unref);
+  member_paths = xb_database_member_paths (xbdb);
+  for (idx = 0; member_paths[idx] != NULL; idx++)
+    {
+      monitor = xb_database_manager_monitor_db (self, member_paths[idx]);
+      if (monitor != NULL)
+        g_ptr_array_add (monitors, monitor);
+    }
+  g_strfreev (member_paths);
+
+  /* The shards of manifests change on their own */
+  if (xbdb.manifest_path != NULL && shard_keys != NULL)
+    {
+      monitored = g_hash_table_new (g_str_hash, g_str_equal);
+      for (idx = 0; idx < shard_keys->len; idx++)
+        {
+          shard = g_hash_table_lookup (shards, g_ptr_array_index (shard_keys, idx));
+          if (!g_hash_table_add (monitored, shard->path))
+            continue;
+
+          monitor = xb_database_manager_monitor_db (self, shard->path);
+          if (monitor != NULL)
+            g_ptr_array_add (monitors, monitor);
+        }
+      g_hash_table_unref (monitored);
+    }
+
+  payload = database_payload_new (db, parser_template, shards, shard_keys,
+                                  self, monitors, path, xbdb);
+  payload->pinned = g_hash_table_contains (priv->pinned, path);
+  g_hash_table_insert (priv->databases, g_strdup (path), payload);
+  priv->databases_opened++;
+
+  for (idx = 0; idx < monitors->len; idx++)
+    g_signal_connect (g_ptr_array_index (monitors, idx), "changed",
+                      G_CALLBACK (database_monitor_changed), payload);
+
+  xb_database_manager_enforce_limits (self, payload);
+  xb_database_manager_schedule_expiry (self);
+
+  return payload;
+}
+
+/* Creates a new XapianDatabase for the given path, and indexes it by path */
+static DatabasePayload *
+xb_database_manager_create_db_internal (XbDatabaseManager *self,
+                                        XbDatabase xbdb,
+                                        const gchar *path,
+                                        GError **error_out)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  XapianDatabase *db;
+  QueryParserTemplate *parser_template;
+  DatabasePayload *payload;
+  GPtrArray *shard_keys = NULL;
+
+  db = xb_database_manager_open_db (self, priv->shards, xbdb, path,
+                                    &shard_keys, NULL, error_out);
+  if (db == NULL)
+    return NULL;
+
+  parser_template = xb_database_manager_create_parser_template (self, db, path);
+  payload = xb_database_manager_add_db (self, xbdb, path, db, parser_template,
+                                        priv->shards, shard_keys);
+
+  g_object_unref (db);
+
+  return payload;
+}
+
+/* Returns the open database for the given path, if any, marking it as
+ * recently used.
+ */
+static DatabasePayload *
+xb_database_manager_lookup_db (XbDatabaseManager *self,
+                               const gchar *path)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  DatabasePayload *payload;
+
+  payload = g_hash_table_lookup (priv->databases, path);
+  if (payload != NULL)
+    xb_database_manager_touch_db (self, payload);
+
+  return payload;
+}
+
+static DatabasePayload *
+ensure_db (XbDatabaseManager *self,
+           XbDatabase db,
+           GError **error_out)
+{
+  DatabasePayload *payload;
+  char *path;
+
+  path = xb_database_path (db);
+
+  payload = xb_database_manager_lookup_db (self, path);
+  if (payload == NULL)
+    payload = xb_database_manager_create_db_internal (self, db, path, error_out);
+
+  g_free (path);
+
+  return payload;
+}
+
+/* A database being opened in a thread, and the requests waiting for it */
+typedef struct {
+  gchar *path;
+  gchar *db_path;
+  gchar *manifest_path;
+  gchar **federated;
+  /* GTasks returning the payload */
+  GList *waiters;
+} PendingOpen;
+
+/* What the opening thread hands over to the main thread */
+typedef struct {
+  XapianDatabase *db;
+  QueryParserTemplate *parser_template;
+  /* The shards opened for @db, to be merged into those of the main thread */
+  GHashTable *shards;
+  GPtrArray *shard_keys;
+} OpenedDatabase;
+
+static void
+pending_open_free (PendingOpen *pending)
+{
+  g_assert (pending->waiters == NULL);
+
+  g_free (pending->path);
+  g_free (pending->db_path);
+  g_free (pending->manifest_path);
+  g_strfreev (pending->federated);
+
+  g_slice_free (PendingOpen, pending);
+}
+
+static void
+opened_database_free (OpenedDatabase *opened)
+{
+  g_clear_object (&opened->db);
+  g_clear_pointer (&opened->parser_template, query_parser_template_unref);
+  g_clear_pointer (&opened->shard_keys, g_ptr_array_unref);
+  g_clear_pointer (&opened->shards, g_hash_table_unref);
+
+  g_slice_free (OpenedDatabase, opened);
+}
+
+/* Opening a database and reading its metadata block on disk, so they do not
+ * happen on the main thread. The monitor is set up once back there.
+ *
+ * The database opened here becomes the handle of the main thread, which
+ * reads the metadata again on refresh and serves the synchronous calls, so
+ * the first worker to query it still opens its own: Xapian objects cannot
+ * be shared between threads.
+ */
+static void
+open_db_in_thread (GTask *task,
+                   gpointer source_object,
+                   gpointer task_data,
+                   GCancellable *cancellable)
+{
+  XbDatabaseManager *self = source_object;
+  PendingOpen *pending = task_data;
+  OpenedDatabase *opened;
+  XbDatabase xbdb;
+  GError *error = NULL;
+  gint64 start = g_get_monotonic_time ();
+
+  xbdb.path = pending->db_path;
+  xbdb.manifest_path = pending->manifest_path;
+  xbdb.federated = (const char * const *) pending->federated;
+
+  opened = g_slice_new0 (OpenedDatabase);
+  /* The shards of the main thread cannot be touched from here, so they are
+   * only shared with the database once back there.
+   */
+  opened->shards = shard_registry_new ();
+  opened->db = xb_database_manager_open_db (self, opened->shards, xbdb, pending->path,
+                                            &opened->shard_keys, NULL, &error);
+  if (opened->db == NULL)
+    {
+      opened_database_free (opened);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  opened->parser_template = xb_database_manager_create_parser_template (self, opened->db,
+                                                                        pending->path);
+
+  g_info ("Opened database %s in %.3f ms", pending->path,
+          (g_get_monotonic_time () - start) / 1000.0);
+
+  g_task_return_pointer (task, opened, (GDestroyNotify) opened_database_free);
+}
+
+/* Shards already open on the main thread when the database was opened in a
+ * thread were opened twice; the database is combined again from the shards
+ * of @registry so the duplicates can be closed.
+ */
+static void
+opened_database_rebind (OpenedDatabase *opened,
+                        GHashTable *registry,
+                        gboolean combined)
+{
+  XapianDatabase *db;
+  SharedShard *shard;
+  GError *error = NULL;
+  guint idx;
+
+  for (idx = 0; idx < opened->shard_keys->len; idx++)
+    {
+      if (g_hash_table_contains (registry, g_ptr_array_index (opened->shard_keys, idx)))
+        break;
+    }
+
+  if (idx == opened->shard_keys->len)
+    return;
+
+  if (!combined)
+    {
+      shard = g_hash_table_lookup (registry, g_ptr_array_index (opened->shard_keys, 0));
+      g_object_unref (opened->db);
+      opened->db = g_object_ref (shard->db);
+      return;
+    }
+
+  db = xapian_database_new (&error);
+  if (db == NULL)
+    {
+      g_warning ("Cannot combine the shards of a database again: %s", error->message);
+      g_error_free (error);
+      return;
+    }
+
+  for (idx = 0; idx < opened->shard_keys->len; idx++)
+    {
+      shard = g_hash_table_lookup (registry, g_ptr_array_index (opened->shard_keys, idx));
+      if (shard == NULL)
+        shard = g_hash_table_lookup (opened->shards, g_ptr_array_index (opened->shard_keys, idx));
+
+      xapian_database_add_database (db, shard->db);
+    }
+
+  g_object_unref (opened->db);
+  opened->db = db;
+}
+
+static void
+on_db_opened (GObject *source,
+              GAsyncResult *result,
+              gpointer user_data)
+{
+  XbDatabaseManager *self = XB_DATABASE_MANAGER (source);
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  PendingOpen *pending = g_task_get_task_data (G_TASK (result));
+  DatabasePayload *payload = NULL;
+  OpenedDatabase *opened;
+  XbDatabase xbdb;
+  GList *waiters, *l;
+  GError *error = NULL;
+
+  g_hash_table_remove (priv->opening, pending->path);
+  waiters = pending->waiters;
+  pending->waiters = NULL;
+
+  opened = g_task_propagate_pointer (G_TASK (result), &error);
+  if (opened != NULL)
+    {
+      /* A synchronous call may have opened the database meanwhile */
+      payload = g_hash_table_lookup (priv->databases, pending->path);
+      if (payload == NULL)
+        {
+          xbdb.path = pending->db_path;
+          xbdb.manifest_path = pending->manifest_path;
+          xbdb.federated = (const char * const *) pending->federated;
+          opened_database_rebind (opened, priv->shards,
+                                  xbdb.manifest_path != NULL || xb_database_is_federated (xbdb));
+          shard_registry_merge (priv->shards, opened->shards);
+          payload = xb_database_manager_add_db (self, xbdb, pending->path, opened->db,
+                                                opened->parser_template, priv->shards,
+                                                opened->shard_keys);
+          opened->parser_template = NULL;
+          opened->shard_keys = NULL;
+        }
+
+      opened_database_free (opened);
+    }
+
+  for (l = waiters; l != NULL; l = l->next)
+    {
+      GTask *waiter = l->data;
+
+      if (payload != NULL)
+        g_task_return_pointer (waiter, database_payload_ref (payload),
+                               (GDestroyNotify) database_payload_unref);
+      else
+        g_task_return_error (waiter, g_error_copy (error));
+
+      g_object_unref (waiter);
+    }
+
+  g_list_free (waiters);
+  g_clear_error (&error);
+}
+
+/* Opens the database in a thread if it is not open yet. Concurrent requests
+ * for the same database wait for the same open, while requests for open
+ * databases keep being served.
+ */
+static void
+xb_database_manager_ensure_db_async (XbDatabaseManager *self,
+                                     XbDatabase xbdb,
+                                     GAsyncReadyCallback callback,
+                                     gpointer user_data)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  DatabasePayload *payload;
+  PendingOpen *pending;
+  GTask *waiter, *task;
+  char *path;
+
+  waiter = g_task_new (self, NULL, callback, user_data);
+  path = xb_database_path (xbdb);
+
+  payload = xb_database_manager_lookup_db (self, path);
+  if (payload != NULL)
+    {
+      g_task_return_pointer (waiter, database_payload_ref (payload),
+                             (GDestroyNotify) database_payload_unref);
+      g_object_unref (waiter);
+      g_free (path);
+      return;
+    }
+
+  pending = g_hash_table_lookup (priv->opening, path);
+  if (pending == NULL)
+    {
+      pending = g_slice_new0 (PendingOpen);
+      pending->path = g_strdup (path);
+      pending->db_path = g_strdup (xbdb.path);
+      pending->manifest_path = g_strdup (xbdb.manifest_path);
+      pending->federated = g_strdupv ((gchar **) xbdb.federated);
+      g_hash_table_insert (priv->opening, pending->path, pending);
+
+      task = g_task_new (self, NULL, on_db_opened, NULL);
+      g_task_set_task_data (task, pending, (GDestroyNotify) pending_open_free);
+      g_task_run_in_thread (task, open_db_in_thread);
+      g_object_unref (task);
+    }
+
+  pending->waiters = g_list_append (pending->waiters, waiter);
+  g_free (path);
+}
+
+/* Returns a new reference to the payload of the database */
+static DatabasePayload *
+xb_database_manager_ensure_db_finish (XbDatabaseManager *self,
+                                      GAsyncResult *result,
+                                      GError **error_out)
+{
+  return g_task_propagate_pointer (G_TASK (result), error_out);
+}
+
+gboolean
+xb_database_manager_ensure_db (XbDatabaseManager *self,
+                               XbDatabase db,
+                               GError **error_out)
+{
+  return (ensure_db (self, db, error_out) != NULL);
+}
+
+/* Opens the database if needed and keeps it open for the lifetime of the
+ * manager: pinned databases are never evicted nor expired, and stay pinned
+ * when they are reopened after a change on disk.
+ */
+static void
+xb_database_manager_pin_payload (XbDatabaseManager *self,
+                                 DatabasePayload *payload)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  payload->pinned = TRUE;
+  g_hash_table_add (priv->pinned, g_strdup (payload->path));
+}
+
+gboolean
+xb_database_manager_pin_db (XbDatabaseManager *self,
+                            XbDatabase db,
+                            GError **error_out)
+{
+  DatabasePayload *payload;
+
+  payload = ensure_db (self, db, error_out);
+  if (payload == NULL)
+    return FALSE;
+
+  xb_database_manager_pin_payload (self, payload);
+
+  return TRUE;
+}
+
+static void
+on_pin_db_ensured (GObject *source,
+                   GAsyncResult *result,
+                   gpointer user_data)
+{
+  XbDatabaseManager *self = XB_DATABASE_MANAGER (source);
+  GTask *task = user_data;
+  DatabasePayload *payload;
+  GError *error = NULL;
+
+  payload = xb_database_manager_ensure_db_finish (self, result, &error);
+  if (payload == NULL)
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  xb_database_manager_pin_payload (self, payload);
+  database_payload_unref (payload);
+
+  g_task_return_boolean (task, TRUE);
+  g_object_unref (task);
+}
+
+/* Like xb_database_manager_pin_db(), but opens the database in a thread */
+void
+xb_database_manager_pin_db_async (XbDatabaseManager *self,
+                                  XbDatabase db,
+                                  GAsyncReadyCallback callback,
+                                  gpointer user_data)
+{
+  GTask *task;
+
+  task = g_task_new (self, NULL, callback, user_data);
+  xb_database_manager_ensure_db_async (self, db, on_pin_db_ensured, task);
+}
+
+gboolean
+xb_database_manager_pin_db_finish (XbDatabaseManager *self,
+                                   GAsyncResult *result,
+                                   GError **error_out)
+{
+  return g_task_propagate_boolean (G_TASK (result), error_out);
 }
 
-/* Registers the prefixes and booleanPrefixes contained in the JSON object
- * to the query parser.
+/* Where xb_database_manager_fetch_results() puts the results it fetches:
+ * see JsonResultsSink and TextResultsSink.
  */
+typedef struct _ResultsSink ResultsSink;
+
+struct _ResultsSink {
+  /* @upper_bound is left out if negative, and @query_str if NULL */
+  void (*begin) (ResultsSink *sink,
+                 guint num_results,
+                 gint64 upper_bound,
+                 guint offset,
+                 const gchar *query_str);
+  /* Both return FALSE if the results are no longer wanted; @data is only
+   * given to add_json_document() if it is a JSON object or array.
+   */
+  gboolean (*add_document) (ResultsSink *sink,
+                            const gchar *data);
+  gboolean (*add_json_document) (ResultsSink *sink,
+                                 const gchar *data);
+  /* @partial if the time limit cut the results short */
+  void (*end) (ResultsSink *sink,
+               gboolean partial);
+};
+
+/* Builds the JSON object for the results */
+typedef struct {
+  ResultsSink sink;
+  JsonObject *object;
+  JsonArray *results;
+  /* Only created for the first JSON document */
+  JsonParser *parser;
+} JsonResultsSink;
+
 static void
-xb_database_manager_add_queryparser_prefixes (XbDatabaseManager *self,
-                                              XapianQueryParser *query_parser,
-                                              JsonObject *object)
+json_results_sink_begin (ResultsSink *sink,
+                         guint num_results,
+                         gint64 upper_bound,
+                         guint offset,
+                         const gchar *query_str)
 {
-  JsonNode *element_node;
-  JsonObject *element_object;
-  JsonArray *array;
-  GList *elements, *l;
+  JsonResultsSink *self = (JsonResultsSink *) sink;
 
-  array = json_object_get_array_member (object, "prefixes");
-  elements = json_array_get_elements (array);
-
-  for (l = elements; l != NULL; l = l->next)
-    {
-      element_node = l->data;
-      element_object = json_node_get_object (element_node);
-      xapian_query_parser_add_prefix (query_parser,
-                                      json_object_get_string_member (element_object, "field"),
-                                      json_object_get_string_member (element_object, "prefix"));
-    }
+  self->object = json_object_new ();
+  json_object_set_int_member (self->object, QUERY_RESULTS_MEMBER_NUM_RESULTS, num_results);
+  if (upper_bound >= 0)
+    json_object_set_int_member (self->object, QUERY_RESULTS_MEMBER_UPPER_BOUND, upper_bound);
+  json_object_set_int_member (self->object, QUERY_RESULTS_MEMBER_OFFSET, offset);
+  if (query_str != NULL)
+    json_object_set_string_member (self->object, QUERY_RESULTS_MEMBER_QUERYSTR, query_str);
 
-  g_list_free (elements);
+  self->results = json_array_new ();
+  json_object_set_array_member (self->object, QUERY_RESULTS_MEMBER_RESULTS, self->results);
+}
 
-  array = json_object_get_array_member (object, "booleanPrefixes");
-  elements = json_array_get_elements (array);
+static gboolean
+json_results_sink_add_document (ResultsSink *sink,
+                                const gchar *data)
+{
+  JsonResultsSink *self = (JsonResultsSink *) sink;
 
-  for (l = elements; l != NULL; l = l->next)
-    {
-      element_node = l->data;
-      element_object = json_node_get_object (element_node);
-      xapian_query_parser_add_boolean_prefix (query_parser,
-                                              json_object_get_string_member (element_object, "field"),
-                                              json_object_get_string_member (element_object, "prefix"),
-                                              FALSE);
-    }
+  json_array_add_string_element (self->results, data);
 
-  g_list_free (elements);
+  return TRUE;
 }
 
-static void
-xb_database_manager_add_queryparser_standard_prefixes (XbDatabaseManager *self,
-                                                       XapianQueryParser *query_parser)
+static gboolean
+json_results_sink_add_json_document (ResultsSink *sink,
+                                     const gchar *data)
 {
-  /* TODO: these should be configurable */
-  static const struct {
-    const gchar *field;
-    const gchar *prefix;
-  } standard_prefixes[] = {
-    { "title", "S" },
-    { "exact_title", "XEXACTS" },
-  }, standard_boolean_prefixes[] = {
-    { "tag", "K" },
-    { "id", "Q" },
-  };
-  gint idx;
+  JsonResultsSink *self = (JsonResultsSink *) sink;
 
-  for (idx = 0; idx < G_N_ELEMENTS (standard_prefixes); idx++)
-    xapian_query_parser_add_prefix (query_parser,
-                                    standard_prefixes[idx].field,
-                                    standard_prefixes[idx].prefix);
+  if (self->parser == NULL)
+    self->parser = json_parser_new ();
 
-  for (idx = 0; idx < G_N_ELEMENTS (standard_boolean_prefixes); idx++)
-    xapian_query_parser_add_boolean_prefix (query_parser,
-                                            standard_boolean_prefixes[idx].field,
-                                            standard_boolean_prefixes[idx].prefix,
-                                            FALSE);
+  /* Already validated */
+  json_parser_load_from_data (self->parser, data, -1, NULL);
+  json_array_add_element (self->results,
+                          json_node_copy (json_parser_get_root (self->parser)));
+
+  return TRUE;
 }
 
 static void
-xb_database_manager_finalize (GObject *object)
+json_results_sink_end (ResultsSink *sink,
+                       gboolean partial)
 {
-  XbDatabaseManager *self = XB_DATABASE_MANAGER (object);
-  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  JsonResultsSink *self = (JsonResultsSink *) sink;
 
-  g_clear_pointer (&priv->databases, g_hash_table_unref);
-  g_clear_pointer (&priv->stemmers, g_hash_table_unref);
+  if (partial)
+    json_object_set_boolean_member (self->object, QUERY_RESULTS_MEMBER_PARTIAL, TRUE);
+}
 
-  G_OBJECT_CLASS (xb_database_manager_parent_class)->finalize (object);
+static void
+json_results_sink_init (JsonResultsSink *self)
+{
+  self->sink.begin = json_results_sink_begin;
+  self->sink.add_document = json_results_sink_add_document;
+  self->sink.add_json_document = json_results_sink_add_json_document;
+  self->sink.end = json_results_sink_end;
+  self->object = NULL;
+  self->results = NULL;
+  self->parser = NULL;
 }
 
 static void
-xb_database_manager_class_init (XbDatabaseManagerClass *klass)
+json_results_sink_clear (JsonResultsSink *self)
 {
-    GObjectClass *gobject_class = (GObjectClass *)klass;
-    gobject_class->finalize = xb_database_manager_finalize;
+  g_clear_object (&self->parser);
+}
+
+/* What a worker streaming results shares with the chunks it handed over to
+ * the main thread, which are sent with the buffers they were handed in.
+ */
+typedef struct {
+  volatile gint ref_count;
+  GMainContext *context;
+  XbDatabaseManagerChunkFunc chunk_func;
+  gpointer chunk_data;
+  GCancellable *cancellable;
+  /* Protects the number of bytes handed over and not freed yet, and when
+   * a chunk was last freed
+   */
+  GMutex lock;
+  GCond sent;
+  gsize pending;
+  gint64 last_sent;
+  /* In microseconds; 0 means none */
+  gint64 write_timeout;
+  /* Set once the client did not read for the write timeout */
+  volatile gint timed_out;
+} ResultsStream;
+
+static ResultsStream *
+results_stream_new (XbDatabaseManagerChunkFunc chunk_func,
+                    gpointer chunk_data,
+                    GCancellable *cancellable,
+                    guint write_timeout)
+{
+  ResultsStream *stream;
+
+  stream = g_slice_new0 (ResultsStream);
+  stream->ref_count = 1;
+  stream->context = g_main_context_ref_thread_default ();
+  stream->chunk_func = chunk_func;
+  stream->chunk_data = chunk_data;
+  stream->cancellable = cancellable != NULL ? g_object_ref (cancellable) : NULL;
+  g_mutex_init (&stream->lock);
+  g_cond_init (&stream->sent);
+  stream->write_timeout = (gint64) write_timeout * G_TIME_SPAN_MILLISECOND;
+
+  return stream;
+}
+
+static ResultsStream *
+results_stream_ref (ResultsStream *stream)
+{
+  g_atomic_int_inc (&stream->ref_count);
+
+  return stream;
 }
 
 static void
-xb_database_manager_init (XbDatabaseManager *self)
+results_stream_unref (ResultsStream *stream)
 {
-  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  if (!g_atomic_int_dec_and_test (&stream->ref_count))
+    return;
 
-  priv->stemmers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
-  g_hash_table_insert (priv->stemmers, g_strdup ("none"), xapian_stem_new ());
+  g_main_context_unref (stream->context);
+  g_clear_object (&stream->cancellable);
+  g_mutex_clear (&stream->lock);
+  g_cond_clear (&stream->sent);
 
-  priv->databases = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                           g_free, (GDestroyNotify) database_payload_free);
+  g_slice_free (ResultsStream, stream);
 }
 
 static gboolean
-xb_database_manager_register_prefixes (XbDatabaseManager *self,
-                                       XapianDatabase *db,
-                                       XapianQueryParser *query_parser,
-                                       GError **error_out)
+results_stream_timed_out (ResultsStream *stream)
 {
-  gchar *metadata_json;
-  GError *error = NULL;
-  JsonParser *parser = NULL;
-  JsonNode *root;
-  gboolean ret = FALSE;
+  return g_atomic_int_get (&stream->timed_out);
+}
 
-  /* Attempt to read the database's custom prefix association metadata */
-  metadata_json = xapian_database_get_metadata (db, PREFIX_METADATA_KEY, &error);
-  if (error != NULL)
-    {
-      g_propagate_error (error_out, error);
-      goto out;
-    }
+static gboolean
+results_stream_is_cancelled (ResultsStream *stream)
+{
+  return g_cancellable_is_cancelled (stream->cancellable) ||
+         results_stream_timed_out (stream);
+}
 
-  parser = json_parser_new ();
-  json_parser_load_from_data (parser, metadata_json, -1, &error);
-  if (error != NULL)
-    {
-      g_propagate_error (error_out, error);
-      goto out;
-    }
+/* A chunk handed over to the main thread */
+typedef struct {
+  ResultsStream *stream;
+  gchar *data;
+  gsize len;
+  GBytes *bytes;
+} StreamedChunk;
 
-  root = json_parser_get_root (parser);
-  if (root != NULL)
-    xb_database_manager_add_queryparser_prefixes (self, query_parser,
-                                                  json_node_get_object (root));
+/* Called once whoever got the chunk is done with it */
+static void
+streamed_chunk_free (gpointer user_data)
+{
+  StreamedChunk *chunk = user_data;
 
-  ret = TRUE;
+  g_mutex_lock (&chunk->stream->lock);
+  chunk->stream->pending -= chunk->len;
+  chunk->stream->last_sent = g_get_monotonic_time ();
+  g_cond_signal (&chunk->stream->sent);
+  g_mutex_unlock (&chunk->stream->lock);
 
- out:
-  /* If there was an error, just use the "standard" prefix map */
-  if (error != NULL)
-    xb_database_manager_add_queryparser_standard_prefixes (self, query_parser);
+  results_stream_unref (chunk->stream);
+  g_free (chunk->data);
 
-  g_clear_error (&error);
-  g_clear_object (&parser);
-  g_free (metadata_json);
-  return ret;
+  g_slice_free (StreamedChunk, chunk);
 }
 
 static gboolean
-xb_database_manager_register_stopwords (XbDatabaseManager *self,
-                                        XapianDatabase *db,
-                                        XapianQueryParser *query_parser,
-                                        GError **error_out)
+streamed_chunk_deliver (gpointer user_data)
 {
-  XapianSimpleStopper *stopper;
-  gchar *stopwords_json;
-  GError *error = NULL;
-  JsonParser *parser;
-  JsonNode *node;
-  JsonArray *array;
-  GList *elements, *l;
-  const gchar *stopword;
-  gchar *stopword_chomped;
+  StreamedChunk *chunk = user_data;
+  GBytes *bytes = g_steal_pointer (&chunk->bytes);
 
-  stopwords_json = xapian_database_get_metadata (db, STOPWORDS_METADATA_KEY, &error);
-  if (error != NULL)
+  chunk->stream->chunk_func (bytes, chunk->stream->chunk_data);
+  g_bytes_unref (bytes);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Hands the contents of @buffer over to the main thread, once the chunks
+ * handed over before are mostly sent. A client that reads nothing for the
+ * write timeout is given up on, rather than holding the worker: the stream
+ * then counts as cancelled, and the rest of the results are dropped.
+ */
+static void
+results_stream_send (ResultsStream *stream,
+                     GString *buffer)
+{
+  StreamedChunk *chunk;
+  gint64 now, waiting_since, end_time;
+
+  g_mutex_lock (&stream->lock);
+  waiting_since = g_get_monotonic_time ();
+  while (stream->pending >= STREAM_MAX_PENDING && !results_stream_is_cancelled (stream))
     {
-      g_propagate_error (error_out, error);
-      return FALSE;
+      now = g_get_monotonic_time ();
+      if (stream->write_timeout > 0 &&
+          now - MAX (waiting_since, stream->last_sent) >= stream->write_timeout)
+        {
+          g_atomic_int_set (&stream->timed_out, 1);
+          break;
+        }
+
+      /* Cancelling does not wake us up */
+      end_time = now + 100 * G_TIME_SPAN_MILLISECOND;
+      g_cond_wait_until (&stream->sent, &stream->lock, end_time);
     }
+  if (!results_stream_is_cancelled (stream))
+    stream->pending += buffer->len;
+  g_mutex_unlock (&stream->lock);
 
-  parser = json_parser_new ();
-  json_parser_load_from_data (parser, stopwords_json, -1, &error);
-  if (error != NULL)
+  if (results_stream_is_cancelled (stream))
     {
-      g_propagate_error (error_out, error);
-      g_object_unref (parser);
-      return FALSE;
+      g_string_truncate (buffer, 0);
+      return;
     }
 
-  /* empty JSON is not an error */
-  node = json_parser_get_root (parser);
-  if (node != NULL)
-    {
-      array = json_node_get_array (node);
-      elements = json_array_get_elements (array);
+  chunk = g_slice_new0 (StreamedChunk);
+  chunk->stream = results_stream_ref (stream);
+  chunk->len = buffer->len;
+  chunk->data = g_strndup (buffer->str, buffer->len);
+  chunk->bytes = g_bytes_new_with_free_func (chunk->data, chunk->len,
+                                             streamed_chunk_free, chunk);
 
-      stopper = xapian_simple_stopper_new ();
-      for (l = elements; l != NULL; l = l->next)
+  g_string_truncate (buffer, 0);
+
+  g_main_context_invoke_full (stream->context, G_PRIORITY_DEFAULT,
+                              streamed_chunk_deliver, chunk, NULL);
+}
+
+/* Writes the results as JSON text, the way json-glib would, and streams it
+ * if given a stream; otherwise the whole text is left in the buffer.
+ */
+typedef struct {
+  ResultsSink sink;
+  ResultsStream *stream;
+  GString *buffer;
+  gboolean first_document;
+} TextResultsSink;
+
+static void
+append_json_string (GString *buffer,
+                    const gchar *str)
+{
+  const gchar *p;
+
+  g_string_append_c (buffer, '"');
+
+  for (p = str; *p != '\0'; p++)
+    {
+      switch (*p)
         {
-          stopword = json_node_get_string (l->data);
-          /* In older databases, each stopword had a newline appended.
-           * This has now been fixed, but to avoid having to rebuild
-           * everything, we check for and remove such newlines.
-           */
-          if (g_str_has_suffix (stopword, "\n"))
-            {
-              stopword_chomped = g_strdup (stopword);
-              g_strchomp (stopword_chomped);
-              xapian_simple_stopper_add (stopper, stopword_chomped);
-              g_free (stopword_chomped);
-            }
+        case '"':
+          g_string_append (buffer, "\\\"");
+          break;
+        case '\\':
+          g_string_append (buffer, "\\\\");
+          break;
+        case '\b':
+          g_string_append (buffer, "\\b");
+          break;
+        case '\f':
+          g_string_append (buffer, "\\f");
+          break;
+        case '\n':
+          g_string_append (buffer, "\\n");
+          break;
+        case '\r':
+          g_string_append (buffer, "\\r");
+          break;
+        case '\t':
+          g_string_append (buffer, "\\t");
+          break;
+        default:
+          if ((guchar) *p < 0x20)
+            g_string_append_printf (buffer, "\\u%04x", (guint) *p);
           else
-            {
-              xapian_simple_stopper_add (stopper, stopword);
-            }
+            g_string_append_c (buffer, *p);
         }
-
-      xapian_query_parser_set_stopper (query_parser, XAPIAN_STOPPER (stopper));
-      g_object_unref (stopper);
     }
 
-  g_object_unref (parser);
-
-  return TRUE;
+  g_string_append_c (buffer, '"');
 }
 
-static XapianDatabase *
-create_database_from_manifest (const char  *manifest_path,
-                               GError     **error_out)
+static void
+text_results_sink_flush (TextResultsSink *self)
 {
-  GError *error = NULL;
-  g_autofree char *manifest_dir_path = NULL;
-  XapianDatabase *db = NULL;
-
-  JsonParser *parser = json_parser_new ();
-  if (!json_parser_load_from_file (parser, manifest_path, &error))
-    goto out;
+  if (self->stream != NULL)
+    results_stream_send (self->stream, self->buffer);
+}
 
-  db = xapian_database_new (&error);
-  if (error != NULL)
-    goto out;
+static void
+text_results_sink_begin (ResultsSink *sink,
+                         guint num_results,
+                         gint64 upper_bound,
+                         guint offset,
+                         const gchar *query_str)
+{
+  TextResultsSink *self = (TextResultsSink *) sink;
+
+  g_string_append_printf (self->buffer, "{\"%s\":%u", QUERY_RESULTS_MEMBER_NUM_RESULTS,
+                          num_results);
+  if (upper_bound >= 0)
+    g_string_append_printf (self->buffer, ",\"%s\":%" G_GINT64_FORMAT,
+                            QUERY_RESULTS_MEMBER_UPPER_BOUND, upper_bound);
+  g_string_append_printf (self->buffer, ",\"%s\":%u", QUERY_RESULTS_MEMBER_OFFSET, offset);
+  if (query_str != NULL)
+    {
+      g_string_append_printf (self->buffer, ",\"%s\":", QUERY_RESULTS_MEMBER_QUERYSTR);
+      append_json_string (self->buffer, query_str);
+    }
+  g_string_append_printf (self->buffer, ",\"%s\":[", QUERY_RESULTS_MEMBER_RESULTS);
 
-  JsonNode *node = json_parser_get_root (parser);
-  JsonObject *json_manifest = json_node_get_object (node);
-  JsonArray *json_dbs = json_object_get_array_member (json_manifest, "xapian_databases");
+  /* The client can start reading before the documents are fetched */
+  text_results_sink_flush (self);
+}
 
-  manifest_dir_path = g_path_get_dirname (manifest_path);
+static gboolean
+text_results_sink_add (TextResultsSink *self,
+                       const gchar *data,
+                       gboolean verbatim)
+{
+  if (self->stream != NULL && results_stream_is_cancelled (self->stream))
+    return FALSE;
 
-  GList *dbs = json_array_get_elements (json_dbs), *l;
-  for (l = dbs; l != NULL; l = l->next)
-    {
-      JsonObject *json_db = json_node_get_object (l->data);
+  if (!self->first_document)
+    g_string_append_c (self->buffer, ',');
+  self->first_document = FALSE;
 
-      guint64 db_offset = json_object_get_int_member (json_db, "offset");
+  if (verbatim)
+    g_string_append (self->buffer, data);
+  else
+    append_json_string (self->buffer, data);
 
-      const char *relpath = json_object_get_string_member (json_db, "path");
-      g_autofree char *db_path = g_build_filename (manifest_dir_path, relpath, NULL);
+  if (self->buffer->len >= STREAM_CHUNK_SIZE)
+    text_results_sink_flush (self);
 
-      XapianDatabase *internal_db = g_initable_new (XAPIAN_TYPE_DATABASE,
-                                                    NULL, &error,
-                                                    "path", db_path,
-                                                    "offset", db_offset,
-                                                    NULL);
+  return TRUE;
+}
 
-      if (error != NULL)
-        goto out;
+static gboolean
+text_results_sink_add_document (ResultsSink *sink,
+                                const gchar *data)
+{
+  return text_results_sink_add ((TextResultsSink *) sink, data, FALSE);
+}
 
-      xapian_database_add_database (db, internal_db);
-      g_object_unref (internal_db);
-    }
+static gboolean
+text_results_sink_add_json_document (ResultsSink *sink,
+                                     const gchar *data)
+{
+  return text_results_sink_add ((TextResultsSink *) sink, data, TRUE);
+}
 
- out:
-  g_clear_object (&parser);
+static void
+text_results_sink_end (ResultsSink *sink,
+                       gboolean partial)
+{
+  TextResultsSink *self = (TextResultsSink *) sink;
 
-  if (error)
-    {
-      g_propagate_error (error_out, error);
-      g_clear_object (&db);
-    }
+  g_string_append_c (self->buffer, ']');
+  if (partial)
+    g_string_append_printf (self->buffer, ",\"%s\":true", QUERY_RESULTS_MEMBER_PARTIAL);
+  g_string_append_c (self->buffer, '}');
+  text_results_sink_flush (self);
+}
 
-  return db;
+/* @stream may be NULL */
+static void
+text_results_sink_init (TextResultsSink *self,
+                        ResultsStream *stream)
+{
+  self->sink.begin = text_results_sink_begin;
+  self->sink.add_document = text_results_sink_add_document;
+  self->sink.add_json_document = text_results_sink_add_json_document;
+  self->sink.end = text_results_sink_end;
+  self->stream = stream;
+  self->buffer = g_string_sized_new (stream != NULL ? STREAM_CHUNK_SIZE + 1024 : 4096);
+  self->first_document = TRUE;
 }
 
-static char *
-read_link (const char *path)
+/* Returns the text written so far, and resets the sink */
+static GBytes *
+text_results_sink_steal_bytes (TextResultsSink *self)
 {
-  char *resolved_path = g_file_read_link (path, NULL);
-  if (resolved_path)
-    return resolved_path;
-  else
-    return g_strdup (path);
+  GBytes *bytes = g_string_free_to_bytes (self->buffer);
+
+  self->buffer = g_string_new (NULL);
+  return bytes;
 }
 
-static char *
-xb_database_path (XbDatabase xbdb)
+static void
+text_results_sink_clear (TextResultsSink *self)
 {
-  if (xbdb.manifest_path)
-    return read_link (xbdb.manifest_path);
-  if (xbdb.path)
-    return read_link (xbdb.path);
-  return NULL;
+  g_string_free (self->buffer, TRUE);
 }
 
-/* Creates a new XapianDatabase for the given path, and indexes it by path,
- * overwriting any existing database with the same name.
- */
-static DatabasePayload *
-xb_database_manager_create_db_internal (XbDatabaseManager *self,
-                                        XbDatabase xbdb,
-                                        GError **error_out)
-{
-  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
-  XapianDatabase *db;
-  GError *error = NULL;
-  XapianQueryParser *query_parser;
-  DatabasePayload *payload;
-  GFileMonitor *monitor;
-  char *path;
+#define MAX_JSON_DEPTH 64
 
-  path = xb_database_path (xbdb);
+static const gchar *scan_json_value (const gchar *p, guint depth);
 
-  g_assert (!g_hash_table_contains (priv->databases, path));
+static const gchar *
+skip_json_whitespace (const gchar *p)
+{
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+    p++;
 
-  if (xbdb.manifest_path)
-    db = create_database_from_manifest (xbdb.manifest_path, &error);
-  else
-    db = xapian_database_new_with_path (xbdb.path, &error);
+  return p;
+}
 
-  if (error != NULL)
-    {
-      g_set_error (error_out, XB_ERROR,
-                   XB_ERROR_INVALID_PATH,
-                   "Cannot create XapianDatabase for path %s: %s",
-                   path, error->message);
-      g_error_free (error);
-      return NULL;
-    }
+static const gchar *
+scan_json_string (const gchar *p)
+{
+  gint idx;
 
-  /* Create a XapianQueryParser for this particular database, stemming by its
-   * registered language.
-   */
-  query_parser = xapian_query_parser_new ();
-  xapian_query_parser_set_database (query_parser, db);
+  if (*p++ != '"')
+    return NULL;
 
-  if (!xb_database_manager_register_prefixes (self, db, query_parser, &error))
+  while (*p != '"')
     {
-      /* Non-fatal */
-      g_warning ("Could not register prefixes for database %s: %s",
-                 path, error->message);
-      g_clear_error (&error);
-    }
+      if ((guchar) *p < 0x20)
+        return NULL;
 
-  if (!xb_database_manager_register_stopwords (self, db, query_parser, &error))
-    {
-      /* Non-fatal */
-      g_warning ("Could not add stop words for database %s: %s.",
-                 path, error->message);
-      g_clear_error (&error);
+      if (*p++ != '\\')
+        continue;
+
+      if (*p == 'u')
+        {
+          for (idx = 1; idx <= 4; idx++)
+            if (!g_ascii_isxdigit (p[idx]))
+              return NULL;
+          p += 5;
+        }
+      else if (*p != '\0' && strchr ("\"\\/bfnrt", *p) != NULL)
+        {
+          p++;
+        }
+      else
+        {
+          return NULL;
+        }
     }
 
-  monitor = xb_database_manager_monitor_db (self, path);
-  payload = database_payload_new (db, query_parser, self, monitor, path);
-  g_hash_table_insert (priv->databases, g_strdup (path), payload);
+  return p + 1;
+}
 
-  g_signal_connect (monitor, "changed",
-                    G_CALLBACK (database_monitor_changed), payload);
+static const gchar *
+scan_json_digits (const gchar *p)
+{
+  if (!g_ascii_isdigit (*p))
+    return NULL;
 
-  g_object_unref (db);
-  g_object_unref (query_parser);
-  g_object_unref (monitor);
-  g_free (path);
+  while (g_ascii_isdigit (*p))
+    p++;
 
-  return payload;
+  return p;
 }
 
-static gboolean
-on_database_expire (DatabasePayload *payload)
+static const gchar *
+scan_json_number (const gchar *p)
 {
-  payload->expiration_timeout = 0;
-  xb_database_manager_invalidate_db (payload->manager, payload->path);
-  return G_SOURCE_REMOVE;
+  if (*p == '-')
+    p++;
+
+  if (*p == '0')
+    p++;
+  else if ((p = scan_json_digits (p)) == NULL)
+    return NULL;
+
+  if (*p == '.' && (p = scan_json_digits (p + 1)) == NULL)
+    return NULL;
+
+  if (*p == 'e' || *p == 'E')
+    {
+      p++;
+      if (*p == '+' || *p == '-')
+        p++;
+      p = scan_json_digits (p);
+    }
+
+  return p;
 }
 
-static DatabasePayload *
-ensure_db (XbDatabaseManager *self,
-           XbDatabase db,
-           GError **error_out)
+/* Scans the members of an object, or the elements of an array, after the
+ * opening bracket.
+ */
+static const gchar *
+scan_json_container (const gchar *p,
+                     gchar close,
+                     guint depth)
 {
-  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
-  GError *error = NULL;
-  DatabasePayload *payload;
-  char *path;
+  p = skip_json_whitespace (p);
+  if (*p == close)
+    return p + 1;
 
-  path = xb_database_path (db);
-  payload = g_hash_table_lookup (priv->databases, path);
+  while (TRUE)
+    {
+      if (close == '}')
+        {
+          if ((p = scan_json_string (p)) == NULL)
+            return NULL;
+          p = skip_json_whitespace (p);
+          if (*p++ != ':')
+            return NULL;
+          p = skip_json_whitespace (p);
+        }
 
-  if (payload == NULL)
-    payload = xb_database_manager_create_db_internal (self, db, &error);
+      if ((p = scan_json_value (p, depth + 1)) == NULL)
+        return NULL;
 
-  if (error != NULL)
+      p = skip_json_whitespace (p);
+      if (*p == close)
+        return p + 1;
+      if (*p++ != ',')
+        return NULL;
+      p = skip_json_whitespace (p);
+    }
+}
+
+/* Returns the end of the JSON value at @p, or NULL if there is none */
+static const gchar *
+scan_json_value (const gchar *p,
+                 guint depth)
+{
+  if (depth > MAX_JSON_DEPTH)
+    return NULL;
+
+  switch (*p)
     {
-      g_propagate_error (error_out, error);
-      return NULL;
+    case '{':
+      return scan_json_container (p + 1, '}', depth);
+    case '[':
+      return scan_json_container (p + 1, ']', depth);
+    case '"':
+      return scan_json_string (p);
+    case 't':
+      return g_str_has_prefix (p, "true") ? p + 4 : NULL;
+    case 'f':
+      return g_str_has_prefix (p, "false") ? p + 5 : NULL;
+    case 'n':
+      return g_str_has_prefix (p, "null") ? p + 4 : NULL;
+    default:
+      return scan_json_number (p);
     }
+}
+
+/* Whether the document data can be embedded in the results as is: only JSON
+ * objects and arrays are, so that data that merely looks like a number or a
+ * literal stays a string.
+ */
+static gboolean
+document_data_is_json (const gchar *data)
+{
+  const gchar *p = skip_json_whitespace (data);
 
-  if (payload->expiration_timeout)
-    g_source_remove (payload->expiration_timeout);
-  payload->expiration_timeout =
-    g_timeout_add_seconds (5, (GSourceFunc) on_database_expire, payload);
+  if (*p != '{' && *p != '[')
+    return FALSE;
 
-  g_free (path);
+  p = scan_json_value (p, 0);
+  if (p == NULL || *skip_json_whitespace (p) != '\0')
+    return FALSE;
 
-  return payload;
+  return g_utf8_validate (data, -1, NULL);
 }
 
-gboolean
-xb_database_manager_ensure_db (XbDatabaseManager *self,
-                               XbDatabase db,
-                               GError **error_out)
+/* Adds the time since @since to @phase, and moves @since to now */
+static void
+add_elapsed (gint64 *phase,
+             gint64 *since)
 {
-  return (ensure_db (self, db, error_out) != NULL);
+  gint64 now = g_get_monotonic_time ();
+
+  *phase += now - *since;
+  *since = now;
 }
 
-static JsonObject *
+static gboolean
 xb_database_manager_fetch_results (XbDatabaseManager *self,
                                    XapianEnquire *enquire,
                                    XapianQuery *query,
                                    const gchar *query_str,
                                    GHashTable *query_options,
+                                   ResultsSink *sink,
+                                   gint64 deadline,
+                                   XbQueryTimings *timings,
                                    GError **error_out)
 {
   const gchar *str;
@@ -592,8 +3558,8 @@ xb_database_manager_fetch_results (XbDatabaseManager *self,
   XapianMSetIterator *iter;
   XapianDocument *document;
   GError *error = NULL;
-  JsonObject *retval;
-  JsonArray *results_array;
+  gboolean raw, capped = FALSE, wanted = TRUE;
+  gint64 since;
 
   str = g_hash_table_lookup (query_options, QUERY_PARAM_OFFSET);
   if (str == NULL)
@@ -601,7 +3567,7 @@ xb_database_manager_fetch_results (XbDatabaseManager *self,
       g_set_error_literal (error_out, XB_ERROR,
                            XB_ERROR_INVALID_PARAMS,
                            "Offset parameter is required for the query");
-      return NULL;
+      return FALSE;
     }
 
   offset = (guint) g_ascii_strtod (str, NULL);
@@ -612,7 +3578,7 @@ xb_database_manager_fetch_results (XbDatabaseManager *self,
       g_set_error_literal (error_out, XB_ERROR,
                            XB_ERROR_INVALID_PARAMS,
                            "Limit parameter is required for the query");
-      return NULL;
+      return FALSE;
     }
 
   /* str may contain a negative value to mean "all matching results"; since
@@ -629,45 +3595,91 @@ xb_database_manager_fetch_results (XbDatabaseManager *self,
       limit = CLAMP (val, 0, G_MAXUINT);
   }
 
+  since = g_get_monotonic_time ();
+
+  /* Nothing left to match with, such as the last queries of a batch */
+  if (deadline > 0 && since >= deadline)
+    {
+      timings->partial = TRUE;
+      sink->begin (sink, 0, -1, offset, query_str);
+      sink->end (sink, TRUE);
+      return TRUE;
+    }
+
+  /* The fewer documents wanted, the more of them Xapian can skip */
+  if (deadline > 0 && limit > TIME_LIMITED_MAX_RESULTS)
+    {
+      limit = TIME_LIMITED_MAX_RESULTS;
+      capped = TRUE;
+    }
+
   xapian_enquire_set_query (enquire, query, xapian_query_get_length (query));
   matches = xapian_enquire_get_mset (enquire, offset, limit, &error);
+  add_elapsed (&timings->match, &since);
   if (error != NULL)
     {
       g_propagate_error (error_out, error);
-      return NULL;
+      return FALSE;
     }
 
-  retval = json_object_new ();
-  json_object_set_int_member (retval, QUERY_RESULTS_MEMBER_NUM_RESULTS, xapian_mset_get_size (matches));
-  json_object_set_int_member (retval, QUERY_RESULTS_MEMBER_UPPER_BOUND, xapian_mset_get_matches_upper_bound (matches));
-  json_object_set_int_member (retval, QUERY_RESULTS_MEMBER_OFFSET, offset);
-  if (query_str != NULL)
-      json_object_set_string_member (retval, QUERY_RESULTS_MEMBER_QUERYSTR, query_str);
+  if (deadline > 0 && since >= deadline)
+    timings->partial = TRUE;
+  if (capped && xapian_mset_get_matches_upper_bound (matches) > (guint64) offset + limit)
+    timings->partial = TRUE;
+
+  raw = g_hash_table_contains (query_options, QUERY_PARAM_RAW_RESULTS);
 
-  results_array = json_array_new ();
-  json_object_set_array_member (retval, QUERY_RESULTS_MEMBER_RESULTS, results_array);
+  sink->begin (sink, xapian_mset_get_size (matches),
+               xapian_mset_get_matches_upper_bound (matches),
+               offset, query_str);
+  add_elapsed (&timings->serialize, &since);
 
+  /* Documents are only read from disk as the sink takes them */
   iter = xapian_mset_get_begin (matches);
-  while (xapian_mset_iterator_next (iter))
+  while (wanted && xapian_mset_iterator_next (iter))
     {
+      /* Whatever was fetched in time is sent */
+      if (deadline > 0 && g_get_monotonic_time () >= deadline)
+        {
+          timings->partial = TRUE;
+          break;
+        }
+
       document = xapian_mset_iterator_get_document (iter, &error);
       if (error != NULL)
         {
           g_warning ("Unable to fetch document from iterator: %s",
                      error->message);
           g_clear_error (&error);
+          add_elapsed (&timings->fetch, &since);
           continue;
         }
 
       document_data = xapian_document_get_data (document);
-      json_array_add_string_element (results_array, document_data);
+      add_elapsed (&timings->fetch, &since);
+
+      if (raw && document_data_is_json (document_data))
+        wanted = sink->add_json_document (sink, document_data);
+      else
+        wanted = sink->add_document (sink, document_data);
       g_free (document_data);
+      add_elapsed (&timings->serialize, &since);
     }
 
   g_object_unref (iter);
   g_object_unref (matches);
 
-  return retval;
+  if (!wanted)
+    {
+      g_set_error_literal (error_out, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                           "The results are no longer wanted");
+      return FALSE;
+    }
+
+  sink->end (sink, timings->partial);
+  add_elapsed (&timings->serialize, &since);
+
+  return TRUE;
 }
 
 /* Checks if the given database is empty (has no documents). Empty databases
@@ -680,21 +3692,15 @@ database_is_empty (XapianDatabase *db)
   return xapian_database_get_doc_count (db) == 0;
 }
 
-static JsonObject *
-create_empty_query_results (void)
+static void
+add_empty_query_results (ResultsSink *sink)
 {
-  JsonObject *object;
-
-  object = json_object_new ();
-  json_object_set_int_member (object, QUERY_RESULTS_MEMBER_NUM_RESULTS, 0);
-  json_object_set_int_member (object, QUERY_RESULTS_MEMBER_OFFSET, 0);
-  json_object_set_array_member (object, QUERY_RESULTS_MEMBER_RESULTS, json_array_new ());
-
-  return object;
+  sink->begin (sink, 0, -1, 0, NULL);
+  sink->end (sink, FALSE);
 }
 
 static gboolean
-parse_default_op (XapianQueryParser *qp, const gchar *str, GError **error)
+parse_default_op (const gchar *str, XapianQueryOp *op_out, GError **error)
 {
   XapianQueryOp op;
   if (g_str_equal (str, "and"))
@@ -740,10 +3746,157 @@ parse_default_op (XapianQueryParser *qp, const gchar *str, GError **error)
                    "defaultOp parameter must be \"and\", \"or\", \"near\", \"phrase\", \"elite-set\", \"synonym\" or \"max\".");
       return FALSE;
     }
-  xapian_query_parser_set_default_op (qp, op);
+  *op_out = op;
   return TRUE;
 }
 
+/* Returns the stemmer for @lang, falling back to no stemming for unknown
+ * languages; @lang_out is set to the name of the language actually used.
+ */
+static XapianStem *
+database_handle_get_stemmer (DatabaseHandle *handle,
+                             const gchar *lang,
+                             const gchar **lang_out)
+{
+  XapianStem *stem;
+  GError *error = NULL;
+
+  if (lang == NULL)
+      lang = "none";
+
+  stem = g_hash_table_lookup (handle->stemmers, lang);
+  if (stem == NULL)
+    {
+      stem = xapian_stem_new_for_language (lang, &error);
+      if (error != NULL)
+        {
+          g_warning ("Cannot create XapianStem for language %s: %s",
+                     lang, error->message);
+          g_clear_error (&error);
+
+          lang = "none";
+          stem = g_hash_table_lookup (handle->stemmers, lang);
+        }
+      else
+        {
+          g_hash_table_insert (handle->stemmers, g_strdup (lang), stem);
+        }
+    }
+
+  g_assert (stem != NULL);
+
+  *lang_out = lang;
+  return stem;
+}
+
+/* Returns the parser of the handle for the given language and default
+ * operator, creating it from the database's parser template on first use.
+ */
+static XapianQueryParser *
+database_handle_get_query_parser (DatabaseHandle *handle,
+                                  const gchar *lang,
+                                  const gchar *default_op,
+                                  GError **error_out)
+{
+  const QueryParserTemplate *template = handle->template;
+  XapianQueryParser *query_parser;
+  XapianQueryOp op = XAPIAN_QUERY_OP_OR;
+  XapianStem *stem;
+  gchar *key;
+  guint idx;
+
+  if (default_op != NULL && !parse_default_op (default_op, &op, error_out))
+    return NULL;
+
+  stem = database_handle_get_stemmer (handle, lang, &lang);
+
+  key = g_strconcat (lang, " ", default_op != NULL ? default_op : "or", NULL);
+  query_parser = g_hash_table_lookup (handle->parsers, key);
+  if (query_parser != NULL)
+    {
+      g_free (key);
+      return query_parser;
+    }
+
+  query_parser = xapian_query_parser_new ();
+  xapian_query_parser_set_database (query_parser, handle->db);
+
+  for (idx = 0; idx + 1 < template->prefixes->len; idx += 2)
+    xapian_query_parser_add_prefix (query_parser,
+                                    g_ptr_array_index (template->prefixes, idx),
+                                    g_ptr_array_index (template->prefixes, idx + 1));
+
+  for (idx = 0; idx + 1 < template->boolean_prefixes->len; idx += 2)
+    xapian_query_parser_add_boolean_prefix (query_parser,
+                                            g_ptr_array_index (template->boolean_prefixes, idx),
+                                            g_ptr_array_index (template->boolean_prefixes, idx + 1),
+                                            FALSE);
+
+  if (handle->stopper != NULL)
+    xapian_query_parser_set_stopper (query_parser, handle->stopper);
+
+  xapian_query_parser_set_stemmer (query_parser, stem);
+  xapian_query_parser_set_stemming_strategy (query_parser, XAPIAN_STEM_STRATEGY_STEM_SOME);
+  xapian_query_parser_set_default_op (query_parser, op);
+
+  g_hash_table_insert (handle->parsers, key, query_parser);
+
+  return query_parser;
+}
+
+/* Parses @query_str with one of the handle's parsers, reusing the result of
+ * an earlier identical parse. Parsers are never reconfigured, so they stand
+ * for their language and default operator in the key.
+ *
+ * Returns a new reference, which only the calling thread may use: Xapian
+ * queries are not thread-safe.
+ */
+static XapianQuery *
+database_handle_parse_query (DatabaseHandle *handle,
+                             XapianQueryParser *query_parser,
+                             const gchar *query_str,
+                             XapianQueryParserFeature flags,
+                             GError **error_out)
+{
+  CachedQuery *cached;
+  XapianQuery *query;
+  gchar *key;
+
+  key = g_strdup_printf ("%p\n%u\n%s", query_parser, (guint) flags, query_str);
+
+  cached = g_hash_table_lookup (handle->queries, key);
+  if (cached != NULL)
+    {
+      g_queue_unlink (&handle->queries_lru, cached->link);
+      g_queue_push_head_link (&handle->queries_lru, cached->link);
+      g_free (key);
+      return g_object_ref (cached->query);
+    }
+
+  query = xapian_query_parser_parse_query_full (query_parser, query_str,
+                                                flags, "", error_out);
+  if (query == NULL)
+    {
+      g_free (key);
+      return NULL;
+    }
+
+  if (handle->queries_lru.length >= MAX_CACHED_QUERIES)
+    {
+      cached = g_queue_pop_tail (&handle->queries_lru);
+      g_hash_table_remove (handle->queries, cached->key);
+    }
+
+  cached = g_slice_new0 (CachedQuery);
+  cached->key = key;
+  cached->query = g_object_ref (query);
+  g_queue_push_head (&handle->queries_lru, cached);
+  cached->link = handle->queries_lru.head;
+  g_hash_table_insert (handle->queries, cached->key, cached);
+
+  return query;
+}
+
 static gboolean
 parse_query_flags (const gchar *str,
                    XapianQueryParserFeature *flags_ptr,
@@ -830,7 +3983,7 @@ parse_query_flags (const gchar *str,
 
 static JsonObject *
 xb_database_manager_fix_query_internal (XbDatabaseManager *self,
-                           DatabasePayload *payload,
+                           DatabaseHandle *handle,
                            GHashTable *query_options,
                            GError **error_out)
 {
@@ -843,7 +3996,8 @@ xb_database_manager_fix_query_internal (XbDatabaseManager *self,
   const gchar *default_op;
   const gchar *flags_str;
   XapianQueryParserFeature flags = QUERY_PARSER_FLAGS;
-  XapianStopper *stopper;
+  XapianQueryParser *query_parser;
+  XapianQuery *parsed_query = NULL;
   JsonObject *retval;
 
   retval = json_object_new ();
@@ -851,8 +4005,6 @@ xb_database_manager_fix_query_internal (XbDatabaseManager *self,
   query_str = g_hash_table_lookup (query_options, QUERY_PARAM_QUERYSTR);
   match_all = g_hash_table_lookup (query_options, QUERY_PARAM_MATCH_ALL);
 
-  stopper = xapian_query_parser_get_stopper (payload->qp);
-
   if (query_str == NULL || match_all != NULL)
     {
       g_set_error (error_out, XB_ERROR,
@@ -860,14 +4012,14 @@ xb_database_manager_fix_query_internal (XbDatabaseManager *self,
                   "Query parameter must be set, and must not be match all.");
       goto out;
     }
-  else if (stopper != NULL)
+  else if (handle->stopper != NULL)
     {
       words = g_strsplit (query_str, " ", -1);
       filtered_words = g_new0 (gchar *, g_strv_length (words) + 1);
 
       filtered_iter = filtered_words;
       for (words_iter = words; *words_iter != NULL; words_iter++)
-        if (!xapian_stopper_is_stop_term (stopper, *words_iter))
+        if (!xapian_stopper_is_stop_term (handle->stopper, *words_iter))
           *filtered_iter++ = *words_iter;
 
       no_stop_words = g_strjoinv (" ", filtered_words);
@@ -876,16 +4028,22 @@ xb_database_manager_fix_query_internal (XbDatabaseManager *self,
     }
 
   default_op = g_hash_table_lookup (query_options, QUERY_PARAM_DEFAULT_OP);
-  if (default_op != NULL && !parse_default_op (payload->qp, default_op, error_out))
+  query_parser = database_handle_get_query_parser (handle,
+                                                   g_hash_table_lookup (query_options,
+                                                                        QUERY_PARAM_LANG),
+                                                   default_op, error_out);
+  if (query_parser == NULL)
     goto out;
 
   flags_str = g_hash_table_lookup (query_options, QUERY_PARAM_FLAGS);
   if (flags_str != NULL && !parse_query_flags (flags_str, &flags, error_out))
     goto out;
 
-  /* Parse the user's query so we can request a spelling correction. */
-  xapian_query_parser_parse_query_full (payload->qp, query_str,
-                                        flags, "", &error);
+  /* Parse the user's query so we can request a spelling correction. The
+   * correction is state left on the parser, so this parse is never cached.
+   */
+  parsed_query = xapian_query_parser_parse_query_full (query_parser, query_str,
+                                                       flags, "", &error);
 
   if (error != NULL)
     {
@@ -893,7 +4051,7 @@ xb_database_manager_fix_query_internal (XbDatabaseManager *self,
       goto out;
     }
 
-  spell_corrected_query_str = xapian_query_parser_get_corrected_query_string (payload->qp);
+  spell_corrected_query_str = xapian_query_parser_get_corrected_query_string (query_parser);
   if (spell_corrected_query_str != NULL && spell_corrected_query_str[0] != '\0')
     {
       json_object_set_string_member (retval, FIX_RESULTS_MEMBER_SPELL_CORRECTED_RESULT,
@@ -901,6 +4059,7 @@ xb_database_manager_fix_query_internal (XbDatabaseManager *self,
     }
 
  out:
+  g_clear_object (&parsed_query);
   g_free (filtered_words);
   g_free (no_stop_words);
   g_free (spell_corrected_query_str);
@@ -909,93 +4068,181 @@ xb_database_manager_fix_query_internal (XbDatabaseManager *self,
   return retval;
 }
 
-/* Queries the database with the given parameters, and returns a JSON object
- * with the following members:
+/* Leaves the wildcard and partial features out of @flags if they would
+ * expand a word shorter than TIME_LIMITED_MIN_EXPANSION into much of the
+ * vocabulary; xapian-glib cannot cap the expansion itself.
+ */
+static XapianQueryParserFeature
+limit_query_expansion (const gchar *query_str,
+                       XapianQueryParserFeature flags)
+{
+  gchar **words;
+  const gchar *p;
+  guint idx, n_chars;
+
+  words = g_strsplit_set (query_str, " \t\r\n", -1);
+
+  for (idx = 0; words[idx] != NULL; idx++)
+    {
+      /* Only counting the word itself, after any field prefix */
+      n_chars = 0;
+      for (p = words[idx]; *p != '\0' && *p != '*'; p = g_utf8_next_char (p))
+        {
+          if (*p == ':')
+            n_chars = 0;
+          else if (g_unichar_isalnum (g_utf8_get_char (p)))
+            n_chars++;
+        }
+
+      if (*p == '*' && n_chars < TIME_LIMITED_MIN_EXPANSION)
+        flags &= ~XAPIAN_QUERY_PARSER_FEATURE_WILDCARD;
+
+      /* The last word is expanded unless a space ends it */
+      if (words[idx + 1] == NULL && words[idx][0] != '\0' &&
+          n_chars < TIME_LIMITED_MIN_EXPANSION)
+        flags &= ~XAPIAN_QUERY_PARSER_FEATURE_PARTIAL;
+    }
+
+  g_strfreev (words);
+
+  return flags;
+}
+
+/* Sets @deadline_out to the monotonic time after which a query started at
+ * @start only sends the results found so far, or to 0 if it has no time
+ * limit; the timeLimit parameter can only lower the default one, and
+ * @deadline, if not 0, bounds both.
+ */
+static gboolean
+get_query_deadline (XbDatabaseManager *self,
+                    GHashTable *query_options,
+                    gint64 start,
+                    gint64 deadline,
+                    gint64 *deadline_out,
+                    GError **error_out)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  const gchar *str;
+  gchar *end;
+  gdouble limit = priv->default_time_limit;
+
+  str = g_hash_table_lookup (query_options, QUERY_PARAM_TIME_LIMIT);
+  if (str != NULL)
+    {
+      gdouble val = g_ascii_strtod (str, &end);
+
+      if (end == str || *end != '\0' || !isfinite (val) || !(val > 0))
+        {
+          g_set_error (error_out, XB_ERROR,
+                       XB_ERROR_INVALID_PARAMS,
+                       "timeLimit parameter must be a positive number of milliseconds");
+          return FALSE;
+        }
+
+      /* Clamp to the longest default-time-limit, so the microseconds fit */
+      val = MIN (val, G_MAXUINT);
+
+      if (limit == 0 || val < limit)
+        limit = val;
+    }
+
+  *deadline_out = limit > 0 ? start + (gint64) (limit * 1000) : 0;
+  if (deadline > 0 && (*deadline_out == 0 || deadline < *deadline_out))
+    *deadline_out = deadline;
+
+  return TRUE;
+}
+
+/* Queries the database with the given parameters, and puts in @sink a JSON
+ * object with the following members:
  *   - numResults: number of results being returned
  *   - offset: index from which results were gathered
  *   - query: the query string that produced the results
- *   - results: an array of strings for every result document, sorted according
- *              to the query parameters
+ *   - results: an array with the data of every result document, sorted
+ *              according to the query parameters; a string each, or with
+ *              rawResults, the JSON object or array the data holds, if any
+ *   - partial: true, only if the time limit ran out before all the matching
+ *              documents were found or fetched, or if a time limited query
+ *              asked for more than TIME_LIMITED_MAX_RESULTS of them
+ * Adds the time spent in each phase to @timings, if not NULL. @deadline, if
+ * not 0, is the monotonic time the query must be done by, whatever its own
+ * time limit.
  */
-static JsonObject *
+static gboolean
 xb_database_manager_query (XbDatabaseManager *self,
-                           DatabasePayload *payload,
+                           DatabaseHandle *handle,
                            GHashTable *query_options,
+                           gint64 deadline,
+                           ResultsSink *sink,
+                           XbQueryTimings *timings,
                            GError **error_out)
 {
-  XapianQuery *parsed_query = NULL, *filter_query, *filterout_query;
+  XapianQuery *parsed_query = NULL, *filter_query, *filterout_query, *combined;
   const gchar *filter_str, *filterout_str;
   gchar *query_str = NULL;
   XapianEnquire *enquire = NULL;
+  XapianQueryParser *query_parser;
   GError *error = NULL;
-  const gchar *lang;
-  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
-  XapianStem *stem;
   const gchar *str;
   const gchar *match_all;
   const gchar *default_op;
   const gchar *flags_str;
   XapianQueryParserFeature flags = QUERY_PARSER_FLAGS;
-  JsonObject *results = NULL;
+  XbQueryTimings unused = { 0, };
+  gint64 since = g_get_monotonic_time ();
+  gboolean res = FALSE;
 
-  if (database_is_empty (payload->db))
-    return create_empty_query_results ();
+  if (timings == NULL)
+    timings = &unused;
 
-  str = g_hash_table_lookup (query_options, QUERY_PARAM_QUERYSTR);
-
-  lang = g_hash_table_lookup (query_options, QUERY_PARAM_LANG);
-  if (lang == NULL)
-      lang = "none";
+  if (!get_query_deadline (self, query_options, since, deadline, &deadline, error_out))
+    return FALSE;
 
-  stem = g_hash_table_lookup (priv->stemmers, lang);
-  if (stem == NULL)
+  if (database_is_empty (handle->db))
     {
-      stem = xapian_stem_new_for_language (lang, &error);
-      if (error != NULL)
-        {
-          g_warning ("Cannot create XapianStem for language %s: %s",
-                     lang, error->message);
-          g_clear_error (&error);
-
-          stem = g_hash_table_lookup (priv->stemmers, "none");
-        }
-      else
-        {
-          g_hash_table_insert (priv->stemmers, g_strdup (lang), stem);
-        }
+      add_empty_query_results (sink);
+      return TRUE;
     }
 
-  g_assert (stem != NULL);
+  str = g_hash_table_lookup (query_options, QUERY_PARAM_QUERYSTR);
+  match_all = g_hash_table_lookup (query_options, QUERY_PARAM_MATCH_ALL);
+
+  /* The default operator only applies to the query string */
+  default_op = NULL;
+  if (str != NULL && match_all == NULL)
+    default_op = g_hash_table_lookup (query_options, QUERY_PARAM_DEFAULT_OP);
 
-  xapian_query_parser_set_stemmer (payload->qp, stem);
-  xapian_query_parser_set_stemming_strategy (payload->qp, XAPIAN_STEM_STRATEGY_STEM_SOME);
+  query_parser = database_handle_get_query_parser (handle,
+                                                   g_hash_table_lookup (query_options,
+                                                                        QUERY_PARAM_LANG),
+                                                   default_op, error_out);
+  if (query_parser == NULL)
+    return FALSE;
 
-  enquire = xapian_enquire_new (payload->db, &error);
+  enquire = xapian_enquire_new (handle->db, &error);
   if (error != NULL)
     {
       g_propagate_error (error_out, error);
       goto out;
     }
 
-  match_all = g_hash_table_lookup (query_options, QUERY_PARAM_MATCH_ALL);
   if (match_all != NULL && str == NULL)
     {
       /* Handled below. */
     }
   else if (str != NULL && match_all == NULL)
     {
-      default_op = g_hash_table_lookup (query_options, QUERY_PARAM_DEFAULT_OP);
-      if (default_op != NULL && !parse_default_op (payload->qp, default_op, error_out))
-        goto out;
-
       flags_str = g_hash_table_lookup (query_options, QUERY_PARAM_FLAGS);
       if (flags_str != NULL && !parse_query_flags (flags_str, &flags, error_out))
         goto out;
 
+      if (deadline > 0)
+        flags = limit_query_expansion (str, flags);
+
       /* save the query string aside */
       query_str = g_strdup (str);
-      parsed_query = xapian_query_parser_parse_query_full (payload->qp, query_str,
-                                                           flags, "", &error);
+      parsed_query = database_handle_parse_query (handle, query_parser, query_str,
+                                                  flags, &error);
 
       if (error != NULL)
         {
@@ -1016,10 +4263,9 @@ xb_database_manager_query (XbDatabaseManager *self,
   filter_str = g_hash_table_lookup (query_options, QUERY_PARAM_FILTER);
   if (filter_str != NULL)
     {
-      filter_query = xapian_query_parser_parse_query_full (payload->qp,
-                                                           filter_str,
-                                                           XAPIAN_QUERY_PARSER_FEATURE_DEFAULT,
-                                                           "", &error);
+      filter_query = database_handle_parse_query (handle, query_parser, filter_str,
+                                                  XAPIAN_QUERY_PARSER_FEATURE_DEFAULT,
+                                                  &error);
       if (error != NULL)
         {
           g_propagate_error (error_out, error);
@@ -1033,9 +4279,12 @@ xb_database_manager_query (XbDatabaseManager *self,
         }
       else
         {
-          parsed_query = xapian_query_new_for_pair (XAPIAN_QUERY_OP_FILTER,
-                                                    parsed_query,
-                                                    filter_query);
+          combined = xapian_query_new_for_pair (XAPIAN_QUERY_OP_FILTER,
+                                                parsed_query,
+                                                filter_query);
+          g_object_unref (parsed_query);
+          g_object_unref (filter_query);
+          parsed_query = combined;
         }
     }
   else if (parsed_query == NULL)
@@ -1046,19 +4295,21 @@ xb_database_manager_query (XbDatabaseManager *self,
   filterout_str = g_hash_table_lookup (query_options, QUERY_PARAM_FILTER_OUT);
   if (filterout_str != NULL)
     {
-      filterout_query = xapian_query_parser_parse_query_full (payload->qp,
-                                                              filterout_str,
-                                                              XAPIAN_QUERY_PARSER_FEATURE_DEFAULT,
-                                                              "", &error);
+      filterout_query = database_handle_parse_query (handle, query_parser, filterout_str,
+                                                     XAPIAN_QUERY_PARSER_FEATURE_DEFAULT,
+                                                     &error);
       if (error != NULL)
         {
           g_propagate_error (error_out, error);
           goto out;
         }
 
-      parsed_query = xapian_query_new_for_pair (XAPIAN_QUERY_OP_AND_NOT,
-                                                parsed_query,
-                                                filterout_query);
+      combined = xapian_query_new_for_pair (XAPIAN_QUERY_OP_AND_NOT,
+                                            parsed_query,
+                                            filterout_query);
+      g_object_unref (parsed_query);
+      g_object_unref (filterout_query);
+      parsed_query = combined;
     }
 
   str = g_hash_table_lookup (query_options, QUERY_PARAM_COLLAPSE_KEY);
@@ -1084,21 +4335,37 @@ xb_database_manager_query (XbDatabaseManager *self,
         xapian_enquire_set_cutoff (enquire, (guint) g_ascii_strtod (str, NULL));
     }
 
-  results = xb_database_manager_fetch_results (self, enquire, parsed_query,
-                                               query_str, query_options, &error);
+  add_elapsed (&timings->parse, &since);
 
-  if (error != NULL)
-    {
-      g_propagate_error (error_out, error);
-      goto out;
-    }
+  res = xb_database_manager_fetch_results (self, enquire, parsed_query,
+                                           query_str, query_options, sink,
+                                           deadline, timings, error_out);
 
  out:
   g_clear_object (&parsed_query);
   g_clear_object (&enquire);
   g_free (query_str);
 
-  return results;
+  return res;
+}
+
+static JsonObject *
+xb_database_manager_query_object (XbDatabaseManager *self,
+                                  DatabaseHandle *handle,
+                                  GHashTable *query_options,
+                                  GError **error_out)
+{
+  JsonResultsSink sink;
+
+  json_results_sink_init (&sink);
+
+  if (!xb_database_manager_query (self, handle, query_options, 0, &sink.sink, NULL,
+                                  error_out))
+    g_clear_pointer (&sink.object, json_object_unref);
+
+  json_results_sink_clear (&sink);
+
+  return sink.object;
 }
 
 JsonObject *
@@ -1117,7 +4384,7 @@ xb_database_manager_fix_query (XbDatabaseManager *self,
       return FALSE;
     }
 
-  return xb_database_manager_fix_query_internal (self, payload, query, error_out);
+  return xb_database_manager_fix_query_internal (self, payload->handle, query, error_out);
 }
 
 /* If a database exists, queries it with the following options:
@@ -1128,7 +4395,11 @@ xb_database_manager_fix_query (XbDatabaseManager *self,
  *   - order: if sortBy is specified, either "desc" or "asc" (resp. "descending"
  *            and "ascending"
  *   - q: querystring that's parseable by a XapianQueryParser
+ *   - rawResults: if present, documents whose data is a JSON object or array
+ *     are embedded in the results as is, rather than as strings
  *   - sortBy: field to sort the results on
+ *   - timeLimit: milliseconds after which only the results found so far are
+ *     returned, if less than the default-time-limit property
  *   - defaultOp: default operator to use when parsing q ("and", "or", "near",
  *     "phrase", "elite-set" or "synonym"; if not specified the default is
  *     "or")
@@ -1149,7 +4420,630 @@ xb_database_manager_query_db (XbDatabaseManager *self,
       return FALSE;
     }
 
-  return xb_database_manager_query (self, payload, query, error_out);
+  return xb_database_manager_query_object (self, payload->handle, query, error_out);
+}
+
+typedef enum {
+  QUERY_JOB_QUERY,
+  QUERY_JOB_FIX,
+  QUERY_JOB_STREAM
+} QueryJobKind;
+
+typedef struct {
+  QueryJobKind kind;
+  DatabasePayload *payload;
+  GHashTable *query;
+  /* NULL if the result is not to be cached */
+  gchar *cache_key;
+  /* Only for QUERY_JOB_STREAM */
+  ResultsStream *stream;
+  /* The encoding asked for, then the one of the result */
+  XbEncoding encoding;
+  /* The cached result, if only the encoded one is missing */
+  GBytes *plain;
+  /* When the job was queued, then how long it took */
+  gint64 queued;
+  /* When the query must be done by, see xb_database_manager_query() */
+  gint64 deadline;
+  XbQueryTimings timings;
+} QueryJob;
+
+static void
+query_job_free (QueryJob *job)
+{
+  g_clear_pointer (&job->payload, database_payload_unref);
+  g_hash_table_unref (job->query);
+  g_free (job->cache_key);
+  g_clear_pointer (&job->stream, results_stream_unref);
+  g_clear_pointer (&job->plain, g_bytes_unref);
+
+  g_slice_free (QueryJob, job);
+}
+
+static GBytes *
+serialize_json_object (JsonObject *object)
+{
+  JsonGenerator *generator;
+  JsonNode *node;
+  gchar *data;
+  gsize len;
+
+  generator = json_generator_new ();
+  node = json_node_new (JSON_NODE_OBJECT);
+
+  json_node_set_object (node, object);
+  json_generator_set_root (generator, node);
+
+  data = json_generator_to_data (generator, &len);
+
+  g_object_unref (generator);
+  json_node_free (node);
+
+  return g_bytes_new_take (data, len);
+}
+
+/* The result of a query depends on the database, its contents, and the query
+ * parameters other than the database paths and timing, which only changes
+ * the headers; the key lists them sorted. Partial results are never cached,
+ * so the time limit is left out too.
+ */
+static gchar *
+make_result_cache_key (QueryJobKind kind,
+                       DatabasePayload *payload,
+                       GHashTable *query)
+{
+  GString *key;
+  GList *names, *l;
+
+  key = g_string_new (payload->path);
+  g_string_append_printf (key, "\n%" G_GUINT64_FORMAT "\n%d",
+                          payload->generation, kind);
+
+  names = g_list_sort (g_hash_table_get_keys (query), (GCompareFunc) g_strcmp0);
+  for (l = names; l != NULL; l = l->next)
+    {
+      const gchar *name = l->data;
+
+      if (g_str_equal (name, "path") || g_str_equal (name, "manifest_path") ||
+          g_str_equal (name, "timing") || g_str_equal (name, QUERY_PARAM_TIME_LIMIT))
+        continue;
+
+      g_string_append_c (key, '\n');
+      g_string_append_uri_escaped (key, name, NULL, FALSE);
+      g_string_append_c (key, '=');
+      g_string_append_uri_escaped (key, g_hash_table_lookup (query, name), NULL, FALSE);
+    }
+
+  g_list_free (names);
+
+  return g_string_free (key, FALSE);
+}
+
+/* Returns the encoding a result of @size bytes is sent in, when @encoding
+ * is asked for.
+ */
+static XbEncoding
+xb_database_manager_choose_encoding (XbDatabaseManager *self,
+                                     XbEncoding encoding,
+                                     gsize size)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  if (priv->compression_level == 0 || size < priv->compression_min_size)
+    return XB_ENCODING_IDENTITY;
+
+  return encoding;
+}
+
+static GBytes *
+xb_database_manager_encode_result (XbDatabaseManager *self,
+                                   GBytes *bytes,
+                                   XbEncoding encoding)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  GZlibCompressor *compressor;
+  GOutputStream *memory, *stream;
+  gconstpointer data;
+  gsize len;
+  GBytes *encoded = NULL;
+  GError *error = NULL;
+
+  compressor = g_zlib_compressor_new (encoding == XB_ENCODING_GZIP ?
+                                      G_ZLIB_COMPRESSOR_FORMAT_GZIP :
+                                      G_ZLIB_COMPRESSOR_FORMAT_ZLIB,
+                                      priv->compression_level);
+  memory = g_memory_output_stream_new_resizable ();
+  stream = g_converter_output_stream_new (memory, G_CONVERTER (compressor));
+
+  data = g_bytes_get_data (bytes, &len);
+  if (g_output_stream_write_all (stream, data, len, NULL, NULL, &error) &&
+      g_output_stream_close (stream, NULL, &error))
+    {
+      encoded = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (memory));
+    }
+  else
+    {
+      /* Non-fatal */
+      g_warning ("Unable to compress result: %s", error->message);
+      g_error_free (error);
+    }
+
+  g_object_unref (stream);
+  g_object_unref (memory);
+  g_object_unref (compressor);
+
+  return encoded;
+}
+
+/* Returns a new reference to the cached result for @key, in the encoding
+ * set in @encoding_out, or NULL. If the result is cached but not in the
+ * encoding asked for, it is returned in @plain_out instead, to be encoded
+ * without querying again.
+ */
+static GBytes *
+xb_database_manager_lookup_result (XbDatabaseManager *self,
+                                   const gchar *key,
+                                   XbEncoding encoding,
+                                   XbEncoding *encoding_out,
+                                   GBytes **plain_out)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  CachedResult *result;
+  GBytes *bytes = NULL;
+
+  g_mutex_lock (&priv->results_lock);
+
+  result = g_hash_table_lookup (priv->results, key);
+  if (result != NULL)
+    {
+      g_queue_unlink (&priv->results_lru, result->link);
+      g_queue_push_head_link (&priv->results_lru, result->link);
+      priv->cache_hits++;
+
+      encoding = xb_database_manager_choose_encoding (self, encoding,
+                                                      g_bytes_get_size (result->bytes[XB_ENCODING_IDENTITY]));
+      if (result->bytes[encoding] != NULL)
+        {
+          bytes = g_bytes_ref (result->bytes[encoding]);
+          *encoding_out = encoding;
+        }
+      else
+        {
+          *plain_out = g_bytes_ref (result->bytes[XB_ENCODING_IDENTITY]);
+        }
+    }
+  else
+    {
+      priv->cache_misses++;
+    }
+
+  g_mutex_unlock (&priv->results_lock);
+
+  return bytes;
+}
+
+/* Caches the plain result for @key, and the @encoded one if not NULL */
+static void
+xb_database_manager_store_result (XbDatabaseManager *self,
+                                  const gchar *path,
+                                  const gchar *key,
+                                  GBytes *plain,
+                                  XbEncoding encoding,
+                                  GBytes *encoded)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  CachedResult *result;
+  gsize size;
+
+  g_mutex_lock (&priv->results_lock);
+
+  /* Another worker may have answered the same query meanwhile, or this one
+   * only encoded a cached result.
+   */
+  result = g_hash_table_lookup (priv->results, key);
+  if (result == NULL)
+    {
+      size = sizeof (CachedResult) + g_bytes_get_size (plain) + 2 * strlen (key);
+      if (size > priv->max_cache_size)
+        goto out;
+
+      result = g_slice_new0 (CachedResult);
+      result->key = g_strdup (key);
+      result->path = g_strdup (path);
+      result->bytes[XB_ENCODING_IDENTITY] = g_bytes_ref (plain);
+      result->size = size;
+
+      g_queue_push_head (&priv->results_lru, result);
+      result->link = priv->results_lru.head;
+      g_hash_table_insert (priv->results, result->key, result);
+      priv->results_size += size;
+    }
+
+  if (encoded != NULL && result->bytes[encoding] == NULL)
+    {
+      result->bytes[encoding] = g_bytes_ref (encoded);
+      result->size += g_bytes_get_size (encoded);
+      priv->results_size += g_bytes_get_size (encoded);
+    }
+
+  xb_database_manager_trim_results (self);
+
+ out:
+  g_mutex_unlock (&priv->results_lock);
+}
+
+/* Runs a query job on one of the worker threads, against the thread's own
+ * handle on the database.
+ */
+static void
+xb_database_manager_run_job (gpointer data,
+                             gpointer user_data)
+{
+  GTask *task = data;
+  XbDatabaseManager *self = user_data;
+  QueryJob *job = g_task_get_task_data (task);
+  DatabaseHandle *handle = NULL;
+  JsonObject *result = NULL;
+  TextResultsSink sink;
+  GBytes *bytes = NULL, *encoded = NULL;
+  XbEncoding encoding;
+  GError *error = NULL;
+  gint64 since;
+  WorkerState *state = worker_state_get (self);
+
+  g_mutex_lock (&state->lock);
+  worker_state_sweep (state);
+
+  /* A cached result only has to be encoded */
+  if (job->plain != NULL)
+    bytes = g_bytes_ref (job->plain);
+  else
+    handle = database_payload_get_worker_handle (job->payload, self, &error);
+
+  /* Including the time this thread took to open its own handle */
+  since = job->queued;
+  add_elapsed (&job->timings.wait, &since);
+
+  if (handle != NULL)
+    {
+      switch (job->kind)
+        {
+        case QUERY_JOB_QUERY:
+          /* Written as text right away, without building a JsonObject */
+          text_results_sink_init (&sink, NULL);
+          if (xb_database_manager_query (self, handle, job->query, job->deadline,
+                                         &sink.sink, &job->timings, &error))
+            bytes = text_results_sink_steal_bytes (&sink);
+          text_results_sink_clear (&sink);
+          break;
+        case QUERY_JOB_FIX:
+          result = xb_database_manager_fix_query_internal (self, handle, job->query, &error);
+          add_elapsed (&job->timings.parse, &since);
+          break;
+        case QUERY_JOB_STREAM:
+          text_results_sink_init (&sink, job->stream);
+          xb_database_manager_query (self, handle, job->query, job->deadline,
+                                     &sink.sink, &job->timings, &error);
+          text_results_sink_clear (&sink);
+
+          /* Even if the last chunk was the one dropped */
+          if (results_stream_timed_out (job->stream))
+            {
+              g_clear_error (&error);
+              g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                                   "The client stopped reading the results");
+            }
+          break;
+        }
+    }
+
+  if (error != NULL)
+    {
+      g_task_return_error (task, error);
+    }
+  else if (job->kind == QUERY_JOB_STREAM)
+    {
+      /* Delivered after the last chunk, which was handed over first */
+      g_task_return_boolean (task, TRUE);
+    }
+  else
+    {
+      if (bytes == NULL)
+        {
+          bytes = serialize_json_object (result);
+          add_elapsed (&job->timings.serialize, &since);
+        }
+
+      encoding = xb_database_manager_choose_encoding (self, job->encoding,
+                                                      g_bytes_get_size (bytes));
+      if (encoding != XB_ENCODING_IDENTITY)
+        {
+          since = g_get_monotonic_time ();
+          encoded = xb_database_manager_encode_result (self, bytes, encoding);
+          add_elapsed (&job->timings.encode, &since);
+        }
+
+      if (job->cache_key != NULL && !job->timings.partial)
+        xb_database_manager_store_result (self, job->payload->path,
+                                          job->cache_key, bytes, encoding, encoded);
+
+      if (encoded != NULL)
+        {
+          g_bytes_unref (bytes);
+          bytes = encoded;
+        }
+      else
+        {
+          job->encoding = XB_ENCODING_IDENTITY;
+        }
+
+      g_task_return_pointer (task, bytes, (GDestroyNotify) g_bytes_unref);
+    }
+
+  if (result != NULL)
+    json_object_unref (result);
+
+  g_object_unref (task);
+
+  /* Including the handle just used, if the database was closed meanwhile */
+  worker_state_sweep (state);
+  g_mutex_unlock (&state->lock);
+}
+
+/* Hands the job over to the workers, unless its result is cached. Takes
+ * ownership of @task and @payload.
+ */
+static void
+xb_database_manager_start_job (XbDatabaseManager *self,
+                               GTask *task,
+                               DatabasePayload *payload)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+  QueryJob *job = g_task_get_task_data (task);
+  GBytes *bytes;
+
+  job->payload = payload;
+
+  /* Answers repeated queries without waking up a worker; streamed results
+   * are never complete in memory, so they are not cached.
+   */
+  if (priv->max_cache_size > 0 && job->kind != QUERY_JOB_STREAM)
+    {
+      job->cache_key = make_result_cache_key (job->kind, payload, job->query);
+      bytes = xb_database_manager_lookup_result (self, job->cache_key, job->encoding,
+                                                 &job->encoding, &job->plain);
+      job->timings.cached = bytes != NULL || job->plain != NULL;
+      if (bytes != NULL)
+        {
+          g_task_return_pointer (task, bytes, (GDestroyNotify) g_bytes_unref);
+          g_object_unref (task);
+          return;
+        }
+    }
+
+  if (priv->workers == NULL)
+    priv->workers = g_thread_pool_new (xb_database_manager_run_job, self,
+                                       xb_database_manager_get_n_threads (self),
+                                       TRUE, NULL);
+
+  g_thread_pool_push (priv->workers, task, NULL);
+}
+
+static void
+on_job_db_ready (GObject *source,
+                 GAsyncResult *result,
+                 gpointer user_data)
+{
+  XbDatabaseManager *self = XB_DATABASE_MANAGER (source);
+  GTask *task = user_data;
+  DatabasePayload *payload;
+  GError *error = NULL;
+
+  payload = xb_database_manager_ensure_db_finish (self, result, &error);
+  if (payload == NULL)
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  xb_database_manager_start_job (self, task, payload);
+}
+
+/* Takes ownership of @stream, if any. @deadline is as in
+ * xb_database_manager_query().
+ */
+static void
+xb_database_manager_queue_job (XbDatabaseManager *self,
+                               QueryJobKind kind,
+                               XbDatabase db,
+                               GHashTable *query,
+                               XbEncoding encoding,
+                               ResultsStream *stream,
+                               gint64 deadline,
+                               GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data)
+{
+  DatabasePayload *payload;
+  QueryJob *job;
+  GTask *task;
+  GHashTableIter iter;
+  const gchar *key, *value;
+  char *path;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+
+  job = g_slice_new0 (QueryJob);
+  job->kind = kind;
+  job->encoding = encoding;
+  job->stream = stream;
+  job->queued = g_get_monotonic_time ();
+  job->deadline = deadline;
+
+  /* The caller's query table does not outlive the request handler */
+  job->query = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_hash_table_iter_init (&iter, query);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &key, (gpointer *) &value))
+    g_hash_table_insert (job->query, g_strdup (key), g_strdup (value));
+
+  g_task_set_task_data (task, job, (GDestroyNotify) query_job_free);
+
+  /* Looking up the database touches the cache, so it happens on the main
+   * thread; only opening it and running the query are deferred to threads.
+   */
+  path = xb_database_path (db);
+  payload = xb_database_manager_lookup_db (self, path);
+  g_free (path);
+
+  if (payload != NULL)
+    xb_database_manager_start_job (self, task, database_payload_ref (payload));
+  else
+    xb_database_manager_ensure_db_async (self, db, on_job_db_ready, task);
+}
+
+/* Asynchronous version of xb_database_manager_query_db(), running the query
+ * on a worker thread. The result is the serialized JSON object.
+ */
+void
+xb_database_manager_query_db_async (XbDatabaseManager *self,
+                                    XbDatabase db,
+                                    GHashTable *query,
+                                    GCancellable *cancellable,
+                                    GAsyncReadyCallback callback,
+                                    gpointer user_data)
+{
+  xb_database_manager_query_db_encoded_async (self, db, query, XB_ENCODING_IDENTITY,
+                                              cancellable, callback, user_data);
+}
+
+/* Like xb_database_manager_query_db_async(), but the query only sends the
+ * results found by @deadline, a monotonic time, even if its time limit
+ * would allow more. Finish it with xb_database_manager_query_db_finish().
+ */
+void
+xb_database_manager_query_db_until_async (XbDatabaseManager *self,
+                                          XbDatabase db,
+                                          GHashTable *query,
+                                          gint64 deadline,
+                                          GCancellable *cancellable,
+                                          GAsyncReadyCallback callback,
+                                          gpointer user_data)
+{
+  xb_database_manager_queue_job (self, QUERY_JOB_QUERY, db, query, XB_ENCODING_IDENTITY,
+                                 NULL, deadline, cancellable, callback, user_data);
+}
+
+GBytes *
+xb_database_manager_query_db_finish (XbDatabaseManager *self,
+                                     GAsyncResult *result,
+                                     GError **error_out)
+{
+  return xb_database_manager_query_db_encoded_finish (self, result, NULL, error_out);
+}
+
+/* Like xb_database_manager_query_db_async(), but the serialized JSON object
+ * is compressed in @encoding, unless it is smaller than the
+ * compression-min-size property. Both forms are cached.
+ */
+void
+xb_database_manager_query_db_encoded_async (XbDatabaseManager *self,
+                                            XbDatabase db,
+                                            GHashTable *query,
+                                            XbEncoding encoding,
+                                            GCancellable *cancellable,
+                                            GAsyncReadyCallback callback,
+                                            gpointer user_data)
+{
+  xb_database_manager_queue_job (self, QUERY_JOB_QUERY, db, query, encoding, NULL, 0,
+                                 cancellable, callback, user_data);
+}
+
+/* Returns the result, in the encoding set in @encoding_out */
+GBytes *
+xb_database_manager_query_db_encoded_finish (XbDatabaseManager *self,
+                                             GAsyncResult *result,
+                                             XbEncoding *encoding_out,
+                                             GError **error_out)
+{
+  QueryJob *job = g_task_get_task_data (G_TASK (result));
+
+  if (encoding_out != NULL)
+    *encoding_out = job->encoding;
+
+  return g_task_propagate_pointer (G_TASK (result), error_out);
+}
+
+/* Asynchronous version of xb_database_manager_fix_query(), running on a
+ * worker thread. The result is the serialized JSON object.
+ */
+void
+xb_database_manager_fix_query_async (XbDatabaseManager *self,
+                                     XbDatabase db,
+                                     GHashTable *query,
+                                     GCancellable *cancellable,
+                                     GAsyncReadyCallback callback,
+                                     gpointer user_data)
+{
+  xb_database_manager_queue_job (self, QUERY_JOB_FIX, db, query, XB_ENCODING_IDENTITY, NULL,
+                                 0, cancellable, callback, user_data);
+}
+
+GBytes *
+xb_database_manager_fix_query_finish (XbDatabaseManager *self,
+                                      GAsyncResult *result,
+                                      GError **error_out)
+{
+  return g_task_propagate_pointer (G_TASK (result), error_out);
+}
+
+/* Like xb_database_manager_query_db_async(), but hands the serialized JSON
+ * object over to @chunk_func as the documents are fetched, rather than all
+ * at once. Chunks are given in order on the thread-default main context of
+ * the caller, and must stay referenced until they are sent: the worker
+ * waits when too much of them is pending, and fails with
+ * %G_IO_ERROR_TIMED_OUT once none was freed for the stream-write-timeout
+ * property. The query fails without calling @chunk_func if it is invalid;
+ * once chunks were given, it only fails if @cancellable is cancelled or on
+ * that timeout.
+ */
+void
+xb_database_manager_stream_query_db_async (XbDatabaseManager *self,
+                                           XbDatabase db,
+                                           GHashTable *query,
+                                           XbDatabaseManagerChunkFunc chunk_func,
+                                           gpointer chunk_data,
+                                           GCancellable *cancellable,
+                                           GAsyncReadyCallback callback,
+                                           gpointer user_data)
+{
+  XbDatabaseManagerPrivate *priv = xb_database_manager_get_instance_private (self);
+
+  xb_database_manager_queue_job (self, QUERY_JOB_STREAM, db, query, XB_ENCODING_IDENTITY,
+                                 results_stream_new (chunk_func, chunk_data, cancellable,
+                                                     priv->stream_write_timeout),
+                                 0, cancellable, callback, user_data);
+}
+
+gboolean
+xb_database_manager_stream_query_db_finish (XbDatabaseManager *self,
+                                            GAsyncResult *result,
+                                            GError **error_out)
+{
+  return g_task_propagate_boolean (G_TASK (result), error_out);
+}
+
+/* Sets @timings_out to how long each phase of the query of @result took,
+ * for the result of any of the asynchronous queries above.
+ */
+void
+xb_database_manager_get_query_timings (XbDatabaseManager *self,
+                                       GAsyncResult *result,
+                                       XbQueryTimings *timings_out)
+{
+  QueryJob *job = g_task_get_task_data (G_TASK (result));
+
+  *timings_out = job->timings;
 }
 
 XbDatabaseManager *
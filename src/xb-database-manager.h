@@ -17,6 +17,7 @@
 #ifndef __XB_DATABASE_MANAGER_H__
 #define __XB_DATABASE_MANAGER_H__
 
+#include <gio/gio.h>
 #include <glib-object.h>
 #include <json-glib/json-glib.h>
 #include <xapian-glib.h>
@@ -46,8 +47,50 @@ struct _XbDatabaseManager
 typedef struct {
     const char *path;
     const char *manifest_path;
+    /* NULL-terminated list of further databases, paths or manifest paths
+     * like the one above, searched together with it as a single database;
+     * may be NULL
+     */
+    const char * const *federated;
 } XbDatabase;
 
+/* Content codings of serialized results, as in the HTTP Content-Encoding */
+typedef enum {
+    XB_ENCODING_IDENTITY,
+    XB_ENCODING_GZIP,
+    XB_ENCODING_DEFLATE
+} XbEncoding;
+
+/* Time spent in each phase of answering a query, in microseconds of the
+ * monotonic clock; phases a query did not go through are 0.
+ */
+typedef struct {
+    /* Whether the result came from the cache, without running the query */
+    gboolean cached;
+    /* Waiting for the database to open and for a worker thread */
+    gint64 wait;
+    /* Parsing the query string and filters, or fixing the query */
+    gint64 parse;
+    /* Matching, in xapian_enquire_get_mset() */
+    gint64 match;
+    /* Reading the matching documents */
+    gint64 fetch;
+    /* Generating the JSON text, including waiting for the client when it is
+     * streamed
+     */
+    gint64 serialize;
+    /* Compressing the JSON text */
+    gint64 encode;
+    /* Whether the time limit cut the results short */
+    gboolean partial;
+} XbQueryTimings;
+
+/* Receives, on the thread that started the query, the next chunk of a
+ * streamed JSON response; see xb_database_manager_stream_query_db_async()
+ */
+typedef void (*XbDatabaseManagerChunkFunc) (GBytes *chunk,
+                                            gpointer user_data);
+
 GType xb_database_manager_get_type (void) G_GNUC_CONST;
 
 XbDatabaseManager *xb_database_manager_new (void);
@@ -56,6 +99,19 @@ gboolean xb_database_manager_ensure_db (XbDatabaseManager *self,
                                         XbDatabase db,
                                         GError **error_out);
 
+gboolean xb_database_manager_pin_db (XbDatabaseManager *self,
+                                     XbDatabase db,
+                                     GError **error_out);
+
+void xb_database_manager_pin_db_async (XbDatabaseManager *self,
+                                       XbDatabase db,
+                                       GAsyncReadyCallback callback,
+                                       gpointer user_data);
+
+gboolean xb_database_manager_pin_db_finish (XbDatabaseManager *self,
+                                            GAsyncResult *result,
+                                            GError **error_out);
+
 JsonObject *xb_database_manager_query_db (XbDatabaseManager *self,
                                           XbDatabase db,
                                           GHashTable *query,
@@ -66,6 +122,66 @@ JsonObject *xb_database_manager_fix_query (XbDatabaseManager *self,
                                            GHashTable *query,
                                            GError **error_out);
 
+void xb_database_manager_query_db_async (XbDatabaseManager *self,
+                                         XbDatabase db,
+                                         GHashTable *query,
+                                         GCancellable *cancellable,
+                                         GAsyncReadyCallback callback,
+                                         gpointer user_data);
+
+GBytes *xb_database_manager_query_db_finish (XbDatabaseManager *self,
+                                             GAsyncResult *result,
+                                             GError **error_out);
+
+void xb_database_manager_query_db_until_async (XbDatabaseManager *self,
+                                               XbDatabase db,
+                                               GHashTable *query,
+                                               gint64 deadline,
+                                               GCancellable *cancellable,
+                                               GAsyncReadyCallback callback,
+                                               gpointer user_data);
+
+void xb_database_manager_query_db_encoded_async (XbDatabaseManager *self,
+                                                 XbDatabase db,
+                                                 GHashTable *query,
+                                                 XbEncoding encoding,
+                                                 GCancellable *cancellable,
+                                                 GAsyncReadyCallback callback,
+                                                 gpointer user_data);
+
+GBytes *xb_database_manager_query_db_encoded_finish (XbDatabaseManager *self,
+                                                     GAsyncResult *result,
+                                                     XbEncoding *encoding_out,
+                                                     GError **error_out);
+
+void xb_database_manager_fix_query_async (XbDatabaseManager *self,
+                                          XbDatabase db,
+                                          GHashTable *query,
+                                          GCancellable *cancellable,
+                                          GAsyncReadyCallback callback,
+                                          gpointer user_data);
+
+GBytes *xb_database_manager_fix_query_finish (XbDatabaseManager *self,
+                                              GAsyncResult *result,
+                                              GError **error_out);
+
+void xb_database_manager_stream_query_db_async (XbDatabaseManager *self,
+                                                XbDatabase db,
+                                                GHashTable *query,
+                                                XbDatabaseManagerChunkFunc chunk_func,
+                                                gpointer chunk_data,
+                                                GCancellable *cancellable,
+                                                GAsyncReadyCallback callback,
+                                                gpointer user_data);
+
+gboolean xb_database_manager_stream_query_db_finish (XbDatabaseManager *self,
+                                                     GAsyncResult *result,
+                                                     GError **error_out);
+
+void xb_database_manager_get_query_timings (XbDatabaseManager *self,
+                                           GAsyncResult *result,
+                                           XbQueryTimings *timings_out);
+
 G_END_DECLS
 
 #endif /* __XB_DATABASE_MANAGER_H__ */
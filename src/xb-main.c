@@ -18,31 +18,57 @@
 
 #include "xb-database-manager.h"
 #include "xb-error.h"
+#include "xb-metrics.h"
 #include "xb-router.h"
 #include "xb-routed-server.h"
 
+#include <gio/gunixsocketaddress.h>
 #include <glib-unix.h>
+#include <glib/gstdio.h>
 #include <json-glib/json-glib.h>
 #include <libsoup/soup.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define DEFAULT_PORT 3004
 #define MIME_JSON "application/json; charset=utf-8"
+#define MIME_METRICS "text/plain; version=0.0.4; charset=utf-8"
 #define SYSTEMD_LISTEN_FD 3
+#define MAX_BATCH_REQUESTS 100
 
 /* JSON array of supported features (for /test). */
 #define XB_FEATURE_JSON_ARRAY "["\
+    "\"batch\","\
+    "\"federated-query\","\
+    "\"metrics\","\
     "\"query-param-defaultOp\","\
     "\"query-param-filter\","\
-    "\"query-param-flags\""\
+    "\"query-param-flags\","\
+    "\"query-param-rawResults\","\
+    "\"query-param-stream\","\
+    "\"query-param-timeLimit\","\
+    "\"query-param-timing\""\
     "]"
 
 typedef struct {
   XbRoutedServer *server;
   XbDatabaseManager *manager;
+  XbMetrics *metrics;
   GMainLoop *loop;
+  gchar *socket_path;
   guint sigterm_id;
+  /* Databases still being pre-warmed, plus one until all were started */
+  guint n_prewarming;
+  gboolean ready;
+  /* Whether every query response has a Server-Timing header */
+  gboolean server_timing;
 } XapianBridge;
 
 /* Sets up a SoupMessage to respond */
@@ -92,125 +118,1317 @@ server_send_response (SoupMessage *message,
     }
 }
 
+/* Returns every value of the @name parameter in the query string of the
+ * request, NULL-terminated; the query table only holds the last one.
+ */
+static gchar **
+get_query_values (SoupMessage *message,
+                  const gchar *name)
+{
+  SoupURI *uri = soup_message_get_uri (message);
+  GPtrArray *values;
+  gchar **pairs, *pair, *separator, *pair_name;
+  gboolean matches;
+  gint idx;
+
+  values = g_ptr_array_new ();
+
+  pairs = g_strsplit (uri->query != NULL ? uri->query : "", "&", -1);
+  for (idx = 0; pairs[idx] != NULL; idx++)
+    {
+      pair = pairs[idx];
+      g_strdelimit (pair, "+", ' ');
+
+      separator = strchr (pair, '=');
+      if (separator == NULL)
+        continue;
+
+      *separator = '\0';
+      pair_name = soup_uri_decode (pair);
+      matches = (g_strcmp0 (pair_name, name) == 0);
+      g_free (pair_name);
+
+      if (matches)
+        g_ptr_array_add (values, soup_uri_decode (separator + 1));
+    }
+  g_strfreev (pairs);
+
+  g_ptr_array_add (values, NULL);
+
+  return (gchar **) g_ptr_array_free (values, FALSE);
+}
+
+/* Several path or manifest_path parameters make a federated database,
+ * searched as one; @members_out then holds the paths, to be freed once @db
+ * is no longer used. As for a single database, manifests take precedence.
+ */
 static gboolean
 fill_xbdb_from_query (SoupMessage *message,
                       GHashTable  *query,
-                      XbDatabase  *db)
+                      XbDatabase  *db,
+                      gchar     ***members_out)
+{
+  gchar **members;
+
+  db->path = g_hash_table_lookup (query, "path");
+  db->manifest_path = g_hash_table_lookup (query, "manifest_path");
+  db->federated = NULL;
+  *members_out = NULL;
+
+  if (db->path == NULL && db->manifest_path == NULL)
+    {
+      server_send_response (message, SOUP_STATUS_BAD_REQUEST, NULL, NULL);
+      return FALSE;
+    }
+
+  members = get_query_values (message, db->manifest_path != NULL ? "manifest_path" : "path");
+  if (g_strv_length (members) < 2)
+    {
+      g_strfreev (members);
+      return TRUE;
+    }
+
+  if (db->manifest_path != NULL)
+    db->manifest_path = members[0];
+  else
+    db->path = members[0];
+  db->federated = (const char * const *) members + 1;
+  *members_out = members;
+
+  return TRUE;
+}
+
+/* Picks the encoding of the response among those the client accepts, in
+ * its order of preference.
+ */
+static XbEncoding
+negotiate_encoding (SoupMessage *message)
+{
+  const gchar *header;
+  GSList *codings, *l;
+  XbEncoding encoding = XB_ENCODING_IDENTITY;
+
+  header = soup_message_headers_get_list (message->request_headers, "Accept-Encoding");
+  if (header == NULL)
+    return XB_ENCODING_IDENTITY;
+
+  codings = soup_header_parse_quality_list (header, NULL);
+  for (l = codings; l != NULL; l = l->next)
+    {
+      if (g_ascii_strcasecmp (l->data, "gzip") == 0 ||
+          g_ascii_strcasecmp (l->data, "x-gzip") == 0)
+        {
+          encoding = XB_ENCODING_GZIP;
+          break;
+        }
+
+      if (g_ascii_strcasecmp (l->data, "deflate") == 0)
+        {
+          encoding = XB_ENCODING_DEFLATE;
+          break;
+        }
+    }
+
+  soup_header_free_list (codings);
+
+  return encoding;
+}
+
+/* Sets up a SoupMessage to respond with an already serialized JSON body,
+ * encoded in @encoding
+ */
+static void
+server_send_json_bytes (SoupMessage *message,
+                        SoupStatus status_code,
+                        GBytes *body,
+                        XbEncoding encoding)
+{
+  SoupBuffer *buffer;
+  gconstpointer data;
+  gsize len;
+
+  soup_message_set_status (message, status_code);
+
+  data = g_bytes_get_data (body, &len);
+  buffer = soup_buffer_new_with_owner (data, len, g_bytes_ref (body),
+                                       (GDestroyNotify) g_bytes_unref);
+
+  if (encoding == XB_ENCODING_GZIP)
+    soup_message_headers_replace (message->response_headers,
+                                  "Content-Encoding", "gzip");
+  else if (encoding == XB_ENCODING_DEFLATE)
+    soup_message_headers_replace (message->response_headers,
+                                  "Content-Encoding", "deflate");
+
+  soup_message_headers_replace (message->response_headers,
+                                "Content-Type", MIME_JSON);
+  soup_message_body_append_buffer (message->response_body, buffer);
+  soup_buffer_free (buffer);
+}
+
+static SoupStatus
+status_for_error (GError *error)
+{
+  if (g_error_matches (error, XB_ERROR, XB_ERROR_DATABASE_NOT_FOUND))
+    return SOUP_STATUS_NOT_FOUND;
+  else if (g_error_matches (error, XB_ERROR, XB_ERROR_INVALID_PARAMS))
+    return SOUP_STATUS_BAD_REQUEST;
+  else
+    return SOUP_STATUS_INTERNAL_SERVER_ERROR;
+}
+
+static void
+server_send_error (SoupMessage *message,
+                   GError *error)
+{
+  server_send_response (message, status_for_error (error), NULL, NULL);
+}
+
+static GQuark
+request_start_quark (void)
+{
+  return g_quark_from_static_string ("xb-request-start");
+}
+
+/* Phases of a query, as named in the Server-Timing header and metrics */
+static const struct {
+  const gchar *name;
+  glong offset;
+} query_phases[] = {
+  { "wait", G_STRUCT_OFFSET (XbQueryTimings, wait) },
+  { "parse", G_STRUCT_OFFSET (XbQueryTimings, parse) },
+  { "match", G_STRUCT_OFFSET (XbQueryTimings, match) },
+  { "fetch", G_STRUCT_OFFSET (XbQueryTimings, fetch) },
+  { "serialize", G_STRUCT_OFFSET (XbQueryTimings, serialize) },
+  { "encode", G_STRUCT_OFFSET (XbQueryTimings, encode) },
+};
+
+static void
+append_server_timing (GString *value,
+                      const gchar *name,
+                      gint64 duration)
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  if (value->len > 0)
+    g_string_append (value, ", ");
+
+  g_string_append_printf (value, "%s;dur=%s", name,
+                          g_ascii_formatd (buf, sizeof (buf), "%.3f", duration / 1000.0));
+}
+
+/* Records the time spent in each phase of the query of @result, and in
+ * setting up its response for @respond microseconds, in the metrics. With
+ * @header, they are also sent in a Server-Timing header, in milliseconds,
+ * along with the total time spent on the request so far.
+ */
+static void
+server_report_query_timings (XapianBridge *xb,
+                             SoupMessage *message,
+                             GAsyncResult *result,
+                             gint64 respond,
+                             gboolean header)
+{
+  XbQueryTimings timings;
+  GString *value;
+  gint64 duration, *start_time;
+  guint idx;
+
+  xb_database_manager_get_query_timings (xb->manager, result, &timings);
+
+  value = g_string_new (NULL);
+  if (timings.cached)
+    g_string_append (value, "cache;desc=\"hit\"");
+
+  for (idx = 0; idx < G_N_ELEMENTS (query_phases); idx++)
+    {
+      duration = G_STRUCT_MEMBER (gint64, &timings, query_phases[idx].offset);
+      if (duration == 0)
+        continue;
+
+      xb_metrics_observe_phase (xb->metrics, query_phases[idx].name, duration);
+      append_server_timing (value, query_phases[idx].name, duration);
+    }
+
+  if (respond > 0)
+    {
+      xb_metrics_observe_phase (xb->metrics, "respond", respond);
+      append_server_timing (value, "respond", respond);
+    }
+
+  start_time = g_object_get_qdata (G_OBJECT (message), request_start_quark ());
+  if (start_time != NULL)
+    append_server_timing (value, "total", g_get_monotonic_time () - *start_time);
+
+  if (header)
+    soup_message_headers_replace (message->response_headers,
+                                  "Server-Timing", value->str);
+
+  g_string_free (value, TRUE);
+}
+
+/* A request paused while its query runs on a worker thread */
+typedef struct {
+  XapianBridge *xb;
+  SoupMessage *message;
+  /* Whether to send a Server-Timing header */
+  gboolean timing;
+} PendingRequest;
+
+static PendingRequest *
+pending_request_new (XapianBridge *xb,
+                     SoupMessage *message,
+                     GHashTable *query)
+{
+  PendingRequest *request;
+
+  request = g_slice_new0 (PendingRequest);
+  request->xb = xb;
+  request->message = g_object_ref (message);
+  request->timing = xb->server_timing || g_hash_table_contains (query, "timing");
+
+  soup_server_pause_message (SOUP_SERVER (xb->server), message);
+
+  return request;
+}
+
+static void
+pending_request_finish (PendingRequest *request)
+{
+  soup_server_unpause_message (SOUP_SERVER (request->xb->server), request->message);
+
+  g_object_unref (request->message);
+  g_slice_free (PendingRequest, request);
+}
+
+static void
+query_ready_callback (GObject *source,
+                      GAsyncResult *result,
+                      gpointer user_data)
+{
+  PendingRequest *request = user_data;
+  GBytes *body;
+  XbEncoding encoding;
+  GError *error = NULL;
+  gint64 start;
+
+  body = xb_database_manager_query_db_encoded_finish (XB_DATABASE_MANAGER (source),
+                                                      result, &encoding, &error);
+
+  if (body != NULL)
+    {
+      start = g_get_monotonic_time ();
+      soup_message_headers_append (request->message->response_headers,
+                                   "Vary", "Accept-Encoding");
+      server_send_json_bytes (request->message, SOUP_STATUS_OK, body, encoding);
+      g_bytes_unref (body);
+      server_report_query_timings (request->xb, request->message, result,
+                                   g_get_monotonic_time () - start, request->timing);
+    }
+  else
+    {
+      server_send_error (request->message, error);
+      g_critical ("Unable to query database: %s", error->message);
+      g_clear_error (&error);
+    }
+
+  pending_request_finish (request);
+}
+
+/* A request whose results are sent with chunked encoding as the documents
+ * are fetched, paused whenever the worker is behind.
+ */
+typedef struct {
+  XapianBridge *xb;
+  SoupMessage *message;
+  GCancellable *cancellable;
+  gulong finished_id;
+  /* Whether the status and headers were set, with the first chunk */
+  gboolean started;
+  /* Whether the client went away */
+  gboolean finished;
+} StreamingRequest;
+
+static void
+streaming_request_message_finished (SoupMessage *message,
+                                    gpointer user_data)
+{
+  StreamingRequest *request = user_data;
+
+  request->finished = TRUE;
+  g_cancellable_cancel (request->cancellable);
+}
+
+static StreamingRequest *
+streaming_request_new (XapianBridge *xb,
+                       SoupMessage *message)
+{
+  StreamingRequest *request;
+
+  request = g_slice_new0 (StreamingRequest);
+  request->xb = xb;
+  request->message = g_object_ref (message);
+  request->cancellable = g_cancellable_new ();
+  request->finished_id = g_signal_connect (message, "finished",
+                                           G_CALLBACK (streaming_request_message_finished),
+                                           request);
+
+  soup_server_pause_message (SOUP_SERVER (xb->server), message);
+
+  return request;
+}
+
+static void
+streaming_request_finish (StreamingRequest *request)
+{
+  if (!request->finished)
+    soup_server_unpause_message (SOUP_SERVER (request->xb->server), request->message);
+
+  g_signal_handler_disconnect (request->message, request->finished_id);
+  g_object_unref (request->message);
+  g_object_unref (request->cancellable);
+  g_slice_free (StreamingRequest, request);
+}
+
+static void
+query_chunk_callback (GBytes *chunk,
+                      gpointer user_data)
+{
+  StreamingRequest *request = user_data;
+  SoupMessage *message = request->message;
+  SoupBuffer *buffer;
+  gconstpointer data;
+  gsize len;
+
+  if (request->finished)
+    return;
+
+  if (!request->started)
+    {
+      soup_message_set_status (message, SOUP_STATUS_OK);
+      soup_message_headers_set_encoding (message->response_headers,
+                                         SOUP_ENCODING_CHUNKED);
+      soup_message_headers_replace (message->response_headers,
+                                    "Content-Type", MIME_JSON);
+      /* Frees every chunk once written, which lets the worker go on */
+      soup_message_body_set_accumulate (message->response_body, FALSE);
+      request->started = TRUE;
+    }
+
+  data = g_bytes_get_data (chunk, &len);
+  buffer = soup_buffer_new_with_owner (data, len, g_bytes_ref (chunk),
+                                       (GDestroyNotify) g_bytes_unref);
+  soup_message_body_append_buffer (message->response_body, buffer);
+  soup_buffer_free (buffer);
+
+  soup_server_unpause_message (SOUP_SERVER (request->xb->server), message);
+}
+
+static void
+query_streamed_callback (GObject *source,
+                         GAsyncResult *result,
+                         gpointer user_data)
+{
+  StreamingRequest *request = user_data;
+  GError *error = NULL;
+  gboolean timed_out = FALSE;
+
+  /* The headers went out with the first chunk, so only the metrics get the
+   * timings
+   */
+  if (xb_database_manager_stream_query_db_finish (XB_DATABASE_MANAGER (source),
+                                                  result, &error))
+    {
+      server_report_query_timings (request->xb, request->message, result, 0, FALSE);
+    }
+  else
+    {
+      /* Too late to change the status once the results started */
+      if (!request->started && !request->finished)
+        server_send_error (request->message, error);
+
+      /* The response is left unterminated, so the client can tell it was
+       * cut short if it ever reads it
+       */
+      timed_out = g_error_matches (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+      if (timed_out)
+        g_warning ("Gave up streaming results: %s", error->message);
+      else if (!request->finished)
+        g_critical ("Unable to query database: %s", error->message);
+      g_clear_error (&error);
+    }
+
+  if (request->started && !request->finished && !timed_out)
+    soup_message_body_complete (request->message->response_body);
+
+  streaming_request_finish (request);
+}
+
+/* GET /query - query an index; with the "stream" parameter, the results are
+ * sent as they are fetched, with chunked encoding. Several path or
+ * manifest_path parameters query the databases together, ranked as one.
+ * With the "timing" parameter, or XB_SERVER_TIMING set, the time spent in
+ * each phase of the query is sent in a Server-Timing header, unless the
+ * results are streamed. Once the milliseconds given in "timeLimit", or
+ * XB_TIME_LIMIT_MS, run out, the results found so far are sent, with a
+ * "partial" member set to true. The time limit counts from when a worker
+ * starts the query, leaving out opening the database and waiting for a
+ * worker. Xapian cannot stop matching once started, so a time limited
+ * query ranks at most 1000 results, and does not expand wildcards or
+ * partial words under 3 characters.
+ * Returns:
+ *     200 - Query was successful
+ *     400 - One of the required parameters wasn't specified (e.g. limit)
+ *     404 - No database was found at index_name
+ */
+static void
+server_get_query_callback (GHashTable *params,
+                           GHashTable *query,
+                           SoupMessage *message,
+                           gpointer user_data)
+{
+  XapianBridge *xb = user_data;
+  StreamingRequest *request;
+  XbDatabase db;
+  gchar **members;
+
+  if (!fill_xbdb_from_query (message, query, &db, &members))
+    return;
+
+  if (g_hash_table_contains (query, "stream"))
+    {
+      request = streaming_request_new (xb, message);
+      xb_database_manager_stream_query_db_async (xb->manager, db, query,
+                                                 query_chunk_callback, request,
+                                                 request->cancellable,
+                                                 query_streamed_callback, request);
+    }
+  else
+    {
+      /* Unlike streamed results, these are compressed if the client accepts it */
+      xb_database_manager_query_db_encoded_async (xb->manager, db, query,
+                                                  negotiate_encoding (message), NULL,
+                                                  query_ready_callback,
+                                                  pending_request_new (xb, message, query));
+    }
+
+  g_strfreev (members);
+}
+
+static void
+fix_ready_callback (GObject *source,
+                    GAsyncResult *result,
+                    gpointer user_data)
+{
+  PendingRequest *request = user_data;
+  GBytes *body;
+  GError *error = NULL;
+  gint64 start;
+
+  body = xb_database_manager_fix_query_finish (XB_DATABASE_MANAGER (source),
+                                               result, &error);
+
+  if (body != NULL)
+    {
+      start = g_get_monotonic_time ();
+      server_send_json_bytes (request->message, SOUP_STATUS_OK, body,
+                              XB_ENCODING_IDENTITY);
+      g_bytes_unref (body);
+      server_report_query_timings (request->xb, request->message, result,
+                                   g_get_monotonic_time () - start, request->timing);
+    }
+  else
+    {
+      server_send_error (request->message, error);
+      g_critical ("Unable to fix user query: %s", error->message);
+      g_clear_error (&error);
+    }
+
+  pending_request_finish (request);
+}
+
+/* GET /fix - fix a user query; the "timing" parameter works as for GET /query
+ * Returns:
+ *     200 - Query was successfully fixed (though no changes may have occurred)
+ *     400 - One of the required parameters wasn't specified
+ *     404 - No database was found at index_name
+ */
+static void
+server_get_fix_callback (GHashTable *params,
+                         GHashTable *query,
+                         SoupMessage *message,
+                         gpointer user_data)
+{
+  XapianBridge *xb = user_data;
+  XbDatabase db;
+  gchar **members;
+
+  if (!fill_xbdb_from_query (message, query, &db, &members))
+    return;
+
+  xb_database_manager_fix_query_async (xb->manager, db, query, NULL,
+                                       fix_ready_callback,
+                                       pending_request_new (xb, message, query));
+  g_strfreev (members);
+}
+
+/* A POST /batch request, answered once all its sub-requests are */
+typedef struct {
+  XapianBridge *xb;
+  SoupMessage *message;
+  /* Serialized JSON result of each sub-request, in order */
+  GBytes **results;
+  guint n_requests;
+  guint n_pending;
+  /* Monotonic time all the queries must be done by, or 0 */
+  gint64 deadline;
+} BatchRequest;
+
+typedef struct {
+  BatchRequest *batch;
+  guint index;
+  gboolean fix;
+} BatchItem;
+
+static GBytes *
+serialize_batch_error (SoupStatus status,
+                       const gchar *message)
+{
+  JsonObject *object, *error;
+  JsonNode *node;
+  JsonGenerator *generator;
+  gchar *data;
+  gsize len;
+
+  error = json_object_new ();
+  json_object_set_int_member (error, "status", status);
+  json_object_set_string_member (error, "message", message);
+
+  object = json_object_new ();
+  json_object_set_object_member (object, "error", error);
+
+  node = json_node_new (JSON_NODE_OBJECT);
+  json_node_take_object (node, object);
+
+  generator = json_generator_new ();
+  json_generator_set_root (generator, node);
+  data = json_generator_to_data (generator, &len);
+
+  g_object_unref (generator);
+  json_node_free (node);
+
+  return g_bytes_new_take (data, len);
+}
+
+static void
+batch_request_send (BatchRequest *batch)
+{
+  GString *body;
+  GBytes *bytes;
+  guint idx;
+
+  body = g_string_new ("{\"results\":[");
+  for (idx = 0; idx < batch->n_requests; idx++)
+    {
+      if (idx > 0)
+        g_string_append_c (body, ',');
+
+      g_string_append_len (body,
+                           g_bytes_get_data (batch->results[idx], NULL),
+                           g_bytes_get_size (batch->results[idx]));
+      g_bytes_unref (batch->results[idx]);
+    }
+  g_string_append (body, "]}");
+
+  bytes = g_string_free_to_bytes (body);
+  server_send_json_bytes (batch->message, SOUP_STATUS_OK, bytes,
+                          XB_ENCODING_IDENTITY);
+  g_bytes_unref (bytes);
+
+  soup_server_unpause_message (SOUP_SERVER (batch->xb->server), batch->message);
+
+  g_object_unref (batch->message);
+  g_free (batch->results);
+  g_slice_free (BatchRequest, batch);
+}
+
+/* Stores the result of the sub-request, and answers the batch once it
+ * was the last one pending.
+ */
+static void
+batch_item_complete (BatchItem *item,
+                     GBytes *result)
+{
+  BatchRequest *batch = item->batch;
+
+  batch->results[item->index] = result;
+  g_slice_free (BatchItem, item);
+
+  if (--batch->n_pending == 0)
+    batch_request_send (batch);
+}
+
+static void
+batch_item_ready_callback (GObject *source,
+                           GAsyncResult *result,
+                           gpointer user_data)
+{
+  BatchItem *item = user_data;
+  GBytes *body;
+  GError *error = NULL;
+
+  if (item->fix)
+    body = xb_database_manager_fix_query_finish (XB_DATABASE_MANAGER (source),
+                                                 result, &error);
+  else
+    body = xb_database_manager_query_db_finish (XB_DATABASE_MANAGER (source),
+                                                result, &error);
+
+  if (body == NULL)
+    {
+      body = serialize_batch_error (status_for_error (error), error->message);
+      g_clear_error (&error);
+    }
+
+  batch_item_complete (item, body);
+}
+
+/* Converts the "params" member of a sub-request to a query table like the
+ * one of GET requests. Returns NULL if a parameter is not a scalar.
+ */
+static GHashTable *
+batch_item_query (JsonObject *params)
+{
+  GHashTable *query;
+  GList *members, *l;
+  JsonNode *node;
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+  gchar *value;
+
+  query = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  members = json_object_get_members (params);
+  for (l = members; l != NULL; l = l->next)
+    {
+      node = json_object_get_member (params, l->data);
+      if (!JSON_NODE_HOLDS_VALUE (node))
+        break;
+
+      switch (json_node_get_value_type (node))
+        {
+        case G_TYPE_STRING:
+          value = g_strdup (json_node_get_string (node));
+          break;
+        case G_TYPE_INT64:
+          value = g_strdup_printf ("%" G_GINT64_FORMAT, json_node_get_int (node));
+          break;
+        case G_TYPE_DOUBLE:
+          value = g_strdup (g_ascii_dtostr (buf, sizeof (buf), json_node_get_double (node)));
+          break;
+        case G_TYPE_BOOLEAN:
+          value = g_strdup (json_node_get_boolean (node) ? "true" : "false");
+          break;
+        default:
+          value = NULL;
+          break;
+        }
+
+      if (value == NULL)
+        break;
+
+      g_hash_table_insert (query, g_strdup (l->data), value);
+    }
+
+  if (l != NULL)
+    g_clear_pointer (&query, g_hash_table_unref);
+
+  g_list_free (members);
+
+  return query;
+}
+
+/* Starts one sub-request of @batch, or completes it right away when it is
+ * invalid.
+ */
+static void
+batch_item_start (BatchRequest *batch,
+                  guint index,
+                  JsonNode *node)
+{
+  BatchItem *item;
+  JsonObject *object;
+  JsonNode *member;
+  GHashTable *query = NULL;
+  const gchar *type = "query";
+  XbDatabase db;
+
+  item = g_slice_new0 (BatchItem);
+  item->batch = batch;
+  item->index = index;
+
+  if (JSON_NODE_HOLDS_OBJECT (node))
+    {
+      object = json_node_get_object (node);
+
+      member = json_object_get_member (object, "type");
+      if (member != NULL)
+        type = JSON_NODE_HOLDS_VALUE (member) ? json_node_get_string (member) : NULL;
+
+      member = json_object_get_member (object, "params");
+      if (member != NULL && JSON_NODE_HOLDS_OBJECT (member))
+        query = batch_item_query (json_node_get_object (member));
+    }
+
+  if (query != NULL)
+    {
+      db.path = g_hash_table_lookup (query, "path");
+      db.manifest_path = g_hash_table_lookup (query, "manifest_path");
+      db.federated = NULL;
+    }
+
+  if (query == NULL || (db.path == NULL && db.manifest_path == NULL) ||
+      (g_strcmp0 (type, "query") != 0 && g_strcmp0 (type, "fix") != 0))
+    {
+      batch_item_complete (item, serialize_batch_error (SOUP_STATUS_BAD_REQUEST,
+                                                        "Invalid request"));
+      g_clear_pointer (&query, g_hash_table_unref);
+      return;
+    }
+
+  /* Each sub-request is a job of its own, so they run in parallel on the
+   * worker threads of the database manager.
+   */
+  item->fix = (g_strcmp0 (type, "fix") == 0);
+  if (item->fix)
+    xb_database_manager_fix_query_async (batch->xb->manager, db, query, NULL,
+                                         batch_item_ready_callback, item);
+  else
+    xb_database_manager_query_db_until_async (batch->xb->manager, db, query,
+                                              batch->deadline, NULL,
+                                              batch_item_ready_callback, item);
+
+  g_hash_table_unref (query);
+}
+
+static GQuark
+batch_parser_quark (void)
+{
+  return g_quark_from_static_string ("xb-batch-parser");
+}
+
+/* Returns the array of sub-requests in the body of a /batch request, or
+ * NULL if it is not one. The body is parsed once, for both the admission
+ * control and the handler.
+ */
+static JsonArray *
+batch_request_parse (SoupMessage *message)
+{
+  JsonParser *parser;
+  JsonNode *root;
+
+  parser = g_object_get_qdata (G_OBJECT (message), batch_parser_quark ());
+  if (parser == NULL)
+    {
+      parser = json_parser_new ();
+      if (message->request_body->length == 0 ||
+          !json_parser_load_from_data (parser, message->request_body->data,
+                                       message->request_body->length, NULL))
+        {
+          g_object_unref (parser);
+          return NULL;
+        }
+
+      g_object_set_qdata_full (G_OBJECT (message), batch_parser_quark (),
+                               parser, g_object_unref);
+    }
+
+  root = json_parser_get_root (parser);
+  if (root == NULL || !JSON_NODE_HOLDS_ARRAY (root))
+    return NULL;
+
+  return json_node_get_array (root);
+}
+
+/* A /batch request counts as one request per sub-request it starts */
+static guint
+batch_request_weight (SoupMessage *message,
+                      gpointer user_data)
+{
+  JsonArray *array = batch_request_parse (message);
+
+  if (array == NULL)
+    return 1;
+
+  return CLAMP (json_array_get_length (array), 1, MAX_BATCH_REQUESTS);
+}
+
+/* POST /batch - run several queries or query fixes at once
+ * The body is a JSON array of {"type": "query" or "fix", "params": {...}}
+ * objects, where params are those of GET /query or GET /fix. The response
+ * is {"results": [...]} with the result of each, in order, or
+ * {"error": {"status": ..., "message": ...}} for those that failed. The
+ * queries share one XB_TIME_LIMIT_MS, counted from when the batch starts:
+ * each only gets what the ones before left, and those that start after it
+ * ran out send empty partial results.
+ * Returns:
+ *     200 - All requests ran, though some of them may have failed
+ *     400 - The body is not a JSON array, or has too many requests
+ */
+static void
+server_post_batch_callback (GHashTable *params,
+                            GHashTable *query,
+                            SoupMessage *message,
+                            gpointer user_data)
+{
+  XapianBridge *xb = user_data;
+  BatchRequest *batch;
+  JsonArray *array;
+  guint idx, time_limit;
+
+  array = batch_request_parse (message);
+  if (array == NULL || json_array_get_length (array) > MAX_BATCH_REQUESTS)
+    {
+      server_send_response (message, SOUP_STATUS_BAD_REQUEST, NULL, NULL);
+      return;
+    }
+
+  batch = g_slice_new0 (BatchRequest);
+  batch->xb = xb;
+  batch->message = g_object_ref (message);
+  batch->n_requests = json_array_get_length (array);
+  batch->results = g_new0 (GBytes *, batch->n_requests);
+
+  g_object_get (xb->manager, "default-time-limit", &time_limit, NULL);
+  if (time_limit > 0)
+    batch->deadline = g_get_monotonic_time () + (gint64) time_limit * 1000;
+
+  soup_server_pause_message (SOUP_SERVER (xb->server), message);
+
+  /* Hold one more, so that sub-requests completing right away don't send
+   * the response before all of them started.
+   */
+  batch->n_pending = batch->n_requests + 1;
+  for (idx = 0; idx < batch->n_requests; idx++)
+    batch_item_start (batch, idx, json_array_get_element (array, idx));
+
+  if (--batch->n_pending == 0)
+    batch_request_send (batch);
+}
+
+/* GET /test - get a list of supported features
+ * Returns:
+ *     200 - List of features supported by this instance of xapian-bridge
+ *
+ * Note: xapian-bridge versions predating the addition of /test return 500
+ * (default response to an unknown URL) so you typically want to handle 500
+ * the same way as if you'd received 200 with an empty list.
+ */
+static void
+server_get_test_callback (GHashTable *params,
+                          GHashTable *query,
+                          SoupMessage *message,
+                          gpointer user_data)
+{
+  XapianBridge *xb = user_data;
+
+  soup_message_set_response (message, MIME_JSON, SOUP_MEMORY_STATIC,
+                             XB_FEATURE_JSON_ARRAY,
+                             strlen (XB_FEATURE_JSON_ARRAY));
+  server_send_response (message, SOUP_STATUS_OK, NULL, NULL);
+}
+
+/* GET /metrics - get request and database statistics, in the Prometheus
+ * text exposition format. With XB_WORKER_PROCESSES, each worker process
+ * only reports its own, told apart by xapian_bridge_worker_pid.
+ * Returns:
+ *     200 - Always
+ */
+static void
+server_get_metrics_callback (GHashTable *params,
+                             GHashTable *query,
+                             SoupMessage *message,
+                             gpointer user_data)
+{
+  XapianBridge *xb = user_data;
+  guint open_databases, in_flight, queued;
+  guint64 opened, evicted, hits, misses, shed;
+  GBytes *body;
+  gsize len;
+
+  g_object_get (xb->manager,
+                "open-databases", &open_databases,
+                "databases-opened", &opened,
+                "databases-evicted", &evicted,
+                "cache-hits", &hits,
+                "cache-misses", &misses,
+                NULL);
+  g_object_get (xb->server,
+                "in-flight", &in_flight,
+                "queued", &queued,
+                "shed-requests", &shed,
+                NULL);
+
+  xb_metrics_set_value (xb->metrics, "xapian_bridge_open_databases", XB_METRIC_GAUGE,
+                        "Databases currently open", open_databases);
+  xb_metrics_set_value (xb->metrics, "xapian_bridge_database_opens_total", XB_METRIC_COUNTER,
+                        "Databases opened, including reopened ones", opened);
+  xb_metrics_set_value (xb->metrics, "xapian_bridge_database_evictions_total", XB_METRIC_COUNTER,
+                        "Databases closed to stay within the limits, or when idle", evicted);
+  xb_metrics_set_value (xb->metrics, "xapian_bridge_cache_hits_total", XB_METRIC_COUNTER,
+                        "Queries answered from the result cache", hits);
+  xb_metrics_set_value (xb->metrics, "xapian_bridge_cache_misses_total", XB_METRIC_COUNTER,
+                        "Queries not found in the result cache", misses);
+  xb_metrics_set_value (xb->metrics, "xapian_bridge_cache_hit_ratio", XB_METRIC_GAUGE,
+                        "Share of queries answered from the result cache",
+                        hits + misses > 0 ? (gdouble) hits / (hits + misses) : 0);
+  xb_metrics_set_value (xb->metrics, "xapian_bridge_admitted_requests_in_flight", XB_METRIC_GAUGE,
+                        "Query, fix and batch requests admitted and not answered yet", in_flight);
+  xb_metrics_set_value (xb->metrics, "xapian_bridge_requests_queued", XB_METRIC_GAUGE,
+                        "Query, fix and batch requests waiting to be handled", queued);
+  xb_metrics_set_value (xb->metrics, "xapian_bridge_requests_shed_total", XB_METRIC_COUNTER,
+                        "Query, fix and batch requests turned away with 503", shed);
+  xb_metrics_set_value (xb->metrics, "xapian_bridge_worker_pid", XB_METRIC_GAUGE,
+                        "Process the other metrics come from", getpid ());
+
+  body = xb_metrics_serialize (xb->metrics);
+  soup_message_set_status (message, SOUP_STATUS_OK);
+  soup_message_set_response (message, MIME_METRICS, SOUP_MEMORY_COPY,
+                             g_bytes_get_data (body, &len), len);
+  g_bytes_unref (body);
+}
+
+static void
+server_request_started (SoupServer *server,
+                        SoupMessage *message,
+                        SoupClientContext *client,
+                        gpointer user_data)
+{
+  XapianBridge *xb = user_data;
+  gint64 *start_time;
+
+  start_time = g_new (gint64, 1);
+  *start_time = g_get_monotonic_time ();
+  g_object_set_qdata_full (G_OBJECT (message), request_start_quark (),
+                           start_time, g_free);
+
+  xb_metrics_request_started (xb->metrics);
+}
+
+/* Handles both finished and aborted requests. The router only sees the
+ * synchronous part of the handlers, so requests are timed here, until the
+ * response is sent.
+ */
+static void
+server_request_finished (SoupServer *server,
+                         SoupMessage *message,
+                         SoupClientContext *client,
+                         gpointer user_data)
+{
+  XapianBridge *xb = user_data;
+  gint64 *start_time;
+  SoupURI *uri;
+
+  start_time = g_object_get_qdata (G_OBJECT (message), request_start_quark ());
+  if (start_time == NULL)
+    return;
+
+  uri = soup_message_get_uri (message);
+  xb_metrics_request_finished (xb->metrics, uri != NULL ? uri->path : NULL,
+                               message->status_code,
+                               g_get_monotonic_time () - *start_time);
+
+  g_object_set_qdata (G_OBJECT (message), request_start_quark (), NULL);
+}
+
+/* Applies the database manager settings given in the environment, if any:
+ *   - XB_MAX_DATABASES: maximum number of open databases
+ *   - XB_MAX_OPEN_FILES: maximum number of open database files
+ *   - XB_MAX_MEMORY: memory budget for open databases, in bytes
+ *   - XB_IDLE_TIMEOUT: seconds after which an unused database is closed
+ *   - XB_WORKER_THREADS: number of threads running queries
+ *   - XB_CACHE_SIZE: memory budget for cached query results, in bytes
+ *   - XB_MONITOR_QUIET_MS: milliseconds without changes on disk before a
+ *     changed database is refreshed
+ *   - XB_COMPRESS_MIN_SIZE: smallest query response compressed for clients
+ *     accepting gzip or deflate, in bytes
+ *   - XB_COMPRESS_LEVEL: zlib compression level of the responses, from 1 to 9
+ *   - XB_STREAM_TIMEOUT_MS: milliseconds a streamed query waits for a client
+ *     that reads nothing before giving up on it
+ *   - XB_TIME_LIMIT_MS: milliseconds a query, or all those of a batch, may
+ *     take before the results found so far are sent, marked as partial
+ * A value of 0 disables the corresponding limit, or for XB_WORKER_THREADS
+ * uses one thread per processor, or for XB_CACHE_SIZE disables the cache,
+ * or for XB_COMPRESS_LEVEL disables compression.
+ */
+static void
+configure_database_manager (XbDatabaseManager *manager)
+{
+  static const struct {
+    const gchar *variable;
+    const gchar *property;
+  } uint_settings[] = {
+    { "XB_MAX_DATABASES", "max-databases" },
+    { "XB_MAX_OPEN_FILES", "max-open-files" },
+    { "XB_IDLE_TIMEOUT", "idle-timeout" },
+    { "XB_WORKER_THREADS", "n-workers" },
+    { "XB_MONITOR_QUIET_MS", "monitor-quiet-period" },
+    { "XB_COMPRESS_MIN_SIZE", "compression-min-size" },
+    { "XB_COMPRESS_LEVEL", "compression-level" },
+    { "XB_STREAM_TIMEOUT_MS", "stream-write-timeout" },
+    { "XB_TIME_LIMIT_MS", "default-time-limit" },
+  };
+  const gchar *value;
+  gint idx;
+
+  for (idx = 0; idx < G_N_ELEMENTS (uint_settings); idx++)
+    {
+      value = g_getenv (uint_settings[idx].variable);
+      if (value != NULL)
+        g_object_set (manager,
+                      uint_settings[idx].property,
+                      (guint) g_ascii_strtod (value, NULL),
+                      NULL);
+    }
+
+  value = g_getenv ("XB_MAX_MEMORY");
+  if (value != NULL)
+    g_object_set (manager,
+                  "max-memory", g_ascii_strtoull (value, NULL, 10),
+                  NULL);
+
+  value = g_getenv ("XB_CACHE_SIZE");
+  if (value != NULL)
+    g_object_set (manager,
+                  "max-cache-size", g_ascii_strtoull (value, NULL, 10),
+                  NULL);
+}
+
+/* Applies the admission control settings given in the environment, if any:
+ *   - XB_MAX_IN_FLIGHT: maximum number of /query, /fix and /batch requests
+ *     handled at once, where a /batch request counts as one per query or
+ *     fix it holds; further ones wait in a queue
+ *   - XB_MAX_QUEUED: maximum number of queued requests
+ *   - XB_QUEUE_TARGET_MS: milliseconds the oldest queued request may wait
+ *     before new requests are turned away; queued requests that waited
+ *     longer are turned away too rather than handled
+ * Requests that don't fit are answered with 503 and Retry-After. A value of
+ * 0 disables the corresponding limit; without XB_MAX_IN_FLIGHT, nothing is
+ * queued.
+ */
+static void
+configure_admission (XbRoutedServer *server)
 {
-  db->path = g_hash_table_lookup (query, "path");
-  db->manifest_path = g_hash_table_lookup (query, "manifest_path");
+  static const struct {
+    const gchar *variable;
+    const gchar *property;
+  } uint_settings[] = {
+    { "XB_MAX_IN_FLIGHT", "max-in-flight" },
+    { "XB_MAX_QUEUED", "max-queued" },
+    { "XB_QUEUE_TARGET_MS", "queue-target-delay" },
+  };
+  const gchar *value;
+  gint idx;
 
-  if (db->path == NULL && db->manifest_path == NULL)
+  for (idx = 0; idx < G_N_ELEMENTS (uint_settings); idx++)
     {
-      server_send_response (message, SOUP_STATUS_BAD_REQUEST, NULL, NULL);
-      return FALSE;
+      value = g_getenv (uint_settings[idx].variable);
+      if (value != NULL)
+        g_object_set (server,
+                      uint_settings[idx].property,
+                      (guint) g_ascii_strtod (value, NULL),
+                      NULL);
     }
 
-  return TRUE;
+  xb_routed_server_limit (server, "/query");
+  xb_routed_server_limit (server, "/fix");
+  xb_routed_server_limit_weighted (server, "/batch", batch_request_weight, NULL);
 }
 
-/* GET /query - query an index
+/* GET /ready - check whether the daemon finished starting up
  * Returns:
- *     200 - Query was successful
- *     400 - One of the required parameters wasn't specified (e.g. limit)
- *     404 - No database was found at index_name
+ *     200 - All configured databases were pre-warmed
+ *     503 - The daemon is still pre-warming databases
  */
 static void
-server_get_query_callback (GHashTable *params,
+server_get_ready_callback (GHashTable *params,
                            GHashTable *query,
                            SoupMessage *message,
                            gpointer user_data)
 {
   XapianBridge *xb = user_data;
-  JsonObject *result;
+
+  if (xb->ready)
+    server_send_response (message, SOUP_STATUS_OK, NULL, NULL);
+  else
+    server_send_response (message, SOUP_STATUS_SERVICE_UNAVAILABLE, NULL, NULL);
+}
+
+/* Tells systemd that startup finished, when running as a Type=notify service.
+ * See http://www.freedesktop.org/software/systemd/man/sd_notify.html
+ */
+static void
+notify_systemd_ready (void)
+{
+  const gchar *socket_path;
+  GSocketAddress *address;
+  GSocket *socket;
   GError *error = NULL;
-  XbDatabase db;
 
-  if (!fill_xbdb_from_query (message, query, &db))
+  socket_path = g_getenv ("NOTIFY_SOCKET");
+  if (socket_path == NULL)
     return;
 
-  result = xb_database_manager_query_db (xb->manager, db, query, &error);
+  /* A leading '@' denotes a socket in the abstract namespace */
+  if (socket_path[0] == '@')
+    address = g_unix_socket_address_new_with_type (socket_path + 1, -1,
+                                                   G_UNIX_SOCKET_ADDRESS_ABSTRACT);
+  else
+    address = g_unix_socket_address_new (socket_path);
+
+  socket = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_DATAGRAM,
+                         G_SOCKET_PROTOCOL_DEFAULT, &error);
+  if (socket != NULL)
+    g_socket_send_to (socket, address, "READY=1", strlen ("READY=1"),
+                      NULL, &error);
 
-  if (result != NULL)
+  if (error != NULL)
     {
-      server_send_response (message, SOUP_STATUS_OK, NULL, result);
-      json_object_unref (result);
+      g_warning ("Unable to notify systemd: %s", error->message);
+      g_error_free (error);
     }
-  else
-    {
-      if (g_error_matches (error, XB_ERROR, XB_ERROR_DATABASE_NOT_FOUND))
-        server_send_response (message, SOUP_STATUS_NOT_FOUND, NULL, NULL);
-      else if (g_error_matches (error, XB_ERROR, XB_ERROR_INVALID_PARAMS))
-        server_send_response (message, SOUP_STATUS_BAD_REQUEST, NULL, NULL);
-      else
-        server_send_response (message, SOUP_STATUS_INTERNAL_SERVER_ERROR, NULL, NULL);
 
-      g_critical ("Unable to query database: %s", error->message);
-      g_clear_error (&error);
-    }
+  g_clear_object (&socket);
+  g_object_unref (address);
 }
 
-/* GET /fix - fix a user query
- * Returns:
- *     200 - Query was successfully fixed (though no changes may have occurred)
- *     400 - One of the required parameters wasn't specified
- *     404 - No database was found at index_name
- */
+/* Becomes ready once the last database is pre-warmed */
 static void
-server_get_fix_callback (GHashTable *params,
-                         GHashTable *query,
-                         SoupMessage *message,
-                         gpointer user_data)
+xapian_bridge_prewarm_done (XapianBridge *xb)
 {
-  XapianBridge *xb = user_data;
-  JsonObject *result;
-  GError *error = NULL;
-  XbDatabase db;
-
-  if (!fill_xbdb_from_query (message, query, &db))
+  if (--xb->n_prewarming > 0)
     return;
 
-  result = xb_database_manager_fix_query (xb->manager, db, query, &error);
+  xb->ready = TRUE;
+  notify_systemd_ready ();
+}
+
+typedef struct {
+  XapianBridge *xb;
+  gchar *name;
+  gint64 start_time;
+} PrewarmRequest;
+
+static void
+on_database_prewarmed (GObject *source,
+                       GAsyncResult *result,
+                       gpointer user_data)
+{
+  PrewarmRequest *request = user_data;
+  GError *error = NULL;
 
-  if (result != NULL)
+  if (xb_database_manager_pin_db_finish (XB_DATABASE_MANAGER (source), result, &error))
     {
-      server_send_response (message, SOUP_STATUS_OK, NULL, result);
-      json_object_unref (result);
+      g_info ("Pre-warmed %s in %.3f ms", request->name,
+              (g_get_monotonic_time () - request->start_time) / 1000.0);
     }
   else
     {
-      if (g_error_matches (error, XB_ERROR, XB_ERROR_DATABASE_NOT_FOUND))
-        server_send_response (message, SOUP_STATUS_NOT_FOUND, NULL, NULL);
-      else if (g_error_matches (error, XB_ERROR, XB_ERROR_INVALID_PARAMS))
-        server_send_response (message, SOUP_STATUS_BAD_REQUEST, NULL, NULL);
-      else
-        server_send_response (message, SOUP_STATUS_INTERNAL_SERVER_ERROR, NULL, NULL);
-
-      g_critical ("Unable to fix user query: %s", error->message);
-      g_clear_error (&error);
+      /* Non-fatal */
+      g_warning ("Unable to pre-warm database: %s", error->message);
+      g_error_free (error);
     }
+
+  xapian_bridge_prewarm_done (request->xb);
+
+  g_free (request->name);
+  g_slice_free (PrewarmRequest, request);
 }
 
-/* GET /test - get a list of supported features
- * Returns:
- *     200 - List of features supported by this instance of xapian-bridge
- *
- * Note: xapian-bridge versions predating the addition of /test return 500
- * (default response to an unknown URL) so you typically want to handle 500
- * the same way as if you'd received 200 with an empty list.
+static void
+prewarm_database (XapianBridge *xb,
+                  XbDatabase db)
+{
+  PrewarmRequest *request;
+
+  request = g_slice_new0 (PrewarmRequest);
+  request->xb = xb;
+  request->name = g_strdup (db.manifest_path != NULL ? db.manifest_path : db.path);
+  request->start_time = g_get_monotonic_time ();
+
+  xb->n_prewarming++;
+  xb_database_manager_pin_db_async (xb->manager, db, on_database_prewarmed, request);
+}
+
+static void
+prewarm_entry (XapianBridge *xb,
+               const gchar *entry)
+{
+  XbDatabase db = { NULL, };
+
+  if (g_str_has_suffix (entry, ".json"))
+    db.manifest_path = entry;
+  else
+    db.path = entry;
+
+  prewarm_database (xb, db);
+}
+
+/* Opens and pins the databases listed in the environment, so that their
+ * first query does not pay for opening them:
+ *   - XB_PREWARM: list of database paths separated by ':'; entries ending in
+ *     ".json" are read as manifests
+ *   - XB_PREWARM_DIR: directory whose *.json files are all manifests
+ * The databases are opened in threads while the main loop runs; the daemon
+ * is ready once they all are.
  */
 static void
-server_get_test_callback (GHashTable *params,
-                          GHashTable *query,
-                          SoupMessage *message,
-                          gpointer user_data)
+xapian_bridge_prewarm (XapianBridge *xb)
 {
-  XapianBridge *xb = user_data;
+  const gchar *value, *name;
+  gchar **entries, **iter;
+  gchar *manifest_path;
+  GDir *dir;
+  GError *error = NULL;
 
-  soup_message_set_response (message, MIME_JSON, SOUP_MEMORY_STATIC,
-                             XB_FEATURE_JSON_ARRAY,
-                             strlen (XB_FEATURE_JSON_ARRAY));
-  server_send_response (message, SOUP_STATUS_OK, NULL, NULL);
+  xb->n_prewarming = 1;
+
+  value = g_getenv ("XB_PREWARM");
+  if (value != NULL)
+    {
+      entries = g_strsplit (value, G_SEARCHPATH_SEPARATOR_S, -1);
+      for (iter = entries; *iter != NULL; iter++)
+        {
+          if (**iter != '\0')
+            prewarm_entry (xb, *iter);
+        }
+      g_strfreev (entries);
+    }
+
+  value = g_getenv ("XB_PREWARM_DIR");
+  if (value != NULL)
+    {
+      dir = g_dir_open (value, 0, &error);
+      if (dir == NULL)
+        {
+          g_warning ("Unable to read pre-warm directory %s: %s",
+                     value, error->message);
+          g_clear_error (&error);
+        }
+
+      while (dir != NULL && (name = g_dir_read_name (dir)) != NULL)
+        {
+          if (!g_str_has_suffix (name, ".json"))
+            continue;
+
+          manifest_path = g_build_filename (value, name, NULL);
+          prewarm_entry (xb, manifest_path);
+          g_free (manifest_path);
+        }
+
+      g_clear_pointer (&dir, g_dir_close);
+    }
+
+  xapian_bridge_prewarm_done (xb);
 }
 
 static gboolean
@@ -222,95 +1440,496 @@ sigterm_handler (gpointer user_data)
   return FALSE;
 }
 
+/* Removes the socket file at @path if there is one and nothing listens on
+ * it anymore, so that it can be bound again. Any other kind of file, or a
+ * socket still in use by another process, is left alone.
+ */
+static void
+remove_stale_socket (const gchar *path)
+{
+  GStatBuf buf;
+  GSocket *socket;
+  GSocketAddress *address;
+  GError *error = NULL;
+
+  if (g_lstat (path, &buf) != 0 || !S_ISSOCK (buf.st_mode))
+    return;
+
+  socket = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_DEFAULT, NULL);
+  if (socket == NULL)
+    return;
+
+  /* A full backlog would block rather than refuse */
+  g_socket_set_blocking (socket, FALSE);
+
+  address = g_unix_socket_address_new (path);
+  if (!g_socket_connect (socket, address, NULL, &error) &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_REFUSED))
+    g_unlink (path);
+
+  g_clear_error (&error);
+  g_object_unref (address);
+  g_object_unref (socket);
+}
+
+/* Returns a Unix domain socket bound to @path, listening */
+static GSocket *
+open_unix_socket (const gchar *path,
+                  GError **error)
+{
+  GSocket *socket;
+  GSocketAddress *address;
+
+  socket = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_DEFAULT, error);
+  if (socket == NULL)
+    return NULL;
+
+  remove_stale_socket (path);
+
+  address = g_unix_socket_address_new (path);
+  if (!g_socket_bind (socket, address, FALSE, error) ||
+      !g_socket_listen (socket, error))
+    g_clear_object (&socket);
+
+  g_object_unref (address);
+
+  return socket;
+}
+
+/* Makes @server listen on the loopback address of @family, on a socket
+ * with SO_REUSEPORT set so that every worker process can bind its own
+ * socket to @port, and the kernel spreads connections among them.
+ */
+static gboolean
+server_listen_loopback_shared (SoupServer *server,
+                               GSocketFamily family,
+                               guint port,
+                               GError **error)
+{
+  GInetAddress *loopback;
+  GSocketAddress *address;
+  GSocket *socket;
+  gboolean ret = FALSE;
+
+  socket = g_socket_new (family, G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_DEFAULT, error);
+  if (socket == NULL)
+    return FALSE;
+
+  loopback = g_inet_address_new_loopback (family);
+  address = g_inet_socket_address_new (loopback, port);
+
+  if (g_socket_set_option (socket, SOL_SOCKET, SO_REUSEPORT, 1, error) &&
+      g_socket_bind (socket, address, TRUE, error) &&
+      g_socket_listen (socket, error))
+    ret = soup_server_listen_socket (server, socket, 0, error);
+
+  g_object_unref (address);
+  g_object_unref (loopback);
+  g_object_unref (socket);
+
+  return ret;
+}
+
+/* Like soup_server_listen_local(), but sharing the port with the other
+ * worker processes.
+ */
+static gboolean
+server_listen_local_shared (SoupServer *server,
+                            guint port,
+                            GError **error)
+{
+  GError *ipv6_error = NULL;
+
+  if (!server_listen_loopback_shared (server, G_SOCKET_FAMILY_IPV4, port, error))
+    return FALSE;
+
+  /* Not every host has IPv6 */
+  if (!server_listen_loopback_shared (server, G_SOCKET_FAMILY_IPV6, port, &ipv6_error))
+    {
+      g_debug ("Not listening on IPv6: %s", ipv6_error->message);
+      g_error_free (ipv6_error);
+    }
+
+  return TRUE;
+}
+
+/* Makes @server listen where configured:
+ *
+ * If this service is launched by systemd, LISTEN_PID and LISTEN_FDS will
+ * be set by systemd and we should set up the server to use the fds instead
+ * of a port.
+ * Somewhat counterintuitively, LISTEN_FDS does not specify the actual file
+ * descriptor to listen on, but will contain the number of descriptors passed by
+ * systemd this way, starting from number 3 (0, 1 and 2 are respectively stdin,
+ * stdout and stderr). We listen on all of them, so that a service can have
+ * both a TCP and a Unix domain socket.
+ *
+ * See http://www.freedesktop.org/software/systemd/man/sd_listen_fds.html
+ * for further information on how this works.
+ *
+ * Otherwise, XB_SOCKET_PATH selects a Unix domain socket, which saves
+ * clients on the same host the TCP loopback overhead, and XB_PORT a TCP
+ * port on the loopback interface. In multi-process mode, the Unix domain
+ * socket is opened by the supervisor and given in @shared_socket, while
+ * each worker binds its own TCP sockets.
+ *
+ * Returns the path of the Unix domain socket bound here, if any, in
+ * @socket_path_out.
+ */
+static gboolean
+xapian_bridge_listen (SoupServer *server,
+                      GSocket *shared_socket,
+                      gboolean multi_process,
+                      gchar **socket_path_out,
+                      GError **error)
+{
+  const gchar *pid_string, *fd_string;
+  const gchar *port_string, *socket_path;
+  GSocket *socket;
+  guint64 n_fds;
+  guint port;
+  gint idx;
+
+  pid_string = g_getenv ("LISTEN_PID");
+  fd_string = g_getenv ("LISTEN_FDS");
+  if (pid_string != NULL && fd_string != NULL)
+    {
+      n_fds = g_ascii_strtoull (fd_string, NULL, 10);
+      if (n_fds == 0 || n_fds > G_MAXINT - SYSTEMD_LISTEN_FD)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Invalid LISTEN_FDS: %s", fd_string);
+          return FALSE;
+        }
+
+      for (idx = 0; idx < n_fds; idx++)
+        {
+          if (!soup_server_listen_fd (server, SYSTEMD_LISTEN_FD + idx, 0, error))
+            return FALSE;
+        }
+
+      return TRUE;
+    }
+
+  if (shared_socket != NULL)
+    return soup_server_listen_socket (server, shared_socket, 0, error);
+
+  socket_path = g_getenv ("XB_SOCKET_PATH");
+  if (socket_path != NULL)
+    {
+      socket = open_unix_socket (socket_path, error);
+      if (socket == NULL)
+        return FALSE;
+
+      if (!soup_server_listen_socket (server, socket, 0, error))
+        {
+          g_object_unref (socket);
+          return FALSE;
+        }
+
+      g_object_unref (socket);
+      *socket_path_out = g_strdup (socket_path);
+      return TRUE;
+    }
+
+  port_string = g_getenv ("XB_PORT");
+  if (port_string != NULL)
+    port = (guint) g_ascii_strtod (port_string, NULL);
+  else
+    port = DEFAULT_PORT;
+
+  if (multi_process)
+    return server_listen_local_shared (server, port, error);
+
+  return soup_server_listen_local (server, port, 0, error);
+}
+
 static void
 xapian_bridge_free (XapianBridge *xb)
 {
+  if (xb->server != NULL)
+    g_signal_handlers_disconnect_by_data (xb->server, xb);
+
   g_clear_object (&xb->manager);
   g_clear_object (&xb->server);
+  g_clear_object (&xb->metrics);
   g_clear_pointer (&xb->loop, g_main_loop_unref);
 
+  if (xb->socket_path != NULL)
+    {
+      remove_stale_socket (xb->socket_path);
+      g_free (xb->socket_path);
+    }
+
   if (xb->sigterm_id > 0)
     g_source_remove (xb->sigterm_id);
 
   g_slice_free (XapianBridge, xb);
 }
 
+/* Every route also gets its own label in the request metrics */
+static const struct {
+  void (* add) (XbRoutedServer *self,
+                const gchar *path,
+                XbRouterCallback callback,
+                gpointer user_data);
+  const gchar *path;
+  XbRouterCallback callback;
+} routes[] = {
+  { xb_routed_server_get, "/query", server_get_query_callback },
+  { xb_routed_server_get, "/fix", server_get_fix_callback },
+  { xb_routed_server_get, "/test", server_get_test_callback },
+  { xb_routed_server_get, "/ready", server_get_ready_callback },
+  { xb_routed_server_post, "/batch", server_post_batch_callback },
+  { xb_routed_server_get, "/metrics", server_get_metrics_callback },
+};
+
 static XapianBridge *
-xapian_bridge_new (GError **error_out)
+xapian_bridge_new (GSocket *shared_socket,
+                   gboolean multi_process,
+                   GError **error)
 {
   XapianBridge *xb;
   XbRoutedServer *server;
-  const gchar *pid_string, *fd_string;
-  const gchar *port_string;
-  guint port;
-  GError *error = NULL;
+  gchar *socket_path = NULL;
+  gint idx;
 
   server = xb_routed_server_new ();
 
-  /* If this service is launched by systemd, LISTEN_PID and LISTEN_FDS will
-   * be set by systemd and we should set up the server to use the fd instead
-   * of a port.
-   * Somewhat counterintuitively, LISTEN_FDS does not specify the actual file
-   * descriptor to listen on, but will contain the number of descriptors passed by
-   * systemd this way, starting from number 3 (0, 1 and 2 are respectively stdin,
-   * stdout and stderr).
-   * We can safely assume that we only want the first one here though, so we ignore
-   * the actual contents of the variable.
-   *
-   * See http://www.freedesktop.org/software/systemd/man/sd_listen_fds.html
-   * for further information on how this works.
-   */
-  pid_string = g_getenv ("LISTEN_PID");
-  fd_string = g_getenv ("LISTEN_FDS");
-  if (pid_string != NULL && fd_string != NULL)
-    {
-      soup_server_listen_fd (SOUP_SERVER (server), SYSTEMD_LISTEN_FD,
-                             0, &error);
-    }
-  else
-    {
-      port_string = g_getenv ("XB_PORT");
-      if (port_string != NULL)
-        port = (guint) g_ascii_strtod (port_string, NULL);
-      else
-        port = DEFAULT_PORT;
-
-      soup_server_listen_local (SOUP_SERVER (server), port,
-                                0, &error);
-    }
-
-  if (error != NULL)
+  if (!xapian_bridge_listen (SOUP_SERVER (server), shared_socket, multi_process,
+                             &socket_path, error))
     {
-      g_propagate_error (error_out, error);
       g_object_unref (server);
-
       return NULL;
     }
 
   xb = g_slice_new0 (XapianBridge);
   xb->server = server;
+  xb->socket_path = socket_path;
   xb->manager = xb_database_manager_new ();
+  configure_database_manager (xb->manager);
+  xb->server_timing = g_strcmp0 (g_getenv ("XB_SERVER_TIMING"), "1") == 0;
   xb->loop = g_main_loop_new (NULL, FALSE);
   xb->sigterm_id = g_unix_signal_add (SIGTERM, sigterm_handler, xb);
 
-  xb_routed_server_get (server, "/query",
-                        server_get_query_callback, xb);
-  xb_routed_server_get (server, "/fix",
-                        server_get_fix_callback, xb);
-  xb_routed_server_get (server, "/test",
-                        server_get_test_callback, xb);
+  xb->metrics = xb_metrics_new ();
+  for (idx = 0; idx < G_N_ELEMENTS (routes); idx++)
+    {
+      routes[idx].add (server, routes[idx].path, routes[idx].callback, xb);
+      xb_metrics_add_route (xb->metrics, routes[idx].path);
+    }
+  configure_admission (server);
+
+  g_signal_connect (server, "request-started",
+                    G_CALLBACK (server_request_started), xb);
+  g_signal_connect (server, "request-finished",
+                    G_CALLBACK (server_request_finished), xb);
+  g_signal_connect (server, "request-aborted",
+                    G_CALLBACK (server_request_finished), xb);
 
   return xb;
 }
 
+/* Number of worker processes from XB_WORKER_PROCESSES: 1 by default, or
+ * one per processor for 0. Workers share nothing but the listening socket:
+ * each has its own database cache and metrics, and a scrape of /metrics
+ * only covers whichever worker accepted it, as xapian_bridge_worker_pid
+ * tells.
+ */
+static guint
+get_n_worker_processes (void)
+{
+  const gchar *value;
+  guint n_processes;
+
+  value = g_getenv ("XB_WORKER_PROCESSES");
+  if (value == NULL)
+    return 1;
+
+  n_processes = (guint) g_ascii_strtoull (value, NULL, 10);
+  if (n_processes == 0)
+    n_processes = g_get_num_processors ();
+
+  return n_processes;
+}
+
+static volatile sig_atomic_t supervisor_quit = 0;
+
+static void
+supervisor_signal_handler (int signum)
+{
+  supervisor_quit = 1;
+}
+
+/* Forks a worker process. Returns 0 in the worker, as fork() does. */
+static pid_t
+spawn_worker (void)
+{
+  pid_t pid;
+
+  pid = fork ();
+  if (pid == 0)
+    {
+      /* Workers must not outlive the supervisor */
+      prctl (PR_SET_PDEATHSIG, SIGTERM);
+      signal (SIGTERM, SIG_DFL);
+      signal (SIGINT, SIG_DFL);
+    }
+  else if (pid < 0)
+    {
+      g_warning ("Unable to start worker process: %s", g_strerror (errno));
+    }
+
+  return pid;
+}
+
+/* Runs @n_workers worker processes, restarting any that exits, until the
+ * supervisor gets SIGTERM or SIGINT and stops them. Returns TRUE in the
+ * supervisor once all workers are gone, and FALSE in each worker, which
+ * then goes on to serve requests.
+ *
+ * The supervisor only forks and waits, without any GLib main loop: it
+ * must not start threads, since the workers are forked from it without
+ * exec().
+ */
+static gboolean
+run_supervisor (guint n_workers)
+{
+  struct sigaction action = { 0 };
+  pid_t *pids;
+  gint64 *start_times;
+  pid_t pid;
+  gint status;
+  guint idx;
+
+  pids = g_new0 (pid_t, n_workers);
+  start_times = g_new0 (gint64, n_workers);
+
+  /* No SA_RESTART, so that waitpid() returns on signals */
+  action.sa_handler = supervisor_signal_handler;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGTERM, &action, NULL);
+  sigaction (SIGINT, &action, NULL);
+
+  for (idx = 0; idx < n_workers && !supervisor_quit; idx++)
+    {
+      pids[idx] = spawn_worker ();
+      if (pids[idx] == 0)
+        goto worker;
+
+      start_times[idx] = g_get_monotonic_time ();
+    }
+
+  while (!supervisor_quit)
+    {
+      pid = waitpid (-1, &status, 0);
+      if (pid < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          break;
+        }
+
+      for (idx = 0; idx < n_workers; idx++)
+        {
+          if (pids[idx] == pid)
+            break;
+        }
+
+      if (idx == n_workers || supervisor_quit)
+        continue;
+
+      if (WIFSIGNALED (status))
+        g_warning ("Worker process %d killed by signal %d, restarting",
+                   pid, WTERMSIG (status));
+      else
+        g_warning ("Worker process %d exited with status %d, restarting",
+                   pid, WEXITSTATUS (status));
+
+      /* Don't spin if workers fail right away */
+      if (g_get_monotonic_time () - start_times[idx] < G_USEC_PER_SEC)
+        g_usleep (G_USEC_PER_SEC);
+
+      pids[idx] = spawn_worker ();
+      if (pids[idx] == 0)
+        goto worker;
+
+      start_times[idx] = g_get_monotonic_time ();
+    }
+
+  for (idx = 0; idx < n_workers; idx++)
+    {
+      if (pids[idx] > 0)
+        kill (pids[idx], SIGTERM);
+    }
+
+  for (idx = 0; idx < n_workers; idx++)
+    {
+      if (pids[idx] > 0)
+        waitpid (pids[idx], NULL, 0);
+    }
+
+  g_free (start_times);
+  g_free (pids);
+
+  return TRUE;
+
+ worker:
+  g_free (start_times);
+  g_free (pids);
+
+  return FALSE;
+}
+
 int
 main (gint argc,
       char **argv)
 {
   GError *error = NULL;
   XapianBridge *xb;
+  GSocket *shared_socket = NULL;
+  const gchar *socket_path;
+  guint n_processes;
+
+  /* In multi-process mode, each worker process has its own database
+   * manager, and a crashing worker is restarted by the supervisor.
+   */
+  n_processes = get_n_worker_processes ();
+  if (n_processes > 1)
+    {
+      /* Workers inherit the systemd sockets, and share the Unix domain
+       * socket bound here. They bind their own TCP sockets.
+       */
+      socket_path = g_getenv ("XB_SOCKET_PATH");
+      if (g_getenv ("LISTEN_FDS") == NULL && socket_path != NULL)
+        {
+          shared_socket = open_unix_socket (socket_path, &error);
+          if (shared_socket == NULL)
+            {
+              g_critical ("Can't start Xapian bridge server: %s", error->message);
+              g_error_free (error);
+              return EXIT_FAILURE;
+            }
+        }
 
-  xb = xapian_bridge_new (&error);
+      if (run_supervisor (n_processes))
+        {
+          if (shared_socket != NULL)
+            {
+              g_object_unref (shared_socket);
+              remove_stale_socket (socket_path);
+            }
+
+          return EXIT_SUCCESS;
+        }
+    }
+
+  xb = xapian_bridge_new (shared_socket, n_processes > 1, &error);
+  g_clear_object (&shared_socket);
   if (error != NULL)
     {
       g_critical ("Can't start Xapian bridge server: %s", error->message);
@@ -318,6 +1937,9 @@ main (gint argc,
       return EXIT_FAILURE;
     }
 
+  /* Queries are served while pre-warming; /ready answers 503 until then */
+  xapian_bridge_prewarm (xb);
+
   g_main_loop_run (xb->loop);
   xapian_bridge_free (xb);
 
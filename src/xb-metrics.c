@@ -0,0 +1,389 @@
+/* Copyright 2026  Endless Mobile
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include "xb-metrics.h"
+
+#include <string.h>
+
+/* Upper bounds of the request duration buckets, in seconds */
+static const gdouble duration_buckets[] = {
+  0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+#define N_DURATION_BUCKETS G_N_ELEMENTS (duration_buckets)
+/* Statuses past this, and libsoup's transport errors, are counted as 0 */
+#define MAX_STATUS 600
+#define OTHER_ROUTE "other"
+
+typedef struct {
+  /* Observations per bucket, not cumulative; the last one is +Inf */
+  guint64 buckets[N_DURATION_BUCKETS + 1];
+  guint64 count;
+  gdouble sum;
+} Histogram;
+
+/* Counters of the requests to one route */
+typedef struct {
+  gchar *route;
+  Histogram duration;
+  /* Requests per response status */
+  guint64 statuses[MAX_STATUS];
+} RouteMetrics;
+
+/* Time spent in one phase of answering queries */
+typedef struct {
+  gchar *phase;
+  Histogram duration;
+} PhaseMetrics;
+
+/* A value sampled by the caller, such as a counter of another module */
+typedef struct {
+  gchar *name;
+  gchar *help;
+  XbMetricType type;
+  gdouble value;
+} MetricValue;
+
+/* Everything is updated from the main thread, so no locking is needed and
+ * recording a request costs a few increments.
+ */
+typedef struct {
+  /* struct RouteMetrics, in the order the routes were added, then other */
+  GPtrArray *routes;
+  RouteMetrics *other;
+  /* struct PhaseMetrics, in the order they were first observed */
+  GPtrArray *phases;
+  /* struct MetricValue, in the order they were first set */
+  GPtrArray *values;
+  guint in_flight;
+} XbMetricsPrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (XbMetrics, xb_metrics, G_TYPE_OBJECT);
+
+static RouteMetrics *
+route_metrics_new (const gchar *route)
+{
+  RouteMetrics *metrics;
+
+  metrics = g_slice_new0 (RouteMetrics);
+  metrics->route = g_strdup (route);
+
+  return metrics;
+}
+
+static void
+route_metrics_free (RouteMetrics *metrics)
+{
+  g_free (metrics->route);
+
+  g_slice_free (RouteMetrics, metrics);
+}
+
+static void
+phase_metrics_free (PhaseMetrics *metrics)
+{
+  g_free (metrics->phase);
+
+  g_slice_free (PhaseMetrics, metrics);
+}
+
+static void
+histogram_observe (Histogram *histogram,
+                   gint64 duration)
+{
+  gdouble seconds = duration / (gdouble) G_USEC_PER_SEC;
+  guint idx;
+
+  for (idx = 0; idx < N_DURATION_BUCKETS; idx++)
+    {
+      if (seconds <= duration_buckets[idx])
+        break;
+    }
+
+  histogram->buckets[idx]++;
+  histogram->count++;
+  histogram->sum += seconds;
+}
+
+static void
+metric_value_free (MetricValue *value)
+{
+  g_free (value->name);
+  g_free (value->help);
+
+  g_slice_free (MetricValue, value);
+}
+
+static void
+xb_metrics_finalize (GObject *object)
+{
+  XbMetrics *self = XB_METRICS (object);
+  XbMetricsPrivate *priv = xb_metrics_get_instance_private (self);
+
+  g_ptr_array_unref (priv->routes);
+  g_ptr_array_unref (priv->phases);
+  g_ptr_array_unref (priv->values);
+
+  G_OBJECT_CLASS (xb_metrics_parent_class)->finalize (object);
+}
+
+static void
+xb_metrics_class_init (XbMetricsClass *klass)
+{
+  GObjectClass *gobject_class = (GObjectClass *)klass;
+  gobject_class->finalize = xb_metrics_finalize;
+}
+
+static void
+xb_metrics_init (XbMetrics *self)
+{
+  XbMetricsPrivate *priv = xb_metrics_get_instance_private (self);
+
+  priv->routes = g_ptr_array_new_with_free_func ((GDestroyNotify) route_metrics_free);
+  priv->phases = g_ptr_array_new_with_free_func ((GDestroyNotify) phase_metrics_free);
+  priv->values = g_ptr_array_new_with_free_func ((GDestroyNotify) metric_value_free);
+
+  priv->other = route_metrics_new (OTHER_ROUTE);
+  g_ptr_array_add (priv->routes, priv->other);
+}
+
+/* Requests to paths that are not a known route are counted together, to
+ * keep the number of series bounded.
+ */
+void
+xb_metrics_add_route (XbMetrics *self,
+                      const gchar *route)
+{
+  XbMetricsPrivate *priv = xb_metrics_get_instance_private (self);
+
+  g_ptr_array_insert (priv->routes, priv->routes->len - 1, route_metrics_new (route));
+}
+
+void
+xb_metrics_request_started (XbMetrics *self)
+{
+  XbMetricsPrivate *priv = xb_metrics_get_instance_private (self);
+
+  priv->in_flight++;
+}
+
+/* Records a request answered with @status after @duration microseconds */
+void
+xb_metrics_request_finished (XbMetrics *self,
+                             const gchar *path,
+                             guint status,
+                             gint64 duration)
+{
+  XbMetricsPrivate *priv = xb_metrics_get_instance_private (self);
+  RouteMetrics *metrics = priv->other;
+  guint idx;
+
+  if (priv->in_flight > 0)
+    priv->in_flight--;
+
+  for (idx = 0; path != NULL && idx < priv->routes->len - 1; idx++)
+    {
+      if (strcmp (((RouteMetrics *) g_ptr_array_index (priv->routes, idx))->route, path) == 0)
+        {
+          metrics = g_ptr_array_index (priv->routes, idx);
+          break;
+        }
+    }
+
+  histogram_observe (&metrics->duration, duration);
+  metrics->statuses[status >= 100 && status < MAX_STATUS ? status : 0]++;
+}
+
+/* Records @duration microseconds spent in @phase of a query; phases are
+ * expected to be a small fixed set.
+ */
+void
+xb_metrics_observe_phase (XbMetrics *self,
+                          const gchar *phase,
+                          gint64 duration)
+{
+  XbMetricsPrivate *priv = xb_metrics_get_instance_private (self);
+  PhaseMetrics *metrics = NULL;
+  guint idx;
+
+  for (idx = 0; idx < priv->phases->len && metrics == NULL; idx++)
+    {
+      if (g_str_equal (((PhaseMetrics *) g_ptr_array_index (priv->phases, idx))->phase, phase))
+        metrics = g_ptr_array_index (priv->phases, idx);
+    }
+
+  if (metrics == NULL)
+    {
+      metrics = g_slice_new0 (PhaseMetrics);
+      metrics->phase = g_strdup (phase);
+      g_ptr_array_add (priv->phases, metrics);
+    }
+
+  histogram_observe (&metrics->duration, duration);
+}
+
+void
+xb_metrics_set_value (XbMetrics *self,
+                      const gchar *name,
+                      XbMetricType type,
+                      const gchar *help,
+                      gdouble value)
+{
+  XbMetricsPrivate *priv = xb_metrics_get_instance_private (self);
+  MetricValue *metric = NULL;
+  guint idx;
+
+  for (idx = 0; idx < priv->values->len && metric == NULL; idx++)
+    {
+      if (g_str_equal (((MetricValue *) g_ptr_array_index (priv->values, idx))->name, name))
+        metric = g_ptr_array_index (priv->values, idx);
+    }
+
+  if (metric == NULL)
+    {
+      metric = g_slice_new0 (MetricValue);
+      metric->name = g_strdup (name);
+      metric->help = g_strdup (help);
+      g_ptr_array_add (priv->values, metric);
+    }
+
+  metric->type = type;
+  metric->value = value;
+}
+
+static void
+append_header (GString *out,
+               const gchar *name,
+               const gchar *type,
+               const gchar *help)
+{
+  g_string_append_printf (out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+append_double (GString *out,
+               const gchar *format,
+               gdouble value)
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  g_string_append (out, g_ascii_formatd (buf, sizeof (buf), format, value));
+}
+
+static void
+append_histogram (GString *out,
+                  const gchar *name,
+                  const gchar *label,
+                  const gchar *label_value,
+                  const Histogram *histogram)
+{
+  guint64 cumulative = 0;
+  guint bucket;
+
+  for (bucket = 0; bucket < N_DURATION_BUCKETS; bucket++)
+    {
+      cumulative += histogram->buckets[bucket];
+      g_string_append_printf (out, "%s_bucket{%s=\"%s\",le=\"", name, label, label_value);
+      append_double (out, "%g", duration_buckets[bucket]);
+      g_string_append_printf (out, "\"} %" G_GUINT64_FORMAT "\n", cumulative);
+    }
+
+  g_string_append_printf (out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+                          name, label, label_value, histogram->count);
+  g_string_append_printf (out, "%s_sum{%s=\"%s\"} ", name, label, label_value);
+  append_double (out, "%.17g", histogram->sum);
+  g_string_append_printf (out, "\n%s_count{%s=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                          name, label, label_value, histogram->count);
+}
+
+/* Returns all metrics in the Prometheus text exposition format, version
+ * 0.0.4. Routes without requests are left out.
+ */
+GBytes *
+xb_metrics_serialize (XbMetrics *self)
+{
+  XbMetricsPrivate *priv = xb_metrics_get_instance_private (self);
+  RouteMetrics *metrics;
+  PhaseMetrics *phase;
+  MetricValue *metric;
+  GString *out;
+  guint idx, status;
+
+  out = g_string_new (NULL);
+
+  append_header (out, "xapian_bridge_request_duration_seconds", "histogram",
+                 "Time from reading a request to sending its whole response");
+  for (idx = 0; idx < priv->routes->len; idx++)
+    {
+      metrics = g_ptr_array_index (priv->routes, idx);
+      if (metrics->duration.count > 0)
+        append_histogram (out, "xapian_bridge_request_duration_seconds",
+                          "route", metrics->route, &metrics->duration);
+    }
+
+  append_header (out, "xapian_bridge_requests_total", "counter",
+                 "Requests answered, by route and status");
+  for (idx = 0; idx < priv->routes->len; idx++)
+    {
+      metrics = g_ptr_array_index (priv->routes, idx);
+      if (metrics->duration.count == 0)
+        continue;
+
+      for (status = 0; status < MAX_STATUS; status++)
+        {
+          if (metrics->statuses[status] > 0)
+            g_string_append_printf (out, "xapian_bridge_requests_total"
+                                    "{route=\"%s\",code=\"%u\"} %" G_GUINT64_FORMAT "\n",
+                                    metrics->route, status, metrics->statuses[status]);
+        }
+    }
+
+  append_header (out, "xapian_bridge_requests_in_flight", "gauge",
+                 "Requests being read or answered");
+  g_string_append_printf (out, "xapian_bridge_requests_in_flight %u\n", priv->in_flight);
+
+  if (priv->phases->len > 0)
+    append_header (out, "xapian_bridge_query_phase_seconds", "histogram",
+                   "Time spent in each phase of answering queries");
+  for (idx = 0; idx < priv->phases->len; idx++)
+    {
+      phase = g_ptr_array_index (priv->phases, idx);
+      append_histogram (out, "xapian_bridge_query_phase_seconds",
+                        "phase", phase->phase, &phase->duration);
+    }
+
+  for (idx = 0; idx < priv->values->len; idx++)
+    {
+      metric = g_ptr_array_index (priv->values, idx);
+      append_header (out, metric->name,
+                     metric->type == XB_METRIC_COUNTER ? "counter" : "gauge",
+                     metric->help);
+      g_string_append_printf (out, "%s ", metric->name);
+      append_double (out, "%.17g", metric->value);
+      g_string_append_c (out, '\n');
+    }
+
+  return g_string_free_to_bytes (out);
+}
+
+XbMetrics *
+xb_metrics_new (void)
+{
+  return g_object_new (XB_TYPE_METRICS, NULL);
+}
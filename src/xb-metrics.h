@@ -0,0 +1,78 @@
+/* Copyright 2026  Endless Mobile
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __XB_METRICS_H__
+#define __XB_METRICS_H__
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define XB_TYPE_METRICS (xb_metrics_get_type())
+#define XB_METRICS(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), XB_TYPE_METRICS, XbMetrics))
+#define XB_METRICS_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), XB_TYPE_METRICS, XbMetricsClass))
+#define XB_IS_METRICS(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), XB_TYPE_METRICS))
+#define XB_IS_METRICS_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), XB_TYPE_METRICS))
+#define XB_METRICS_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), XB_TYPE_METRICS, XbMetricsClass))
+
+typedef struct _XbMetrics      XbMetrics;
+typedef struct _XbMetricsClass XbMetricsClass;
+
+struct _XbMetricsClass
+{
+    GObjectClass parent_class;
+};
+
+struct _XbMetrics
+{
+    GObject parent;
+};
+
+typedef enum {
+    XB_METRIC_COUNTER,
+    XB_METRIC_GAUGE
+} XbMetricType;
+
+GType xb_metrics_get_type (void) G_GNUC_CONST;
+
+XbMetrics *xb_metrics_new (void);
+
+void xb_metrics_add_route (XbMetrics *self,
+                           const gchar *route);
+
+void xb_metrics_request_started (XbMetrics *self);
+
+void xb_metrics_request_finished (XbMetrics *self,
+                                  const gchar *path,
+                                  guint status,
+                                  gint64 duration);
+
+void xb_metrics_observe_phase (XbMetrics *self,
+                               const gchar *phase,
+                               gint64 duration);
+
+void xb_metrics_set_value (XbMetrics *self,
+                           const gchar *name,
+                           XbMetricType type,
+                           const gchar *help,
+                           gdouble value);
+
+GBytes *xb_metrics_serialize (XbMetrics *self);
+
+G_END_DECLS
+
+#endif /* __XB_METRICS_H__ */
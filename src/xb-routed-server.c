@@ -18,28 +18,223 @@
 
 #include "xb-routed-server.h"
 
+enum {
+  PROP_0,
+  PROP_MAX_IN_FLIGHT,
+  PROP_MAX_QUEUED,
+  PROP_QUEUE_TARGET_DELAY,
+  PROP_IN_FLIGHT,
+  PROP_QUEUED,
+  PROP_SHED_REQUESTS,
+  NUM_PROPS
+};
+
+static GParamSpec *props[NUM_PROPS] = { NULL, };
+
 typedef struct {
   XbRouter *router;
+  /* Paths of the routes subject to admission control => struct
+   * LimitedRoute, or NULL for requests weighing one
+   */
+  GHashTable *limited_paths;
+  guint max_in_flight;
+  guint max_queued;
+  guint queue_target_delay;
+  /* The weights of the requests being handled, added up */
+  guint in_flight;
+  /* QueuedRequest, oldest first */
+  GQueue queue;
+  guint64 shed_requests;
 } XbRoutedServerPrivate;
 
+typedef struct {
+  XbRoutedServerWeightFunc weight_func;
+  gpointer user_data;
+} LimitedRoute;
+
+/* A request paused until one in flight finishes */
+typedef struct {
+  SoupMessage *message;
+  gchar *path;
+  GHashTable *query;
+  guint weight;
+  gint64 queued;
+} QueuedRequest;
+
 G_DEFINE_TYPE_WITH_PRIVATE (XbRoutedServer, xb_routed_server, SOUP_TYPE_SERVER);
 
+static GQuark
+admitted_quark (void)
+{
+  return g_quark_from_static_string ("xb-routed-server-admitted");
+}
+
 static void
-xb_routed_server_finalize (GObject *object)
+limited_route_free (LimitedRoute *route)
+{
+  g_slice_free (LimitedRoute, route);
+}
+
+static QueuedRequest *
+queued_request_new (SoupMessage *message,
+                    const gchar *path,
+                    GHashTable *query,
+                    guint weight)
+{
+  QueuedRequest *request;
+
+  request = g_slice_new0 (QueuedRequest);
+  request->message = g_object_ref (message);
+  request->path = g_strdup (path);
+  request->query = query != NULL ? g_hash_table_ref (query) : NULL;
+  request->weight = weight;
+  request->queued = g_get_monotonic_time ();
+
+  return request;
+}
+
+static void
+queued_request_free (QueuedRequest *request)
+{
+  g_object_unref (request->message);
+  g_free (request->path);
+  g_clear_pointer (&request->query, g_hash_table_unref);
+
+  g_slice_free (QueuedRequest, request);
+}
+
+/* How many requests @msg counts as, at most the whole in-flight limit so
+ * that it can still be let in on its own.
+ */
+static guint
+routed_server_get_weight (XbRoutedServer *self,
+                          SoupMessage *msg,
+                          const gchar *path)
 {
-  XbRoutedServer *self = XB_ROUTED_SERVER (object);
   XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+  LimitedRoute *route;
+  guint weight = 1;
 
-  g_clear_object (&priv->router);
+  route = g_hash_table_lookup (priv->limited_paths, path);
+  if (route != NULL)
+    weight = MAX (1, route->weight_func (msg, route->user_data));
 
-  G_OBJECT_CLASS (xb_routed_server_parent_class)->finalize (object);
+  if (priv->max_in_flight > 0)
+    weight = MIN (weight, priv->max_in_flight);
+
+  return weight;
+}
+
+static gboolean
+routed_server_fits (XbRoutedServer *self,
+                    guint weight)
+{
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+
+  /* The limit may have been lowered since @weight was clamped to it */
+  return priv->max_in_flight == 0 ||
+    priv->in_flight + MIN (weight, priv->max_in_flight) <= priv->max_in_flight;
 }
 
 static void
-xb_routed_server_class_init (XbRoutedServerClass *klass)
+routed_server_admit (XbRoutedServer *self,
+                     SoupMessage *msg,
+                     const gchar *path,
+                     GHashTable *query,
+                     guint weight)
 {
-  GObjectClass *gobject_class = (GObjectClass *)klass;
-  gobject_class->finalize = xb_routed_server_finalize;
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+
+  priv->in_flight += weight;
+  g_object_set_qdata (G_OBJECT (msg), admitted_quark (), GUINT_TO_POINTER (weight));
+
+  xb_router_handle_route (priv->router, msg->method, path, msg, query);
+}
+
+/* Answers 503 right away, asking the client to come back after @wait, in
+ * microseconds, the time the oldest queued request waited.
+ */
+static void
+routed_server_shed (XbRoutedServer *self,
+                    SoupMessage *msg,
+                    gint64 wait)
+{
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+  gchar *retry_after;
+
+  retry_after = g_strdup_printf ("%" G_GINT64_FORMAT,
+                                 MAX (1, (wait + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC));
+  soup_message_headers_replace (msg->response_headers, "Retry-After", retry_after);
+  soup_message_set_status (msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+  g_free (retry_after);
+
+  priv->shed_requests++;
+  g_info ("%s %s shed, %u in flight and %u queued", msg->method,
+          soup_message_get_uri (msg)->path, priv->in_flight, priv->queue.length);
+}
+
+/* How long the oldest queued request has waited, in microseconds */
+static gint64
+routed_server_get_queue_delay (XbRoutedServer *self)
+{
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+  QueuedRequest *oldest;
+
+  oldest = g_queue_peek_head (&priv->queue);
+  if (oldest == NULL)
+    return 0;
+
+  return g_get_monotonic_time () - oldest->queued;
+}
+
+static gboolean
+routed_server_is_stale (XbRoutedServer *self,
+                        gint64 delay)
+{
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+
+  return priv->queue_target_delay > 0 && delay > priv->queue_target_delay * (gint64) 1000;
+}
+
+/* Starts as many queued requests as the in-flight limit allows, in order.
+ * Those that waited longer than the target delay are turned away instead:
+ * their clients have likely given up, or will by the time they are served.
+ */
+static void
+routed_server_dispatch (XbRoutedServer *self)
+{
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+  QueuedRequest *request;
+  gint64 delay;
+
+  while ((request = g_queue_peek_head (&priv->queue)) != NULL)
+    {
+      delay = routed_server_get_queue_delay (self);
+      if (!routed_server_is_stale (self, delay) && !routed_server_fits (self, request->weight))
+        break;
+
+      g_queue_pop_head (&priv->queue);
+
+      /* The handler may pause it again; that cancels this unpause */
+      soup_server_unpause_message (SOUP_SERVER (self), request->message);
+      if (routed_server_is_stale (self, delay))
+        routed_server_shed (self, request->message, delay);
+      else
+        routed_server_admit (self, request->message, request->path, request->query,
+                             request->weight);
+      queued_request_free (request);
+    }
+}
+
+static gboolean
+routed_server_should_shed (XbRoutedServer *self)
+{
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+
+  if (priv->max_queued > 0 && priv->queue.length >= priv->max_queued)
+    return TRUE;
+
+  return routed_server_is_stale (self, routed_server_get_queue_delay (self));
 }
 
 static void
@@ -52,8 +247,220 @@ routed_server_handler (SoupServer *server,
 {
   XbRoutedServer *self = user_data;
   XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+  guint weight;
 
-  xb_router_handle_route (priv->router, msg->method, path, msg, query);
+  if (!g_hash_table_contains (priv->limited_paths, path))
+    {
+      xb_router_handle_route (priv->router, msg->method, path, msg, query);
+      return;
+    }
+
+  /* Nothing overtakes the queued requests */
+  weight = routed_server_get_weight (self, msg, path);
+  if (priv->queue.length == 0 && routed_server_fits (self, weight))
+    {
+      routed_server_admit (self, msg, path, query, weight);
+      return;
+    }
+
+  if (routed_server_should_shed (self))
+    {
+      routed_server_shed (self, msg, routed_server_get_queue_delay (self));
+      return;
+    }
+
+  soup_server_pause_message (server, msg);
+  g_queue_push_tail (&priv->queue, queued_request_new (msg, path, query, weight));
+}
+
+/* Handles both finished and aborted requests */
+static void
+routed_server_request_done (XbRoutedServer *self,
+                            SoupMessage *msg)
+{
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+  guint weight;
+  GList *l;
+
+  weight = GPOINTER_TO_UINT (g_object_get_qdata (G_OBJECT (msg), admitted_quark ()));
+  if (weight != 0)
+    {
+      g_object_set_qdata (G_OBJECT (msg), admitted_quark (), NULL);
+      priv->in_flight -= weight;
+      routed_server_dispatch (self);
+      return;
+    }
+
+  /* The client gave up while its request was queued */
+  for (l = priv->queue.head; l != NULL; l = l->next)
+    {
+      QueuedRequest *request = l->data;
+
+      if (request->message == msg)
+        {
+          g_queue_delete_link (&priv->queue, l);
+          queued_request_free (request);
+          return;
+        }
+    }
+}
+
+static void
+xb_routed_server_request_finished (SoupServer *server,
+                                   SoupMessage *msg,
+                                   SoupClientContext *client)
+{
+  SoupServerClass *parent_class = SOUP_SERVER_CLASS (xb_routed_server_parent_class);
+
+  routed_server_request_done (XB_ROUTED_SERVER (server), msg);
+
+  if (parent_class->request_finished != NULL)
+    parent_class->request_finished (server, msg, client);
+}
+
+static void
+xb_routed_server_request_aborted (SoupServer *server,
+                                  SoupMessage *msg,
+                                  SoupClientContext *client)
+{
+  SoupServerClass *parent_class = SOUP_SERVER_CLASS (xb_routed_server_parent_class);
+
+  routed_server_request_done (XB_ROUTED_SERVER (server), msg);
+
+  if (parent_class->request_aborted != NULL)
+    parent_class->request_aborted (server, msg, client);
+}
+
+static void
+xb_routed_server_get_property (GObject *object,
+                               guint prop_id,
+                               GValue *value,
+                               GParamSpec *pspec)
+{
+  XbRoutedServer *self = XB_ROUTED_SERVER (object);
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_MAX_IN_FLIGHT:
+      g_value_set_uint (value, priv->max_in_flight);
+      break;
+    case PROP_MAX_QUEUED:
+      g_value_set_uint (value, priv->max_queued);
+      break;
+    case PROP_QUEUE_TARGET_DELAY:
+      g_value_set_uint (value, priv->queue_target_delay);
+      break;
+    case PROP_IN_FLIGHT:
+      g_value_set_uint (value, priv->in_flight);
+      break;
+    case PROP_QUEUED:
+      g_value_set_uint (value, priv->queue.length);
+      break;
+    case PROP_SHED_REQUESTS:
+      g_value_set_uint64 (value, priv->shed_requests);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+xb_routed_server_set_property (GObject *object,
+                               guint prop_id,
+                               const GValue *value,
+                               GParamSpec *pspec)
+{
+  XbRoutedServer *self = XB_ROUTED_SERVER (object);
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_MAX_IN_FLIGHT:
+      priv->max_in_flight = g_value_get_uint (value);
+      /* A larger limit lets queued requests in right away */
+      routed_server_dispatch (self);
+      break;
+    case PROP_MAX_QUEUED:
+      priv->max_queued = g_value_get_uint (value);
+      break;
+    case PROP_QUEUE_TARGET_DELAY:
+      priv->queue_target_delay = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+xb_routed_server_finalize (GObject *object)
+{
+  XbRoutedServer *self = XB_ROUTED_SERVER (object);
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+
+  g_queue_foreach (&priv->queue, (GFunc) queued_request_free, NULL);
+  g_queue_clear (&priv->queue);
+  g_clear_pointer (&priv->limited_paths, g_hash_table_unref);
+  g_clear_object (&priv->router);
+
+  G_OBJECT_CLASS (xb_routed_server_parent_class)->finalize (object);
+}
+
+static void
+xb_routed_server_class_init (XbRoutedServerClass *klass)
+{
+  GObjectClass *gobject_class = (GObjectClass *)klass;
+  SoupServerClass *server_class = (SoupServerClass *)klass;
+
+  gobject_class->get_property = xb_routed_server_get_property;
+  gobject_class->set_property = xb_routed_server_set_property;
+  gobject_class->finalize = xb_routed_server_finalize;
+  server_class->request_finished = xb_routed_server_request_finished;
+  server_class->request_aborted = xb_routed_server_request_aborted;
+
+  /* Requests to limited routes handled at once; 0 means unbounded. */
+  props[PROP_MAX_IN_FLIGHT] =
+    g_param_spec_uint ("max-in-flight", "Max in flight",
+                       "Maximum number of limited requests handled at once",
+                       0, G_MAXUINT, 0,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /* Requests waiting for one in flight to finish; 0 means unbounded. */
+  props[PROP_MAX_QUEUED] =
+    g_param_spec_uint ("max-queued", "Max queued",
+                       "Maximum number of limited requests waiting to be handled",
+                       0, G_MAXUINT, 0,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /* Milliseconds the oldest queued request may wait before new ones are
+   * turned away; 0 means they are only turned away when the queue is full.
+   */
+  props[PROP_QUEUE_TARGET_DELAY] =
+    g_param_spec_uint ("queue-target-delay", "Queue target delay",
+                       "Longest wait in the queue before shedding, in milliseconds",
+                       0, G_MAXUINT, 0,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /* Requests weighing more than one count as that many */
+  props[PROP_IN_FLIGHT] =
+    g_param_spec_uint ("in-flight", "In flight",
+                       "Number of limited requests being handled",
+                       0, G_MAXUINT, 0,
+                       G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_QUEUED] =
+    g_param_spec_uint ("queued", "Queued",
+                       "Number of limited requests waiting to be handled",
+                       0, G_MAXUINT, 0,
+                       G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  props[PROP_SHED_REQUESTS] =
+    g_param_spec_uint64 ("shed-requests", "Shed requests",
+                         "Number of limited requests answered with 503",
+                         0, G_MAXUINT64, 0,
+                         G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (gobject_class, NUM_PROPS, props);
 }
 
 static void
@@ -61,6 +468,9 @@ xb_routed_server_init (XbRoutedServer *self)
 {
   XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
   priv->router = xb_router_new ();
+  priv->limited_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify) limited_route_free);
+  g_queue_init (&priv->queue);
 
   /* Setup a singleton handler for all HTTP requests; this will use the
    * router to actually delegate requests to each method handler.
@@ -68,6 +478,35 @@ xb_routed_server_init (XbRoutedServer *self)
   soup_server_add_handler (SOUP_SERVER (self), NULL, routed_server_handler, self, NULL);
 }
 
+/* Subjects requests for path to the in-flight and queue limits */
+void
+xb_routed_server_limit (XbRoutedServer *self,
+                        const gchar *path)
+{
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+  g_hash_table_insert (priv->limited_paths, g_strdup (path), NULL);
+}
+
+/* Like xb_routed_server_limit(), but each request counts as as many as
+ * @weight_func returns, such as one that fans out to several jobs. It is
+ * called once the request body was read, before the request is queued.
+ */
+void
+xb_routed_server_limit_weighted (XbRoutedServer *self,
+                                 const gchar *path,
+                                 XbRoutedServerWeightFunc weight_func,
+                                 gpointer user_data)
+{
+  XbRoutedServerPrivate *priv = xb_routed_server_get_instance_private (self);
+  LimitedRoute *route;
+
+  route = g_slice_new0 (LimitedRoute);
+  route->weight_func = weight_func;
+  route->user_data = user_data;
+
+  g_hash_table_insert (priv->limited_paths, g_strdup (path), route);
+}
+
 void
 xb_routed_server_get (XbRoutedServer *self,
                       const gchar *path,
@@ -31,6 +31,10 @@ G_BEGIN_DECLS
 #define XB_IS_ROUTED_SERVER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), XB_TYPE_ROUTED_SERVER))
 #define XB_ROUTED_SERVER_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), XB_TYPE_ROUTED_SERVER, XbRoutedServerClass))
 
+/* Returns how many requests @message counts as for admission control */
+typedef guint (*XbRoutedServerWeightFunc) (SoupMessage *message,
+                                           gpointer user_data);
+
 typedef struct _XbRoutedServer      XbRoutedServer;
 typedef struct _XbRoutedServerClass XbRoutedServerClass;
 
@@ -65,6 +69,13 @@ void xb_routed_server_post (XbRoutedServer *self,
                             XbRouterCallback callback,
                             gpointer user_data);
 
+void xb_routed_server_limit (XbRoutedServer *self,
+                             const gchar *path);
+void xb_routed_server_limit_weighted (XbRoutedServer *self,
+                                      const gchar *path,
+                                      XbRoutedServerWeightFunc weight_func,
+                                      gpointer user_data);
+
 G_END_DECLS
 
 #endif /* __XB_ROUTED_SERVER_H__ */
@@ -16,8 +16,15 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "xb-router.h"
 
+/* Longest run of :param components a single path spec may contain; matched
+ * values are collected on the stack while walking the trie.
+ */
+#define MAX_PATH_PARAMS 16
+
 enum {
   PATH_NOT_HANDLED,
   NUM_SIGNALS
@@ -25,81 +32,187 @@ enum {
 
 static guint signals[NUM_SIGNALS] = { 0, };
 
+/* A path component that is not necessarily NUL-terminated, so that the trie
+ * can be walked without copying pieces of the request path.
+ */
 typedef struct {
-  GList *routes;
-} XbRouterPrivate;
+  const gchar *str;
+  gsize len;
+} XbRouterSegment;
+
+typedef struct _XbRouterNode XbRouterNode;
+
+struct _XbRouterNode {
+  XbRouterSegment segment;
+  GHashTable *children;
+  XbRouterNode *param_child;
+  GPtrArray *routes;
+};
 
 typedef struct {
+  guint order;
   const gchar *method;
-  GRegex *path_regex;
-  GList *path_spec_keys;
+  gchar **param_keys;
   XbRouterCallback callback;
   gpointer user_data;
 } XbRouterRoute;
 
+typedef struct {
+  XbRouterRoute *route;
+  XbRouterSegment values[MAX_PATH_PARAMS];
+} XbRouterMatch;
+
+typedef struct {
+  GPtrArray *routes;
+  GHashTable *static_routes;
+  XbRouterNode *root;
+  guint first_param_order;
+  GHashTable *no_params;
+} XbRouterPrivate;
+
 G_DEFINE_TYPE_WITH_PRIVATE (XbRouter, xb_router, G_TYPE_OBJECT);
 
-/* Takes a path_spec and returns a GRegex that can be used to match a test path
- * against the given path_spec.
- */
-static GRegex *
-route_get_regexp_for_path (const gchar *path_spec,
-                           GList **path_spec_keys)
+static guint
+segment_hash (gconstpointer key)
 {
-  gchar **components, **regex_components;
-  gchar *regex_join, *pattern;
-  GList *keys = NULL;
-  gint idx, len;
-  GError *error = NULL;
-  GRegex *regex;
+  const XbRouterSegment *segment = key;
+  guint hash = 5381;
+  gsize idx;
 
-  g_assert (path_spec_keys != NULL);
+  for (idx = 0; idx < segment->len; idx++)
+    hash = (hash << 5) + hash + (guchar) segment->str[idx];
+
+  return hash;
+}
 
-  components = g_strsplit (path_spec, "/", -1);
-  len = g_strv_length (components);
-  regex_components = g_malloc0 (sizeof (gchar *) * (len + 1));
+static gboolean
+segment_equal (gconstpointer a,
+               gconstpointer b)
+{
+  const XbRouterSegment *sa = a, *sb = b;
+
+  return sa->len == sb->len && memcmp (sa->str, sb->str, sa->len) == 0;
+}
 
-  for (idx = 0; idx < len; idx++)
+static XbRouterNode *
+xb_router_node_new (const gchar *str,
+                    gsize len)
+{
+  XbRouterNode *node = g_slice_new0 (XbRouterNode);
+
+  node->segment.str = g_strndup (str, len);
+  node->segment.len = len;
+
+  return node;
+}
+
+static void
+xb_router_node_free (XbRouterNode *node)
+{
+  g_clear_pointer (&node->children, g_hash_table_unref);
+  g_clear_pointer (&node->param_child, xb_router_node_free);
+  g_clear_pointer (&node->routes, g_ptr_array_unref);
+  g_free ((gchar *) node->segment.str);
+
+  g_slice_free (XbRouterNode, node);
+}
+
+static XbRouterNode *
+xb_router_node_get_child (XbRouterNode *node,
+                          const gchar *component)
+{
+  XbRouterSegment key = { component, strlen (component) };
+  XbRouterNode *child;
+
+  if (component[0] == ':')
     {
-      const gchar *component = components[idx];
+      if (node->param_child == NULL)
+        node->param_child = xb_router_node_new (":", 1);
+      return node->param_child;
+    }
 
-      if (component[0] == ':')
-        {
-          keys = g_list_prepend (keys, g_strdup (component + 1));
-          regex_components[idx] = g_strdup ("([^\\/]+)");
-        }
-      else
-        {
-          regex_components[idx] = g_strdup (component);
-        }
+  if (node->children == NULL)
+    node->children = g_hash_table_new_full (segment_hash, segment_equal, NULL,
+                                            (GDestroyNotify) xb_router_node_free);
+
+  child = g_hash_table_lookup (node->children, &key);
+  if (child == NULL)
+    {
+      child = xb_router_node_new (key.str, key.len);
+      g_hash_table_insert (node->children, &child->segment, child);
     }
 
-  regex_join = g_strjoinv ("\\/", regex_components);
-  /* Make sure that we only match if the entire string matches */
-  pattern = g_strconcat ("^", regex_join, "$", NULL);
-  g_free (regex_join);
-  g_strfreev (regex_components);
+  return child;
+}
+
+/* Walks every branch of the trie that can match the path starting at
+ * component, keeping the earliest added route for the method. Static
+ * children and the :param child may both match the same component, so both
+ * are tried.
+ */
+static void
+xb_router_node_lookup (XbRouterNode *node,
+                       const gchar *method,
+                       const gchar *component,
+                       XbRouterSegment *values,
+                       guint n_values,
+                       XbRouterMatch *match)
+{
+  XbRouterSegment key;
+  XbRouterNode *child;
+  const gchar *end, *next;
+  guint idx;
+
+  if (component == NULL)
+    {
+      if (node->routes == NULL)
+        return;
+
+      for (idx = 0; idx < node->routes->len; idx++)
+        {
+          XbRouterRoute *route = g_ptr_array_index (node->routes, idx);
+
+          if (match->route != NULL && route->order > match->route->order)
+            break;
+          if (route->method != method)
+            continue;
+
+          match->route = route;
+          memcpy (match->values, values, n_values * sizeof (XbRouterSegment));
+          break;
+        }
 
-  regex = g_regex_new (pattern, 0, 0, &error);
-  g_free (pattern);
+      return;
+    }
 
-  if (error != NULL)
+  end = strchr (component, '/');
+  if (end != NULL)
+    {
+      next = end + 1;
+    }
+  else
     {
-      g_warning ("Can't compile GRegex for path spec %s: %s",
-                 path_spec, error->message);
-      g_error_free (error);
-      g_list_free_full (keys, g_free);
-      return NULL;
+      end = component + strlen (component);
+      next = NULL;
     }
 
-  *path_spec_keys = g_list_reverse (keys);
+  key.str = component;
+  key.len = end - component;
 
-  return regex;
+  if (node->children != NULL &&
+      (child = g_hash_table_lookup (node->children, &key)) != NULL)
+    xb_router_node_lookup (child, method, next, values, n_values, match);
+
+  if (node->param_child != NULL && key.len > 0 && n_values < MAX_PATH_PARAMS)
+    {
+      values[n_values] = key;
+      xb_router_node_lookup (node->param_child, method, next, values,
+                             n_values + 1, match);
+    }
 }
 
 static XbRouterRoute *
 xb_router_route_new (const gchar *method,
-                     const gchar *path_spec,
                      XbRouterCallback callback,
                      gpointer user_data)
 {
@@ -111,16 +224,13 @@ xb_router_route_new (const gchar *method,
   route->callback = callback;
   route->user_data = user_data;
 
-  route->path_regex = route_get_regexp_for_path (path_spec, &route->path_spec_keys);
-
   return route;
 }
 
 static void
 xb_router_route_free (XbRouterRoute *route)
 {
-  g_clear_pointer (&route->path_regex, g_regex_unref);
-  g_list_free_full (route->path_spec_keys, g_free);
+  g_strfreev (route->param_keys);
 
   g_slice_free (XbRouterRoute, route);
 }
@@ -131,7 +241,10 @@ xb_router_finalize (GObject *object)
   XbRouter *self = XB_ROUTER (object);
   XbRouterPrivate *priv = xb_router_get_instance_private (self);
 
-  g_list_free_full (priv->routes, (GDestroyNotify) xb_router_route_free);
+  g_clear_pointer (&priv->static_routes, g_hash_table_unref);
+  g_clear_pointer (&priv->root, xb_router_node_free);
+  g_clear_pointer (&priv->routes, g_ptr_array_unref);
+  g_clear_pointer (&priv->no_params, g_hash_table_unref);
 
   G_OBJECT_CLASS (xb_router_parent_class)->finalize (object);
 }
@@ -153,6 +266,40 @@ xb_router_class_init (XbRouterClass *klass)
 static void
 xb_router_init (XbRouter *self)
 {
+  XbRouterPrivate *priv = xb_router_get_instance_private (self);
+
+  priv->routes = g_ptr_array_new_with_free_func ((GDestroyNotify) xb_router_route_free);
+  priv->static_routes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify) g_ptr_array_unref);
+  priv->root = xb_router_node_new ("", 0);
+  priv->first_param_order = G_MAXUINT;
+  /* Handed to every route without :param components, so that those requests
+   * are dispatched without allocating.
+   */
+  priv->no_params = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+static XbRouterRoute *
+lookup_static_route (XbRouterPrivate *priv,
+                     const gchar *method,
+                     const gchar *path)
+{
+  GPtrArray *routes;
+  guint idx;
+
+  routes = g_hash_table_lookup (priv->static_routes, path);
+  if (routes == NULL)
+    return NULL;
+
+  for (idx = 0; idx < routes->len; idx++)
+    {
+      XbRouterRoute *route = g_ptr_array_index (routes, idx);
+
+      if (route->method == method)
+        return route;
+    }
+
+  return NULL;
 }
 
 void
@@ -163,58 +310,47 @@ xb_router_handle_route (XbRouter *self,
                         GHashTable *query)
 {
   XbRouterPrivate *priv = xb_router_get_instance_private (self);
-  GList *l, *k;
-  GMatchInfo *match_info;
-  XbRouterRoute *route;
+  XbRouterSegment values[MAX_PATH_PARAMS];
+  XbRouterMatch match;
   GHashTable *params;
-  gchar *word;
-  gint idx;
-  gint64 start_time, end_time;
-
-  start_time = g_get_monotonic_time ();
+  guint idx;
 
   if (method == NULL && message != NULL)
     method = message->method;
 
-  for (l = priv->routes; l != NULL; l = l->next)
-    {
-      route = l->data;
-      if (method != route->method)
-        continue;
-
-      if (!g_regex_match (route->path_regex, path, 0, &match_info))
-        continue;
+  match.route = lookup_static_route (priv, method, path);
 
-      /* We found our handler */
-      params = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  /* Routes added earlier win, so the trie only needs walking if a :param
+   * route predates the static match.
+   */
+  if (match.route == NULL || match.route->order > priv->first_param_order)
+    xb_router_node_lookup (priv->root, method, path, values, 0, &match);
 
-      if (route->path_spec_keys != NULL)
-        {
-          /* For every key in the path_spec, get their value in the matched
-           * path, and build a (path_spec_key -> value) dictionary.
-           */
-          for (idx = 1, k = route->path_spec_keys;
-               idx < g_match_info_get_match_count (match_info) && k != NULL;
-               idx++, k = k->next)
-            {
-              word = g_match_info_fetch (match_info, idx);
-              g_hash_table_insert (params, g_strdup (k->data), word);
-            }
-        }
-
-      route->callback (params, query, message, route->user_data);
-      g_hash_table_unref (params);
-
-      end_time = g_get_monotonic_time ();
-      g_info ("%s %s handled in %.3f ms", method, path,
-              (end_time - start_time) / 1000.0);
+  if (match.route == NULL)
+    {
+      g_info ("%s %s not handled", method, path);
+      g_signal_emit (self, signals[PATH_NOT_HANDLED], 0);
+      return;
+    }
 
+  if (match.route->param_keys == NULL)
+    {
+      match.route->callback (priv->no_params, query, message,
+                             match.route->user_data);
       return;
     }
 
-  /* No handlers were found */
-  g_info ("%s %s not handled", method, path);
-  g_signal_emit (self, signals[PATH_NOT_HANDLED], 0);
+  /* For every key in the path_spec, get their value in the matched
+   * path, and build a (path_spec_key -> value) dictionary.
+   */
+  params = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  for (idx = 0; match.route->param_keys[idx] != NULL; idx++)
+    g_hash_table_insert (params, g_strdup (match.route->param_keys[idx]),
+                         g_strndup (match.values[idx].str,
+                                    match.values[idx].len));
+
+  match.route->callback (params, query, message, match.route->user_data);
+  g_hash_table_unref (params);
 }
 
 /* Caller is responsible to keep user_data alive during the
@@ -229,9 +365,60 @@ xb_router_add_route (XbRouter *self,
 {
   XbRouterRoute *route;
   XbRouterPrivate *priv = xb_router_get_instance_private (self);
+  XbRouterNode *node;
+  GPtrArray *keys, *routes;
+  gchar **components;
+  guint idx;
+
+  components = g_strsplit (path, "/", -1);
+  keys = g_ptr_array_new_with_free_func (g_free);
+
+  for (idx = 0; components[idx] != NULL; idx++)
+    if (components[idx][0] == ':')
+      g_ptr_array_add (keys, g_strdup (components[idx] + 1));
+
+  if (keys->len > MAX_PATH_PARAMS)
+    {
+      g_warning ("Path spec %s has more than %d parameters",
+                 path, MAX_PATH_PARAMS);
+      g_ptr_array_free (keys, TRUE);
+      g_strfreev (components);
+      return;
+    }
+
+  route = xb_router_route_new (method, callback, user_data);
+  route->order = priv->routes->len;
+  g_ptr_array_add (priv->routes, route);
+
+  if (keys->len == 0)
+    {
+      g_ptr_array_free (keys, TRUE);
+
+      routes = g_hash_table_lookup (priv->static_routes, path);
+      if (routes == NULL)
+        {
+          routes = g_ptr_array_new ();
+          g_hash_table_insert (priv->static_routes, g_strdup (path), routes);
+        }
+      g_ptr_array_add (routes, route);
+    }
+  else
+    {
+      g_ptr_array_add (keys, NULL);
+      route->param_keys = (gchar **) g_ptr_array_free (keys, FALSE);
+
+      node = priv->root;
+      for (idx = 0; components[idx] != NULL; idx++)
+        node = xb_router_node_get_child (node, components[idx]);
+
+      if (node->routes == NULL)
+        node->routes = g_ptr_array_new ();
+      g_ptr_array_add (node->routes, route);
+
+      priv->first_param_order = MIN (priv->first_param_order, route->order);
+    }
 
-  route = xb_router_route_new (method, path, callback, user_data);
-  priv->routes = g_list_append (priv->routes, route);
+  g_strfreev (components);
 }
 
 XbRouter *
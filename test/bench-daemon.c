@@ -0,0 +1,709 @@
+/* Load generator for xapian-bridge: starts the daemon against a corpus,
+ * sends it a mix of /query and /fix requests, either keeping a fixed number
+ * of them in flight or at a fixed rate, and prints the throughput and
+ * latency percentiles as JSON.
+ *
+ *   bench-daemon [--db PATH] [--concurrency N] [--rate N] [--duration S] ...
+ *
+ * Without --db, generate-test-db writes a corpus of --documents documents
+ * in --shards shards to a temporary directory, removed afterwards. The
+ * words queried for are the ones in words.txt next to the database, unless
+ * given with --terms.
+ */
+
+#include <gio/gio.h>
+#include <json-glib/json-glib.h>
+#include <libsoup/soup.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+
+#include "test-util.h"
+
+#define STARTUP_TIMEOUT (10 * G_USEC_PER_SEC)
+
+typedef enum {
+  BENCH_QUERY,
+  BENCH_FIX,
+  N_BENCH_KINDS
+} BenchKind;
+
+static const gchar *kind_names[N_BENCH_KINDS] = { "query", "fix" };
+
+typedef struct {
+  /* Latencies of the successful requests, in microseconds */
+  GArray *latencies;
+  guint64 errors;
+} KindStats;
+
+typedef struct {
+  SoupSession *session;
+  GMainLoop *loop;
+  GRand *rand;
+  gchar *base_uri;
+  /* "path" or "manifest_path" */
+  const gchar *db_param;
+  gchar *escaped_db;
+  gchar **terms;
+  guint n_terms;
+  guint weights[N_BENCH_KINDS];
+  guint total_weight;
+  guint concurrency;
+  gdouble rate;
+  /* Requests started before warmup_end are not recorded */
+  gint64 start;
+  gint64 warmup_end;
+  gint64 end;
+  guint64 scheduled;
+  guint in_flight;
+  guint timer_id;
+  KindStats stats[N_BENCH_KINDS];
+} Bench;
+
+typedef struct {
+  Bench *bench;
+  BenchKind kind;
+  /* When the request was due to start, which it may have waited for a
+   * connection after
+   */
+  gint64 start;
+} BenchRequest;
+
+static gchar *opt_daemon = NULL;
+static gchar *opt_generator = NULL;
+static gchar *opt_db = NULL;
+static gchar *opt_mix = NULL;
+static gchar *opt_terms = NULL;
+static gchar *opt_output = NULL;
+static gchar **opt_env = NULL;
+static gint opt_port = 0;
+static gint opt_documents = 10000;
+static gint opt_shards = 4;
+static gint opt_concurrency = 16;
+static gint opt_limit = 10;
+static gdouble opt_rate = 0;
+static gdouble opt_duration = 10;
+static gdouble opt_warmup = 1;
+
+static GOptionEntry entries[] = {
+  { "daemon", 0, 0, G_OPTION_ARG_FILENAME, &opt_daemon,
+    "xapian-bridge binary (default: next to this one)", "PATH" },
+  { "generator", 0, 0, G_OPTION_ARG_FILENAME, &opt_generator,
+    "generate-test-db binary (default: next to this one)", "PATH" },
+  { "port", 0, 0, G_OPTION_ARG_INT, &opt_port,
+    "Port for the daemon (default: random)", "PORT" },
+  { "env", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_env,
+    "Extra environment for the daemon; repeatable", "NAME=VALUE" },
+  { "db", 0, 0, G_OPTION_ARG_FILENAME, &opt_db,
+    "Database or manifest to query (default: a generated corpus)", "PATH" },
+  { "documents", 0, 0, G_OPTION_ARG_INT, &opt_documents,
+    "Documents in the generated corpus (default: 10000)", "N" },
+  { "shards", 0, 0, G_OPTION_ARG_INT, &opt_shards,
+    "Shards of the generated corpus (default: 4)", "N" },
+  { "terms", 0, 0, G_OPTION_ARG_STRING, &opt_terms,
+    "Comma-separated words to query for (default: from words.txt)", "WORDS" },
+  { "mix", 0, 0, G_OPTION_ARG_STRING, &opt_mix,
+    "Relative weights of the requests (default: query=9,fix=1)", "KIND=N,..." },
+  { "limit", 0, 0, G_OPTION_ARG_INT, &opt_limit,
+    "Results asked for per query (default: 10)", "N" },
+  { "concurrency", 'c', 0, G_OPTION_ARG_INT, &opt_concurrency,
+    "Requests in flight, or connections with --rate (default: 16)", "N" },
+  { "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &opt_rate,
+    "Requests per second, rather than as many as --concurrency allows", "N" },
+  { "duration", 'd', 0, G_OPTION_ARG_DOUBLE, &opt_duration,
+    "Seconds to record for (default: 10)", "S" },
+  { "warmup", 0, 0, G_OPTION_ARG_DOUBLE, &opt_warmup,
+    "Seconds to run before recording (default: 1)", "S" },
+  { "output", 'o', 0, G_OPTION_ARG_FILENAME, &opt_output,
+    "File to write the report to (default: standard output)", "PATH" },
+  { NULL }
+};
+
+/* Returns the path of the program @name in the same directory as @argv0 */
+static gchar *
+get_sibling_program (const gchar *argv0,
+                     const gchar *name)
+{
+  gchar *dir, *path;
+
+  dir = g_path_get_dirname (argv0);
+  path = g_build_filename (dir, name, NULL);
+  g_free (dir);
+
+  return path;
+}
+
+static gboolean
+generate_corpus (const gchar *generator,
+                 const gchar *dir,
+                 GError **error)
+{
+  GSubprocess *process;
+  gchar *documents, *shards;
+  gboolean res;
+
+  documents = g_strdup_printf ("%d", opt_documents);
+  shards = g_strdup_printf ("%d", opt_shards);
+
+  process = g_subprocess_new (G_SUBPROCESS_FLAGS_NONE, error, generator,
+                              "--documents", documents,
+                              "--shards", shards,
+                              "--output", dir,
+                              NULL);
+  res = process != NULL && g_subprocess_wait_check (process, NULL, error);
+
+  g_clear_object (&process);
+  g_free (documents);
+  g_free (shards);
+
+  return res;
+}
+
+/* Reads the words, one per line, from the words.txt file next to @db_path */
+static gchar **
+load_terms (const gchar *db_path,
+            GError **error)
+{
+  gchar *dir, *path, *contents;
+  gchar **lines, **terms;
+  guint idx, n_terms = 0;
+
+  dir = g_path_get_dirname (db_path);
+  path = g_build_filename (dir, "words.txt", NULL);
+  g_free (dir);
+
+  if (!g_file_get_contents (path, &contents, NULL, error))
+    {
+      g_prefix_error (error, "No words to query for; use --terms: ");
+      g_free (path);
+      return NULL;
+    }
+  g_free (path);
+
+  lines = g_strsplit (contents, "\n", -1);
+  g_free (contents);
+
+  terms = g_new0 (gchar *, g_strv_length (lines) + 1);
+  for (idx = 0; lines[idx] != NULL; idx++)
+    {
+      if (*g_strstrip (lines[idx]) != '\0')
+        terms[n_terms++] = g_strdup (lines[idx]);
+    }
+  g_strfreev (lines);
+
+  return terms;
+}
+
+static gboolean
+parse_mix (Bench *bench,
+           const gchar *mix,
+           GError **error)
+{
+  gchar **items, **item, *sep;
+  gint kind;
+
+  items = g_strsplit (mix, ",", -1);
+  for (item = items; *item != NULL; item++)
+    {
+      sep = strchr (*item, '=');
+      for (kind = 0; kind < N_BENCH_KINDS && sep != NULL; kind++)
+        {
+          if (strncmp (*item, kind_names[kind], sep - *item) == 0 &&
+              strlen (kind_names[kind]) == sep - *item)
+            break;
+        }
+
+      if (sep == NULL || kind == N_BENCH_KINDS)
+        {
+          g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                       "Invalid request mix entry: %s", *item);
+          g_strfreev (items);
+          return FALSE;
+        }
+
+      bench->weights[kind] = (guint) g_ascii_strtoull (sep + 1, NULL, 10);
+    }
+  g_strfreev (items);
+
+  for (kind = 0; kind < N_BENCH_KINDS; kind++)
+    bench->total_weight += bench->weights[kind];
+
+  if (bench->total_weight == 0)
+    {
+      g_set_error_literal (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                           "The request mix has no weights");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+setup_daemon_process (gpointer user_data)
+{
+  /* send SIGTERM when we die, to avoid leaving the daemon around */
+  prctl (PR_SET_PDEATHSIG, SIGTERM);
+}
+
+static GSubprocess *
+start_daemon (const gchar *daemon_path,
+              gint port,
+              GError **error)
+{
+  GSubprocessLauncher *launcher;
+  GSubprocess *daemon;
+  gchar *port_str, **env;
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_set_child_setup (launcher, setup_daemon_process, NULL, NULL);
+
+  port_str = g_strdup_printf ("%d", port);
+  g_subprocess_launcher_setenv (launcher, "XB_PORT", port_str, TRUE);
+  g_free (port_str);
+
+  for (env = opt_env; env != NULL && *env != NULL; env++)
+    g_subprocess_launcher_putenv (launcher, *env);
+
+  daemon = g_subprocess_launcher_spawn (launcher, error, daemon_path, NULL);
+  g_object_unref (launcher);
+
+  return daemon;
+}
+
+/* Waits until the daemon answers GET /ready */
+static gboolean
+wait_for_daemon (Bench *bench,
+                 GError **error)
+{
+  SoupMessage *message;
+  gchar *uri;
+  gint64 deadline = g_get_monotonic_time () + STARTUP_TIMEOUT;
+  guint status = SOUP_STATUS_NONE;
+
+  uri = g_strconcat (bench->base_uri, "/ready", NULL);
+
+  while (status != SOUP_STATUS_OK && g_get_monotonic_time () < deadline)
+    {
+      message = soup_message_new (SOUP_METHOD_GET, uri);
+      status = soup_session_send_message (bench->session, message);
+      g_object_unref (message);
+
+      if (status != SOUP_STATUS_OK)
+        g_usleep (50 * G_TIME_SPAN_MILLISECOND);
+    }
+
+  g_free (uri);
+
+  if (status != SOUP_STATUS_OK)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                           "The daemon did not become ready");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gchar *
+make_request_uri (Bench *bench,
+                  BenchKind kind)
+{
+  const gchar *first, *second;
+  gchar *q, *escaped, *uri;
+
+  first = bench->terms[g_rand_int_range (bench->rand, 0, bench->n_terms)];
+  second = bench->terms[g_rand_int_range (bench->rand, 0, bench->n_terms)];
+
+  /* Fixing a query is mostly worth it for single words */
+  if (kind == BENCH_FIX || g_rand_boolean (bench->rand))
+    q = g_strdup (first);
+  else
+    q = g_strdup_printf ("%s %s", first, second);
+
+  escaped = g_uri_escape_string (q, NULL, FALSE);
+
+  if (kind == BENCH_QUERY)
+    uri = g_strdup_printf ("%s/query?%s=%s&q=%s&offset=0&limit=%d",
+                           bench->base_uri, bench->db_param, bench->escaped_db,
+                           escaped, opt_limit);
+  else
+    uri = g_strdup_printf ("%s/fix?%s=%s&q=%s",
+                           bench->base_uri, bench->db_param, bench->escaped_db,
+                           escaped);
+
+  g_free (escaped);
+  g_free (q);
+
+  return uri;
+}
+
+static BenchKind
+pick_kind (Bench *bench)
+{
+  guint value = g_rand_int_range (bench->rand, 0, bench->total_weight);
+  gint kind;
+
+  for (kind = 0; kind < N_BENCH_KINDS - 1; kind++)
+    {
+      if (value < bench->weights[kind])
+        break;
+      value -= bench->weights[kind];
+    }
+
+  return kind;
+}
+
+static void send_request (Bench *bench, gint64 start);
+
+static void
+request_done (SoupSession *session,
+              SoupMessage *message,
+              gpointer user_data)
+{
+  BenchRequest *request = user_data;
+  Bench *bench = request->bench;
+  KindStats *stats = &bench->stats[request->kind];
+  gint64 now = g_get_monotonic_time ();
+  gint64 latency = now - request->start;
+
+  if (request->start >= bench->warmup_end && request->start < bench->end)
+    {
+      if (message->status_code == SOUP_STATUS_OK)
+        g_array_append_val (stats->latencies, latency);
+      else
+        stats->errors++;
+    }
+
+  bench->in_flight--;
+  g_slice_free (BenchRequest, request);
+
+  /* Without a rate, every answer lets another request go */
+  if (bench->rate <= 0 && now < bench->end)
+    send_request (bench, now);
+
+  if (now >= bench->end && bench->in_flight == 0 && bench->timer_id == 0)
+    g_main_loop_quit (bench->loop);
+}
+
+static void
+send_request (Bench *bench,
+              gint64 start)
+{
+  BenchRequest *request;
+  SoupMessage *message;
+  gchar *uri;
+
+  request = g_slice_new0 (BenchRequest);
+  request->bench = bench;
+  request->kind = pick_kind (bench);
+  request->start = start;
+
+  uri = make_request_uri (bench, request->kind);
+  message = soup_message_new (SOUP_METHOD_GET, uri);
+  g_free (uri);
+
+  bench->in_flight++;
+  soup_session_queue_message (bench->session, message, request_done, request);
+}
+
+/* Starts the requests that are due at the given rate. They are timed from
+ * when they were due, so that a slow daemon does not slow down the load
+ * and hide its own latency.
+ */
+static gboolean
+send_scheduled_requests (gpointer user_data)
+{
+  Bench *bench = user_data;
+  gint64 now = g_get_monotonic_time ();
+  guint64 due;
+
+  due = (guint64) ((MIN (now, bench->end) - bench->start) * bench->rate / G_USEC_PER_SEC);
+  for (; bench->scheduled < due; bench->scheduled++)
+    send_request (bench, bench->start + bench->scheduled * G_USEC_PER_SEC / bench->rate);
+
+  if (now < bench->end)
+    return G_SOURCE_CONTINUE;
+
+  bench->timer_id = 0;
+  if (bench->in_flight == 0)
+    g_main_loop_quit (bench->loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+run_bench (Bench *bench)
+{
+  guint idx;
+
+  bench->start = g_get_monotonic_time ();
+  bench->warmup_end = bench->start + opt_warmup * G_USEC_PER_SEC;
+  bench->end = bench->warmup_end + opt_duration * G_USEC_PER_SEC;
+
+  if (bench->rate > 0)
+    bench->timer_id = g_timeout_add (1, send_scheduled_requests, bench);
+  else
+    for (idx = 0; idx < bench->concurrency; idx++)
+      send_request (bench, bench->start);
+
+  g_main_loop_run (bench->loop);
+}
+
+static gint
+compare_latencies (gconstpointer a,
+                   gconstpointer b)
+{
+  gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted latencies, in milliseconds */
+static gdouble
+percentile (GArray *latencies,
+            gdouble p)
+{
+  guint rank;
+
+  if (latencies->len == 0)
+    return 0;
+
+  rank = (guint) (p * latencies->len);
+  if (rank < p * latencies->len)
+    rank++;
+  rank = CLAMP (rank, 1, latencies->len);
+
+  return g_array_index (latencies, gint64, rank - 1) / 1000.0;
+}
+
+static void
+add_stats (JsonBuilder *builder,
+           GArray *latencies,
+           guint64 errors,
+           gdouble seconds)
+{
+  gdouble sum = 0;
+  guint idx;
+
+  g_array_sort (latencies, compare_latencies);
+  for (idx = 0; idx < latencies->len; idx++)
+    sum += g_array_index (latencies, gint64, idx);
+
+  json_builder_set_member_name (builder, "requests");
+  json_builder_add_int_value (builder, latencies->len + errors);
+  json_builder_set_member_name (builder, "errors");
+  json_builder_add_int_value (builder, errors);
+  json_builder_set_member_name (builder, "throughput");
+  json_builder_add_double_value (builder, latencies->len / seconds);
+
+  json_builder_set_member_name (builder, "latency_ms");
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "mean");
+  json_builder_add_double_value (builder, latencies->len > 0 ? sum / latencies->len / 1000.0 : 0);
+  json_builder_set_member_name (builder, "p50");
+  json_builder_add_double_value (builder, percentile (latencies, 0.5));
+  json_builder_set_member_name (builder, "p95");
+  json_builder_add_double_value (builder, percentile (latencies, 0.95));
+  json_builder_set_member_name (builder, "p99");
+  json_builder_add_double_value (builder, percentile (latencies, 0.99));
+  json_builder_set_member_name (builder, "p999");
+  json_builder_add_double_value (builder, percentile (latencies, 0.999));
+  json_builder_set_member_name (builder, "max");
+  json_builder_add_double_value (builder, percentile (latencies, 1));
+  json_builder_end_object (builder);
+}
+
+static gchar *
+make_report (Bench *bench)
+{
+  JsonBuilder *builder;
+  JsonGenerator *generator;
+  JsonNode *root;
+  GArray *all;
+  guint64 errors = 0;
+  gchar *report;
+  gint kind;
+
+  all = g_array_new (FALSE, FALSE, sizeof (gint64));
+  for (kind = 0; kind < N_BENCH_KINDS; kind++)
+    {
+      g_array_append_vals (all, bench->stats[kind].latencies->data,
+                           bench->stats[kind].latencies->len);
+      errors += bench->stats[kind].errors;
+    }
+
+  builder = json_builder_new ();
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "duration");
+  json_builder_add_double_value (builder, opt_duration);
+  json_builder_set_member_name (builder, "concurrency");
+  json_builder_add_int_value (builder, bench->concurrency);
+  json_builder_set_member_name (builder, "rate");
+  json_builder_add_double_value (builder, bench->rate);
+  add_stats (builder, all, errors, opt_duration);
+
+  json_builder_set_member_name (builder, "kinds");
+  json_builder_begin_object (builder);
+  for (kind = 0; kind < N_BENCH_KINDS; kind++)
+    {
+      if (bench->weights[kind] == 0)
+        continue;
+
+      json_builder_set_member_name (builder, kind_names[kind]);
+      json_builder_begin_object (builder);
+      add_stats (builder, bench->stats[kind].latencies, bench->stats[kind].errors,
+                 opt_duration);
+      json_builder_end_object (builder);
+    }
+  json_builder_end_object (builder);
+
+  json_builder_end_object (builder);
+
+  root = json_builder_get_root (builder);
+  generator = json_generator_new ();
+  json_generator_set_pretty (generator, TRUE);
+  json_generator_set_root (generator, root);
+  report = json_generator_to_data (generator, NULL);
+
+  g_object_unref (generator);
+  json_node_free (root);
+  g_object_unref (builder);
+  g_array_unref (all);
+
+  return report;
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  GOptionContext *context;
+  Bench bench = { NULL, };
+  GSubprocess *daemon = NULL;
+  gchar *corpus_dir = NULL, *daemon_path, *generator, *report;
+  gint kind, status = EXIT_FAILURE;
+  GError *error = NULL;
+
+  context = g_option_context_new ("- measure xapian-bridge throughput and latency");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    goto out;
+
+  if (!parse_mix (&bench, opt_mix != NULL ? opt_mix : "query=9,fix=1", &error))
+    goto out;
+
+  if (opt_db == NULL)
+    {
+      corpus_dir = g_dir_make_tmp ("bench-daemon-XXXXXX", &error);
+      if (corpus_dir == NULL)
+        goto out;
+
+      g_printerr ("Generating %d documents in %s\n", opt_documents, corpus_dir);
+      generator = opt_generator != NULL ? g_strdup (opt_generator) :
+                  get_sibling_program (argv[0], "generate-test-db");
+      if (!generate_corpus (generator, corpus_dir, &error))
+        {
+          g_free (generator);
+          goto out;
+        }
+      g_free (generator);
+
+      opt_db = g_build_filename (corpus_dir, "manifest.json", NULL);
+    }
+
+  bench.db_param = g_str_has_suffix (opt_db, ".json") ? "manifest_path" : "path";
+
+  if (opt_terms != NULL)
+    bench.terms = g_strsplit (opt_terms, ",", -1);
+  else
+    bench.terms = load_terms (opt_db, &error);
+  if (bench.terms == NULL)
+    goto out;
+
+  bench.n_terms = g_strv_length (bench.terms);
+  if (bench.n_terms == 0)
+    {
+      g_set_error_literal (&error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                           "No words to query for");
+      goto out;
+    }
+
+  if (opt_port == 0)
+    opt_port = g_random_int_range (13000, 13500);
+
+  daemon_path = opt_daemon != NULL ? g_strdup (opt_daemon) :
+                get_sibling_program (argv[0], "xapian-bridge");
+
+  daemon = start_daemon (daemon_path, opt_port, &error);
+  g_free (daemon_path);
+  if (daemon == NULL)
+    goto out;
+
+  bench.concurrency = MAX (opt_concurrency, 1);
+  bench.rate = opt_rate;
+  bench.rand = g_rand_new ();
+  bench.loop = g_main_loop_new (NULL, FALSE);
+  bench.base_uri = g_strdup_printf ("http://127.0.0.1:%d", opt_port);
+  bench.escaped_db = g_uri_escape_string (opt_db, NULL, FALSE);
+  bench.session = soup_session_new_with_options (SOUP_SESSION_MAX_CONNS, bench.concurrency,
+                                                 SOUP_SESSION_MAX_CONNS_PER_HOST, bench.concurrency,
+                                                 NULL);
+  for (kind = 0; kind < N_BENCH_KINDS; kind++)
+    bench.stats[kind].latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+  if (!wait_for_daemon (&bench, &error))
+    goto out;
+
+  run_bench (&bench);
+
+  report = make_report (&bench);
+  if (opt_output != NULL)
+    {
+      if (!g_file_set_contents (opt_output, report, -1, &error))
+        {
+          g_free (report);
+          goto out;
+        }
+    }
+  else
+    {
+      g_print ("%s\n", report);
+    }
+  g_free (report);
+
+  status = EXIT_SUCCESS;
+
+ out:
+  if (error != NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+    }
+
+  if (daemon != NULL)
+    {
+      g_subprocess_send_signal (daemon, SIGTERM);
+      g_subprocess_wait (daemon, NULL, NULL);
+      g_object_unref (daemon);
+    }
+
+  if (corpus_dir != NULL)
+    {
+      test_clear_dir (corpus_dir);
+      g_free (corpus_dir);
+    }
+
+  for (kind = 0; kind < N_BENCH_KINDS; kind++)
+    g_clear_pointer (&bench.stats[kind].latencies, g_array_unref);
+  g_clear_object (&bench.session);
+  g_clear_pointer (&bench.loop, g_main_loop_unref);
+  g_clear_pointer (&bench.rand, g_rand_free);
+  g_free (bench.base_uri);
+  g_free (bench.escaped_db);
+  g_strfreev (bench.terms);
+  g_option_context_free (context);
+
+  return status;
+}
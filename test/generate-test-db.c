@@ -1,16 +1,74 @@
+/* Writes the test databases, or with --documents, a synthetic corpus for
+ * benchmarks:
+ *
+ *   generate-test-db                 test/testdb, as a chert database
+ *   generate-test-db glass           test/testdb.glass, as a single-file
+ *                                    glass database
+ *   generate-test-db --documents N [--shards N] [--output DIR] ...
+ *
+ * The corpus has a Zipf-distributed vocabulary, titles indexed with the
+ * prefixes listed in its XbPrefixes metadata, tags and ids as boolean
+ * terms, its most frequent words as XbStopwords, spelling data, and values
+ * to sort (slot 0) and collapse (slot 1) on. Its shards are compacted one
+ * after the other into DIR/corpus.glass, listed with their offsets in
+ * DIR/manifest.json. DIR/words.txt lists words worth querying for.
+ */
+
+#include <gio/gio.h>
 #include <xapian-glib.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "test-util.h"
+
 #define N_DOCUMENTS 5
 
+#define N_TAGS 20
+#define N_STOPWORDS 10
+#define N_QUERY_WORDS 1000
+#define MAX_TITLE_WORDS 6
+#define SORT_SLOT 0
+#define COLLAPSE_SLOT 1
+
+#define PREFIXES_JSON "{" \
+  "\"prefixes\":[{\"field\":\"title\",\"prefix\":\"S\"}]," \
+  "\"booleanPrefixes\":[{\"field\":\"tag\",\"prefix\":\"K\"},{\"field\":\"id\",\"prefix\":\"Q\"}]" \
+  "}"
+
+static gint opt_documents = 0;
+static gint opt_shards = 1;
+static gint opt_vocabulary = 20000;
+static gint opt_words = 100;
+static gdouble opt_zipf = 1.0;
+static gint opt_seed = 0;
+static gchar *opt_output = NULL;
+
+static GOptionEntry entries[] = {
+  { "documents", 'n', 0, G_OPTION_ARG_INT, &opt_documents,
+    "Write a synthetic corpus of N documents", "N" },
+  { "shards", 0, 0, G_OPTION_ARG_INT, &opt_shards,
+    "Shards of the corpus (default: 1)", "N" },
+  { "vocabulary", 0, 0, G_OPTION_ARG_INT, &opt_vocabulary,
+    "Distinct words in the corpus (default: 20000)", "N" },
+  { "words", 0, 0, G_OPTION_ARG_INT, &opt_words,
+    "Words per document (default: 100)", "N" },
+  { "zipf", 0, 0, G_OPTION_ARG_DOUBLE, &opt_zipf,
+    "Exponent of the word frequency distribution (default: 1.0)", "S" },
+  { "seed", 0, 0, G_OPTION_ARG_INT, &opt_seed,
+    "Random seed (default: 0)", "N" },
+  { "output", 'o', 0, G_OPTION_ARG_FILENAME, &opt_output,
+    "Directory to write the corpus to (default: corpus)", "DIR" },
+  { NULL }
+};
+
 static void
 add_document (XapianWritableDatabase *db)
 {
   XapianDocument *doc;
   gboolean res;
   GError *error = NULL;
-  
+
   doc = xapian_document_new ();
   g_assert_nonnull (doc);
 
@@ -24,9 +82,8 @@ add_document (XapianWritableDatabase *db)
   g_object_unref (doc);
 }
 
-int
-main (int argc,
-      char **argv)
+static void
+generate_test_db (gboolean glass)
 {
   XapianWritableDatabase *db;
   gboolean res;
@@ -34,11 +91,9 @@ main (int argc,
   gint idx;
   const gchar *outfile = "test/testdb";
   XapianDatabaseBackend backend = XAPIAN_DATABASE_BACKEND_CHERT;
-  gboolean glass = FALSE;
 
-  if (argc > 1 && strcmp (argv[1], "glass") == 0)
+  if (glass)
     {
-      glass = TRUE;
       outfile = "test/testdb.tmp";
       backend = XAPIAN_DATABASE_BACKEND_GLASS;
     }
@@ -62,6 +117,362 @@ main (int argc,
     xapian_database_compact_to_path (XAPIAN_DATABASE (db), "test/testdb.glass",
                                      XAPIAN_DATABASE_COMPACT_FLAGS_SINGLE_FILE);
   xapian_database_close (XAPIAN_DATABASE (db));
+}
+
+/* Words are made of syllables, so that misspelling one often gives another
+ * one, or something close enough to be corrected.
+ */
+static gchar *
+make_word (guint rank)
+{
+  static const gchar *syllables[] = {
+    "ba", "ko", "mi", "ne", "ru", "sa", "te", "vo", "li", "da",
+    "fe", "gu", "ha", "jo", "pi", "ze",
+  };
+  GString *word = g_string_new (NULL);
+
+  rank++;
+  do
+    {
+      g_string_append (word, syllables[rank % G_N_ELEMENTS (syllables)]);
+      rank /= G_N_ELEMENTS (syllables);
+    }
+  while (rank > 0);
+
+  return g_string_free (word, FALSE);
+}
+
+typedef struct {
+  GRand *rand;
+  /* Cumulative probability of the words up to each rank */
+  gdouble *cumulative;
+  gchar **words;
+  guint n_words;
+} Vocabulary;
+
+static void
+vocabulary_init (Vocabulary *vocabulary,
+                 guint n_words,
+                 gdouble exponent,
+                 guint32 seed)
+{
+  gdouble total = 0;
+  guint rank;
+
+  vocabulary->rand = g_rand_new_with_seed (seed);
+  vocabulary->n_words = n_words;
+  vocabulary->cumulative = g_new (gdouble, n_words);
+  vocabulary->words = g_new0 (gchar *, n_words + 1);
+
+  for (rank = 0; rank < n_words; rank++)
+    {
+      total += 1 / pow (rank + 1, exponent);
+      vocabulary->cumulative[rank] = total;
+      vocabulary->words[rank] = make_word (rank);
+    }
+
+  for (rank = 0; rank < n_words; rank++)
+    vocabulary->cumulative[rank] /= total;
+}
+
+static void
+vocabulary_clear (Vocabulary *vocabulary)
+{
+  g_rand_free (vocabulary->rand);
+  g_free (vocabulary->cumulative);
+  g_strfreev (vocabulary->words);
+}
+
+static const gchar *
+vocabulary_pick (Vocabulary *vocabulary)
+{
+  gdouble x = g_rand_double (vocabulary->rand);
+  guint low = 0, high = vocabulary->n_words - 1, mid;
+
+  while (low < high)
+    {
+      mid = (low + high) / 2;
+      if (vocabulary->cumulative[mid] < x)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  return vocabulary->words[low];
+}
+
+static void
+add_corpus_document (XapianWritableDatabase *db,
+                     Vocabulary *vocabulary,
+                     guint id)
+{
+  XapianDocument *doc;
+  GString *data, *title;
+  const gchar *word;
+  gchar *term, *value, *tag;
+  guint idx, n_title_words, position = 1;
+  GError *error = NULL;
+
+  doc = xapian_document_new ();
+  title = g_string_new (NULL);
+
+  n_title_words = g_rand_int_range (vocabulary->rand, 1, MAX_TITLE_WORDS + 1);
+  for (idx = 0; idx < n_title_words; idx++)
+    {
+      word = vocabulary_pick (vocabulary);
+      if (title->len > 0)
+        g_string_append_c (title, ' ');
+      g_string_append (title, word);
+
+      term = g_strconcat ("S", word, NULL);
+      xapian_document_add_posting (doc, term, position);
+      xapian_document_add_posting (doc, word, position++);
+      xapian_writable_database_add_spelling (db, word, 1);
+      g_free (term);
+    }
+
+  term = g_strconcat ("XEXACTS", title->str, NULL);
+  xapian_document_add_boolean_term (doc, term);
+  g_free (term);
+
+  /* A gap, so that phrases do not span the title and the body */
+  position += 100;
+  for (idx = 0; idx < opt_words; idx++)
+    {
+      word = vocabulary_pick (vocabulary);
+      xapian_document_add_posting (doc, word, position++);
+      xapian_writable_database_add_spelling (db, word, 1);
+    }
+
+  tag = g_strdup_printf ("tag%u", (guint) (g_rand_double (vocabulary->rand) *
+                                           g_rand_double (vocabulary->rand) * N_TAGS));
+  term = g_strconcat ("K", tag, NULL);
+  xapian_document_add_boolean_term (doc, term);
+  g_free (term);
+
+  term = g_strdup_printf ("Q%u", id);
+  xapian_document_add_boolean_term (doc, term);
+  g_free (term);
+
+  /* Sorts as a string, like a date would */
+  value = g_strdup_printf ("%010u", g_rand_int (vocabulary->rand));
+  xapian_document_add_value (doc, SORT_SLOT, value);
+  g_free (value);
+
+  /* A few documents share each collapse key */
+  value = g_strdup_printf ("%u", g_rand_int_range (vocabulary->rand, 0,
+                                                   MAX (opt_documents / 4, 1)));
+  xapian_document_add_value (doc, COLLAPSE_SLOT, value);
+  g_free (value);
+
+  data = g_string_new (NULL);
+  g_string_append_printf (data, "{\"id\":%u,\"title\":\"%s\",\"tags\":[\"%s\"]}",
+                          id, title->str, tag);
+  xapian_document_set_data (doc, data->str);
+
+  xapian_writable_database_add_document (db, doc, NULL, &error);
+  g_assert_no_error (error);
+
+  g_string_free (data, TRUE);
+  g_string_free (title, TRUE);
+  g_free (tag);
+  g_object_unref (doc);
+}
+
+static gchar *
+make_stopwords_json (Vocabulary *vocabulary)
+{
+  GString *json = g_string_new ("[");
+  guint idx;
+
+  for (idx = 0; idx < N_STOPWORDS && idx < vocabulary->n_words; idx++)
+    g_string_append_printf (json, "%s\"%s\"", idx > 0 ? "," : "",
+                            vocabulary->words[idx]);
+  g_string_append_c (json, ']');
+
+  return g_string_free (json, FALSE);
+}
+
+/* Writes the documents id % n_shards == shard, like Xapian interleaves the
+ * documents of the databases it searches together, as a single-file
+ * database at @path.
+ */
+static void
+generate_shard (const gchar *tmp_dir,
+                const gchar *path,
+                Vocabulary *vocabulary,
+                guint shard,
+                guint n_shards)
+{
+  XapianWritableDatabase *db;
+  gchar *db_path, *stopwords;
+  guint id;
+  GError *error = NULL;
+
+  db_path = g_strdup_printf ("%s/shard%u", tmp_dir, shard);
+  db = g_initable_new (XAPIAN_TYPE_WRITABLE_DATABASE, NULL, &error,
+                       "path", db_path,
+                       "action", XAPIAN_DATABASE_ACTION_CREATE_OR_OVERWRITE,
+                       "backend", XAPIAN_DATABASE_BACKEND_GLASS,
+                       NULL);
+  g_assert_no_error (error);
+
+  stopwords = make_stopwords_json (vocabulary);
+  xapian_writable_database_set_metadata (db, "XbPrefixes", PREFIXES_JSON);
+  xapian_writable_database_set_metadata (db, "XbStopwords", stopwords);
+  g_free (stopwords);
+
+  for (id = shard; id < opt_documents; id += n_shards)
+    add_corpus_document (db, vocabulary, id);
+
+  xapian_writable_database_commit (db, &error);
+  g_assert_no_error (error);
+
+  xapian_database_compact_to_path (XAPIAN_DATABASE (db), path,
+                                   XAPIAN_DATABASE_COMPACT_FLAGS_SINGLE_FILE);
+  xapian_database_close (XAPIAN_DATABASE (db));
+  g_object_unref (db);
+  g_free (db_path);
+}
+
+/* Appends the file at @path to @out, and returns where it starts */
+static goffset
+append_file (GOutputStream *out,
+             const gchar *path)
+{
+  GFile *file;
+  GFileInputStream *in;
+  goffset offset;
+  GError *error = NULL;
+
+  offset = g_seekable_tell (G_SEEKABLE (out));
+
+  file = g_file_new_for_path (path);
+  in = g_file_read (file, NULL, &error);
+  g_assert_no_error (error);
+
+  g_output_stream_splice (out, G_INPUT_STREAM (in),
+                          G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE, NULL, &error);
+  g_assert_no_error (error);
+
+  g_object_unref (in);
+  g_object_unref (file);
+
+  return offset;
+}
+
+static void
+write_words (const gchar *path,
+             Vocabulary *vocabulary)
+{
+  GString *words = g_string_new (NULL);
+  guint idx;
+  GError *error = NULL;
+
+  for (idx = N_STOPWORDS; idx < N_STOPWORDS + N_QUERY_WORDS && idx < vocabulary->n_words; idx++)
+    g_string_append_printf (words, "%s\n", vocabulary->words[idx]);
+
+  g_file_set_contents (path, words->str, words->len, &error);
+  g_assert_no_error (error);
+
+  g_string_free (words, TRUE);
+}
+
+static void
+generate_corpus (const gchar *output)
+{
+  Vocabulary vocabulary;
+  GFile *file;
+  GFileOutputStream *out;
+  GString *manifest;
+  gchar *tmp_dir, *shard_path, *path;
+  goffset offset;
+  guint shard;
+  GError *error = NULL;
+
+  g_mkdir_with_parents (output, 0755);
+  tmp_dir = g_dir_make_tmp ("generate-test-db-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  vocabulary_init (&vocabulary, opt_vocabulary, opt_zipf, opt_seed);
+
+  path = g_build_filename (output, "corpus.glass", NULL);
+  file = g_file_new_for_path (path);
+  out = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, &error);
+  g_assert_no_error (error);
+  g_free (path);
+
+  manifest = g_string_new ("{\n  \"xapian_databases\": [\n");
+
+  for (shard = 0; shard < opt_shards; shard++)
+    {
+      shard_path = g_strdup_printf ("%s/shard%u.glass", tmp_dir, shard);
+      generate_shard (tmp_dir, shard_path, &vocabulary, shard, opt_shards);
+
+      offset = append_file (G_OUTPUT_STREAM (out), shard_path);
+      g_string_append_printf (manifest,
+                              "    {\n"
+                              "      \"path\": \"corpus.glass\",\n"
+                              "      \"offset\": %" G_GOFFSET_FORMAT "\n"
+                              "    }%s\n",
+                              offset, shard + 1 < opt_shards ? "," : "");
+      g_free (shard_path);
+    }
+
+  g_string_append (manifest, "  ]\n}\n");
+
+  g_output_stream_close (G_OUTPUT_STREAM (out), NULL, &error);
+  g_assert_no_error (error);
+
+  path = g_build_filename (output, "manifest.json", NULL);
+  g_file_set_contents (path, manifest->str, manifest->len, &error);
+  g_assert_no_error (error);
+  g_free (path);
+
+  path = g_build_filename (output, "words.txt", NULL);
+  write_words (path, &vocabulary);
+  g_free (path);
+
+  test_clear_dir (tmp_dir);
+
+  vocabulary_clear (&vocabulary);
+  g_string_free (manifest, TRUE);
+  g_object_unref (out);
+  g_object_unref (file);
+  g_free (tmp_dir);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+
+  context = g_option_context_new ("[glass] - write the test databases or a corpus");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return EXIT_FAILURE;
+    }
+  g_option_context_free (context);
+
+  if (opt_documents > 0)
+    {
+      if (opt_shards < 1 || opt_vocabulary < 1)
+        {
+          g_printerr ("There must be at least one shard and one word\n");
+          return EXIT_FAILURE;
+        }
+
+      generate_corpus (opt_output != NULL ? opt_output : "corpus");
+    }
+  else
+    {
+      generate_test_db (argc > 1 && strcmp (argv[1], "glass") == 0);
+    }
 
   return EXIT_SUCCESS;
 }
@@ -1,8 +1,10 @@
 #include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
 #include <libsoup/soup.h>
 #include <signal.h>
 #include <string.h>
 #include <sys/prctl.h>
+#include <unistd.h>
 
 #include "test-util.h"
 
@@ -28,6 +30,7 @@ setup (DaemonFixture *fixture,
   GSubprocessLauncher *launcher;
   GSocketClient *client;
   GSocketConnection *connection;
+  const gchar * const *env;
   gint port;
 
   daemon_path = g_test_build_filename (G_TEST_BUILT, "xapian-bridge", NULL);
@@ -41,6 +44,10 @@ setup (DaemonFixture *fixture,
   g_subprocess_launcher_set_child_setup (launcher, setup_xapian_bridge_process, NULL, NULL);
   g_subprocess_launcher_setenv (launcher, "XB_PORT", fixture->port, TRUE);
 
+  /* extra environment for the daemon, as NAME=value strings */
+  for (env = user_data; env != NULL && *env != NULL; env++)
+    g_subprocess_launcher_putenv (launcher, *env);
+
   fixture->daemon = g_subprocess_launcher_spawnv (launcher, argv, &error);
   g_assert_no_error (error);
 
@@ -149,6 +156,39 @@ test_feature_testing_works (DaemonFixture *fixture,
 
 }
 
+static void
+test_ready_after_startup (DaemonFixture *fixture,
+                          gconstpointer user_data)
+{
+  SoupSession *session;
+  SoupRequestHTTP *req;
+  GInputStream *stream;
+  GError *error = NULL;
+  SoupMessage *message;
+  gchar *req_uri;
+
+  req_uri = g_strdup_printf ("http://localhost:%s/ready", fixture->port);
+
+  session = soup_session_new ();
+  req = soup_session_request_http (session, SOUP_METHOD_GET,
+                                   req_uri,
+                                   &error);
+  g_assert_no_error (error);
+  g_free (req_uri);
+
+  stream = soup_request_send (SOUP_REQUEST (req), NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (stream);
+
+  message = soup_request_http_get_message (req);
+  g_assert_cmpint (message->status_code, ==, 200);
+
+  g_object_unref (req);
+  g_object_unref (session);
+  g_object_unref (message);
+  g_object_unref (stream);
+}
+
 static void
 test_get_query_returns_json (DaemonFixture *fixture,
                              gconstpointer user_data)
@@ -195,6 +235,186 @@ test_get_query_returns_json (DaemonFixture *fixture,
   g_object_unref (stream);
 }
 
+static void
+test_get_query_reports_server_timing (DaemonFixture *fixture,
+                                      gconstpointer user_data)
+{
+  gchar *db_path;
+  SoupSession *session;
+  SoupMessage *message;
+  gchar *req_uri;
+  const gchar *server_timing;
+
+  db_path = test_get_sample_db_path_for_query ();
+  req_uri = g_strdup_printf ("http://localhost:%s/query?path=%s&q=a&offset=0&limit=5&timing",
+                             fixture->port, db_path);
+  g_free (db_path);
+
+  session = soup_session_new ();
+  message = soup_message_new (SOUP_METHOD_GET, req_uri);
+  soup_session_send_message (session, message);
+  g_assert_cmpint (message->status_code, ==, 200);
+  g_free (req_uri);
+
+  server_timing = soup_message_headers_get_one (message->response_headers, "Server-Timing");
+  g_assert_nonnull (server_timing);
+  g_assert_nonnull (strstr (server_timing, "wait;dur="));
+  g_assert_nonnull (strstr (server_timing, "total;dur="));
+
+  g_object_unref (message);
+  g_object_unref (session);
+}
+
+static void
+test_get_query_streams_json (DaemonFixture *fixture,
+                             gconstpointer user_data)
+{
+  gchar *db_path;
+  SoupSession *session;
+  SoupRequestHTTP *req;
+  GInputStream *stream;
+  GError *error = NULL;
+  GString *reply;
+  SoupMessage *message;
+  gchar *req_uri;
+
+  db_path = test_get_sample_db_path_for_query ();
+  req_uri = g_strdup_printf ("http://localhost:%s/query?path=%s&q=a&offset=0&limit=-1&stream=1",
+                             fixture->port, db_path);
+  g_free (db_path);
+
+  session = soup_session_new ();
+  req = soup_session_request_http (session, SOUP_METHOD_GET,
+                                   req_uri,
+                                   &error);
+  g_assert_no_error (error);
+  g_free (req_uri);
+
+  stream = soup_request_send (SOUP_REQUEST (req), NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (stream);
+
+  reply = flush_stream_to_string (stream);
+  g_assert_cmpint (reply->str[0], ==, '{');
+  g_assert_true (g_str_has_suffix (reply->str, "]}"));
+
+  message = soup_request_http_get_message (req);
+  g_assert_cmpint (message->status_code, ==, 200);
+  g_assert_cmpint (soup_message_headers_get_encoding (message->response_headers),
+                   ==, SOUP_ENCODING_CHUNKED);
+
+  g_string_free (reply, TRUE);
+  g_object_unref (req);
+  g_object_unref (session);
+  g_object_unref (message);
+  g_object_unref (stream);
+}
+
+static void
+test_get_metrics_counts_requests (DaemonFixture *fixture,
+                                  gconstpointer user_data)
+{
+  SoupSession *session;
+  SoupMessage *message;
+  GHashTable *names;
+  gchar *req_uri, *body, *name;
+  gchar **lines;
+  guint idx;
+
+  session = soup_session_new ();
+
+  req_uri = g_strdup_printf ("http://localhost:%s/ready", fixture->port);
+  message = soup_message_new (SOUP_METHOD_GET, req_uri);
+  soup_session_send_message (session, message);
+  g_assert_cmpint (message->status_code, ==, 200);
+  g_object_unref (message);
+  g_free (req_uri);
+
+  req_uri = g_strdup_printf ("http://localhost:%s/metrics", fixture->port);
+  message = soup_message_new (SOUP_METHOD_GET, req_uri);
+  soup_session_send_message (session, message);
+  g_assert_cmpint (message->status_code, ==, 200);
+  g_free (req_uri);
+
+  body = g_strndup (message->response_body->data, message->response_body->length);
+  g_assert_nonnull (strstr (body, "xapian_bridge_requests_total{route=\"/ready\",code=\"200\"} 1\n"));
+  g_assert_nonnull (strstr (body, "# TYPE xapian_bridge_open_databases gauge\n"));
+  g_assert_nonnull (strstr (body, "# TYPE xapian_bridge_admitted_requests_in_flight gauge\n"));
+  g_assert_nonnull (strstr (body, "# TYPE xapian_bridge_worker_pid gauge\n"));
+
+  /* Prometheus rejects a whole scrape in which a metric appears twice */
+  names = g_hash_table_new (g_str_hash, g_str_equal);
+  lines = g_strsplit (body, "\n", -1);
+  for (idx = 0; lines[idx] != NULL; idx++)
+    {
+      if (!g_str_has_prefix (lines[idx], "# TYPE "))
+        continue;
+
+      name = lines[idx] + strlen ("# TYPE ");
+      *strchr (name, ' ') = '\0';
+      if (!g_hash_table_add (names, name))
+        g_error ("Metric %s appears twice in:\n%s", name, body);
+    }
+  g_hash_table_unref (names);
+  g_strfreev (lines);
+
+  g_free (body);
+  g_object_unref (message);
+  g_object_unref (session);
+}
+
+static void
+test_post_batch_returns_all_results (DaemonFixture *fixture,
+                                     gconstpointer user_data)
+{
+  gchar *db_path, *req_uri, *body;
+  SoupSession *session;
+  SoupMessage *message;
+  JsonParser *parser;
+  JsonObject *root;
+  JsonArray *results;
+  GError *error = NULL;
+
+  db_path = test_get_sample_db_path ();
+  body = g_strdup_printf ("["
+                          "{\"params\": {\"path\": \"%1$s\", \"q\": \"a\", \"limit\": 5, \"offset\": 0}},"
+                          "{\"type\": \"fix\", \"params\": {\"path\": \"%1$s\", \"q\": \"a\"}},"
+                          "{\"params\": {\"q\": \"a\"}}"
+                          "]", db_path);
+  g_free (db_path);
+
+  req_uri = g_strdup_printf ("http://localhost:%s/batch", fixture->port);
+
+  session = soup_session_new ();
+  message = soup_message_new (SOUP_METHOD_POST, req_uri);
+  soup_message_set_request (message, "application/json", SOUP_MEMORY_TAKE,
+                            body, strlen (body));
+  soup_session_send_message (session, message);
+  g_assert_cmpint (message->status_code, ==, 200);
+
+  parser = json_parser_new ();
+  json_parser_load_from_data (parser, message->response_body->data,
+                              message->response_body->length, &error);
+  g_assert_no_error (error);
+
+  root = json_node_get_object (json_parser_get_root (parser));
+  results = json_object_get_array_member (root, "results");
+  g_assert_cmpuint (json_array_get_length (results), ==, 3);
+
+  /* results come in the order of the requests */
+  g_assert_true (json_object_has_member (json_array_get_object_element (results, 0),
+                                         "numResults"));
+  g_assert_false (json_object_has_member (json_array_get_object_element (results, 1),
+                                          "error"));
+  g_assert_true (json_object_has_member (json_array_get_object_element (results, 2),
+                                         "error"));
+
+  g_object_unref (parser);
+  g_object_unref (message);
+  g_object_unref (session);
+  g_free (req_uri);
+}
+
 static void
 test_daemon_starts_successfully (DaemonFixture *fixture,
                                  gconstpointer user_data)
@@ -202,10 +422,392 @@ test_daemon_starts_successfully (DaemonFixture *fixture,
   g_assert_nonnull (fixture->daemon);
 }
 
+static GString *
+request_ready (GSocketConnectable *address)
+{
+  GSocketClient *client;
+  GSocketConnection *connection;
+  GOutputStream *output;
+  GString *reply;
+  GError *error = NULL;
+  const gchar *request = "GET /ready HTTP/1.1\r\n"
+                         "Host: localhost\r\n"
+                         "Connection: close\r\n\r\n";
+
+  client = g_socket_client_new ();
+  connection = g_socket_client_connect (client, address, NULL, &error);
+  g_assert_no_error (error);
+
+  output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+  g_output_stream_write_all (output, request, strlen (request), NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  reply = flush_stream_to_string (g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+
+  g_object_unref (connection);
+  g_object_unref (client);
+
+  return reply;
+}
+
+static void
+test_listens_on_unix_socket (void)
+{
+  gchar *daemon_path, *tmp_dir, *socket_path;
+  const gchar *argv[2];
+  GError *error = NULL;
+  GSubprocessLauncher *launcher;
+  GSubprocess *daemon;
+  GSocketClient *client;
+  GSocketAddress *address;
+  GSocketConnection *connection;
+  GString *reply;
+
+  daemon_path = g_test_build_filename (G_TEST_BUILT, "xapian-bridge", NULL);
+  argv[0] = daemon_path;
+  argv[1] = NULL;
+
+  tmp_dir = g_dir_make_tmp ("xb-test-XXXXXX", &error);
+  g_assert_no_error (error);
+  socket_path = g_build_filename (tmp_dir, "xapian-bridge.sock", NULL);
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_set_child_setup (launcher, setup_xapian_bridge_process, NULL, NULL);
+  g_subprocess_launcher_setenv (launcher, "XB_SOCKET_PATH", socket_path, TRUE);
+
+  daemon = g_subprocess_launcher_spawnv (launcher, argv, &error);
+  g_assert_no_error (error);
+
+  /* wait until the server starts listening */
+  client = g_socket_client_new ();
+  address = g_unix_socket_address_new (socket_path);
+  while ((connection = g_socket_client_connect (client, G_SOCKET_CONNECTABLE (address),
+                                                NULL, &error)) == NULL)
+    {
+      g_assert_true (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) ||
+                     g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_REFUSED));
+      g_clear_error (&error);
+    }
+
+  g_object_unref (connection);
+
+  reply = request_ready (G_SOCKET_CONNECTABLE (address));
+  g_assert_true (g_str_has_prefix (reply->str, "HTTP/1.1 200"));
+
+  g_string_free (reply, TRUE);
+  g_object_unref (address);
+  g_object_unref (client);
+
+  g_subprocess_send_signal (daemon, SIGTERM);
+  g_subprocess_wait (daemon, NULL, &error);
+  g_assert_no_error (error);
+
+  /* the socket file is removed on exit */
+  g_assert_false (g_file_test (socket_path, G_FILE_TEST_EXISTS));
+
+  g_object_unref (daemon);
+  g_object_unref (launcher);
+  test_clear_dir (tmp_dir);
+  g_free (socket_path);
+  g_free (tmp_dir);
+  g_free (daemon_path);
+}
+
+static GSubprocess *
+spawn_daemon_on_unix_socket (const gchar *socket_path)
+{
+  gchar *daemon_path;
+  const gchar *argv[2];
+  GError *error = NULL;
+  GSubprocessLauncher *launcher;
+  GSubprocess *daemon;
+
+  daemon_path = g_test_build_filename (G_TEST_BUILT, "xapian-bridge", NULL);
+  argv[0] = daemon_path;
+  argv[1] = NULL;
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDERR_SILENCE);
+  g_subprocess_launcher_set_child_setup (launcher, setup_xapian_bridge_process, NULL, NULL);
+  g_subprocess_launcher_setenv (launcher, "XB_SOCKET_PATH", socket_path, TRUE);
+
+  daemon = g_subprocess_launcher_spawnv (launcher, argv, &error);
+  g_assert_no_error (error);
+
+  g_object_unref (launcher);
+  g_free (daemon_path);
+
+  return daemon;
+}
+
+static void
+test_keeps_unix_socket_in_use (void)
+{
+  gchar *tmp_dir, *socket_path;
+  GError *error = NULL;
+  GSubprocess *first, *second;
+  GSocketClient *client;
+  GSocketAddress *address;
+  GSocketConnection *connection;
+  GString *reply;
+
+  tmp_dir = g_dir_make_tmp ("xb-test-XXXXXX", &error);
+  g_assert_no_error (error);
+  socket_path = g_build_filename (tmp_dir, "xapian-bridge.sock", NULL);
+
+  first = spawn_daemon_on_unix_socket (socket_path);
+
+  /* wait until the first daemon starts listening */
+  client = g_socket_client_new ();
+  address = g_unix_socket_address_new (socket_path);
+  while ((connection = g_socket_client_connect (client, G_SOCKET_CONNECTABLE (address),
+                                                NULL, &error)) == NULL)
+    {
+      g_assert_true (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) ||
+                     g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_REFUSED));
+      g_clear_error (&error);
+    }
+
+  g_object_unref (connection);
+
+  /* a second daemon must not take the socket over */
+  second = spawn_daemon_on_unix_socket (socket_path);
+  g_subprocess_wait (second, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_false (g_subprocess_get_successful (second));
+
+  reply = request_ready (G_SOCKET_CONNECTABLE (address));
+  g_assert_true (g_str_has_prefix (reply->str, "HTTP/1.1 200"));
+
+  g_string_free (reply, TRUE);
+  g_object_unref (address);
+  g_object_unref (client);
+
+  g_subprocess_send_signal (first, SIGTERM);
+  g_subprocess_wait (first, NULL, &error);
+  g_assert_no_error (error);
+
+  g_object_unref (second);
+  g_object_unref (first);
+  test_clear_dir (tmp_dir);
+  g_free (socket_path);
+  g_free (tmp_dir);
+}
+
+/* Returns the fd of a new TCP socket listening on the loopback interface,
+ * with its port in @port_out.
+ */
+static gint
+open_listening_fd (guint16 *port_out)
+{
+  GSocket *socket;
+  GInetAddress *loopback;
+  GSocketAddress *address, *local_address;
+  GError *error = NULL;
+  gint fd;
+
+  socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_DEFAULT, &error);
+  g_assert_no_error (error);
+
+  loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  address = g_inet_socket_address_new (loopback, 0);
+  g_socket_bind (socket, address, TRUE, &error);
+  g_assert_no_error (error);
+  g_socket_listen (socket, &error);
+  g_assert_no_error (error);
+
+  local_address = g_socket_get_local_address (socket, &error);
+  g_assert_no_error (error);
+  *port_out = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (local_address));
+
+  fd = dup (g_socket_get_fd (socket));
+
+  g_object_unref (local_address);
+  g_object_unref (address);
+  g_object_unref (loopback);
+  g_object_unref (socket);
+
+  return fd;
+}
+
+static void
+test_listens_on_all_passed_fds (void)
+{
+  gchar *daemon_path;
+  const gchar *argv[2];
+  GError *error = NULL;
+  GSubprocessLauncher *launcher;
+  GSubprocess *daemon;
+  GInetAddress *loopback;
+  GSocketAddress *address;
+  GString *reply;
+  guint16 ports[2];
+  gint idx;
+
+  daemon_path = g_test_build_filename (G_TEST_BUILT, "xapian-bridge", NULL);
+  argv[0] = daemon_path;
+  argv[1] = NULL;
+
+  /* pass two sockets, the way systemd does */
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_set_child_setup (launcher, setup_xapian_bridge_process, NULL, NULL);
+  g_subprocess_launcher_take_fd (launcher, open_listening_fd (&ports[0]), 3);
+  g_subprocess_launcher_take_fd (launcher, open_listening_fd (&ports[1]), 4);
+  g_subprocess_launcher_setenv (launcher, "LISTEN_PID", "1", TRUE);
+  g_subprocess_launcher_setenv (launcher, "LISTEN_FDS", "2", TRUE);
+
+  daemon = g_subprocess_launcher_spawnv (launcher, argv, &error);
+  g_assert_no_error (error);
+
+  /* the sockets already listen, so connections wait in the backlog until
+   * the daemon starts accepting them
+   */
+  loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  for (idx = 0; idx < G_N_ELEMENTS (ports); idx++)
+    {
+      address = g_inet_socket_address_new (loopback, ports[idx]);
+      reply = request_ready (G_SOCKET_CONNECTABLE (address));
+      g_assert_true (g_str_has_prefix (reply->str, "HTTP/1.1 200"));
+
+      g_string_free (reply, TRUE);
+      g_object_unref (address);
+    }
+
+  g_subprocess_send_signal (daemon, SIGTERM);
+  g_subprocess_wait (daemon, NULL, &error);
+  g_assert_no_error (error);
+
+  g_object_unref (loopback);
+  g_object_unref (daemon);
+  g_object_unref (launcher);
+  g_free (daemon_path);
+}
+
+/* Returns the fd of a new Unix domain socket listening on @path */
+static gint
+open_listening_unix_fd (const gchar *path)
+{
+  GSocket *socket;
+  GSocketAddress *address;
+  GError *error = NULL;
+  gint fd;
+
+  socket = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_DEFAULT, &error);
+  g_assert_no_error (error);
+
+  address = g_unix_socket_address_new (path);
+  g_socket_bind (socket, address, FALSE, &error);
+  g_assert_no_error (error);
+  g_socket_listen (socket, &error);
+  g_assert_no_error (error);
+
+  fd = dup (g_socket_get_fd (socket));
+
+  g_object_unref (address);
+  g_object_unref (socket);
+
+  return fd;
+}
+
+/* Mean round trip of @n_requests requests for /ready, in microseconds,
+ * each on a new connection
+ */
+static gdouble
+time_ready_requests (GSocketConnectable *address,
+                     guint n_requests)
+{
+  GString *reply;
+  gint64 start;
+  guint idx;
+
+  start = g_get_monotonic_time ();
+  for (idx = 0; idx < n_requests; idx++)
+    {
+      reply = request_ready (address);
+      g_assert_true (g_str_has_prefix (reply->str, "HTTP/1.1 200"));
+      g_string_free (reply, TRUE);
+    }
+
+  return (gdouble) (g_get_monotonic_time () - start) / n_requests;
+}
+
+static void
+test_unix_socket_latency (void)
+{
+  const guint n_requests = 2000;
+  gchar *daemon_path, *tmp_dir, *socket_path;
+  const gchar *argv[2];
+  GError *error = NULL;
+  GSubprocessLauncher *launcher;
+  GSubprocess *daemon;
+  GInetAddress *loopback;
+  GSocketAddress *tcp_address, *unix_address;
+  guint16 port;
+  gdouble tcp_us, unix_us;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Only run in perf mode");
+      return;
+    }
+
+  daemon_path = g_test_build_filename (G_TEST_BUILT, "xapian-bridge", NULL);
+  argv[0] = daemon_path;
+  argv[1] = NULL;
+
+  tmp_dir = g_dir_make_tmp ("xb-test-XXXXXX", &error);
+  g_assert_no_error (error);
+  socket_path = g_build_filename (tmp_dir, "xapian-bridge.sock", NULL);
+
+  /* one daemon serves both sockets, so only the transport differs */
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_set_child_setup (launcher, setup_xapian_bridge_process, NULL, NULL);
+  g_subprocess_launcher_take_fd (launcher, open_listening_fd (&port), 3);
+  g_subprocess_launcher_take_fd (launcher, open_listening_unix_fd (socket_path), 4);
+  g_subprocess_launcher_setenv (launcher, "LISTEN_PID", "1", TRUE);
+  g_subprocess_launcher_setenv (launcher, "LISTEN_FDS", "2", TRUE);
+
+  daemon = g_subprocess_launcher_spawnv (launcher, argv, &error);
+  g_assert_no_error (error);
+
+  loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  tcp_address = g_inet_socket_address_new (loopback, port);
+  unix_address = g_unix_socket_address_new (socket_path);
+
+  /* warm up both, and wait for the daemon to start */
+  time_ready_requests (G_SOCKET_CONNECTABLE (tcp_address), 100);
+  time_ready_requests (G_SOCKET_CONNECTABLE (unix_address), 100);
+
+  tcp_us = time_ready_requests (G_SOCKET_CONNECTABLE (tcp_address), n_requests);
+  unix_us = time_ready_requests (G_SOCKET_CONNECTABLE (unix_address), n_requests);
+
+  g_test_message ("GET /ready round trip: TCP loopback %.1f us, Unix socket %.1f us (%.0f%%)",
+                  tcp_us, unix_us, 100.0 * unix_us / tcp_us);
+  g_test_minimized_result (tcp_us, "TCP loopback round trip: %.1f us", tcp_us);
+  g_test_minimized_result (unix_us, "Unix socket round trip: %.1f us", unix_us);
+
+  g_subprocess_send_signal (daemon, SIGTERM);
+  g_subprocess_wait (daemon, NULL, &error);
+  g_assert_no_error (error);
+
+  g_object_unref (unix_address);
+  g_object_unref (tcp_address);
+  g_object_unref (loopback);
+  g_object_unref (daemon);
+  g_object_unref (launcher);
+  test_clear_dir (tmp_dir);
+  g_free (socket_path);
+  g_free (tmp_dir);
+  g_free (daemon_path);
+}
+
 int
 main (int argc,
       char **argv)
 {
+  static const gchar *multi_process_env[] = { "XB_WORKER_PROCESSES=2", NULL };
+
   g_test_init (&argc, &argv, NULL);
 
 #define ADD_DAEMON_TEST(path, func) \
@@ -215,10 +817,32 @@ main (int argc,
                    test_daemon_starts_successfully);
   ADD_DAEMON_TEST ("/daemon/get-query-returns-json",
                    test_get_query_returns_json);
+  ADD_DAEMON_TEST ("/daemon/get-query-reports-server-timing",
+                   test_get_query_reports_server_timing);
+  ADD_DAEMON_TEST ("/daemon/get-query-streams-json",
+                   test_get_query_streams_json);
   ADD_DAEMON_TEST ("/daemon/feature-testing-works",
                    test_feature_testing_works);
+  ADD_DAEMON_TEST ("/daemon/ready-after-startup",
+                   test_ready_after_startup);
+  ADD_DAEMON_TEST ("/daemon/get-metrics-counts-requests",
+                   test_get_metrics_counts_requests);
+  ADD_DAEMON_TEST ("/daemon/post-batch-returns-all-results",
+                   test_post_batch_returns_all_results);
+
+  g_test_add ("/daemon/multi-process/get-query-returns-json", DaemonFixture,
+              multi_process_env, setup, test_get_query_returns_json, teardown);
 
 #undef ADD_DAEMON_TEST
 
+  g_test_add_func ("/daemon/listens-on-unix-socket",
+                   test_listens_on_unix_socket);
+  g_test_add_func ("/daemon/keeps-unix-socket-in-use",
+                   test_keeps_unix_socket_in_use);
+  g_test_add_func ("/daemon/listens-on-all-passed-fds",
+                   test_listens_on_all_passed_fds);
+  g_test_add_func ("/daemon/unix-socket-latency",
+                   test_unix_socket_latency);
+
   return g_test_run ();
 }
@@ -1,5 +1,7 @@
 #include "config.h"
 
+#include <glib/gstdio.h>
+
 #include "xb-database-manager.h"
 #include "xb-error.h"
 #include "test-util.h"
@@ -165,6 +167,73 @@ test_query_invalid_params_fails (DatabaseManagerFixture *fixture,
   g_free ((char *) db.path);
 }
 
+static void
+test_query_time_limit (DatabaseManagerFixture *fixture,
+                       gconstpointer user_data)
+{
+  static const gchar *invalid[] = { "soon", "0", "-5", "inf", "nan" };
+  GHashTable *query;
+  JsonObject *object;
+  gboolean res;
+  XbDatabase db;
+  GError *error = NULL;
+  guint idx;
+
+  res = create_sample_db (fixture, &db, &error);
+
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  /* A generous default leaves the results whole */
+  g_object_set (fixture->manager, "default-time-limit", 60000, NULL);
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "5");
+  g_hash_table_insert (query, "offset", "0");
+
+  object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+
+  g_assert_no_error (error);
+  assert_json_query_object (object, 5, 0, "a");
+  g_assert_false (json_object_has_member (object, "partial"));
+  json_object_unref (object);
+
+  /* Runs out before the first document is fetched */
+  g_hash_table_insert (query, "timeLimit", "0.000001");
+
+  object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+
+  g_assert_no_error (error);
+  g_assert_true (json_object_get_boolean_member (object, "partial"));
+  g_assert_cmpint (json_array_get_length (json_object_get_array_member (object, "results")),
+                   ==, 0);
+  json_object_unref (object);
+
+  /* Too large to hold is the same as the default */
+  g_hash_table_insert (query, "timeLimit", "1e300");
+
+  object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+
+  g_assert_no_error (error);
+  g_assert_false (json_object_has_member (object, "partial"));
+  json_object_unref (object);
+
+  for (idx = 0; idx < G_N_ELEMENTS (invalid); idx++)
+    {
+      g_hash_table_insert (query, "timeLimit", (gchar *) invalid[idx]);
+
+      object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+
+      g_assert_null (object);
+      g_assert_error (error, XB_ERROR, XB_ERROR_INVALID_PARAMS);
+      g_clear_error (&error);
+    }
+
+  g_hash_table_unref (query);
+  g_free ((char *) db.path);
+}
+
 static void
 test_query_invalid_db_fails (DatabaseManagerFixture *fixture,
                              gconstpointer user_data)
@@ -243,89 +312,1470 @@ test_queries_db (DatabaseManagerFixture *fixture,
 }
 
 static void
-test_query_invalid_lang_succeeds (DatabaseManagerFixture *fixture,
-                                  gconstpointer user_data)
+store_async_result (GObject *source,
+                    GAsyncResult *result,
+                    gpointer user_data)
+{
+  GAsyncResult **result_out = user_data;
+  *result_out = g_object_ref (result);
+}
+
+static void
+test_queries_db_async (DatabaseManagerFixture *fixture,
+                       gconstpointer user_data)
+{
+  GHashTable *query;
+  GAsyncResult *result = NULL;
+  JsonParser *parser;
+  GBytes *bytes;
+  XbDatabase db;
+  GError *error = NULL;
+
+  db = get_sample_db ();
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "5");
+  g_hash_table_insert (query, "offset", "0");
+
+  xb_database_manager_query_db_async (fixture->manager, db, query, NULL,
+                                      store_async_result, &result);
+  g_hash_table_unref (query);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  bytes = xb_database_manager_query_db_finish (fixture->manager, result, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (bytes);
+
+  parser = json_parser_new ();
+  json_parser_load_from_data (parser, g_bytes_get_data (bytes, NULL),
+                              g_bytes_get_size (bytes), &error);
+  g_assert_no_error (error);
+  assert_json_query_object (json_node_get_object (json_parser_get_root (parser)),
+                            5, 0, "a");
+
+  g_object_unref (parser);
+  g_bytes_unref (bytes);
+  g_object_unref (result);
+  g_free ((char *) db.path);
+}
+
+static void
+append_chunk (GBytes *chunk,
+              gpointer user_data)
+{
+  GPtrArray *chunks = user_data;
+
+  g_ptr_array_add (chunks, g_bytes_ref (chunk));
+}
+
+static void
+test_streams_query_results (DatabaseManagerFixture *fixture,
+                            gconstpointer user_data)
 {
+  GHashTable *query;
+  GAsyncResult *result = NULL;
+  GPtrArray *chunks;
+  GString *body;
+  JsonParser *parser;
+  XbDatabase db;
   gboolean res;
   GError *error = NULL;
+  guint idx;
+
+  db = get_sample_db ();
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "-1");
+  g_hash_table_insert (query, "offset", "0");
+
+  chunks = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+  xb_database_manager_stream_query_db_async (fixture->manager, db, query,
+                                             append_chunk, chunks, NULL,
+                                             store_async_result, &result);
+  g_hash_table_unref (query);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  res = xb_database_manager_stream_query_db_finish (fixture->manager, result, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  /* The members before the results come first, on their own */
+  g_assert_cmpuint (chunks->len, >=, 2);
+
+  body = g_string_new (NULL);
+  for (idx = 0; idx < chunks->len; idx++)
+    {
+      GBytes *chunk = g_ptr_array_index (chunks, idx);
+      g_string_append_len (body, g_bytes_get_data (chunk, NULL), g_bytes_get_size (chunk));
+    }
+
+  parser = json_parser_new ();
+  json_parser_load_from_data (parser, body->str, body->len, &error);
+  g_assert_no_error (error);
+  assert_json_query_object (json_node_get_object (json_parser_get_root (parser)),
+                            5, 0, "a");
+
+  g_object_unref (parser);
+  g_string_free (body, TRUE);
+  g_ptr_array_unref (chunks);
+  g_object_unref (result);
+  g_free ((char *) db.path);
+}
+
+static GBytes *
+run_async_query (DatabaseManagerFixture *fixture,
+                 XbDatabase db,
+                 GHashTable *query)
+{
+  GAsyncResult *result = NULL;
+  GBytes *bytes;
+  GError *error = NULL;
+
+  xb_database_manager_query_db_async (fixture->manager, db, query, NULL,
+                                      store_async_result, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  bytes = xb_database_manager_query_db_finish (fixture->manager, result, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (bytes);
+
+  g_object_unref (result);
+  return bytes;
+}
+
+static void
+test_query_until_deadline (DatabaseManagerFixture *fixture,
+                           gconstpointer user_data)
+{
   GHashTable *query;
+  GAsyncResult *result = NULL;
+  GBytes *bytes;
+  gboolean res;
   XbDatabase db;
-  JsonObject *object;
+  GError *error = NULL;
 
   res = create_sample_db (fixture, &db, &error);
 
   g_assert_true (res);
   g_assert_no_error (error);
-  g_assert_nonnull (db.path);
+
+  /* The deadline of a batch wins over a generous time limit */
+  g_object_set (fixture->manager, "default-time-limit", 60000, NULL);
 
   query = g_hash_table_new (g_str_hash, g_str_equal);
-  g_hash_table_insert (query, "q", "a");
-  g_hash_table_insert (query, "limit", "5");
+  g_hash_table_insert (query, "q", "a*");
+  g_hash_table_insert (query, "limit", "-1");
   g_hash_table_insert (query, "offset", "0");
-  g_hash_table_insert (query, "lang", "asd_LOL.LMAO");
 
-  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
-                         "Cannot create XapianStem for language*");
-  object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+  xb_database_manager_query_db_until_async (fixture->manager, db, query,
+                                            g_get_monotonic_time () - 1, NULL,
+                                            store_async_result, &result);
 
-  g_test_assert_expected_messages ();
-  g_assert_nonnull (object);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  bytes = xb_database_manager_query_db_finish (fixture->manager, result, &error);
   g_assert_no_error (error);
-  assert_json_query_object (object, 5, 0, "a");
+  g_assert_nonnull (g_strstr_len (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+                                  "\"results\":[],\"partial\":true"));
+  g_bytes_unref (bytes);
+  g_clear_object (&result);
+
+  /* Short wildcards are left unexpanded rather than failing */
+  bytes = run_async_query (fixture, db, query);
+  g_assert_null (g_strstr_len (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+                               "\"partial\""));
+  g_bytes_unref (bytes);
 
-  json_object_unref (object);
   g_hash_table_unref (query);
   g_free ((char *) db.path);
 }
 
 static void
-test_create_invalid_db_fails (DatabaseManagerFixture *fixture,
-                              gconstpointer user_data)
+count_database_opens (const gchar *log_domain,
+                      GLogLevelFlags log_level,
+                      const gchar *message,
+                      gpointer user_data)
 {
-  gboolean res;
+  gint *n_opens = user_data;
+
+  if (g_str_has_prefix (message, "Opened database "))
+    g_atomic_int_inc (n_opens);
+}
+
+static void
+test_opens_db_once_for_concurrent_queries (DatabaseManagerFixture *fixture,
+                                           gconstpointer user_data)
+{
+  GHashTable *query;
+  GAsyncResult *results[3] = { NULL, };
+  GBytes *bytes;
+  XbDatabase db;
+  guint open_databases, handler_id;
   GError *error = NULL;
+  gint idx, n_opens = 0;
 
-  XbDatabase db = { .path = test_get_invalid_db_path () };
-  res = xb_database_manager_ensure_db (fixture->manager, db, &error);
+  db = get_manifest_db ();
+
+  handler_id = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_INFO,
+                                  count_database_opens, &n_opens);
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "5");
+  g_hash_table_insert (query, "offset", "0");
+
+  /* All the queries wait for the same open */
+  for (idx = 0; idx < G_N_ELEMENTS (results); idx++)
+    xb_database_manager_query_db_async (fixture->manager, db, query, NULL,
+                                        store_async_result, &results[idx]);
+  g_hash_table_unref (query);
+
+  for (idx = 0; idx < G_N_ELEMENTS (results); idx++)
+    {
+      while (results[idx] == NULL)
+        g_main_context_iteration (NULL, TRUE);
+
+      bytes = xb_database_manager_query_db_finish (fixture->manager, results[idx], &error);
+      g_assert_no_error (error);
+      g_assert_nonnull (bytes);
+
+      g_bytes_unref (bytes);
+      g_object_unref (results[idx]);
+    }
+
+  g_log_remove_handler (G_LOG_DOMAIN, handler_id);
+
+  /* Opening it once per query would also leave a single database */
+  g_assert_cmpint (g_atomic_int_get (&n_opens), ==, 1);
+
+  g_object_get (fixture->manager, "open-databases", &open_databases, NULL);
+  g_assert_cmpuint (open_databases, ==, 1);
+
+  g_free ((char *) db.manifest_path);
+}
+
+static void
+test_caches_query_results (DatabaseManagerFixture *fixture,
+                           gconstpointer user_data)
+{
+  GHashTable *query;
+  GBytes *first, *second;
+  guint64 hits, misses;
+  XbDatabase db;
+
+  db = get_sample_db ();
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "path", (gchar *) db.path);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "5");
+  g_hash_table_insert (query, "offset", "0");
+
+  first = run_async_query (fixture, db, query);
+  second = run_async_query (fixture, db, query);
+
+  g_assert_true (g_bytes_equal (first, second));
+
+  g_object_get (fixture->manager,
+                "cache-hits", &hits,
+                "cache-misses", &misses,
+                NULL);
+  g_assert_cmpuint (hits, ==, 1);
+  g_assert_cmpuint (misses, ==, 1);
+
+  g_bytes_unref (first);
+  g_bytes_unref (second);
+
+  /* A different query is a miss */
+  g_hash_table_insert (query, "offset", "1");
+  first = run_async_query (fixture, db, query);
+
+  g_object_get (fixture->manager, "cache-misses", &misses, NULL);
+  g_assert_cmpuint (misses, ==, 2);
+
+  g_bytes_unref (first);
+  g_hash_table_unref (query);
   g_free ((char *) db.path);
+}
 
-  g_assert_false (res);
-  g_assert_error (error, XB_ERROR, XB_ERROR_INVALID_PATH);
-  g_error_free (error);
+static void
+run_timed_query (DatabaseManagerFixture *fixture,
+                 XbDatabase db,
+                 GHashTable *query,
+                 XbQueryTimings *timings_out)
+{
+  GAsyncResult *result = NULL;
+  GBytes *bytes;
+  GError *error = NULL;
+
+  xb_database_manager_query_db_async (fixture->manager, db, query, NULL,
+                                      store_async_result, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  bytes = xb_database_manager_query_db_finish (fixture->manager, result, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (bytes);
+
+  xb_database_manager_get_query_timings (fixture->manager, result, timings_out);
+
+  g_bytes_unref (bytes);
+  g_object_unref (result);
 }
 
 static void
-test_creates_db (DatabaseManagerFixture *fixture,
-                 gconstpointer user_data)
+test_reports_query_timings (DatabaseManagerFixture *fixture,
+                            gconstpointer user_data)
 {
-  gboolean res;
+  GHashTable *query;
+  XbQueryTimings timings;
   XbDatabase db;
+
+  db = get_sample_db ();
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "5");
+  g_hash_table_insert (query, "offset", "0");
+
+  run_timed_query (fixture, db, query, &timings);
+  g_assert_false (timings.cached);
+  g_assert_cmpint (timings.wait, >, 0);
+  g_assert_cmpint (timings.parse + timings.match + timings.fetch + timings.serialize, >, 0);
+  g_assert_cmpint (timings.encode, ==, 0);
+
+  /* Asking for the timings does not make it a different query */
+  g_hash_table_insert (query, "timing", "");
+  run_timed_query (fixture, db, query, &timings);
+  g_assert_true (timings.cached);
+  g_assert_cmpint (timings.match, ==, 0);
+
+  g_hash_table_unref (query);
+  g_free ((char *) db.path);
+}
+
+static GBytes *
+run_encoded_query (DatabaseManagerFixture *fixture,
+                   XbDatabase db,
+                   GHashTable *query,
+                   XbEncoding encoding,
+                   XbEncoding *encoding_out)
+{
+  GAsyncResult *result = NULL;
+  GBytes *bytes;
   GError *error = NULL;
 
-  res = create_sample_db (fixture, &db, &error);
+  xb_database_manager_query_db_encoded_async (fixture->manager, db, query, encoding,
+                                              NULL, store_async_result, &result);
 
-  g_assert_true (res);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  bytes = xb_database_manager_query_db_encoded_finish (fixture->manager, result,
+                                                       encoding_out, &error);
   g_assert_no_error (error);
-  g_assert_nonnull (db.path);
+  g_assert_nonnull (bytes);
+
+  g_object_unref (result);
+  return bytes;
+}
+
+static GBytes *
+decompress_bytes (GBytes *bytes,
+                  GZlibCompressorFormat format)
+{
+  GZlibDecompressor *decompressor;
+  GInputStream *memory, *stream;
+  GOutputStream *output;
+  GBytes *decompressed;
+  GError *error = NULL;
+
+  decompressor = g_zlib_decompressor_new (format);
+  memory = g_memory_input_stream_new_from_bytes (bytes);
+  stream = g_converter_input_stream_new (memory, G_CONVERTER (decompressor));
+  output = g_memory_output_stream_new_resizable ();
+
+  g_output_stream_splice (output, stream, G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                          NULL, &error);
+  g_assert_no_error (error);
+  decompressed = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
 
+  g_object_unref (output);
+  g_object_unref (stream);
+  g_object_unref (memory);
+  g_object_unref (decompressor);
+
+  return decompressed;
+}
+
+static void
+test_compresses_query_results (DatabaseManagerFixture *fixture,
+                               gconstpointer user_data)
+{
+  GHashTable *query;
+  GBytes *plain, *encoded, *decompressed;
+  XbEncoding encoding;
+  guint64 hits;
+  XbDatabase db;
+
+  g_object_set (fixture->manager, "compression-min-size", 0, NULL);
+
+  db = get_sample_db ();
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "5");
+  g_hash_table_insert (query, "offset", "0");
+
+  plain = run_async_query (fixture, db, query);
+
+  encoded = run_encoded_query (fixture, db, query, XB_ENCODING_GZIP, &encoding);
+  g_assert_cmpint (encoding, ==, XB_ENCODING_GZIP);
+  decompressed = decompress_bytes (encoded, G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+  g_assert_true (g_bytes_equal (plain, decompressed));
+  g_bytes_unref (decompressed);
+  g_bytes_unref (encoded);
+
+  encoded = run_encoded_query (fixture, db, query, XB_ENCODING_DEFLATE, &encoding);
+  g_assert_cmpint (encoding, ==, XB_ENCODING_DEFLATE);
+  decompressed = decompress_bytes (encoded, G_ZLIB_COMPRESSOR_FORMAT_ZLIB);
+  g_assert_true (g_bytes_equal (plain, decompressed));
+  g_bytes_unref (decompressed);
+  g_bytes_unref (encoded);
+
+  /* Encoding a cached result does not run the query again */
+  g_object_get (fixture->manager, "cache-hits", &hits, NULL);
+  g_assert_cmpuint (hits, ==, 2);
+
+  /* Small results are sent as is */
+  g_object_set (fixture->manager, "compression-min-size", G_MAXUINT, NULL);
+  encoded = run_encoded_query (fixture, db, query, XB_ENCODING_GZIP, &encoding);
+  g_assert_cmpint (encoding, ==, XB_ENCODING_IDENTITY);
+  g_assert_true (g_bytes_equal (plain, encoded));
+  g_bytes_unref (encoded);
+
+  g_bytes_unref (plain);
+  g_hash_table_unref (query);
   g_free ((char *) db.path);
 }
 
 static void
-test_creates_db_from_manifest (DatabaseManagerFixture *fixture,
-                               gconstpointer unused)
+test_query_invalid_lang_succeeds (DatabaseManagerFixture *fixture,
+                                  gconstpointer user_data)
 {
   gboolean res;
-  XbDatabase db;
   GError *error = NULL;
+  GHashTable *query;
+  XbDatabase db;
+  JsonObject *object;
 
-  res = create_manifest_db (fixture, &db, &error);
+  res = create_sample_db (fixture, &db, &error);
 
   g_assert_true (res);
   g_assert_no_error (error);
-  g_assert_nonnull (db.manifest_path);
+  g_assert_nonnull (db.path);
 
-  g_free ((char *) db.manifest_path);
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "5");
+  g_hash_table_insert (query, "offset", "0");
+  g_hash_table_insert (query, "lang", "asd_LOL.LMAO");
+
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
+                         "Cannot create XapianStem for language*");
+  object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+
+  g_test_assert_expected_messages ();
+  g_assert_nonnull (object);
+  g_assert_no_error (error);
+  assert_json_query_object (object, 5, 0, "a");
+
+  json_object_unref (object);
+  g_hash_table_unref (query);
+  g_free ((char *) db.path);
+}
+
+static void
+test_query_repeated_filters (DatabaseManagerFixture *fixture,
+                             gconstpointer user_data)
+{
+  GHashTable *query;
+  JsonObject *object;
+  XbDatabase db;
+  GError *error = NULL;
+  gint idx;
+
+  db = get_sample_db ();
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "5");
+  g_hash_table_insert (query, "offset", "0");
+
+  /* Parsed queries are reused between requests */
+  for (idx = 0; idx < 3; idx++)
+    {
+      g_hash_table_insert (query, "filter", "asd");
+      g_hash_table_remove (query, "filterOut");
+
+      object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+      g_assert_no_error (error);
+      assert_json_query_object (object, 5, 0, "a");
+      json_object_unref (object);
+
+      g_hash_table_remove (query, "filter");
+      g_hash_table_insert (query, "filterOut", "asd");
+
+      object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+      g_assert_no_error (error);
+      assert_json_query_object (object, 0, 0, "a");
+      json_object_unref (object);
+    }
+
+  g_hash_table_unref (query);
+  g_free ((char *) db.path);
+}
+
+static void
+test_query_default_op_does_not_leak (DatabaseManagerFixture *fixture,
+                                     gconstpointer user_data)
+{
+  GHashTable *query;
+  JsonObject *object;
+  XbDatabase db;
+  GError *error = NULL;
+
+  db = get_sample_db ();
+
+  /* Every document matches "a", none matches "zzz" */
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a zzz");
+  g_hash_table_insert (query, "limit", "5");
+  g_hash_table_insert (query, "offset", "0");
+  g_hash_table_insert (query, "defaultOp", "and");
+
+  object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+
+  g_assert_no_error (error);
+  g_assert_nonnull (object);
+  assert_json_query_object (object, 0, 0, "a zzz");
+  json_object_unref (object);
+
+  /* Without defaultOp, the query is parsed with the "or" default again */
+  g_hash_table_remove (query, "defaultOp");
+
+  object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+
+  g_assert_no_error (error);
+  g_assert_nonnull (object);
+  assert_json_query_object (object, 5, 0, "a zzz");
+  json_object_unref (object);
+
+  g_hash_table_unref (query);
+  g_free ((char *) db.path);
+}
+
+static void
+test_create_invalid_db_fails (DatabaseManagerFixture *fixture,
+                              gconstpointer user_data)
+{
+  gboolean res;
+  GError *error = NULL;
+
+  XbDatabase db = { .path = test_get_invalid_db_path () };
+  res = xb_database_manager_ensure_db (fixture->manager, db, &error);
+  g_free ((char *) db.path);
+
+  g_assert_false (res);
+  g_assert_error (error, XB_ERROR, XB_ERROR_INVALID_PATH);
+  g_error_free (error);
+}
+
+static void
+test_creates_db (DatabaseManagerFixture *fixture,
+                 gconstpointer user_data)
+{
+  gboolean res;
+  XbDatabase db;
+  GError *error = NULL;
+
+  res = create_sample_db (fixture, &db, &error);
+
+  g_assert_true (res);
+  g_assert_no_error (error);
+  g_assert_nonnull (db.path);
+
+  g_free ((char *) db.path);
+}
+
+static void
+test_creates_db_from_manifest (DatabaseManagerFixture *fixture,
+                               gconstpointer unused)
+{
+  gboolean res;
+  XbDatabase db;
+  GError *error = NULL;
+
+  res = create_manifest_db (fixture, &db, &error);
+
+  g_assert_true (res);
+  g_assert_no_error (error);
+  g_assert_nonnull (db.manifest_path);
+
+  g_free ((char *) db.manifest_path);
+}
+
+static void
+test_queries_sharded_manifest_db (DatabaseManagerFixture *fixture,
+                                  gconstpointer unused)
+{
+  GHashTable *query;
+  JsonObject *object;
+  XbDatabase db;
+  GError *error = NULL;
+
+  db = ((XbDatabase) { .manifest_path = test_get_sharded_manifest_db_path () });
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "20");
+  g_hash_table_insert (query, "offset", "0");
+
+  /* Three shards of five documents each */
+  object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (object);
+  assert_json_query_object (object, 15, 0, "a");
+
+  json_object_unref (object);
+  g_hash_table_unref (query);
+  g_free ((char *) db.manifest_path);
+}
+
+static void
+test_shares_shards_across_dbs (DatabaseManagerFixture *fixture,
+                               gconstpointer unused)
+{
+  GHashTable *query;
+  JsonObject *object;
+  XbDatabase sample_db, sharded_db;
+  GError *error = NULL;
+
+  g_object_set (fixture->manager, "max-databases", 1, NULL);
+
+  sample_db = get_sample_db ();
+  sharded_db = ((XbDatabase) { .manifest_path = test_get_sharded_manifest_db_path () });
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "20");
+  g_hash_table_insert (query, "offset", "0");
+
+  object = xb_database_manager_query_db (fixture->manager, sample_db, query, &error);
+  g_assert_no_error (error);
+  assert_json_query_object (object, 5, 0, "a");
+  json_object_unref (object);
+
+  /* Evicts the sample database, whose shard the manifest keeps using */
+  object = xb_database_manager_query_db (fixture->manager, sharded_db, query, &error);
+  g_assert_no_error (error);
+  assert_json_query_object (object, 15, 0, "a");
+  json_object_unref (object);
+
+  object = xb_database_manager_query_db (fixture->manager, sample_db, query, &error);
+  g_assert_no_error (error);
+  assert_json_query_object (object, 5, 0, "a");
+  json_object_unref (object);
+
+  g_hash_table_unref (query);
+  g_free ((char *) sample_db.path);
+  g_free ((char *) sharded_db.manifest_path);
+}
+
+static void
+test_counts_shared_shards_once (DatabaseManagerFixture *fixture,
+                                gconstpointer unused)
+{
+  gboolean res;
+  XbDatabase sample_db, sharded_db;
+  guint64 sharded_files, open_files;
+  GError *error = NULL;
+
+  sample_db = get_sample_db ();
+  sharded_db = ((XbDatabase) { .manifest_path = test_get_sharded_manifest_db_path () });
+
+  res = xb_database_manager_ensure_db (fixture->manager, sharded_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  g_object_get (fixture->manager, "open-files", &sharded_files, NULL);
+  g_assert_cmpuint (sharded_files, >, 0);
+
+  /* The sample database is one of the shards of the manifest */
+  res = xb_database_manager_ensure_db (fixture->manager, sample_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  g_object_get (fixture->manager, "open-files", &open_files, NULL);
+  g_assert_cmpuint (open_files, ==, sharded_files);
+
+  g_free ((char *) sample_db.path);
+  g_free ((char *) sharded_db.manifest_path);
+}
+
+static void
+test_shares_shards_opened_concurrently (DatabaseManagerFixture *fixture,
+                                        gconstpointer unused)
+{
+  XbDatabaseManager *reference;
+  GAsyncResult *result = NULL;
+  GHashTable *query;
+  GBytes *bytes;
+  gboolean res;
+  XbDatabase sample_db, sharded_db;
+  guint64 sharded_files, open_files;
+  GError *error = NULL;
+
+  sample_db = get_sample_db ();
+  sharded_db = ((XbDatabase) { .manifest_path = test_get_sharded_manifest_db_path () });
+
+  reference = xb_database_manager_new ();
+  res = xb_database_manager_ensure_db (reference, sharded_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+  g_object_get (reference, "open-files", &sharded_files, NULL);
+  g_object_unref (reference);
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+
+  /* The manifest opens in a thread while the sample database, one of its
+   * shards, opens on the main thread.
+   */
+  xb_database_manager_query_db_async (fixture->manager, sharded_db, query, NULL,
+                                      store_async_result, &result);
+  res = xb_database_manager_ensure_db (fixture->manager, sample_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  bytes = xb_database_manager_query_db_finish (fixture->manager, result, &error);
+  g_assert_no_error (error);
+  g_bytes_unref (bytes);
+  g_object_unref (result);
+
+  g_object_get (fixture->manager, "open-files", &open_files, NULL);
+  g_assert_cmpuint (open_files, ==, sharded_files);
+
+  g_hash_table_unref (query);
+  g_free ((char *) sample_db.path);
+  g_free ((char *) sharded_db.manifest_path);
+}
+
+/* Writes a manifest listing the database at @relpath, relative to @dir */
+static gchar *
+write_manifest (const gchar *dir,
+                const gchar *relpath)
+{
+  gchar *manifest_path, *contents;
+  GError *error = NULL;
+
+  g_mkdir_with_parents (dir, 0755);
+  manifest_path = g_build_filename (dir, "manifest.json", NULL);
+  contents = g_strdup_printf ("{\"xapian_databases\": "
+                              "[{\"path\": \"%s\", \"offset\": 0}]}", relpath);
+
+  g_file_set_contents (manifest_path, contents, -1, &error);
+  g_assert_no_error (error);
+
+  g_free (contents);
+  return manifest_path;
+}
+
+static void
+test_shares_shards_across_paths (DatabaseManagerFixture *fixture,
+                                 gconstpointer unused)
+{
+  XbDatabase first_db, second_db;
+  gchar *tmp_dir, *sample_path, *db_dir, *dir, *filename, *contents;
+  const gchar *name;
+  guint64 first_files, open_files;
+  gsize length;
+  gboolean res;
+  GDir *sample_dir;
+  GError *error = NULL;
+
+  tmp_dir = g_dir_make_tmp ("xb-test-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  /* A copy, so that no symbolic link tells the paths apart */
+  sample_path = test_get_sample_db_path ();
+  db_dir = g_build_filename (tmp_dir, "db", NULL);
+  g_mkdir (db_dir, 0755);
+
+  sample_dir = g_dir_open (sample_path, 0, &error);
+  g_assert_no_error (error);
+  while ((name = g_dir_read_name (sample_dir)) != NULL)
+    {
+      filename = g_build_filename (sample_path, name, NULL);
+      g_file_get_contents (filename, &contents, &length, &error);
+      g_assert_no_error (error);
+      g_free (filename);
+
+      filename = g_build_filename (db_dir, name, NULL);
+      g_file_set_contents (filename, contents, length, &error);
+      g_assert_no_error (error);
+      g_free (filename);
+      g_free (contents);
+    }
+  g_dir_close (sample_dir);
+
+  /* Sibling directories reaching the same shard through ".." */
+  dir = g_build_filename (tmp_dir, "first", NULL);
+  first_db = ((XbDatabase) { .manifest_path = write_manifest (dir, "../db") });
+  g_free (dir);
+
+  dir = g_build_filename (tmp_dir, "second", NULL);
+  second_db = ((XbDatabase) { .manifest_path = write_manifest (dir, "../db") });
+  g_free (dir);
+
+  res = xb_database_manager_ensure_db (fixture->manager, first_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  g_object_get (fixture->manager, "open-files", &first_files, NULL);
+  g_assert_cmpuint (first_files, >, 0);
+
+  res = xb_database_manager_ensure_db (fixture->manager, second_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  g_object_get (fixture->manager, "open-files", &open_files, NULL);
+  g_assert_cmpuint (open_files, ==, first_files);
+
+  g_clear_object (&fixture->manager);
+  test_clear_dir (tmp_dir);
+
+  g_free ((char *) first_db.manifest_path);
+  g_free ((char *) second_db.manifest_path);
+  g_free (db_dir);
+  g_free (sample_path);
+  g_free (tmp_dir);
+}
+
+/* Waits for the main thread to catch up with the workers */
+static guint64
+wait_for_open_files_within (DatabaseManagerFixture *fixture,
+                            guint64 max_open_files)
+{
+  gint64 deadline = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+  guint64 open_files;
+
+  for (;;)
+    {
+      while (g_main_context_iteration (NULL, FALSE))
+        ;
+
+      g_object_get (fixture->manager, "open-files", &open_files, NULL);
+      if (open_files <= max_open_files || g_get_monotonic_time () > deadline)
+        return open_files;
+
+      g_usleep (1000);
+    }
+}
+
+static void
+test_worker_files_within_budget (DatabaseManagerFixture *fixture,
+                                 gconstpointer unused)
+{
+  GAsyncResult *results[16] = { NULL, };
+  GHashTable *query;
+  GBytes *bytes;
+  gboolean res;
+  XbDatabase db;
+  guint64 db_files, open_files;
+  gchar offset[16];
+  GError *error = NULL;
+  guint idx;
+
+  db = get_sample_db ();
+
+  res = xb_database_manager_ensure_db (fixture->manager, db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+  g_object_get (fixture->manager, "open-files", &db_files, NULL);
+
+  /* Room for the main thread and one worker, out of four */
+  g_object_set (fixture->manager,
+                "n-workers", 4,
+                "max-cache-size", (guint64) 0,
+                "max-open-files", (guint) (2 * db_files),
+                NULL);
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "5");
+
+  for (idx = 0; idx < G_N_ELEMENTS (results); idx++)
+    {
+      g_snprintf (offset, sizeof offset, "%u", idx % 5);
+      g_hash_table_insert (query, "offset", offset);
+      xb_database_manager_query_db_async (fixture->manager, db, query, NULL,
+                                          store_async_result, &results[idx]);
+    }
+  g_hash_table_unref (query);
+
+  for (idx = 0; idx < G_N_ELEMENTS (results); idx++)
+    {
+      while (results[idx] == NULL)
+        g_main_context_iteration (NULL, TRUE);
+
+      bytes = xb_database_manager_query_db_finish (fixture->manager, results[idx], &error);
+      g_assert_no_error (error);
+      g_bytes_unref (bytes);
+      g_object_unref (results[idx]);
+    }
+
+  open_files = wait_for_open_files_within (fixture, 2 * db_files);
+  g_assert_cmpuint (open_files, <=, 2 * db_files);
+
+  g_free ((char *) db.path);
+}
+
+static void
+test_closes_evicted_worker_files (DatabaseManagerFixture *fixture,
+                                  gconstpointer unused)
+{
+  GAsyncResult *results[8] = { NULL, };
+  GHashTable *query;
+  GBytes *bytes;
+  gboolean res;
+  XbDatabase sample_db, other_db;
+  guint64 other_files, open_files;
+  GError *error = NULL;
+  guint idx;
+
+  g_object_set (fixture->manager,
+                "n-workers", 4,
+                "max-databases", 1,
+                NULL);
+
+  res = create_sample_db (fixture, &other_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+  g_object_get (fixture->manager, "open-files", &other_files, NULL);
+
+  /* Leaves handles on the sample database in idle workers */
+  sample_db = get_sample_db ();
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+
+  for (idx = 0; idx < G_N_ELEMENTS (results); idx++)
+    xb_database_manager_query_db_async (fixture->manager, sample_db, query, NULL,
+                                        store_async_result, &results[idx]);
+  g_hash_table_unref (query);
+
+  for (idx = 0; idx < G_N_ELEMENTS (results); idx++)
+    {
+      while (results[idx] == NULL)
+        g_main_context_iteration (NULL, TRUE);
+
+      bytes = xb_database_manager_query_db_finish (fixture->manager, results[idx], &error);
+      g_assert_no_error (error);
+      g_bytes_unref (bytes);
+      g_object_unref (results[idx]);
+    }
+
+  g_object_get (fixture->manager, "open-files", &open_files, NULL);
+  g_assert_cmpuint (open_files, >, other_files);
+
+  /* Evicting the sample database closes them, with no further job */
+  res = xb_database_manager_ensure_db (fixture->manager, other_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  open_files = wait_for_open_files_within (fixture, other_files);
+  g_assert_cmpuint (open_files, ==, other_files);
+
+  g_free ((char *) sample_db.path);
+  g_free ((char *) other_db.path);
+}
+
+static void
+test_evicts_over_max_databases (DatabaseManagerFixture *fixture,
+                                gconstpointer unused)
+{
+  gboolean res;
+  XbDatabase sample_db, manifest_db;
+  guint open_databases;
+  GError *error = NULL;
+
+  g_object_set (fixture->manager, "max-databases", 1, NULL);
+
+  res = create_sample_db (fixture, &sample_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  res = create_manifest_db (fixture, &manifest_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  g_object_get (fixture->manager, "open-databases", &open_databases, NULL);
+  g_assert_cmpuint (open_databases, ==, 1);
+
+  /* Evicted databases are transparently reopened */
+  res = xb_database_manager_ensure_db (fixture->manager, sample_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  g_object_get (fixture->manager, "open-databases", &open_databases, NULL);
+  g_assert_cmpuint (open_databases, ==, 1);
+
+  g_free ((char *) sample_db.path);
+  g_free ((char *) manifest_db.manifest_path);
+}
+
+static void
+test_pinned_db_not_evicted (DatabaseManagerFixture *fixture,
+                            gconstpointer unused)
+{
+  gboolean res;
+  XbDatabase sample_db, manifest_db;
+  guint open_databases;
+  GError *error = NULL;
+
+  g_object_set (fixture->manager, "max-databases", 1, NULL);
+
+  sample_db = get_sample_db ();
+  res = xb_database_manager_pin_db (fixture->manager, sample_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  res = create_manifest_db (fixture, &manifest_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  g_object_get (fixture->manager, "open-databases", &open_databases, NULL);
+  g_assert_cmpuint (open_databases, ==, 2);
+
+  g_free ((char *) sample_db.path);
+  g_free ((char *) manifest_db.manifest_path);
+}
+
+static void
+test_pins_db_async (DatabaseManagerFixture *fixture,
+                    gconstpointer unused)
+{
+  GAsyncResult *result = NULL;
+  gboolean res;
+  XbDatabase sample_db, manifest_db;
+  guint open_databases;
+  GError *error = NULL;
+
+  g_object_set (fixture->manager, "max-databases", 1, NULL);
+
+  sample_db = get_sample_db ();
+  xb_database_manager_pin_db_async (fixture->manager, sample_db,
+                                    store_async_result, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  res = xb_database_manager_pin_db_finish (fixture->manager, result, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+  g_object_unref (result);
+
+  res = create_manifest_db (fixture, &manifest_db, &error);
+  g_assert_true (res);
+  g_assert_no_error (error);
+
+  g_object_get (fixture->manager, "open-databases", &open_databases, NULL);
+  g_assert_cmpuint (open_databases, ==, 2);
+
+  /* Failures are reported like the synchronous call does */
+  result = NULL;
+  xb_database_manager_pin_db_async (fixture->manager, (XbDatabase) { .path = "invalid" },
+                                    store_async_result, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  res = xb_database_manager_pin_db_finish (fixture->manager, result, &error);
+  g_assert_false (res);
+  g_assert_error (error, XB_ERROR, XB_ERROR_INVALID_PATH);
+  g_clear_error (&error);
+  g_object_unref (result);
+
+  g_free ((char *) sample_db.path);
+  g_free ((char *) manifest_db.manifest_path);
+}
+
+static void
+add_test_document (XapianWritableDatabase *db)
+{
+  XapianDocument *doc;
+  GError *error = NULL;
+
+  doc = xapian_document_new ();
+  xapian_document_set_data (doc, "{}");
+  xapian_document_add_term (doc, "a");
+
+  g_assert_true (xapian_writable_database_add_document (db, doc, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (xapian_writable_database_commit (db, &error));
+  g_assert_no_error (error);
+
+  g_object_unref (doc);
+}
+
+static gint
+count_query_results (DatabaseManagerFixture *fixture,
+                     XbDatabase db)
+{
+  GHashTable *query;
+  JsonObject *object;
+  GError *error = NULL;
+  gint num_results;
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "10");
+  g_hash_table_insert (query, "offset", "0");
+
+  object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+  g_assert_no_error (error);
+  num_results = json_object_get_int_member (object, "numResults");
+
+  json_object_unref (object);
+  g_hash_table_unref (query);
+
+  return num_results;
+}
+
+static XapianWritableDatabase *
+create_writable_db (gchar **dir_out)
+{
+  XapianWritableDatabase *writable;
+  GError *error = NULL;
+
+  *dir_out = g_dir_make_tmp ("xb-test-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  writable = g_initable_new (XAPIAN_TYPE_WRITABLE_DATABASE, NULL, &error,
+                             "path", *dir_out,
+                             "action", XAPIAN_DATABASE_ACTION_CREATE_OR_OVERWRITE,
+                             NULL);
+  g_assert_no_error (error);
+  add_test_document (writable);
+
+  return writable;
+}
+
+/* Waits for the database to pick up the changes on disk */
+static void
+wait_for_query_results (DatabaseManagerFixture *fixture,
+                        XbDatabase db,
+                        gint num_results)
+{
+  gint64 deadline;
+
+  deadline = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+  while (count_query_results (fixture, db) != num_results &&
+         g_get_monotonic_time () < deadline)
+    {
+      if (!g_main_context_iteration (NULL, FALSE))
+        g_usleep (10000);
+    }
+
+  g_assert_cmpint (count_query_results (fixture, db), ==, num_results);
+}
+
+static void
+test_reopens_changed_db (DatabaseManagerFixture *fixture,
+                         gconstpointer user_data)
+{
+  XapianWritableDatabase *writable;
+  XbDatabase db;
+  gchar *dir;
+  guint open_databases;
+
+  writable = create_writable_db (&dir);
+
+  db = ((XbDatabase) { .path = dir });
+  g_assert_cmpint (count_query_results (fixture, db), ==, 1);
+
+  add_test_document (writable);
+  wait_for_query_results (fixture, db, 2);
+
+  g_object_get (fixture->manager, "open-databases", &open_databases, NULL);
+  g_assert_cmpuint (open_databases, ==, 1);
+
+  xapian_database_close (XAPIAN_DATABASE (writable));
+  g_object_unref (writable);
+  g_clear_object (&fixture->manager);
+  test_clear_dir (dir);
+  g_free (dir);
+}
+
+static void
+test_queries_federated_dbs (DatabaseManagerFixture *fixture,
+                            gconstpointer user_data)
+{
+  XapianWritableDatabase *first, *second;
+  const gchar *federated[2] = { NULL, };
+  XbDatabase db;
+  gchar *first_dir, *second_dir;
+  guint open_databases;
+  guint64 opened, reopened;
+
+  first = create_writable_db (&first_dir);
+  second = create_writable_db (&second_dir);
+  add_test_document (second);
+
+  db = ((XbDatabase) { .path = first_dir });
+  g_assert_cmpint (count_query_results (fixture, db), ==, 1);
+
+  /* Both databases are searched as one */
+  federated[0] = second_dir;
+  db.federated = federated;
+  g_assert_cmpint (count_query_results (fixture, db), ==, 3);
+
+  /* The federation is kept open on its own */
+  g_assert_cmpint (count_query_results (fixture, db), ==, 3);
+  g_object_get (fixture->manager, "open-databases", &open_databases, NULL);
+  g_assert_cmpuint (open_databases, ==, 2);
+
+  /* And reopened in place when a member changes */
+  g_object_get (fixture->manager, "databases-opened", &opened, NULL);
+  add_test_document (second);
+  wait_for_query_results (fixture, db, 4);
+  g_object_get (fixture->manager, "databases-opened", &reopened, NULL);
+  g_assert_cmpuint (reopened, ==, opened);
+
+  xapian_database_close (XAPIAN_DATABASE (first));
+  xapian_database_close (XAPIAN_DATABASE (second));
+  g_object_unref (first);
+  g_object_unref (second);
+  g_clear_object (&fixture->manager);
+  test_clear_dir (first_dir);
+  test_clear_dir (second_dir);
+  g_free (first_dir);
+  g_free (second_dir);
+}
+
+static void
+test_embeds_raw_json_results (DatabaseManagerFixture *fixture,
+                              gconstpointer user_data)
+{
+  XapianWritableDatabase *writable;
+  GHashTable *query;
+  JsonObject *object;
+  JsonParser *parser;
+  JsonArray *results;
+  GBytes *bytes;
+  XbDatabase db, sample_db;
+  gchar *dir;
+  GError *error = NULL;
+
+  writable = create_writable_db (&dir);
+  db = ((XbDatabase) { .path = dir });
+  sample_db = get_sample_db ();
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "10");
+  g_hash_table_insert (query, "offset", "0");
+  g_hash_table_insert (query, "rawResults", "1");
+
+  object = xb_database_manager_query_db (fixture->manager, db, query, &error);
+  g_assert_no_error (error);
+  results = json_object_get_array_member (object, "results");
+  g_assert_cmpuint (json_array_get_length (results), ==, 1);
+  g_assert_nonnull (json_array_get_object_element (results, 0));
+  json_object_unref (object);
+
+  bytes = run_async_query (fixture, db, query);
+  g_assert_nonnull (g_strstr_len (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+                                  "\"results\":[{}]"));
+  g_bytes_unref (bytes);
+
+  /* The sample documents are not valid JSON, so they stay strings */
+  bytes = run_async_query (fixture, sample_db, query);
+  parser = json_parser_new ();
+  json_parser_load_from_data (parser, g_bytes_get_data (bytes, NULL),
+                              g_bytes_get_size (bytes), &error);
+  g_assert_no_error (error);
+  object = json_node_get_object (json_parser_get_root (parser));
+  results = json_object_get_array_member (object, "results");
+  g_assert_cmpstr (json_array_get_string_element (results, 0), ==, "{ 'foo': 'bar' }");
+  g_object_unref (parser);
+  g_bytes_unref (bytes);
+
+  g_hash_table_unref (query);
+  xapian_database_close (XAPIAN_DATABASE (writable));
+  g_object_unref (writable);
+  g_clear_object (&fixture->manager);
+  test_clear_dir (dir);
+  g_free (dir);
+  g_free ((char *) sample_db.path);
+}
+
+static void
+test_reopens_changed_manifest_db (DatabaseManagerFixture *fixture,
+                                  gconstpointer user_data)
+{
+  XapianWritableDatabase *writable;
+  XbDatabase db;
+  gchar *dir, *manifest_dir, *basename, *relpath;
+  guint64 opened, reopened;
+
+  writable = create_writable_db (&dir);
+
+  manifest_dir = g_strconcat (dir, "-manifest", NULL);
+  basename = g_path_get_basename (dir);
+  relpath = g_build_filename ("..", basename, NULL);
+
+  db = ((XbDatabase) { .manifest_path = write_manifest (manifest_dir, relpath) });
+  g_assert_cmpint (count_query_results (fixture, db), ==, 1);
+  g_object_get (fixture->manager, "databases-opened", &opened, NULL);
+
+  /* Commits to a shard are picked up */
+  add_test_document (writable);
+  wait_for_query_results (fixture, db, 2);
+
+  /* So is a manifest listing the same shards, without opening them anew */
+  g_free ((char *) db.manifest_path);
+  db.manifest_path = write_manifest (manifest_dir, relpath);
+  add_test_document (writable);
+  wait_for_query_results (fixture, db, 3);
+
+  g_object_get (fixture->manager, "databases-opened", &reopened, NULL);
+  g_assert_cmpuint (reopened, ==, opened);
+
+  xapian_database_close (XAPIAN_DATABASE (writable));
+  g_object_unref (writable);
+  g_clear_object (&fixture->manager);
+  test_clear_dir (manifest_dir);
+  test_clear_dir (dir);
+  g_free ((char *) db.manifest_path);
+  g_free (relpath);
+  g_free (basename);
+  g_free (manifest_dir);
+  g_free (dir);
+}
+
+static void
+test_gives_up_on_unread_stream (DatabaseManagerFixture *fixture,
+                                gconstpointer user_data)
+{
+  XapianWritableDatabase *writable;
+  XapianDocument *doc;
+  GAsyncResult *result = NULL;
+  GHashTable *query;
+  GPtrArray *chunks;
+  XbDatabase db;
+  gchar *dir, *data;
+  gboolean res;
+  GError *error = NULL;
+  guint idx;
+
+  g_object_set (fixture->manager,
+                "n-workers", 1,
+                "stream-write-timeout", 200,
+                NULL);
+
+  /* Well over what may be pending at once */
+  writable = create_writable_db (&dir);
+  data = g_strnfill (16 * 1024, 'x');
+  for (idx = 0; idx < 64; idx++)
+    {
+      doc = xapian_document_new ();
+      xapian_document_set_data (doc, data);
+      xapian_document_add_term (doc, "a");
+      xapian_writable_database_add_document (writable, doc, NULL, &error);
+      g_assert_no_error (error);
+      g_object_unref (doc);
+    }
+  xapian_writable_database_commit (writable, &error);
+  g_assert_no_error (error);
+  g_free (data);
+
+  db = ((XbDatabase) { .path = dir });
+
+  query = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (query, "q", "a");
+  g_hash_table_insert (query, "limit", "-1");
+  g_hash_table_insert (query, "offset", "0");
+
+  /* A client that never reads: none of the chunks is ever freed */
+  chunks = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+  xb_database_manager_stream_query_db_async (fixture->manager, db, query,
+                                             append_chunk, chunks, NULL,
+                                             store_async_result, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  res = xb_database_manager_stream_query_db_finish (fixture->manager, result, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+  g_assert_false (res);
+  g_clear_error (&error);
+  g_clear_object (&result);
+
+  /* The only worker is free again */
+  g_bytes_unref (run_async_query (fixture, db, query));
+
+  g_hash_table_unref (query);
+  g_ptr_array_unref (chunks);
+  xapian_database_close (XAPIAN_DATABASE (writable));
+  g_object_unref (writable);
+  g_clear_object (&fixture->manager);
+  test_clear_dir (dir);
+  g_free (dir);
+}
+
+static void
+test_coalesces_db_changes (DatabaseManagerFixture *fixture,
+                           gconstpointer user_data)
+{
+  XapianWritableDatabase *writable;
+  XbDatabase db;
+  gchar *dir;
+  guint64 coalesced;
+
+  g_object_set (fixture->manager, "monitor-quiet-period", 200, NULL);
+
+  writable = create_writable_db (&dir);
+
+  db = ((XbDatabase) { .path = dir });
+  g_assert_cmpint (count_query_results (fixture, db), ==, 1);
+
+  /* Both commits are picked up by a single refresh */
+  add_test_document (writable);
+  add_test_document (writable);
+  wait_for_query_results (fixture, db, 3);
+
+  g_object_get (fixture->manager, "coalesced-refreshes", &coalesced, NULL);
+  g_assert_cmpuint (coalesced, >, 0);
+
+  xapian_database_close (XAPIAN_DATABASE (writable));
+  g_object_unref (writable);
+  g_clear_object (&fixture->manager);
+  test_clear_dir (dir);
+  g_free (dir);
 }
 
 static void
@@ -350,16 +1800,68 @@ main (int argc,
                       test_creates_db);
   ADD_DBMANAGER_TEST ("/dbmanager/creates-db-from-manifest",
                       test_creates_db_from_manifest);
+  ADD_DBMANAGER_TEST ("/dbmanager/queries-sharded-manifest-db",
+                      test_queries_sharded_manifest_db);
+  ADD_DBMANAGER_TEST ("/dbmanager/shares-shards-across-dbs",
+                      test_shares_shards_across_dbs);
+  ADD_DBMANAGER_TEST ("/dbmanager/counts-shared-shards-once",
+                      test_counts_shared_shards_once);
+  ADD_DBMANAGER_TEST ("/dbmanager/shares-shards-across-paths",
+                      test_shares_shards_across_paths);
+  ADD_DBMANAGER_TEST ("/dbmanager/shares-shards-opened-concurrently",
+                      test_shares_shards_opened_concurrently);
+  ADD_DBMANAGER_TEST ("/dbmanager/worker-files-within-budget",
+                      test_worker_files_within_budget);
+  ADD_DBMANAGER_TEST ("/dbmanager/closes-evicted-worker-files",
+                      test_closes_evicted_worker_files);
+  ADD_DBMANAGER_TEST ("/dbmanager/evicts-over-max-databases",
+                      test_evicts_over_max_databases);
+  ADD_DBMANAGER_TEST ("/dbmanager/pinned-db-not-evicted",
+                      test_pinned_db_not_evicted);
+  ADD_DBMANAGER_TEST ("/dbmanager/pins-db-async",
+                      test_pins_db_async);
+  ADD_DBMANAGER_TEST ("/dbmanager/reopens-changed-db",
+                      test_reopens_changed_db);
+  ADD_DBMANAGER_TEST ("/dbmanager/queries-federated-dbs",
+                      test_queries_federated_dbs);
+  ADD_DBMANAGER_TEST ("/dbmanager/reopens-changed-manifest-db",
+                      test_reopens_changed_manifest_db);
+  ADD_DBMANAGER_TEST ("/dbmanager/coalesces-db-changes",
+                      test_coalesces_db_changes);
   ADD_DBMANAGER_TEST ("/dbmanager/create-invalid-db-fails",
                       test_create_invalid_db_fails);
   ADD_DBMANAGER_TEST ("/dbmanager/queries-db",
                       test_queries_db);
+  ADD_DBMANAGER_TEST ("/dbmanager/queries-db-async",
+                      test_queries_db_async);
+  ADD_DBMANAGER_TEST ("/dbmanager/streams-query-results",
+                      test_streams_query_results);
+  ADD_DBMANAGER_TEST ("/dbmanager/gives-up-on-unread-stream",
+                      test_gives_up_on_unread_stream);
+  ADD_DBMANAGER_TEST ("/dbmanager/embeds-raw-json-results",
+                      test_embeds_raw_json_results);
+  ADD_DBMANAGER_TEST ("/dbmanager/opens-db-once-for-concurrent-queries",
+                      test_opens_db_once_for_concurrent_queries);
+  ADD_DBMANAGER_TEST ("/dbmanager/caches-query-results",
+                      test_caches_query_results);
+  ADD_DBMANAGER_TEST ("/dbmanager/reports-query-timings",
+                      test_reports_query_timings);
+  ADD_DBMANAGER_TEST ("/dbmanager/compresses-query-results",
+                      test_compresses_query_results);
+  ADD_DBMANAGER_TEST ("/dbmanager/query-time-limit",
+                      test_query_time_limit);
+  ADD_DBMANAGER_TEST ("/dbmanager/query-until-deadline",
+                      test_query_until_deadline);
   ADD_DBMANAGER_TEST ("/dbmanager/query-invalid-db-fails",
                       test_query_invalid_db_fails);
   ADD_DBMANAGER_TEST ("/dbmanager/query-invalid-params-fails",
                       test_query_invalid_params_fails);
   ADD_DBMANAGER_TEST ("/dbmanager/query-invalid-lang-succeeds",
                       test_query_invalid_lang_succeeds);
+  ADD_DBMANAGER_TEST ("/dbmanager/query-default-op-does-not-leak",
+                      test_query_default_op_does_not_leak);
+  ADD_DBMANAGER_TEST ("/dbmanager/query-repeated-filters",
+                      test_query_repeated_filters);
 
 #undef ADD_DBMANAGER_TEST
 
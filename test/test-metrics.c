@@ -0,0 +1,163 @@
+#include "xb-metrics.h"
+
+#include <string.h>
+
+typedef struct {
+  XbMetrics *metrics;
+} MetricsFixture;
+
+static void
+teardown (MetricsFixture *fixture,
+          gconstpointer user_data)
+{
+  g_clear_object (&fixture->metrics);
+}
+
+static void
+setup (MetricsFixture *fixture,
+       gconstpointer user_data)
+{
+  fixture->metrics = xb_metrics_new ();
+  xb_metrics_add_route (fixture->metrics, "/query");
+}
+
+/* Prometheus rejects a whole scrape in which a metric appears twice */
+static void
+assert_unique_names (const gchar *text)
+{
+  GHashTable *names = g_hash_table_new (g_str_hash, g_str_equal);
+  gchar **lines = g_strsplit (text, "\n", -1);
+  gchar **line, *name;
+
+  for (line = lines; *line != NULL; line++)
+    {
+      if (!g_str_has_prefix (*line, "# TYPE "))
+        continue;
+
+      name = *line + strlen ("# TYPE ");
+      *strchr (name, ' ') = '\0';
+      if (!g_hash_table_add (names, name))
+        g_error ("Metric %s appears twice in:\n%s", name, text);
+    }
+
+  g_hash_table_unref (names);
+  g_strfreev (lines);
+}
+
+static gchar *
+serialize (MetricsFixture *fixture)
+{
+  g_autoptr(GBytes) bytes = xb_metrics_serialize (fixture->metrics);
+  gsize len;
+  const gchar *data = g_bytes_get_data (bytes, &len);
+  gchar *text = g_strndup (data, len);
+
+  assert_unique_names (text);
+
+  return text;
+}
+
+static void
+assert_has_line (const gchar *text,
+                 const gchar *line)
+{
+  g_autofree gchar *needle = g_strconcat ("\n", line, "\n", NULL);
+  g_autofree gchar *haystack = g_strconcat ("\n", text, NULL);
+
+  if (strstr (haystack, needle) == NULL)
+    g_error ("Line '%s' not found in:\n%s", line, text);
+}
+
+static void
+test_records_request_durations (MetricsFixture *fixture,
+                                gconstpointer user_data)
+{
+  g_autofree gchar *text = NULL;
+
+  xb_metrics_request_started (fixture->metrics);
+  xb_metrics_request_finished (fixture->metrics, "/query", 200, 2000);
+  xb_metrics_request_started (fixture->metrics);
+
+  text = serialize (fixture);
+  assert_has_line (text, "xapian_bridge_request_duration_seconds_bucket{route=\"/query\",le=\"0.001\"} 0");
+  assert_has_line (text, "xapian_bridge_request_duration_seconds_bucket{route=\"/query\",le=\"0.0025\"} 1");
+  assert_has_line (text, "xapian_bridge_request_duration_seconds_bucket{route=\"/query\",le=\"+Inf\"} 1");
+  assert_has_line (text, "xapian_bridge_request_duration_seconds_count{route=\"/query\"} 1");
+  assert_has_line (text, "xapian_bridge_request_duration_seconds_sum{route=\"/query\"} 0.002");
+  assert_has_line (text, "xapian_bridge_requests_total{route=\"/query\",code=\"200\"} 1");
+  assert_has_line (text, "xapian_bridge_requests_in_flight 1");
+}
+
+static void
+test_groups_unknown_routes (MetricsFixture *fixture,
+                            gconstpointer user_data)
+{
+  g_autofree gchar *text = NULL;
+
+  xb_metrics_request_started (fixture->metrics);
+  xb_metrics_request_finished (fixture->metrics, "/nope", 404, 20 * G_USEC_PER_SEC);
+
+  text = serialize (fixture);
+  assert_has_line (text, "xapian_bridge_request_duration_seconds_bucket{route=\"other\",le=\"10\"} 0");
+  assert_has_line (text, "xapian_bridge_request_duration_seconds_bucket{route=\"other\",le=\"+Inf\"} 1");
+  assert_has_line (text, "xapian_bridge_requests_total{route=\"other\",code=\"404\"} 1");
+  assert_has_line (text, "xapian_bridge_requests_in_flight 0");
+}
+
+static void
+test_records_query_phases (MetricsFixture *fixture,
+                           gconstpointer user_data)
+{
+  g_autofree gchar *text = NULL;
+
+  xb_metrics_observe_phase (fixture->metrics, "match", 300);
+  xb_metrics_observe_phase (fixture->metrics, "match", 3000);
+  xb_metrics_observe_phase (fixture->metrics, "fetch", 20000);
+
+  text = serialize (fixture);
+  assert_has_line (text, "# TYPE xapian_bridge_query_phase_seconds histogram");
+  assert_has_line (text, "xapian_bridge_query_phase_seconds_bucket{phase=\"match\",le=\"0.0005\"} 1");
+  assert_has_line (text, "xapian_bridge_query_phase_seconds_bucket{phase=\"match\",le=\"0.005\"} 2");
+  assert_has_line (text, "xapian_bridge_query_phase_seconds_count{phase=\"match\"} 2");
+  assert_has_line (text, "xapian_bridge_query_phase_seconds_bucket{phase=\"fetch\",le=\"0.025\"} 1");
+}
+
+static void
+test_sets_values (MetricsFixture *fixture,
+                  gconstpointer user_data)
+{
+  g_autofree gchar *text = NULL;
+
+  xb_metrics_set_value (fixture->metrics, "xapian_bridge_open_databases",
+                        XB_METRIC_GAUGE, "Open databases", 3);
+  xb_metrics_set_value (fixture->metrics, "xapian_bridge_open_databases",
+                        XB_METRIC_GAUGE, "Open databases", 5);
+
+  text = serialize (fixture);
+  assert_has_line (text, "# TYPE xapian_bridge_open_databases gauge");
+  assert_has_line (text, "xapian_bridge_open_databases 5");
+  g_assert_null (strstr (text, "xapian_bridge_open_databases 3"));
+}
+
+int
+main (int argc,
+      gchar **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+#define ADD_METRICS_TEST(path, func) \
+  g_test_add ((path), MetricsFixture, NULL, setup, (func), teardown)
+
+  ADD_METRICS_TEST ("/metrics/records-request-durations",
+                    test_records_request_durations);
+  ADD_METRICS_TEST ("/metrics/groups-unknown-routes",
+                    test_groups_unknown_routes);
+  ADD_METRICS_TEST ("/metrics/records-query-phases",
+                    test_records_query_phases);
+  ADD_METRICS_TEST ("/metrics/sets-values",
+                    test_sets_values);
+
+#undef ADD_METRICS_TEST
+
+  return g_test_run ();
+}
@@ -0,0 +1,342 @@
+#include "xb-routed-server.h"
+
+typedef struct {
+  XbRoutedServer *server;
+  SoupSession *session;
+  gchar *base_uri;
+  /* Requests to /slow, paused until released */
+  GPtrArray *held;
+  /* Messages whose responses arrived */
+  GPtrArray *responses;
+} ServerFixture;
+
+static void
+slow_callback (GHashTable *params,
+               GHashTable *query,
+               SoupMessage *message,
+               gpointer user_data)
+{
+  ServerFixture *fixture = user_data;
+
+  soup_server_pause_message (SOUP_SERVER (fixture->server), message);
+  g_ptr_array_add (fixture->held, g_object_ref (message));
+}
+
+static void
+fast_callback (GHashTable *params,
+               GHashTable *query,
+               SoupMessage *message,
+               gpointer user_data)
+{
+  soup_message_set_status (message, SOUP_STATUS_OK);
+}
+
+static void
+teardown (ServerFixture *fixture,
+          gconstpointer user_data)
+{
+  soup_session_abort (fixture->session);
+  g_clear_object (&fixture->session);
+  g_clear_pointer (&fixture->held, g_ptr_array_unref);
+  g_clear_pointer (&fixture->responses, g_ptr_array_unref);
+  g_clear_object (&fixture->server);
+  g_free (fixture->base_uri);
+}
+
+static void
+setup (ServerFixture *fixture,
+       gconstpointer user_data)
+{
+  GError *error = NULL;
+  GSList *uris;
+
+  fixture->held = g_ptr_array_new_with_free_func (g_object_unref);
+  fixture->responses = g_ptr_array_new_with_free_func (g_object_unref);
+
+  fixture->server = xb_routed_server_new ();
+  xb_routed_server_get (fixture->server, "/slow", slow_callback, fixture);
+  xb_routed_server_get (fixture->server, "/fast", fast_callback, fixture);
+  xb_routed_server_limit (fixture->server, "/slow");
+  g_object_set (fixture->server, "max-in-flight", 1, NULL);
+
+  soup_server_listen_local (SOUP_SERVER (fixture->server), 0, 0, &error);
+  g_assert_no_error (error);
+
+  uris = soup_server_get_uris (SOUP_SERVER (fixture->server));
+  g_assert_nonnull (uris);
+  fixture->base_uri = soup_uri_to_string (uris->data, FALSE);
+  g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+  fixture->session = soup_session_new_with_options (SOUP_SESSION_MAX_CONNS_PER_HOST, 8,
+                                                    NULL);
+}
+
+static void
+response_callback (SoupSession *session,
+                   SoupMessage *message,
+                   gpointer user_data)
+{
+  ServerFixture *fixture = user_data;
+
+  g_ptr_array_add (fixture->responses, g_object_ref (message));
+}
+
+static SoupMessage *
+send_request (ServerFixture *fixture,
+              const gchar *path)
+{
+  SoupMessage *message;
+  gchar *uri;
+
+  uri = g_strconcat (fixture->base_uri, path + 1, NULL);
+  message = soup_message_new (SOUP_METHOD_GET, uri);
+  g_free (uri);
+
+  soup_session_queue_message (fixture->session, message, response_callback, fixture);
+
+  return message;
+}
+
+static guint
+get_queued (ServerFixture *fixture)
+{
+  guint queued;
+
+  g_object_get (fixture->server, "queued", &queued, NULL);
+  return queued;
+}
+
+static void
+wait_for_held (ServerFixture *fixture,
+               guint n_held)
+{
+  while (fixture->held->len < n_held)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+wait_for_queued (ServerFixture *fixture,
+                 guint n_queued)
+{
+  while (get_queued (fixture) < n_queued)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+wait_for_responses (ServerFixture *fixture,
+                    guint n_responses)
+{
+  while (fixture->responses->len < n_responses)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+release_held (ServerFixture *fixture)
+{
+  SoupMessage *message;
+
+  while (fixture->held->len > 0)
+    {
+      message = g_ptr_array_index (fixture->held, 0);
+      soup_message_set_status (message, SOUP_STATUS_OK);
+      soup_server_unpause_message (SOUP_SERVER (fixture->server), message);
+      g_ptr_array_remove_index (fixture->held, 0);
+    }
+}
+
+static void
+test_queues_over_limit (ServerFixture *fixture,
+                        gconstpointer user_data)
+{
+  SoupMessage *first, *second;
+  guint in_flight;
+
+  first = send_request (fixture, "/slow");
+  wait_for_held (fixture, 1);
+  second = send_request (fixture, "/slow");
+  wait_for_queued (fixture, 1);
+
+  g_object_get (fixture->server, "in-flight", &in_flight, NULL);
+  g_assert_cmpint (in_flight, ==, 1);
+  g_assert_cmpint (fixture->held->len, ==, 1);
+
+  /* Finishing the first request lets the second one in */
+  release_held (fixture);
+  wait_for_held (fixture, 1);
+  g_assert_cmpint (get_queued (fixture), ==, 0);
+
+  release_held (fixture);
+  wait_for_responses (fixture, 2);
+
+  g_assert_cmpint (first->status_code, ==, SOUP_STATUS_OK);
+  g_assert_cmpint (second->status_code, ==, SOUP_STATUS_OK);
+}
+
+static void
+test_sheds_when_queue_full (ServerFixture *fixture,
+                            gconstpointer user_data)
+{
+  SoupMessage *shed;
+  guint64 shed_requests;
+
+  g_object_set (fixture->server, "max-queued", 1, NULL);
+
+  send_request (fixture, "/slow");
+  wait_for_held (fixture, 1);
+  send_request (fixture, "/slow");
+  wait_for_queued (fixture, 1);
+
+  shed = send_request (fixture, "/slow");
+  wait_for_responses (fixture, 1);
+
+  g_assert_true (g_ptr_array_index (fixture->responses, 0) == shed);
+  g_assert_cmpint (shed->status_code, ==, SOUP_STATUS_SERVICE_UNAVAILABLE);
+  g_assert_cmpstr (soup_message_headers_get_one (shed->response_headers, "Retry-After"),
+                   ==, "1");
+
+  g_object_get (fixture->server, "shed-requests", &shed_requests, NULL);
+  g_assert_cmpint (shed_requests, ==, 1);
+
+  release_held (fixture);
+  wait_for_held (fixture, 1);
+  release_held (fixture);
+  wait_for_responses (fixture, 3);
+}
+
+static void
+test_sheds_after_target_delay (ServerFixture *fixture,
+                               gconstpointer user_data)
+{
+  SoupMessage *shed;
+
+  g_object_set (fixture->server, "queue-target-delay", 10, NULL);
+
+  send_request (fixture, "/slow");
+  wait_for_held (fixture, 1);
+  send_request (fixture, "/slow");
+  wait_for_queued (fixture, 1);
+
+  g_usleep (20 * 1000);
+
+  shed = send_request (fixture, "/slow");
+  wait_for_responses (fixture, 1);
+
+  g_assert_cmpint (shed->status_code, ==, SOUP_STATUS_SERVICE_UNAVAILABLE);
+  g_assert_cmpint (get_queued (fixture), ==, 1);
+
+  /* By now the queued request waited too long as well */
+  release_held (fixture);
+  wait_for_responses (fixture, 3);
+  g_assert_cmpint (fixture->held->len, ==, 0);
+}
+
+static void
+test_sheds_stale_queued_requests (ServerFixture *fixture,
+                                  gconstpointer user_data)
+{
+  SoupMessage *first, *stale;
+
+  g_object_set (fixture->server, "queue-target-delay", 10, NULL);
+
+  first = send_request (fixture, "/slow");
+  wait_for_held (fixture, 1);
+  stale = send_request (fixture, "/slow");
+  wait_for_queued (fixture, 1);
+
+  g_usleep (20 * 1000);
+
+  /* The queued request is turned away rather than let in */
+  release_held (fixture);
+  wait_for_responses (fixture, 2);
+
+  g_assert_cmpint (first->status_code, ==, SOUP_STATUS_OK);
+  g_assert_cmpint (stale->status_code, ==, SOUP_STATUS_SERVICE_UNAVAILABLE);
+  g_assert_nonnull (soup_message_headers_get_one (stale->response_headers, "Retry-After"));
+  g_assert_cmpint (fixture->held->len, ==, 0);
+  g_assert_cmpint (get_queued (fixture), ==, 0);
+}
+
+static guint
+weigh_two (SoupMessage *message,
+           gpointer user_data)
+{
+  return 2;
+}
+
+static void
+test_weighs_requests (ServerFixture *fixture,
+                      gconstpointer user_data)
+{
+  guint in_flight;
+
+  xb_routed_server_get (fixture->server, "/heavy", slow_callback, fixture);
+  xb_routed_server_limit_weighted (fixture->server, "/heavy", weigh_two, NULL);
+  g_object_set (fixture->server, "max-in-flight", 2, NULL);
+
+  send_request (fixture, "/slow");
+  wait_for_held (fixture, 1);
+
+  /* Does not fit next to the first one, and is not overtaken */
+  send_request (fixture, "/heavy");
+  wait_for_queued (fixture, 1);
+  send_request (fixture, "/slow");
+  wait_for_queued (fixture, 2);
+
+  release_held (fixture);
+  wait_for_held (fixture, 1);
+
+  g_object_get (fixture->server, "in-flight", &in_flight, NULL);
+  g_assert_cmpint (in_flight, ==, 2);
+  g_assert_cmpint (get_queued (fixture), ==, 1);
+
+  release_held (fixture);
+  wait_for_held (fixture, 1);
+  release_held (fixture);
+  wait_for_responses (fixture, 3);
+}
+
+static void
+test_other_routes_not_limited (ServerFixture *fixture,
+                               gconstpointer user_data)
+{
+  SoupMessage *fast;
+
+  send_request (fixture, "/slow");
+  wait_for_held (fixture, 1);
+
+  fast = send_request (fixture, "/fast");
+  wait_for_responses (fixture, 1);
+
+  g_assert_cmpint (fast->status_code, ==, SOUP_STATUS_OK);
+  g_assert_cmpint (get_queued (fixture), ==, 0);
+
+  release_held (fixture);
+  wait_for_responses (fixture, 2);
+}
+
+int
+main (int argc,
+      gchar **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+#define ADD_SERVER_TEST(path, func) \
+  g_test_add ((path), ServerFixture, NULL, setup, (func), teardown)
+
+  ADD_SERVER_TEST ("/routed-server/queues-requests-over-limit",
+                   test_queues_over_limit);
+  ADD_SERVER_TEST ("/routed-server/sheds-when-queue-full",
+                   test_sheds_when_queue_full);
+  ADD_SERVER_TEST ("/routed-server/sheds-after-target-delay",
+                   test_sheds_after_target_delay);
+  ADD_SERVER_TEST ("/routed-server/sheds-stale-queued-requests",
+                   test_sheds_stale_queued_requests);
+  ADD_SERVER_TEST ("/routed-server/weighs-requests",
+                   test_weighs_requests);
+  ADD_SERVER_TEST ("/routed-server/does-not-limit-other-routes",
+                   test_other_routes_not_limited);
+
+#undef ADD_SERVER_TEST
+
+  return g_test_run ();
+}
@@ -72,6 +72,129 @@ increment_count_callback (GHashTable *params,
   (*count)++;
 }
 
+static void
+record_param_callback (GHashTable *params,
+                       GHashTable *query,
+                       SoupMessage *message,
+                       gpointer user_data)
+{
+  gchar **value = user_data;
+
+  g_free (*value);
+  *value = g_strdup (g_hash_table_lookup (params, "x"));
+}
+
+static void
+test_match_backtracks (RouterFixture *fixture,
+                       gconstpointer user_data)
+{
+  gboolean y_called = FALSE;
+  gchar *x = NULL;
+
+  xb_router_add_route (fixture->router, SOUP_METHOD_GET, "/a/b/:y/d",
+                       set_boolean_callback, &y_called);
+  xb_router_add_route (fixture->router, SOUP_METHOD_GET, "/a/:x/c",
+                       record_param_callback, &x);
+  xb_router_handle_route (fixture->router, SOUP_METHOD_GET, "/a/b/c",
+                          NULL, NULL);
+
+  g_assert_false (y_called);
+  g_assert_cmpstr (x, ==, "b");
+
+  g_free (x);
+}
+
+static void
+test_match_earliest_route (RouterFixture *fixture,
+                           gconstpointer user_data)
+{
+  gint param_calls = 0;
+  gint static_calls = 0;
+
+  xb_router_add_route (fixture->router, SOUP_METHOD_GET, "/:anything",
+                       increment_count_callback, &param_calls);
+  xb_router_add_route (fixture->router, SOUP_METHOD_GET, "/foo",
+                       increment_count_callback, &static_calls);
+  xb_router_add_route (fixture->router, SOUP_METHOD_GET, "/bar/baz",
+                       increment_count_callback, &static_calls);
+  xb_router_add_route (fixture->router, SOUP_METHOD_GET, "/bar/:anything",
+                       increment_count_callback, &param_calls);
+
+  xb_router_handle_route (fixture->router, SOUP_METHOD_GET, "/foo",
+                          NULL, NULL);
+  g_assert_cmpint (param_calls, ==, 1);
+  g_assert_cmpint (static_calls, ==, 0);
+
+  xb_router_handle_route (fixture->router, SOUP_METHOD_GET, "/bar/baz",
+                          NULL, NULL);
+  g_assert_cmpint (param_calls, ==, 1);
+  g_assert_cmpint (static_calls, ==, 1);
+}
+
+static void
+noop_callback (GHashTable *params,
+               GHashTable *query,
+               SoupMessage *message,
+               gpointer user_data)
+{
+}
+
+/* Times lookups of the last static and the last :param route as the number
+ * of routes grows. Only run with -m perf.
+ */
+static void
+test_lookup_scaling (RouterFixture *fixture,
+                     gconstpointer user_data)
+{
+  static const guint route_counts[] = { 10, 100, 1000, 10000 };
+  const guint lookups = 100000;
+  gchar static_path[64], param_path[64];
+  guint idx, n_routes = 0, lookup;
+  gdouble static_ns, param_ns;
+  gint64 start;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Only run in perf mode");
+      return;
+    }
+
+  for (idx = 0; idx < G_N_ELEMENTS (route_counts); idx++)
+    {
+      for (; n_routes < route_counts[idx]; n_routes++)
+        {
+          g_snprintf (static_path, sizeof static_path, "/static/%u", n_routes);
+          xb_router_add_route (fixture->router, SOUP_METHOD_GET, static_path,
+                               noop_callback, NULL);
+          g_snprintf (param_path, sizeof param_path, "/param/%u/:x", n_routes);
+          xb_router_add_route (fixture->router, SOUP_METHOD_GET, param_path,
+                               noop_callback, NULL);
+        }
+
+      g_snprintf (static_path, sizeof static_path, "/static/%u", n_routes - 1);
+      g_snprintf (param_path, sizeof param_path, "/param/%u/value", n_routes - 1);
+
+      start = g_get_monotonic_time ();
+      for (lookup = 0; lookup < lookups; lookup++)
+        xb_router_handle_route (fixture->router, SOUP_METHOD_GET, static_path,
+                                NULL, NULL);
+      static_ns = (g_get_monotonic_time () - start) * 1000.0 / lookups;
+
+      start = g_get_monotonic_time ();
+      for (lookup = 0; lookup < lookups; lookup++)
+        xb_router_handle_route (fixture->router, SOUP_METHOD_GET, param_path,
+                                NULL, NULL);
+      param_ns = (g_get_monotonic_time () - start) * 1000.0 / lookups;
+
+      g_test_message ("%u routes: static %.1f ns, param %.1f ns per lookup",
+                      2 * n_routes, static_ns, param_ns);
+      g_test_minimized_result (static_ns, "static lookup with %u routes: %.1f ns",
+                               2 * n_routes, static_ns);
+      g_test_minimized_result (param_ns, "param lookup with %u routes: %.1f ns",
+                               2 * n_routes, param_ns);
+    }
+}
+
 static void
 test_match_not_only_suffix (RouterFixture *fixture,
                             gconstpointer user_data)
@@ -238,6 +361,12 @@ main (int argc,
                    test_match_not_only_suffix);
   ADD_ROUTER_TEST ("/router/calls-handler-with-dict",
                    test_calls_handler_with_dict);
+  ADD_ROUTER_TEST ("/router/backtracks-to-param-route",
+                   test_match_backtracks);
+  ADD_ROUTER_TEST ("/router/matches-earliest-added-route",
+                   test_match_earliest_route);
+  ADD_ROUTER_TEST ("/router/lookup-scaling",
+                   test_lookup_scaling);
 
 #undef ADD_ROUTER_TEST
 
@@ -21,6 +21,15 @@ test_get_manifest_db_path (void)
                                 NULL);
 }
 
+gchar *
+test_get_sharded_manifest_db_path (void)
+{
+  return g_test_build_filename (G_TEST_DIST,
+                                "test",
+                                "sharded-manifest.json",
+                                NULL);
+}
+
 gchar *
 test_get_invalid_db_path (void)
 {
@@ -13,5 +13,6 @@ gchar *test_get_invalid_db_path_for_query (void);
 gchar *test_get_sample_db_path (void);
 gchar *test_get_sample_db_path_for_query (void);
 gchar *test_get_manifest_db_path (void);
+gchar *test_get_sharded_manifest_db_path (void);
 
 #endif /* __TEST_UTIL_H__ */